@@ -0,0 +1,133 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+//ArchiveMap provides read-only access to a file of IntegPeriods, as
+//written by IntegPeriod::write or found in the store, by memory mapping
+//the file rather than parsing it through a stream. When the file is
+//opened the record boundaries are checked once and an offset table is
+//built, after which each record can be examined through a PeriodView
+//which reads the fields directly from the mapping. Nothing is copied
+//and only the pages which are actually used are read from disk, so
+//even very large files open almost instantly.
+//
+//Both the original format and the version 2 format (see RecordV2.h) are
+//understood. The fields of a version 1 record are not aligned within the
+//file, so the spectra and audio are returned as pointers to raw bytes
+//which should be copied out (eg with memcpy) or accessed through the
+//per-bin methods. A damaged version 2 record is skipped and the search
+//for good records continues after it.
+
+#ifndef _ARCHIVEMAP_HDR_
+#define _ARCHIVEMAP_HDR_
+
+#include <IntegPeriod.h>
+#include <RecordV2.h>
+#include <string.h>
+
+//The spectra which a record may hold, in the order they are stored
+typedef enum view_spectrum {
+  view_phase=0,
+  view_cross,
+  view_input1,
+  view_input2,
+  view_numspectra
+} view_spectrum;
+
+//A lightweight view of one record within an ArchiveMap
+class PeriodView {
+public:
+  //'v2' is true if the record is in the version 2 format
+  PeriodView(const char *rec, bool v2=false) :itsRec(rec), itsV2(v2) { }
+
+  //Return the fields of the period
+  inline long long timeStamp() const {return getField<long long>(itsV2?8:4);}
+  inline float powerX() const {return getField<float>(itsV2?16:12);}
+  inline float power1() const {return getField<float>(itsV2?20:16);}
+  inline float power2() const {return getField<float>(itsV2?24:20);}
+  inline float amplitude() const {return getField<float>(itsV2?28:24);}
+  inline float phase() const {return getField<float>(itsV2?32:28);}
+  inline int numBins() const {return getField<int>(itsV2?40:32);}
+  inline bool RFI() const {
+    return itsV2 ? (getField<unsigned int>(36)&v2_rfi)!=0 : itsRec[36]=='R';
+  }
+
+  //Return the raw bytes of the given spectrum or NULL if it wasn't saved
+  const char *spectrum(view_spectrum which) const;
+  //Return one bin of the given spectrum, which must have been saved
+  inline float spectrum(view_spectrum which, int bin) const {
+    float res;
+    memcpy(&res, spectrum(which)+bin*sizeof(float), sizeof(float));
+    return res;
+  }
+
+  //Return the number of audio samples for each channel
+  int audioLen() const;
+  //Return true if the audio was saved compressed
+  bool audioCompressed() const;
+
+  //Fill out a full IntegPeriod with a copy of this record, including
+  //any audio which is decompressed if necessary
+  bool get(IntegPeriod &per) const;
+
+private:
+  template <class T>
+  inline T getField(int offset) const {
+    T res;
+    memcpy(&res, itsRec+offset, sizeof(T));
+    return res;
+  }
+  //Return the offset of the audio length field
+  int audioOffset() const;
+
+  const char *itsRec;
+  bool itsV2;
+};
+
+
+class ArchiveMap {
+public:
+  ArchiveMap();
+  ~ArchiveMap();
+
+  //Map the named file and find its records. Returns false if the file
+  //couldn't be opened or the first record is corrupt. If a later record
+  //is corrupt a warning is printed and, for version 1 files, the
+  //remainder is ignored. Version 2 files continue from the next good
+  //record.
+  bool open(const char *fname);
+  //Release the mapping
+  void close();
+
+  //Return the number of records in the file
+  inline int size() const {return itsCount;}
+  //Return a view of the given record
+  inline PeriodView operator[](int i) const {
+    return PeriodView(itsMap+itsOffsets[i], itsV2);
+  }
+  //Return the index of the first record at or after 'epoch', assuming
+  //the file is time sorted
+  int find(long long epoch) const;
+
+  //Check the record at 'rec' with 'avail' bytes remaining in the file
+  //and return its length, or -1 if it doesn't make sense
+  static long long checkRecord(const char *rec, long long avail);
+
+private:
+  //The mapped file and its length
+  char *itsMap;
+  long long itsMapLen;
+  //True if the file is in the version 2 format
+  bool itsV2;
+  //Offset of each record within the mapping
+  long long *itsOffsets;
+  int itsCount;
+};
+
+#endif
@@ -0,0 +1,176 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+//AsyncLoader downloads integration periods from a server in the
+//background, like IntegPeriod::load, so that a program can get data
+//from several servers at once or get on with something else meanwhile.
+//
+//One thread reads the reply from the socket into large blocks of whole
+//records, without looking inside them, and hands each block over as
+//soon as it is full or the server finishes a group of periods. One or
+//more parse threads turn the blocks into IntegPeriods, so reading from
+//the network and decoding overlap and the array doesn't have to be
+//sized from a count sent in advance.
+//
+//Several ranges can also be loaded at once with startMany(), which asks
+//for them all together (see IntegPeriod::loadMany) so that the server
+//works on them at the same time. loadMany decodes the replies itself, so
+//there are no parse threads then, just the one doing the loading.
+//
+//When a load finishes the optional callback is called, from the
+//loader's own thread. Otherwise wait(), take() or takeMany() block until
+//it has.
+
+#ifndef _ASYNCLOADER_HDR_
+#define _ASYNCLOADER_HDR_
+
+#include <TCPstream.h>
+#include <pthread.h>
+#include <string>
+
+using namespace std;
+
+class IntegPeriod;
+class AsyncLoader;
+
+//Called when a load has finished, whether or not it worked
+typedef void (*loader_callback)(AsyncLoader *loader, void *arg);
+
+class AsyncLoader {
+  //Helpers for spawning the threads
+  friend void *asyncloader_receive(void *arg);
+  friend void *asyncloader_parse(void *arg);
+  friend class AsyncRequest;
+public:
+  //Load over an established connection, which mustn't be used by
+  //anyone else until the load has finished
+  AsyncLoader(TCPstream &sock, int parsers=1);
+  //Load over a connection from the global ServerPool
+  AsyncLoader(const char *server, int port=31234, int parsers=1);
+  //Waits for any load to finish
+  ~AsyncLoader();
+
+  //Start loading the periods from 'start' to 'end', with the server
+  //cleaning them as for the BETWEEN command if 'preprocess' is set.
+  //Returns false if a load is still going.
+  bool start(long long start, long long end, int preprocess=1,
+	     loader_callback callback=NULL, void *arg=NULL);
+  //Start loading the 'num' ranges from 'start[i]' to 'end[i]' at once,
+  //otherwise as above
+  bool startMany(const long long *start, const long long *end, int num,
+		 int preprocess=1, loader_callback callback=NULL,
+		 void *arg=NULL);
+
+  //Has the load finished
+  bool finished();
+  //Wait for the load to finish and return whether it worked
+  bool wait();
+  //Wait for the load and take the periods, which the caller must then
+  //delete. 'count' may be zero even if true is returned.
+  bool take(IntegPeriod *&data, int &count);
+  //As above for a load started by startMany(), filling in the periods
+  //and count for each range. The arrays must have room for all of them.
+  bool takeMany(IntegPeriod **data, int *count);
+
+private:
+  //A block of whole records read from the network
+  typedef struct loadblock_t {
+    //The serialised records
+    char *buf;
+    int len;
+    int size;
+    //Number of records in the block
+    int num;
+    //The decoded periods, once a parse thread has done them
+    IntegPeriod *data;
+    bool ok;
+  } loadblock_t;
+
+  //Tidy up after an earlier load. Returns false if it is still going.
+  bool reset();
+  //Start the threads for the load which has been set up
+  void launch(int preprocess, loader_callback callback, void *arg);
+  //Main loop of the receive thread
+  void receiveLoop();
+  //Main loop of a parse thread
+  void parseLoop();
+  //Ask for the data and read the reply into blocks
+  bool receive(TCPstream &sock);
+  //Ask for all of the ranges and load them
+  bool receiveMany(TCPstream &sock);
+  //Delete the periods loaded for each range which haven't been taken
+  void freeRanges();
+  //Start filling a new block big enough for at least 'minsize' bytes
+  void newBlock(int minsize);
+  //Queue the block we have been filling, if it has anything in it
+  void queueBlock();
+  //Forget all the blocks, after the parse threads finish the ones
+  //they're working on
+  void clearBlocks();
+  //Put the decoded blocks together into the result
+  bool collect();
+
+  //Connection to load over, or NULL to use the ServerPool
+  TCPstream *itsSock;
+  string itsServer;
+  int itsPort;
+
+  //What to ask for
+  long long itsStart;
+  long long itsEnd;
+  int itsPreprocess;
+  //The ranges for startMany(), and how many there are, or 0 for a load
+  //of just the one range above
+  long long *itsStarts;
+  long long *itsEnds;
+  int itsNumRanges;
+  int itsRangesSize;
+  loader_callback itsCallback;
+  void *itsCallbackArg;
+
+  //Blocks in the order they arrived, and the next one to decode
+  loadblock_t **itsBlocks;
+  int itsNumBlocks;
+  int itsBlocksSize;
+  int itsNextParse;
+  //Number of parse threads decoding a block at the moment
+  int itsParsing;
+  //The block being filled by the receive thread
+  loadblock_t *itsFilling;
+  //Has the receive thread read everything it is going to
+  bool itsReceived;
+
+  //The result
+  IntegPeriod *itsData;
+  int itsCount;
+  //Or the result for each range
+  IntegPeriod **itsRangeData;
+  int *itsRangeCounts;
+  bool itsOK;
+  bool itsDone;
+
+  pthread_t itsReceiveThread;
+  bool itsStarted;
+  pthread_t *itsParseThreads;
+  int itsNumParsers;
+
+  //Protects everything above and signals changes to it
+  pthread_mutex_t itsLock;
+  pthread_cond_t itsCond;
+  inline void Lock() {pthread_mutex_lock(&itsLock);}
+  inline void Unlock() {pthread_mutex_unlock(&itsLock);}
+
+  //Size a block grows to before it is handed over
+  static const int theirBlockSize;
+  //Biggest record we believe
+  static const int theirMaxRecord;
+};
+
+#endif
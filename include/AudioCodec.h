@@ -0,0 +1,44 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+//Lossless compression of the raw stereo audio of an integration period,
+//along the lines of FLAC. Each channel is predicted from its previous
+//samples with whichever of the fixed polynomial predictors of order 0
+//to 4 gives the smallest residuals, and the residuals are Rice coded in
+//partitions which each have their own Rice parameter. The second input
+//is coded either directly or as its difference from the first input,
+//whichever is smaller, since the two receivers often see the same
+//signal.
+//
+//The residuals of the fixed predictors are just the successive
+//differences of the samples, so the encoder computes them with simple
+//loops over whole arrays which the compiler can vectorise.
+
+#ifndef _AUDIOCODEC_HDR_
+#define _AUDIOCODEC_HDR_
+
+#include <IntegPeriod.h>
+
+class AudioCodec {
+public:
+  //Compress 'numsamples' stereo interleaved samples from 'in'. The result
+  //is written to 'out', which is reallocated with new[] if it is smaller
+  //than needed in which case 'outsize' is updated. 'outlen' returns the
+  //length of the encoded data.
+  static void encode(const audio_t *in, int numsamples,
+		     char *&out, int &outsize, int &outlen);
+
+  //Decompress 'numsamples' stereo samples into 'out', which must have
+  //room for 2*numsamples values. Returns false if the data is corrupt.
+  static bool decode(const char *in, int inlen,
+		     audio_t *out, int numsamples);
+};
+
+#endif
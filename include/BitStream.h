@@ -0,0 +1,144 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+//Simple classes for packing variable length fields into a byte buffer,
+//most significant bit first, as used by the lossless codecs for the
+//store. These are inlined as they sit in the innermost encoding loops.
+
+#ifndef _BITSTREAM_HDR_
+#define _BITSTREAM_HDR_
+
+#include <string.h>
+
+///////////////////////////////////////////////////////////////////////
+//Writes a stream of bits, most significant first, to a growable buffer
+class BitWriter {
+public:
+  BitWriter(char *&buf, int &size)
+    :itsBuf(buf), itsSize(size), itsLen(0), itsAcc(0), itsBits(0) { }
+
+  //Append the lowest 'n' bits of 'val', n may be up to 32
+  inline void put(unsigned int val, int n) {
+    itsAcc = (itsAcc<<n) | (val & ((1ull<<n)-1));
+    itsBits += n;
+    while (itsBits>=8) {
+      itsBits -= 8;
+      if (itsLen==itsSize) grow();
+      itsBuf[itsLen++] = (char)(itsAcc>>itsBits);
+    }
+  }
+  //Append all 64 bits of 'val'
+  inline void put64(unsigned long long val) {
+    put((unsigned int)(val>>32), 32);
+    put((unsigned int)val, 32);
+  }
+  //Append 'val' as a Rice code with parameter 'k': the quotient in
+  //unary as zeros terminated by a one, then the low 'k' bits
+  inline void putRice(unsigned int val, int k) {
+    unsigned int q = val>>k;
+    if (q+1+k<=32) {
+      put((1u<<k) | (val & ((1u<<k)-1)), q+1+k);
+    } else {
+      for (; q>=32; q-=32) put(0, 32);
+      put(0, q);
+      put(1, 1);
+      put(val, k);
+    }
+  }
+  //Pad out the final byte and return the number of bytes written
+  int finish() {
+    if (itsBits>0) put(0, 8-itsBits);
+    return itsLen;
+  }
+
+private:
+  void grow() {
+    int newsize = 2*itsSize+64;
+    char *newbuf = new char[newsize];
+    if (itsLen>0) memcpy(newbuf, itsBuf, itsLen);
+    if (itsBuf!=NULL) delete[] itsBuf;
+    itsBuf = newbuf;
+    itsSize = newsize;
+  }
+
+  char *&itsBuf;
+  int &itsSize;
+  int itsLen;
+  unsigned long long itsAcc;
+  int itsBits;
+};
+
+
+///////////////////////////////////////////////////////////////////////
+//Reads a stream of bits written by BitWriter
+class BitReader {
+public:
+  BitReader(const char *buf, int len)
+    :itsBuf((const unsigned char*)buf), itsLen(len), itsPos(0),
+     itsAcc(0), itsBits(0), itsBad(false) { }
+
+  //Return the next 'n' bits, n may be up to 32
+  inline unsigned int get(int n) {
+    while (itsBits<n) {
+      itsAcc <<= 8;
+      if (itsPos<itsLen) itsAcc |= itsBuf[itsPos++];
+      else itsBad = true;
+      itsBits += 8;
+    }
+    itsBits -= n;
+    return (unsigned int)((itsAcc>>itsBits) & ((1ull<<n)-1));
+  }
+  //Return the next 64 bits
+  inline unsigned long long get64() {
+    unsigned long long hi = get(32);
+    return (hi<<32) | get(32);
+  }
+  //Return a value written by BitWriter::putRice with parameter 'k'
+  inline unsigned int getRice(int k) {
+    unsigned int q = 0;
+    while (true) {
+      if (itsBits==0) {
+	if (itsPos>=itsLen || q>(1u<<24)) {
+	  //Ran off the end or the quotient is absurd, data is corrupt
+	  itsBad = true;
+	  return 0;
+	}
+	itsAcc = (itsAcc<<8) | itsBuf[itsPos++];
+	itsBits = 8;
+      }
+      unsigned int avail = (unsigned int)(itsAcc & ((1u<<itsBits)-1));
+      if (avail==0) {
+	q += itsBits;
+	itsBits = 0;
+      } else {
+	//Skip the zeros and the terminating one
+	int top = 31-__builtin_clz(avail);
+	q += itsBits-1-top;
+	itsBits = top;
+	break;
+      }
+    }
+    return (q<<k) | get(k);
+  }
+  //Flag that the data didn't make sense
+  inline void setBad() {itsBad = true;}
+  //Returns true if we have read past the end or found corrupt data
+  inline bool bad() {return itsBad;}
+
+private:
+  const unsigned char *itsBuf;
+  int itsLen;
+  int itsPos;
+  unsigned long long itsAcc;
+  int itsBits;
+  bool itsBad;
+};
+
+#endif
@@ -37,16 +37,38 @@ private:
   bool itsKeepAudio;
   //Should the storage system keep spectral information
   bool itsKeepSpectra;
+  //Should the storage system maintain multi-resolution rollups
+  bool itsKeepRollups;
+  //Should closed days in the store be packed into segment files
+  bool itsCompactStore;
+  //Should compacted days be compressed
+  bool itsCompressStore;
   //Directory to use for the short-term raw data store
   string itsRawStoreDir;
   //Maximum age (microseconds) of raw data to be kept
   long long itsMaxRawAge;
   //Should the raw data store be used (true) or disabled (false)
   bool itsStoreRaw;
+  //Should audio in the raw data store be compressed
+  bool itsCompressRaw;
   //Network port for the server to listen on
   int itsServerPort;
   //Maximum number of network clients to run
   int itsMaxClients;
+  //Number of threads servicing the slower network requests
+  int itsWebWorkers;
+  //Number of threads servicing the bulk network requests
+  int itsBulkWorkers;
+  //Requests covering more than this many hours count as bulk
+  int itsBulkSpan;
+  //Most each network client may be sent, in kilobytes per second
+  int itsClientKBytes;
+  //Most commands each network client may make per second
+  float itsClientRequests;
+  //Seconds worth of the client limits which may be used in a burst
+  float itsClientBurst;
+  //Compress what we send to network clients which ask for it
+  bool itsNetCompress;
   //Number of spectral channels to calculate
   int itsNumBins;
   //Latitude of the telescope in degrees, North +ve.
@@ -96,12 +118,24 @@ public:
   //Return true if the main storage system should store spectral information
   inline bool getKeepSpectra() {return itsKeepSpectra;}
 
+  //Return true if the main storage system should maintain rollups
+  inline bool getKeepRollups() {return itsKeepRollups;}
+
+  //Return true if closed days in the main store should be compacted
+  inline bool getCompactStore() {return itsCompactStore;}
+
+  //Return true if compacted days in the main store should be compressed
+  inline bool getCompressStore() {return itsCompressStore;}
+
   //Return the base directory for the optional raw data store
   inline string getRawStoreDir() {return itsRawStoreDir;}
 
   //Return if the optional raw data store should be used (true if so)
   inline bool getStoreRaw() {return itsStoreRaw;}
 
+  //Return true if audio in the raw data store should be compressed
+  inline bool getCompressRaw() {return itsCompressRaw;}
+
   //Return the maximum age of raw data to be kept - older data will be removed
   inline long long getMaxRawAge() {return itsMaxRawAge;}
 
@@ -111,6 +145,27 @@ public:
   //Return the maximum number of network clients to start
   inline int getMaxClients() {return itsMaxClients;}
 
+  //Return the number of threads to service slow network requests with
+  inline int getWebWorkers() {return itsWebWorkers;}
+
+  //Return the number of threads to service bulk network requests with
+  inline int getBulkWorkers() {return itsBulkWorkers;}
+
+  //Return how many hours a request must cover to count as bulk
+  inline int getBulkSpan() {return itsBulkSpan;}
+
+  //Return the most kilobytes per second to send a client, 0 for no limit
+  inline int getClientKBytes() {return itsClientKBytes;}
+
+  //Return the most commands per second a client may make, 0 for no limit
+  inline float getClientRequests() {return itsClientRequests;}
+
+  //Return how many seconds of the client limits may be used in a burst
+  inline float getClientBurst() {return itsClientBurst;}
+
+  //Return true if network clients may ask for compressed replies
+  inline bool getNetCompress() {return itsNetCompress;}
+
   //Return the server latitude, in degrees, North +ve
   inline float getLatitude() {return itsLatitude;}
 
@@ -0,0 +1,86 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+//Version 2 of the network protocol sends everything as frames, so that
+//a client can have several requests on the go over one connection and
+//tell the replies apart. Each frame is a fixed header followed by
+//'length' bytes of payload. The fields of the header are all sent in
+//network byte order:
+//
+//  length   4 bytes  number of bytes of payload after the header
+//  id       4 bytes  the request the frame belongs to, chosen by the client
+//  type     2 bytes  one of frame_type
+//  reserved 2 bytes  always zero
+//  count    4 bytes  number of records in a data frame, or the total
+//                    number in the reply for an end frame
+//
+//The client sends request frames, whose payload is a command as it would
+//be sent in version 1 without the newline, and cancel frames. The server
+//answers each request with any number of data frames followed by either
+//an end frame or an error frame whose payload says what went wrong.
+
+#ifndef _FRAME_HDR_
+#define _FRAME_HDR_
+
+#include <arpa/inet.h>
+#include <string.h>
+
+//Number of bytes in the header of a frame
+#define FRAME_HEADER 16
+
+typedef enum frame_type {
+  //Client to server: a command, and giving up on an earlier request
+  frame_request = 1,
+  frame_cancel = 2,
+  //Server to client: part of a reply, the end of it, and failure
+  frame_data = 16,
+  frame_end = 17,
+  frame_error = 18
+} frame_type;
+
+//The header of a frame, once unpacked
+typedef struct frame_t {
+  unsigned int length;
+  unsigned int id;
+  int type;
+  unsigned int count;
+} frame_t;
+
+
+//Write the header into the FRAME_HEADER bytes at 'buf'
+inline void packFrame(const frame_t &frame, char *buf)
+{
+  unsigned int word;
+  word = htonl(frame.length);
+  memcpy(buf, &word, 4);
+  word = htonl(frame.id);
+  memcpy(buf+4, &word, 4);
+  word = htonl(((unsigned int)frame.type)<<16);
+  memcpy(buf+8, &word, 4);
+  word = htonl(frame.count);
+  memcpy(buf+12, &word, 4);
+}
+
+
+//Read the header from the FRAME_HEADER bytes at 'buf'
+inline void unpackFrame(const char *buf, frame_t &frame)
+{
+  unsigned int word;
+  memcpy(&word, buf, 4);
+  frame.length = ntohl(word);
+  memcpy(&word, buf+4, 4);
+  frame.id = ntohl(word);
+  memcpy(&word, buf+8, 4);
+  frame.type = ntohl(word)>>16;
+  memcpy(&word, buf+12, 4);
+  frame.count = ntohl(word);
+}
+
+#endif
@@ -55,6 +55,10 @@ typedef enum windowing_mode {
 class IntegPeriod {
 public:
   IntegPeriod();
+  //Copy constructor makes its own copy of any spectra and audio
+  IntegPeriod(const IntegPeriod &rhs);
+  //Move constructor takes over the spectra and audio of 'rhs'
+  IntegPeriod(IntegPeriod &&rhs);
   //Destructor frees all subdata if they exist
   ~IntegPeriod();
 
@@ -116,13 +120,22 @@ public:
   //These methods load a bunch of IntegPeriods from a source
   //data and count are filled in by the methods
   //count may be zero even if true is returned (connection ok but no data)
+  //'preprocess' is the clean_mode the server should apply, if any
   static bool load(IntegPeriod *&data, int &count,
                    long long start, long long end,
                    const char *server="localhost",
-                   int port=31234, bool preprocess=true);
+                   int port=31234, int preprocess=1);
   static bool load(IntegPeriod *&data, int &count,
                    long long start, long long end,
-                   TCPstream &sock, bool preprocess=true);
+                   TCPstream &sock, int preprocess=1);
+  //Load 'num' ranges over the one connection, from start[i] to end[i]
+  //into data[i] and count[i]. With protocol 2 the requests are all sent
+  //without waiting, so the server can work on them at the same time,
+  //otherwise they are loaded one after another. Returns false unless
+  //every range was loaded, but any which were are still filled in.
+  static bool loadMany(IntegPeriod **data, int *count,
+                       const long long *start, const long long *end,
+                       int num, TCPstream &sock, int preprocess=1);
   //Load 'raw' data (includes audio if available)
   static bool loadraw(IntegPeriod *&data, int &count,
                       long long start, long long end,
@@ -135,7 +148,8 @@ public:
   static bool load(IntegPeriod *&data, int &count, const char *infile, bool keepaudio=false);
   static bool load(IntegPeriod *&data, int &count, ifstream &infile, bool keepaudio=false);
 
-  //Write the array of IntegPeriods to a file
+  //Write the array of IntegPeriods to a file in the version 2 format
+  //described in RecordV2.h. Both formats can be loaded.
   //Fails silently it seems...
   static void write(const IntegPeriod *data, int count, ofstream &outfile);
   static void write(const IntegPeriod *data, int count, const char *fname);
@@ -153,23 +167,41 @@ public:
   //Scale and offset both inputs to the scale of power1 of the reference
   static void translate(IntegPeriod *data, int datalen,
 			IntegPeriod *ref, int reflen);
-  //Merge and timesort the given, sorted, integration periods
+  //Merge and timesort the given, sorted, integration periods. The
+  //periods are moved into the result, so data1 and data2 are left
+  //without any spectra or audio and should then be deleted.
   static void merge(IntegPeriod *&resdata, int &rescount,
 		    IntegPeriod *data1, int count1,
 		    IntegPeriod *data2, int count2);
-  //Time sort the unordered integration periods
+  //Merge any number of sorted sets in one pass. Equal time stamps keep
+  //the order of the sets. The periods are moved as above.
+  static void merge(IntegPeriod *&resdata, int &rescount,
+		    IntegPeriod **data, const int *counts, int num);
+  //Time sort the unordered integration periods. The sort is stable and
+  //is done in place by moving periods, so 'data' is not reallocated.
+  //Sorted or rotated data is detected in a single pass, and large
+  //arrays are sorted by several threads.
   static void sort(IntegPeriod *&data, int count);
   //Normalise power 1 and power 2 values and then scale cross power
   static void normalise(IntegPeriod *&data, int count);
   //Accumulate integration periods up to the indicated duration
-  //Assumes data are sorted
+  //Assumes data are sorted. Only periods which contain some data are
+  //returned, and spectra are averaged if all of the inputs have them.
   static void integrate(IntegPeriod *&cleandata, int &cleanlen,
 			IntegPeriod *data, int len,
 			long long period, bool keeprfi=false);
-  //Return a new series by purging the RFI-flagged integration periods
+  //Return a new series by purging the RFI-flagged integration periods.
+  //The kept periods are moved out of 'data', which should then be deleted.
   static int purgeFlagged(IntegPeriod *&res, int &reslen,
 			  IntegPeriod *data, int datalen);
+  //Copy another period, reusing our existing buffers where they fit
   void operator=(const IntegPeriod &rhs);
+  //Take over the spectra and audio of 'rhs', leaving it without any
+  void operator=(IntegPeriod &&rhs);
+  //Exchange everything with another period
+  void swap(IntegPeriod &rhs);
+  //Return a full copy of the period, including spectra and audio
+  IntegPeriod clone() const;
   //    void operator=(IntegPeriod &rhs);
   //Return the given index from the cross power spectrum
   float operator[](int index);
@@ -196,6 +228,36 @@ public:
   //Saves state of the integperiod to a file
   friend ofstream &operator<<(ofstream& os, const IntegPeriod& per);
   friend TCPstream &operator<<(TCPstream& os, const IntegPeriod& per);
+  //Save in the same form as operator<< to any stream, optionally with
+  //the raw audio losslessly compressed. Either form can be read back
+  //with the usual operator>>
+  static void save(ostream &os, const IntegPeriod &per,
+		   bool packaudio=false);
+  //Return the length of the period when serialised without compression
+  static int encodedSize(const IntegPeriod &per);
+  //Serialise the period, in the same form as operator<<, into 'buf'
+  //which must hold encodedSize() bytes. Returns the end of the record.
+  static char *encode(const IntegPeriod &per, char *buf);
+  //Serialise just the fixed fields at the start of a record which will
+  //be 'len' bytes long. Returns the number of bytes used.
+  static int encodeHeader(const IntegPeriod &per, int len, char *buf);
+  //Length of the fixed fields written by encodeHeader
+  static const int theirHeaderLen = sizeof(int) + sizeof(long long)
+    + 5*sizeof(float) + sizeof(int) + 5;
+
+  //Agree on the protocol with a network server, unless that has already
+  //been done on the connection, by asking for version 1.2 and waiting
+  //for the reply. If 'compress' is set we also ask for what it sends to
+  //be compressed, and decompress everything from then on if it agrees.
+  //Returns the version the connection uses times ten, 12 or else 11, or
+  //0 if the connection failed. A server too old to know the PROTOCOL
+  //command closes the connection when it is asked.
+  static int negotiate(TCPstream &sock, bool compress=true);
+  //As above for a connection which has just been made to 'addr'. If the
+  //server closes it we connect again and use protocol 1.1. Returns false
+  //if we couldn't.
+  static bool negotiate(TCPstream &sock, const SocketAddr &addr,
+			bool compress=true);
   //Read state of integperiod from a file
   friend istream &operator>>(istream& os, IntegPeriod& per);
 
@@ -214,6 +276,19 @@ private:
   void getNextAudio(int blockLen, int blockNum, float *&a1, float *&a2);
   //Calculate the zero lag correlation of ch1 and ch2.
   float correlate(int len, float *ch1, float *ch2);
+
+  //Read the groups of periods in a protocol 1.2 reply, up to and
+  //including the trailer. Returns false on error or if the server
+  //reported one.
+  static bool readChunks(IntegPeriod *&data, int &count, TCPstream &sock);
+  //Read a protocol 1.1 reply, the number of periods on a line by itself
+  //and then that many periods. If 'samprate' is given the sampling rate
+  //comes after the count, as in the reply to RAW-BETWEEN.
+  static bool readCounted(IntegPeriod *&data, int &count, TCPstream &sock,
+			  int *samprate=NULL);
+  //Send the server a protocol 2 frame
+  static void sendFrame(TCPstream &sock, unsigned int id, int type,
+			const string &payload);
 };
 
 #endif
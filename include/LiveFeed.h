@@ -0,0 +1,99 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+//LiveFeed is a broadcast ring holding copies of the most recent
+//integration periods, as the Processor produces them, for network
+//clients which have subscribed to the live data. Each period is given a
+//sequence number and readers keep track of the next number they want,
+//so there can be any number of readers and none of them can hold up the
+//writer. Once the ring is full the oldest period is simply overwritten,
+//and a reader which has fallen that far behind can tell how many it
+//missed.
+//
+//A reader can ask for a period with only some of the data, in which
+//case it is serialised once for each combination asked for and kept in
+//the ring, so that many readers cost little more than one. This is done
+//without holding the lock, so the writer is never kept waiting while a
+//period is serialised.
+//
+//A pipe becomes readable whenever a new period is added, so the ring
+//can be watched with select or epoll along with other sockets.
+
+#ifndef _LIVEFEED_HDR_
+#define _LIVEFEED_HDR_
+
+#include <pthread.h>
+#include <string>
+
+using namespace std;
+
+class IntegPeriod;
+
+class LiveFeed {
+public:
+  //Create a ring which keeps the last 'size' periods
+  LiveFeed(int size);
+  ~LiveFeed();
+
+  //Add a copy of the period to the ring. We don't take ownership.
+  void put(const IntegPeriod &per);
+
+  //Return the sequence number the next period will be given
+  long long head();
+  //Return the sequence number of the oldest period still in the ring
+  long long oldest();
+
+  //Append period 'seq', serialised as for the BETWEEN command with only
+  //the data asked for, to 'out'. Returns false if the period isn't in
+  //the ring, either because it has been overwritten or hasn't arrived.
+  bool get(long long seq, bool cross, bool inputs, bool audio, string &out);
+
+  //Return the file descriptor which becomes readable when data arrives
+  inline int getWakeFd() const {return itsWakePipe[0];}
+  //Clear the wake up notice, before reading the new data
+  void clearWake();
+
+private:
+  //A period which readers may be serialising after it has left the
+  //ring. The last of the ring and the readers to let go deletes it.
+  typedef struct liveper_t {
+    IntegPeriod *per;
+    int refs;
+  } liveper_t;
+
+  //Let go of the period, returning true if it should now be deleted
+  bool release(liveper_t *live);
+
+  //One period in the ring and the forms it has been serialised in
+  typedef struct liveslot_t {
+    liveper_t *live;
+    //Serialised period for each combination of cross, inputs and audio
+    string coded[8];
+    bool havecoded[8];
+  } liveslot_t;
+
+  //The ring of periods, period 'n' is in slot n%itsSize
+  liveslot_t *itsSlots;
+  int itsSize;
+  //Sequence number which the next period will get
+  long long itsHead;
+
+  //Have we written to the pipe since it was last cleared
+  bool itsSignalled;
+  //Pipe used to wake up anyone waiting for new data
+  int itsWakePipe[2];
+
+  //Protects the ring
+  pthread_mutex_t itsLock;
+  inline void Lock() {pthread_mutex_lock(&itsLock);}
+  inline void Unlock() {pthread_mutex_unlock(&itsLock);}
+};
+
+#endif
@@ -0,0 +1,87 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+//PeriodBatch serialises a group of IntegPeriods, in the same form as
+//operator<<, so they can be written out in one go rather than a field
+//at a time. Only the small fixed fields of each record are copied, into
+//one growing buffer, while the spectra and audio are referenced where
+//they already are in memory. The batch can then be sent to a socket as
+//a single gathered writev, or copied into one block for a file.
+//
+//The periods must not be changed or deleted until the batch has been
+//written or cleared.
+
+#ifndef _PERIODBATCH_HDR_
+#define _PERIODBATCH_HDR_
+
+#include <IntegPeriod.h>
+#include <TCPstream.h>
+#include <iostream>
+
+using namespace std;
+
+class PeriodBatch {
+public:
+  //If 'packaudio' is set any raw audio is compressed as it is added
+  PeriodBatch(bool packaudio=false);
+  ~PeriodBatch();
+
+  //Add a period to the end of the batch
+  void add(const IntegPeriod &per);
+  //Add a period which is already serialised, 'len' bytes at 'rec'
+  void addRecord(const char *rec, long long len);
+  //Return the number of periods in the batch
+  inline int count() const {return itsCount;}
+  //Return the number of bytes the batch will write
+  inline long long length() const {return itsLength;}
+  //Forget everything in the batch
+  void clear();
+
+  //Write the batch to the stream as a single block
+  void write(ostream &os);
+  //Send the batch straight to the socket, after 'prefixlen' bytes from
+  //'prefix' if given. Returns false on error.
+  bool send(TCPstream &sock, const char *prefix=NULL, int prefixlen=0);
+
+private:
+  //One contiguous piece of the output. If 'ptr' is NULL the piece is
+  //in our own buffer at 'offset'.
+  typedef struct piece_t {
+    const char *ptr;
+    long long offset;
+    long long len;
+  } piece_t;
+
+  //Append bytes to our own buffer as part of the output
+  void addLocal(const void *data, int len);
+  //Append a reference to someone else's data
+  void addRef(const void *data, long long len);
+  //Make room for another piece
+  piece_t &newPiece();
+
+  bool itsPackAudio;
+  int itsCount;
+  long long itsLength;
+
+  //Buffer holding the fixed fields of each record
+  char *itsLocal;
+  long long itsLocalLen;
+  long long itsLocalSize;
+  //The pieces which make up the output, in order
+  piece_t *itsPieces;
+  int itsNumPieces;
+  int itsPiecesSize;
+  //Compressed audio which we need to free
+  char **itsPacked;
+  int itsNumPacked;
+  int itsPackedSize;
+};
+
+#endif
@@ -0,0 +1,81 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+//PeriodSeries holds the scalar fields of a series of IntegPeriods as
+//columns, with one contiguous array for each of the time stamps, the
+//powers, the visibility amplitude and phase and the RFI flags. The
+//statistics and plotting code only look at one or two of these at a
+//time, so scanning a column touches far less memory than walking an
+//array of IntegPeriods, and each column can be handed straight to the
+//plotting routines without first being copied out.
+//
+//Spectra and audio are not kept, so a series is only suitable once the
+//data has been reduced to total powers.
+
+#ifndef _PERIODSERIES_HDR_
+#define _PERIODSERIES_HDR_
+
+#include <IntegPeriod.h>
+
+class PeriodSeries {
+public:
+  PeriodSeries();
+  //Create a series with room for 'size' periods
+  PeriodSeries(int size);
+  //Create a series holding a copy of the given periods
+  PeriodSeries(const IntegPeriod *data, int count);
+  PeriodSeries(const PeriodSeries &rhs);
+  ~PeriodSeries();
+  void operator=(const PeriodSeries &rhs);
+
+  //Return the number of periods in the series
+  inline int size() const {return itsSize;}
+  //Change the number of periods. Any existing contents are discarded.
+  void resize(int size);
+
+  //Replace the contents with the given periods
+  void set(const IntegPeriod *data, int count);
+  //Copy the series into an existing array of size() periods
+  void get(IntegPeriod *data) const;
+  //Return a new array of IntegPeriods holding the series
+  IntegPeriod *toPeriods() const;
+  //Copy just the RFI flags into an existing array of size() periods
+  void copyFlags(IntegPeriod *data) const;
+
+  //Fill 'res' with the unflagged periods and return how many were
+  //dropped. 'res' may be this series.
+  int purgeFlagged(PeriodSeries &res) const;
+  //Accumulate the periods into bins of the given duration, in the same
+  //way as IntegPeriod::integrate. Assumes the series is sorted. 'res'
+  //may be this series.
+  void integrate(PeriodSeries &res, long long period,
+		 bool keeprfi=false) const;
+  //Return a new array of the time stamps in hours after 'offset'
+  float *hours(long long offset=0) const;
+
+  //The columns, each of size() entries
+  long long *timeStamp;
+  float *powerX;
+  float *power1;
+  float *power2;
+  float *amplitude;
+  float *phase;
+  bool *RFI;
+
+private:
+  //Exchange contents with another series
+  void swap(PeriodSeries &rhs);
+  //Free the columns
+  void release();
+
+  int itsSize;
+};
+
+#endif
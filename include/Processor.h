@@ -23,6 +23,8 @@
 //Forward declarations
 class IntegPeriod;
 class StoreMaster;
+class RawRing;
+class LiveFeed;
 
 class Processor : public ThreadedObject {
 public:
@@ -31,13 +33,16 @@ public:
   //IntegPeriods with attached raw audio data will be stored in the
   //rolling 'rawout' storage buffer if 'rawout' is non-null.
   Processor(Buf<IntegPeriod*> *in, StoreMaster *out,
-            StoreMaster *rawout=NULL, float gain1=1.0, float gain2=1.0);
+            RawRing *rawout=NULL, float gain1=1.0, float gain2=1.0);
   //Destructor
   ~Processor();
 
   //Do we keep audio (true) or strip it before saving (false)
   inline void setKeepAudio(bool keep) {itsKeepAudio = keep;}
 
+  //Also send each processed period to the given ring for live clients
+  inline void setLiveFeed(LiveFeed *feed) {itsLiveFeed = feed;}
+
 private:
   //Main loop of execution for the dedicated thread
   void run();
@@ -52,7 +57,9 @@ private:
   StoreMaster *itsOutBuf;
   //Buffer to which we write processed IntegPeriods with raw data
   //Can be NULL in which case we don't store a raw audio buffer.
-  StoreMaster *itsRawOutBuf;
+  RawRing *itsRawOutBuf;
+  //Ring of recent periods for subscribed clients, can be NULL
+  LiveFeed *itsLiveFeed;
 
   //Number of frequency domain spectral channels in our output
   int itsNumBins;
@@ -13,15 +13,30 @@
 
 #include <TimeCoord.h>
 class IntegPeriod;
+class PeriodSeries;
 
 //Some hacked together functions from previous code.
 //This doesn't contain any great insights into RFI mitigation, rather
 //it is a loose collection of some poorly implemented statistical
 //processing functions..
 
+//How cleanData decides which periods are contaminated. clean_sigma
+//compares each period with the mean and standard deviation around it,
+//while clean_median uses the median and median absolute deviation,
+//which bursts of RFI can't drag about, so a much shorter window will do.
+typedef enum clean_mode {clean_none=0, clean_sigma, clean_median} clean_mode;
+
 //"autoclean" the 'data' argument. Size of 'res' is held in 'rescount'
 void cleanData(IntegPeriod *&res, int &rescount,
-	       IntegPeriod *data, int count);
+	       IntegPeriod *data, int count, clean_mode mode=clean_sigma);
+void cleanData(PeriodSeries &res, PeriodSeries &data,
+	       clean_mode mode=clean_sigma);
+
+//Clean 'data' as for clean_median, flagging more than 'sigma' robust
+//deviations above the local median, and integrate what is left into
+//'res' in bins of 'inttime' microseconds. The flags are left on 'data'.
+void medianClean(PeriodSeries &res, PeriodSeries &data, float sigma,
+		 long long inttime);
 
 //Get average float value over 'len' indices, starting from 'start'
 float getAvg(float *v, int start, int len);
@@ -34,21 +49,23 @@ float getSD(float mean, float *v, int start, int len);
 //any data with a local standard deviation greater
 void markOutliers(IntegPeriod *data, int size, float sigma,
 		  int len, bool sdnazi=false);
+void markOutliers(PeriodSeries &data, float sigma,
+		  int len, bool sdnazi=false);
 
 //Flag data more than 'cutoff' times the local mean
 void powerClean(IntegPeriod *data, int size, float cutoff, int len);
+void powerClean(PeriodSeries &data, float cutoff, int len);
+
+//Flag any data more than 'sigma' times the scaled median absolute
+//deviation above the median of the 'len' periods around it
+void markMedianOutliers(IntegPeriod *data, int size, float sigma, int len);
+void markMedianOutliers(PeriodSeries &data, float sigma, int len);
 
 //Find mapping y=mx+b between datasets and set m and b
 void regression(float &m, float &b,
 		float *x, timegen_t *xtimes, int xlen,
                 float *y, timegen_t *ytimes, int ylen);
 
-int nearest(int i, timegen_t *a, int alen,
-	    timegen_t *b, int blen, timegen_t cutoff=0);
-
-int matchTimes(int i, timegen_t *a, int alen,
-	       timegen_t *b, int blen);
-
 //Find closest matches between a and b and return new datasets in ref's
 //The caller needs to delete the pointers when done.
 void matchTimes(float *adata, timegen_t *atimes, int alen,
@@ -0,0 +1,107 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+//RawRing is the short-term store for raw data (complete integration
+//periods including the audio). It is a single file, preallocated when it
+//is created with enough room for 'maxrawage' worth of data, which is
+//memory mapped and used as a circular buffer. New periods are appended
+//after the previous one and the oldest data is simply overwritten once
+//the ring is full, so there are no files to create, search for or unlink.
+//
+//The file starts with a header and an index holding the time stamp and
+//position of each period in the ring, followed by the data area. Each
+//period is stored in the same serialised form as the StoreMaster files and
+//never straddles the end of the data area. This means that a request for
+//all periods between two times can be answered with at most two
+//contiguous regions of the mapped file, which can be written straight to
+//a network client without loading them into IntegPeriods.
+//
+//The ring survives a restart of sac provided the configuration which
+//determines its size hasn't changed, otherwise it is recreated empty.
+
+#ifndef _RAWRING_HDR_
+#define _RAWRING_HDR_
+
+#include <pthread.h>
+#include <string>
+
+using namespace std;
+
+class IntegPeriod;
+typedef struct ringheader_t ringheader_t;
+typedef struct ringslot_t ringslot_t;
+
+//The periods between two times, as up to two regions of the mapped file
+typedef struct rawslice_t {
+  //Number of periods in the slice
+  int count;
+  //Start and length of each region, the second may be empty
+  const char *start[2];
+  long long len[2];
+  //Position of the first period, to check it hasn't been overwritten
+  long long pos;
+} rawslice_t;
+
+class RawRing {
+public:
+  //Open or create the ring file 'fname' with room for 'maxage'
+  //microseconds of data. The size of each period is determined from the
+  //sampling rate in Hz, integration time in ms and number of channels.
+  RawRing(string fname, long long maxage,
+	  int samprate, int integtime, int numbins);
+  ~RawRing();
+
+  //Returns true if the ring was opened and mapped okay
+  inline bool isOpen() {return itsHeader!=NULL;}
+
+  //Enable or disable lossless compression of the audio as it is saved
+  inline void setCompressAudio(bool compress) {itsCompressAudio = compress;}
+
+  //Append a copy of the period to the ring. We don't take ownership.
+  void put(const IntegPeriod &per);
+
+  //Find all periods between the given times, set end to zero to get all
+  //data since the start epoch. The regions remain valid until they are
+  //overwritten by new data, which can be checked with stillValid.
+  void slice(long long start, long long end, rawslice_t &res);
+
+  //Check that the data in the slice hasn't been overwritten since it
+  //was found. Call this after using the data.
+  bool stillValid(const rawslice_t &sl);
+
+private:
+  //Create a new empty ring file of the given size
+  bool create(int fd, int numslots, long long datasize);
+  //Return the index slot for the given sequence number
+  inline ringslot_t &slot(long long seq);
+  //Return the first sequence number with a time stamp at or after 'epoch'
+  long long findSeq(long long epoch);
+
+  //Name of the ring file
+  string itsFileName;
+  //Whether audio should be compressed
+  bool itsCompressAudio;
+  //The mapped file and its length
+  char *itsMap;
+  long long itsMapLen;
+  //The header, index and data area within the mapping
+  ringheader_t *itsHeader;
+  ringslot_t *itsIndex;
+  char *itsData;
+  //How much of the oldest data we won't hand out because it is
+  //about to be overwritten
+  long long itsGuard;
+  //Protects the header and index
+  pthread_mutex_t itsLock;
+  inline void Lock() {pthread_mutex_lock(&itsLock);}
+  inline void Unlock() {pthread_mutex_unlock(&itsLock);}
+};
+
+#endif
@@ -0,0 +1,113 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+//Version 2 of the binary format for files of IntegPeriods. The original
+//format, still used by the store and the network protocol, has a length
+//followed by the fields and then five characters to flag which sections
+//follow, which leaves nothing aligned and no way to tell a damaged
+//record from a good one. Files written by the tools (IntegPeriod::write)
+//now use this format instead:
+//
+// -The file starts with a 16 byte header declaring the format version.
+// -Each record starts with a fixed 56 byte header holding a magic
+//  number, the record length, all of the scalar fields, a bitmask of
+//  which sections follow, the number of channels, the audio length and
+//  a CRC32C checksum of the whole record.
+// -The spectra and audio follow, each padded out to a multiple of 8
+//  bytes so that every record and section is 8 byte aligned and the
+//  header can be used directly as a struct.
+//
+//A reader which finds a record with a bad checksum can skip straight to
+//the next one using the length, or search forward for the next magic
+//number if the length itself is damaged. Version 1 files remain
+//readable everywhere that files are loaded.
+
+#ifndef _RECORDV2_HDR_
+#define _RECORDV2_HDR_
+
+#include <iostream>
+
+using namespace std;
+
+class IntegPeriod;
+
+//Header at the start of a version 2 file
+typedef struct v2fileheader_t {
+  char magic[8];
+  int version;
+  int reserved;
+} v2fileheader_t;
+
+//Header at the start of each record
+typedef struct v2header_t {
+  unsigned int magic;
+  //Total length of the record including this header and any padding
+  unsigned int length;
+  long long timeStamp;
+  float powerX;
+  float power1;
+  float power2;
+  float amplitude;
+  float phase;
+  //Bitmask of v2_flag values
+  unsigned int flags;
+  int numBins;
+  //Number of audio samples for each channel
+  int audioLen;
+  //Number of bytes of audio data, before padding
+  int audioBytes;
+  //CRC32C of the record, calculated with this field set to zero
+  unsigned int crc;
+} v2header_t;
+
+//Bits used in the flags field of the record header
+typedef enum v2_flag {
+  v2_rfi=1,
+  v2_phase=2,
+  v2_cross=4,
+  v2_input1=8,
+  v2_input2=16,
+  //The audio is compressed with AudioCodec
+  v2_packedaudio=32
+} v2_flag;
+
+class RecordV2 {
+public:
+  //Write the file header which must precede the records
+  static void writeFileHeader(ostream &os);
+  //Returns true if the data begins with a version 2 file header
+  static bool isFileHeader(const char *data, long long len);
+
+  //Write a period as a version 2 record, optionally with the audio
+  //compressed
+  static void save(ostream &os, const IntegPeriod &per,
+		   bool packaudio=false);
+  //Read a record into 'per'. Sets the failbit if the record is damaged,
+  //in which case the stream is left at the start of the next record if
+  //the length was believable.
+  static bool read(istream &is, IntegPeriod &per);
+
+  //Check the record at 'rec' with 'avail' bytes remaining and return
+  //its length, or -1 if it is damaged
+  static long long check(const char *rec, long long avail);
+
+  //Return the offset within a record of the given section, where the
+  //sections are numbered in the order of the flag bits after v2_rfi
+  static long long sectionOffset(const v2header_t &hdr, int section);
+
+  //Calculate the CRC32C of a block, continuing from a previous 'crc'
+  static unsigned int crc32c(const char *data, long long len,
+			     unsigned int crc=0);
+
+  //Magic number at the start of each record
+  static const unsigned int theirMagic;
+};
+
+#endif
@@ -0,0 +1,111 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+//A Rollup summarises all of the integration periods which fall within
+//a fixed length time bucket, keeping the mean, minimum and maximum of
+//each power field along with how many periods were accumulated. The
+//StoreMaster maintains several tiers of these (eg 10 second, 1 minute,
+//10 minute and 1 hour buckets) as data is flushed to disk, so that long
+//range queries can be answered from a few thousand rollups rather than
+//by reading and re-integrating millions of raw periods.
+//
+//The phase is accumulated as I/Q components so that the mean of the
+//complex visibility is correct even when the phase wraps.
+
+#ifndef _ROLLUP_HDR_
+#define _ROLLUP_HDR_
+
+#include <TCPstream.h>
+#include <fstream>
+
+class IntegPeriod;
+
+//Indices of the fields which we keep statistics for
+typedef enum rollup_field {
+  rollup_power1=0,
+  rollup_power2,
+  rollup_powerX,
+  rollup_amplitude,
+  rollup_numfields
+} rollup_field;
+
+class Rollup {
+public:
+  Rollup();
+
+  //Start time of the bucket, microseconds since the epoch
+  long long timeStamp;
+  //Length of the bucket in microseconds
+  long long period;
+  //Number of integration periods accumulated into this bucket
+  int count;
+  //How many of the accumulated periods were flagged as RFI
+  int numRFI;
+  //Sum, minimum and maximum of each field, indexed by rollup_field
+  double sum[rollup_numfields];
+  float min[rollup_numfields];
+  float max[rollup_numfields];
+  //Sum of the in-phase and quadrature components of the visibility
+  double sumI;
+  double sumQ;
+
+  //Reset to an empty bucket starting at the given time
+  void clear(long long start, long long length);
+  //Accumulate an integration period into this bucket
+  void add(const IntegPeriod &per);
+  //Combine the statistics from another bucket into this one
+  void add(const Rollup &rhs);
+
+  //Return the mean of the given field, or 0 if the bucket is empty
+  inline float mean(int field) const {
+    return count>0 ? (float)(sum[field]/count) : 0.0;
+  }
+  //Return the mean phase of the accumulated visibilities
+  float meanPhase() const;
+
+  //Fill out an IntegPeriod with the mean values from this bucket
+  void toIntegPeriod(IntegPeriod &per) const;
+  //Convert an array of rollups to an array of mean IntegPeriods
+  static void toIntegPeriods(IntegPeriod *&res, int &reslen,
+			     const Rollup *data, int count);
+
+  //Merge consecutive rollups into buckets of the given length, which
+  //should be a multiple of the length of the argument buckets. Buckets
+  //with the same start time, eg those written again after a restart,
+  //are also merged. The result is written back into 'data'.
+  static void rebin(Rollup *data, int &count, long long length);
+
+  //Load rollups of the given resolution from a network server
+  static bool load(Rollup *&data, int &count,
+		   long long start, long long end, long long resolution,
+		   const char *server="localhost", int port=31234);
+  static bool load(Rollup *&data, int &count,
+		   long long start, long long end, long long resolution,
+		   TCPstream &sock);
+
+  //Load no more than 'maxbuckets' rollups across the range from a
+  //network server, which chooses the length of the buckets
+  static bool loadBuckets(Rollup *&data, int &count,
+			  long long start, long long end, int maxbuckets,
+			  const char *server="localhost", int port=31234);
+  static bool loadBuckets(Rollup *&data, int &count,
+			  long long start, long long end, int maxbuckets,
+			  TCPstream &sock);
+
+  //Saves state of the rollup to a file or across the network
+  friend ofstream &operator<<(ofstream& os, const Rollup& roll);
+  friend TCPstream &operator<<(TCPstream& os, const Rollup& roll);
+  //Save in the same form as operator<< to any stream
+  static void save(ostream &os, const Rollup &roll);
+  //Read state of the rollup from a file or the network
+  friend istream &operator>>(istream& is, Rollup& roll);
+};
+
+#endif
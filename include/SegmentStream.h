@@ -0,0 +1,123 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+//A day segment holds all of the data for one day of a StoreMaster once
+//the minute files have been compacted. The file starts with a header
+//which gives the offset of the data for each minute of the day and how
+//it is encoded, followed by the data itself.
+//
+//SegmentStream is an istream which returns the records from a segment,
+//starting at a given minute and continuing to the end of the day, in the
+//same format as they were written to the minute files. Compressed
+//minutes are decoded one at a time as the stream is read, so the caller
+//doesn't need to know how the segment was encoded. Only relative seeks
+//are supported, which is all the StoreMaster needs to skip records.
+
+#ifndef _SEGMENTSTREAM_HDR_
+#define _SEGMENTSTREAM_HDR_
+
+#include <fstream>
+#include <iostream>
+
+using namespace::std;
+
+//Number of minute files which are packed into each day segment
+#define SEG_MINUTES 1440
+//Name of the segment file within each day directory
+#define SEG_NAME "day.seg"
+
+//Ways in which the data for each minute may be encoded
+typedef enum seg_encoding {
+  //The records exactly as they were written to the minute file
+  seg_plain=0,
+  //Compressed with TimeSeriesCodec
+  seg_timeseries
+} seg_encoding;
+
+//Header written at the start of each day segment. Data for minute 'm'
+//of the day occupies bytes offsets[m] to offsets[m+1] of the file.
+typedef struct segheader_t {
+  //Identifies the file, "SACSEG1"
+  char magic[8];
+  //Version of the segment format
+  int version;
+  //Number of minutes indexed, always SEG_MINUTES
+  int numminutes;
+  //Epoch of the start of the day
+  long long daystart;
+  //Offset of the data for each minute, and then of the end of the data
+  long long offsets[SEG_MINUTES+1];
+  //How the data for each minute is encoded, a seg_encoding
+  unsigned char encoding[SEG_MINUTES];
+} segheader_t;
+
+
+class SegmentBuf : public streambuf {
+public:
+  SegmentBuf();
+  ~SegmentBuf();
+
+  //Open the named segment ready to read from the first minute, at or
+  //after the minute containing 'epoch', which has any data. Returns
+  //false if the segment is missing/corrupt or has no such data.
+  bool open(const char *fname, long long epoch);
+
+  //Read the header from a segment and check that it makes sense
+  static bool readHeader(istream &in, segheader_t &hdr);
+  //Fill out a header for an empty segment for the given day
+  static void initHeader(segheader_t &hdr, long long daystart);
+
+  //Read the data for the given minute from an open segment, decoding
+  //it if required. 'out' is reallocated if it is smaller than needed
+  //in which case 'outsize' is updated. Returns false on error.
+  static bool readMinute(istream &in, const segheader_t &hdr, int minute,
+			 char *&out, int &outsize, int &outlen,
+			 char *&raw, int &rawsize);
+
+protected:
+  //Load the next minute when the current one has been consumed
+  int_type underflow();
+  //Skip forward or back relative to the current position
+  pos_type seekoff(off_type off, ios_base::seekdir dir,
+		   ios_base::openmode which = ios_base::in);
+
+private:
+  //Load the next minute with data. Returns false at the end of the day
+  bool loadMinute();
+
+  //The segment file itself
+  ifstream itsFile;
+  //The header from the segment
+  segheader_t itsHeader;
+  //The next minute to be loaded
+  int itsMinute;
+  //Holds the records for the current minute
+  char *itsBuf;
+  int itsBufSize;
+  //Holds the encoded data for the current minute
+  char *itsRaw;
+  int itsRawSize;
+  //Position in the stream of the start of the current minute
+  long long itsBase;
+};
+
+
+class SegmentStream : public istream {
+public:
+  SegmentStream();
+
+  //Open the named segment, as for SegmentBuf::open
+  bool open(const char *fname, long long epoch);
+
+private:
+  SegmentBuf itsSegBuf;
+};
+
+#endif
@@ -0,0 +1,137 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+//ServerPool keeps connections to sac servers open between requests, so
+//that a program which asks many small questions, of one server or of
+//many, only pays for setting up each connection once. The connections
+//are kept by server name and port, and each is only used for one
+//request at a time, so the pool can be shared between threads. Only a
+//few connections are made to each server, so that one busy program
+//doesn't use up all of the clients a server will take, and a request
+//waits for one of them to be free if need be.
+//
+//The version of the protocol to use is agreed once, when a connection
+//is made (see IntegPeriod::negotiate). A server too old to know about
+//versions closes the connection when asked, so we connect again and
+//the requests fall back to protocol 1.1.
+//
+//Each connection also asks the server to compress what it sends, which
+//is well worth it over a slow link. It costs the server CPU time though,
+//and stops it sending unprocessed data straight from its files, so a
+//program pulling a lot of data over a fast network, such as a mirror on
+//the same LAN, is better off without it. setCompress() turns it off for
+//the connections made from then on. The global() pool starts with it
+//off if the environment variable SAC_NETCOMPRESS is "false", so that
+//any of the programs can be told without a new option.
+//
+//If a server has closed a connection while we kept it, for instance
+//because it was restarted, the request is simply tried again on a new
+//connection. Making a connection gives up after the connect timeout,
+//and once connected a reply which takes longer than the reply timeout
+//is treated as the connection failing. A request which timed out isn't
+//tried again, as the server is most likely still busy with it. By
+//default there is no reply timeout, since a server cleaning a long
+//range sends nothing until it has finished.
+//
+//A request is made by passing a PoolRequest to perform(). The network
+//loading methods of IntegPeriod and Rollup which take a server name do
+//this with the pool returned by global(), which most programs can just
+//share.
+
+#ifndef _SERVERPOOL_HDR_
+#define _SERVERPOOL_HDR_
+
+#include <TCPstream.h>
+#include <pthread.h>
+#include <string>
+
+using namespace std;
+
+//A request made over one of the pool's connections
+class PoolRequest {
+public:
+  virtual ~PoolRequest() {}
+  //Make the request over the connection. Return false if it failed.
+  virtual bool run(TCPstream &sock) = 0;
+};
+
+class ServerPool {
+public:
+  //The timeouts are in milliseconds, 0 to wait for ever
+  ServerPool(int connecttimeout=10000, int replytimeout=0);
+  //Closes all of the connections
+  ~ServerPool();
+
+  //Change the timeouts, for requests made from now on
+  void setTimeouts(int connecttimeout, int replytimeout);
+  //Say whether new connections ask for compressed replies
+  void setCompress(bool compress);
+  inline bool getCompress() const {return itsCompress;}
+
+  //Make the request to the server over a connection from the pool,
+  //connecting if there isn't a spare one. Returns the request's result,
+  //or false if we couldn't connect.
+  bool perform(const string &server, int port, PoolRequest &req);
+
+  //Ask the server where its telescope is, in degrees
+  bool getLocation(double &longitude, double &latitude,
+		   const string &server, int port=31234);
+
+  //Close all of the connections which aren't in use
+  void closeIdle();
+
+  //The pool shared by the whole program
+  static ServerPool &global();
+
+private:
+  //One connection
+  typedef struct poolconn_t {
+    string server;
+    int port;
+    TCPstream *sock;
+    //Is someone making a request over it
+    bool busy;
+  } poolconn_t;
+
+  //Take a spare connection to the server, or make one. Returns NULL if
+  //we can't connect. 'reused' says whether it was kept from before.
+  TCPstream *acquire(const string &server, int port, bool &reused);
+  //Give the connection back, keeping it only if 'keep' is set
+  void release(TCPstream *sock, bool keep);
+  //Connect the stream to the server, giving up after the connect timeout
+  bool connect(TCPstream *sock, const string &server, int port);
+  //Agree on the protocol for a new connection, connecting again if the
+  //server closes it. Returns false if that fails.
+  bool handshake(TCPstream *sock, const string &server, int port);
+  //Make the pool returned by global()
+  static ServerPool *makeGlobal();
+
+  //The connections we have, in use or not
+  poolconn_t *itsConns;
+  int itsNumConns;
+  int itsConnsSize;
+  //Timeouts in milliseconds
+  int itsConnectTimeout;
+  int itsReplyTimeout;
+  //Do new connections ask for compressed replies
+  bool itsCompress;
+  //Protects the connections and signals when one is given back
+  pthread_mutex_t itsLock;
+  pthread_cond_t itsCond;
+  inline void Lock() {pthread_mutex_lock(&itsLock);}
+  inline void Unlock() {pthread_mutex_unlock(&itsLock);}
+
+  //Most spare connections we keep open
+  static const int theirMaxIdle;
+  //Most connections we make to any one server
+  static const int theirMaxPerServer;
+};
+
+#endif
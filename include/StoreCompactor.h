@@ -0,0 +1,40 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+//The StoreCompactor is an optional thread which packs the one-minute
+//files written by a StoreMaster into a single segment file for each
+//day, once the day has finished. This saves the file system from
+//holding half a million small files for each year of data and means a
+//range of data in a compacted day can be read sequentially from one
+//file. The StoreMaster is able to read both layouts.
+
+#ifndef _STORECOMPACTOR_HDR_
+#define _STORECOMPACTOR_HDR_
+
+#include <ThreadedObject.h>
+
+class StoreMaster;
+
+class StoreCompactor : public ThreadedObject {
+public:
+  //Compact the closed days held by the given store
+  StoreCompactor(StoreMaster *store);
+
+  ~StoreCompactor();
+
+  //Main loop of finding and compacting closed days
+  void run();
+
+private:
+  //The store whose data we compact
+  StoreMaster *itsStore;
+};
+
+#endif
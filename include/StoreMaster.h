@@ -21,6 +21,25 @@
 #include <fstream>
 
 class IntegPeriod;
+class Rollup;
+
+//Receives the periods found by StoreMaster::scan, one at a time
+class PeriodVisitor {
+public:
+  virtual ~PeriodVisitor() {}
+  //Take ownership of the next period. Return false to end the scan.
+  virtual bool visit(IntegPeriod *per) = 0;
+};
+
+//A PeriodVisitor which can also take runs of periods straight from the
+//files of the store, for sending on without them being read
+class SpanVisitor : public PeriodVisitor {
+public:
+  //Take the 'count' whole periods which are the 'len' bytes at 'offset'
+  //in the open file 'fd'. Return false to end the scan.
+  virtual bool visitSpan(int fd, long long offset, long long len,
+			 int count) = 0;
+};
 
 class StoreMaster {
 public:
@@ -50,13 +69,75 @@ public:
 		    long long end,
 		    int &count);
 
+  //Pass each period between the given times to the visitor, in time
+  //order, as it is read. Set end to zero for all data since the start.
+  //Unlike get() this never holds all of the data at once, so there is
+  //no limit on how many periods there may be. Returns false if the
+  //visitor ended the scan.
+  bool scan(long long start, long long end, PeriodVisitor &visitor);
+  //As for scan, but periods in the plain minute files are passed on as
+  //spans of the file, so they can be sent without being read or copied.
+  //The audio of these may be compressed. Periods from a compacted day or
+  //from memory still go through visit().
+  bool scanSpans(long long start, long long end, SpanVisitor &visitor);
+
+  //Enable or disable maintenance of the rollup tiers
+  inline void setKeepRollups(bool keep) {itsKeepRollups = keep;}
+
+  //Enable or disable compression of the data when days are compacted
+  inline void setCompressSegments(bool compress) {itsCompressSegments = compress;}
+
+  //Enable or disable lossless compression of raw audio as it is saved
+  inline void setCompressAudio(bool compress) {itsCompressAudio = compress;}
+
+  //Get summary rollups covering the given range of times. The rollups
+  //come from the coarsest tier whose buckets are no longer than
+  //'resolution' and are then merged into buckets of 'resolution'. If no
+  //tier is fine enough they are built from the full-cadence data.
+  //'count' is set to the number of rollups returned.
+  Rollup *getRollup(long long start,
+		    long long end,
+		    long long resolution,
+		    int &count);
+
+  //Return the shortest bucket length for which getRollup will return
+  //no more than 'maxbuckets' buckets over the given range. This is a
+  //multiple of the coarsest rollup tier which fits, so the answer can
+  //come straight from that tier.
+  long long bucketLength(long long start, long long end, int maxbuckets);
+
+  //Pack the minute files for the oldest closed day which still has
+  //them into a single segment file for that day. Returns true if a day
+  //was compacted, false if there was nothing to do or an error.
+  bool compact();
+
 private:
+  //Does the work of scan, passing runs from minute files to 'spans'
+  //if it isn't NULL
+  bool scan(long long start, long long end, PeriodVisitor &visitor,
+	    SpanVisitor *spans);
+  //Pass the run of whole periods, from the current position in the
+  //minute file for 'fileepoch', to the visitor. The run stops before
+  //any period after 'end', setting 'pastend', or at or after 'oldest',
+  //and the handle is left at the first period not passed on. Returns
+  //false if the visitor ended the scan.
+  bool spanFile(long long fileepoch, istream *infile, long long end,
+		long long oldest, SpanVisitor &visitor, bool &pastend);
   //Translate the given epoch into a filename. The filename is
   //added to the given ostringstream.
   void toFileName(long long epoch, ostringstream &output);
   //Translate the given filename into an epoch.
   //Returns -1 if fname is not understood.
   long long fromFileName(string fname);
+  //Translate the given epoch into the name of the segment file which
+  //holds all of the data for that day once it has been compacted.
+  void toSegmentName(long long epoch, ostringstream &output);
+  //Open the named segment and seek to the data for the first minute,
+  //at or after the minute containing 'epoch', which has any data.
+  //Returns false if the segment is missing/corrupt or has no such data.
+  bool openSegment(string fname, long long epoch, istream *&infile);
+  //Pack the minute files in the given day directory into a segment
+  bool compactDay(string daydir);
   //Open a handle to which ever file immediately chronologically precedes
   //the file that 'epoch' would be stored in. Will return an epoch for
   //the returned file, or 0 if none found.
@@ -64,16 +145,21 @@ private:
   //Open a handle to which ever file chronologically follows the
   //file that 'epoch' would be stored in. If the file immediately
   //after cannot be found we will search forward until we find one.
-  //Will return an epoch for the returned file, or 0 if none found.
-  long long nextFile(long long epoch, ifstream *&fhandle);
+  //Will return the epoch of the last minute which the returned handle
+  //covers (the end of the day for a segment), or 0 if none found.
+  long long nextFile(long long epoch, istream *&fhandle);
   //Recurse the given directory to find the first file containing
   //data after the target file 'epoch' would be written to. The
-  //resulting filename is returned in 'output' if a file is found.
-  bool fileAfter(string dir, long long epoch, ostringstream &output);
+  //resulting filename is returned in 'output' if a file is found
+  //and 'fileepoch' is set to the epoch of the minute it holds.
+  bool fileAfter(string dir, long long epoch, ostringstream &output,
+		 long long &fileepoch);
   //Recurse the main storage directory to find the first file containing
   //data after the target file 'epoch' would be written to. The
-  //resulting filename is returned in 'output' if a file is found.
-  bool searchForward(long long epoch, ostringstream &output);
+  //resulting filename is returned in 'output' if a file is found
+  //and 'fileepoch' is set to the epoch of the minute it holds.
+  bool searchForward(long long epoch, ostringstream &output,
+		     long long &fileepoch);
 
   //Ensure all directories in the given path exist
   bool checkDirs(ostringstream &savepath);
@@ -82,13 +168,19 @@ private:
   bool checkFile(long long epoch);
   //Check if the file which would, by name, contain the data for
   //the specified epoch exists. Returns true and opens if it exists.
-  bool checkFile(long long epoch, ifstream *&infile);
+  //If the day has been compacted the handle is opened on the segment
+  //and 'lastepoch' is set to the last minute of the day, otherwise it
+  //is set to 'epoch'.
+  bool checkFile(long long epoch, istream *&infile, long long &lastepoch);
 
   //Locate the right file for the specified 'epoch',  open it,
   //seek within a file to locate the first integration period with
   //timestamp after 'epoch'. Then returns the open file handle.
   //Will return false if no data exists for that period.
-  bool findEpoch(long long epoch, ifstream *&infile);
+  bool findEpoch(long long epoch, istream *&infile);
+  //As above but also sets 'lastepoch' to the last minute covered by
+  //the returned handle, as for checkFile.
+  bool findEpoch(long long epoch, istream *&infile, long long &lastepoch);
 
   //Delete any data more than itsMaxDataAge old.
   //This won't delete data more than a week older than the expiry period.
@@ -96,6 +188,15 @@ private:
   ///TODO: At present the directories are not removed
   void removeOldData();
 
+  //Translate the given epoch into the name of the file holding the
+  //rollups for the given tier on that day.
+  void rollupFileName(int tier, long long epoch, ostringstream &output);
+  //Accumulate the given period into the current bucket of each tier,
+  //saving any buckets which the period shows to be complete.
+  void addRollup(IntegPeriod *per);
+  //Append the current bucket for the given tier to its file
+  void saveRollup(int tier);
+
   //MutEx and locking functions
   pthread_mutex_t itsLock, itsDirLock;
   inline void Lock() {pthread_mutex_lock(&itsLock);}
@@ -123,6 +224,19 @@ private:
   //Holds the maximum number of periods to return for any given request
   static const int theirMaxResults;
 
+  //Should we maintain the rollup tiers for this store
+  bool itsKeepRollups;
+  //The bucket currently being accumulated for each rollup tier
+  Rollup *itsRollups;
+  //Should compacted days be compressed with TimeSeriesCodec
+  bool itsCompressSegments;
+  //Should raw audio be compressed with AudioCodec when it is saved
+  bool itsCompressAudio;
+  //Length of the buckets for each rollup tier, finest first
+  static const long long theirRollupTiers[];
+  //The number of rollup tiers which we maintain
+  static const int theirNumRollupTiers;
+
   //Records the maximum age of data in our store - data older than this
   //will be automatically removed. An epoch of zero means that we should
   //never remove data, no matter how old it may be.
@@ -44,6 +44,7 @@
 #include <winsock.h>
 #endif
 #include <iostream>
+#include <string>
 #if defined(B_BEOS_VERSION)
 typedef  basic_iostream<char, char_traits<char> > iostream;
 #endif
@@ -51,6 +52,7 @@ typedef  basic_iostream<char, char_traits<char> > iostream;
 using namespace::std;
 
 class SocketAddr;
+class WireCodec;
 
 				// An "abstract" class to declare functions
 				// called when i/o is in progress, but not
@@ -145,6 +147,17 @@ public:
 class TCPbuf : public streambuf
 {
   int socket_handle;		// Socket handle = file handle
+  bool gave_up;			// Has a timeout expired on this connection
+  int protocol;			// Version of the protocol agreed with
+  				// the other end, 0 until it has been
+  				// Compression of what we send and of what
+  				// we receive, once it has been agreed
+  				// with the other end (see WireCodec.h)
+  WireCodec * zout;
+  WireCodec * zin;
+  char * zblock;		// The last block we decompressed
+  string zraw;			// Compressed bytes read but not used yet
+  size_t zraw_pos;		// ... starting here
   
   				// These are the functions that actually
   				// read/write from the socket to/from
@@ -155,6 +168,23 @@ class TCPbuf : public streambuf
   				// and async io was requested
   int write(const char * buffer, const int n);
   int read(char * buffer, const int n);
+  				// Compress a block and write it out.
+  				// Return false on error
+  bool write_packed(const char * buffer, const long long n, const int stride);
+  				// Read until at least n compressed bytes
+  				// are waiting. Return false on EOF or error
+  bool read_raw(const size_t n);
+  				// Decompress the next block into zblock.
+  				// Return its length, or EOF on error
+  int read_packed(void);
+  				// True if a blocking read or write has
+  				// just given up because of the timeout,
+  				// which is remembered for expired()
+  bool timed_out(void);
+  				// Free the buffer and forget the get and
+  				// put areas which were in it, along with
+  				// any compression
+  void release_buffer(void);
 
 //#if defined(B_BEOS_VERSION)
   struct Buffer {
@@ -203,6 +233,7 @@ public:
   char *buf_ptr;
  
   bool is_open(void) const { return socket_handle >= 0; }
+  int get_handle(void) const { return socket_handle; }
   TCPbuf* close(void);
   virtual TCPbuf* setbuf(char* p, const int len);
   
@@ -222,8 +253,54 @@ public:
   
   void dump(const char title []) const;	// print out some diagnostics
 
+  				// Flush the put area and then write a block
+  				// straight to the socket without copying it
+  				// into the buffer. Returns the number of
+  				// bytes written or EOF on error
+  int write_direct(const char * buffer, const int n);
+  				// As above but gather the blocks described
+  				// by 'iov' with writev(). The entries are
+  				// modified as they are sent. Returns the
+  				// number of bytes written or EOF on error
+  				// If we are compressing, the blocks are
+  				// shuffled with 'stride' (see WireCodec.h)
+  long long writev_direct(struct iovec * iov, int count,
+			  const int stride = 1);
+  				// As above but send 'len' bytes from 'offset'
+  				// in the open file 'fd' with sendfile(), so
+  				// they never pass through user space
+  long long sendfile_direct(int fd, long long offset, long long len,
+			    const int stride = 1);
+
+  				// Compress everything we send from now on,
+  				// after flushing what has been put so far
+  void compress_output(void);
+  				// Decompress everything we receive from
+  				// the next unread byte on
+  void decompress_input(void);
+  bool compressing(void) const { return zout != 0; }
+  bool decompressing(void) const { return zin != 0; }
+  				// Append data to 'out' as it would be
+  				// written to the stream, for a caller
+  				// which does its own sending. Return false
+  				// on error
+  bool pack(const char * data, const long long n, string & out,
+	    const int stride = 1);
+
   				// Some TCP specific stuff
   void set_blocking_io(const bool onoff);
+  				// Give up on a blocking read or write which
+  				// has waited this many milliseconds, 0 to
+  				// wait for ever. The stream then fails.
+  void set_timeout(const int msec);
+  				// True if anything has given up because of
+  				// the timeout since the connection was made
+  bool expired(void) const { return gave_up; }
+  				// Remember which version of its protocol
+  				// the application has agreed on for this
+  				// connection. Forgotten when it is closed
+  int get_protocol(void) const { return protocol; }
+  void set_protocol(const int version) { protocol = version; }
 				// Enable/disable SIGIO upon arriving of a
 				// new packet
   void enable_sigio(const bool onoff);
@@ -235,6 +312,9 @@ public:
   			// On exit, peeraddr would be an addr of the
   			// connected peer
   TCPbuf* accept(int listening_socket, SocketAddr& peeraddr);
+  			// Take over a socket which has already been
+  			// connected, eg by an accept() made elsewhere
+  TCPbuf* attach(int connected_socket);
 };
 
 
@@ -0,0 +1,61 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+//TimeAlign pairs up the samples of two time series. Each method returns
+//an index map with an entry for every sample of the first series, giving
+//the index of the sample it was matched with in the second series or -1
+//if there was no suitable match. The maps are made by walking along both
+//series together, so they cost O(n+m) rather than comparing every pair
+//of samples.
+//
+//The series should be in time order. Any which aren't are put in order
+//first, which costs O(n log n), and the maps still refer to the original
+//indices. Where two samples are equally near, the 'tie' arguments choose
+//the one with the lowest or highest index, as a scan through the series
+//using < or <= would.
+//
+//The caller needs to delete the returned maps when done.
+
+#ifndef _TIMEALIGN_HDR_
+#define _TIMEALIGN_HDR_
+
+#include <TimeCoord.h>
+class IntegPeriod;
+
+class TimeAlign {
+public:
+  //Which of several equally near samples to choose
+  typedef enum tie_t {first_tie=0, last_tie} tie_t;
+
+  //Map each sample of 'a' to the nearest sample of 'b'. If 'cutoff' is
+  //not zero, samples further apart than that aren't matched.
+  static int *nearest(const timegen_t *a, int alen,
+		      const timegen_t *b, int blen,
+		      timegen_t cutoff=0, tie_t tie=first_tie);
+
+  //Map each sample of 'a' to the nearest sample of 'b', but only where
+  //the sample of 'a' is also the nearest to that sample of 'b'
+  static int *mutual(const timegen_t *a, int alen,
+		     const timegen_t *b, int blen,
+		     tie_t fwdtie=last_tie, tie_t backtie=last_tie);
+  static int *mutual(const IntegPeriod *a, int alen,
+		     const IntegPeriod *b, int blen,
+		     tie_t fwdtie=last_tie, tie_t backtie=last_tie);
+
+private:
+  //Return the order to visit the samples in, or NULL if already sorted
+  static int *order(const timegen_t *t, int len);
+  //Nearest matching for one direction, with the time orders given
+  static void nearest(int *map, const timegen_t *a, int alen, const int *aord,
+		      const timegen_t *b, int blen, const int *bord,
+		      timegen_t cutoff, tie_t tie);
+};
+
+#endif
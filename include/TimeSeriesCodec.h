@@ -0,0 +1,46 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+//Lossless compression of a block of serialised IntegPeriods, as written
+//by the file operator<< of IntegPeriod. The timestamps are nearly regular
+//and the powers and spectra change slowly from one period to the next,
+//so we use the approach of the Gorilla time series database:
+//
+// -Timestamps are stored as the difference between consecutive deltas,
+//  which is usually zero or a few bits for jitter.
+// -Each float is XORed with the same field of the previous period and
+//  only the meaningful bits of the result are stored, reusing the window
+//  of the previous value where possible. An unchanged value takes 1 bit.
+// -The interference and spectra flags are packed into 5 bits and the
+//  number of bins and audio length take 1 bit if they haven't changed.
+//
+//Decoding reproduces the original records byte for byte. Any raw audio
+//is stored verbatim.
+
+#ifndef _TIMESERIESCODEC_HDR_
+#define _TIMESERIESCODEC_HDR_
+
+class TimeSeriesCodec {
+public:
+  //Compress the serialised periods in 'in' of length 'inlen' bytes. The
+  //result is written to 'out', which is reallocated with new[] if it is
+  //smaller than needed in which case 'outsize' is updated. 'outlen'
+  //returns the length of the encoded data. Returns false if the input
+  //doesn't consist entirely of well formed records.
+  static bool encode(const char *in, int inlen,
+		     char *&out, int &outsize, int &outlen);
+
+  //Decompress data produced by encode, arguments as for encode.
+  //Returns false if the data is corrupt.
+  static bool decode(const char *in, int inlen,
+		     char *&out, int &outsize, int &outlen);
+};
+
+#endif
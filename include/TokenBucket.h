@@ -0,0 +1,60 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+//TokenBucket limits how fast something may happen, such as how many
+//bytes a network client is sent or how many commands it may make. The
+//bucket fills at a steady rate up to a burst size and each use takes
+//tokens out. A use is allowed to take more than the bucket holds, which
+//leaves it in debt, and nothing more is allowed until the debt has been
+//paid off. So the rate averages out right however big each use is, and
+//the caller never has to split things up to fit the bucket.
+//
+//The bucket can be shared between threads.
+
+#ifndef _TOKENBUCKET_HDR_
+#define _TOKENBUCKET_HDR_
+
+#include <pthread.h>
+
+class TokenBucket {
+public:
+  //Tokens are added at 'rate' per second, up to 'burst' of them. A
+  //rate of 0 means there is no limit.
+  TokenBucket(double rate=0, double burst=0);
+  ~TokenBucket();
+
+  //Change the rate and burst size, starting with a full bucket
+  void setRate(double rate, double burst);
+
+  //Take the tokens, going into debt if there aren't enough
+  void take(double num);
+  //Return how many microseconds until the bucket is out of debt, or 0
+  //if something may be done now
+  long long delay();
+
+  inline bool limited() const {return itsRate>0;}
+
+private:
+  //Add the tokens which have arrived since we last looked
+  void refill();
+
+  double itsRate;
+  double itsBurst;
+  //Tokens in the bucket, negative if in debt
+  double itsLevel;
+  //When we last added tokens (microseconds)
+  long long itsLast;
+
+  pthread_mutex_t itsLock;
+  inline void Lock() {pthread_mutex_lock(&itsLock);}
+  inline void Unlock() {pthread_mutex_unlock(&itsLock);}
+};
+
+#endif
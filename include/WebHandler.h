@@ -8,51 +8,249 @@
 //
 // $Id: WebHandler.h,v 1.5 2004/04/03 01:44:36 brodo Exp $
 
-//For the duration of it's existence the WebHandler parses and
-//services requests from the client. We deregister with the WebMaster
-//when the connection times out or is otherwise closed.
+//A WebHandler holds the state of one client connection for as long as
+//it lasts. The WebMaster reads whatever the client sends and hands the
+//handler each complete command line. Cheap commands are answered
+//straight away into an output buffer, which the WebMaster sends as fast
+//as the client will take it. Anything else is serviced by one of the
+//WebMaster's worker threads, which has the connection to itself and
+//writes the reply directly until the command is finished.
+//
+//Once a client switches to protocol 2 it sends frames rather than lines
+//(see Frame.h) and can have several requests outstanding. Every request
+//is then serviced by a worker, and the workers take turns to write whole
+//frames while the WebMaster carries on reading what the client sends,
+//so that it can cancel requests.
+//
+//Commands which will take a lot of reading or cleaning are marked as
+//bulk, so the WebMaster can keep them to workers of their own. Each
+//client may also be limited in how many commands it makes and how much
+//it is sent, each with a TokenBucket. A client which has been sent more
+//than it is allowed is held by the WebMaster, before it is given another
+//worker, until its bytes have come round. Only the bulk workers wait part
+//way through a reply, so a rate limited client can't tie up the workers
+//the realtime requests need. The live data is sent whenever there is
+//room and just counts against the client.
 
 #ifndef _WEBHANDLER_HDR_
 #define _WEBHANDLER_HDR_
 
-#include <ThreadedObject.h>
 #include <TCPstream.h>
+#include <TokenBucket.h>
 #include <sstream>
+#include <string>
 #include <time.h>
+#include <pthread.h>
 
 using namespace::std;
 
 class StoreMaster;
+class RawRing;
 class WebMaster;
+class LiveFeed;
+class IntegPeriod;
+class Rollup;
+class PeriodBatch;
 class TCPstream;
 class SocketAddr;
+typedef struct rawslice_t rawslice_t;
+
+class WebHandler {
+  friend class ChunkSender;
 
-class WebHandler : public ThreadedObject {
 public:
-  //Create a handler for the given TCP stream on the given socket.
+  //Create a handler for the client connected on the given socket.
   //Data is provided to the client from the specified StoreMaster and
   //raw audio data from the 'rawstore' if non-NULL.
-  WebHandler(int listening_socket, StoreMaster *store,
-	     StoreMaster *rawstore, WebMaster *master);
+  WebHandler(int sock, const SocketAddr &peer, StoreMaster *store,
+	     RawRing *rawstore, WebMaster *master);
 
+  //Closes the connection
   ~WebHandler();
 
-  //Main loop of parsing and servicing client connections
-  void run();
+  //Return the socket of the client connection
+  inline int getSocket() const {return itsSock;}
+
+  //Read whatever the client has sent without waiting. Returns false if
+  //the connection has failed or the client sent a line which is too long.
+  bool readInput();
+  //Return true once the client has closed its side of the connection.
+  //Any commands it sent before that still need to be answered.
+  inline bool closed() const {return itsClosed;}
+  //Take the next complete command line from what the client has sent.
+  //Returns false if there isn't one yet.
+  bool nextLine(string &line);
+
+  //Service the command now if it is cheap, leaving any reply in the
+  //output buffer. Otherwise the command is kept for serviceCommand()
+  //and false is returned.
+  bool quickCommand(const string &line);
+  //Return true if the command kept by quickCommand() is bulk work
+  inline bool bulkCommand() const {return itsCommandBulk;}
+  //Service the command kept by quickCommand(), writing the reply
+  //straight to the client, or with protocol 2 the oldest waiting bulk
+  //or other request. This is called from a worker thread.
+  void serviceCommand(bool bulk);
+  //Return true if the command needs so much reading, cleaning or
+  //sending that it should be left to the bulk workers
+  bool isBulk(const string &line);
+
+  //Send as much of the output buffer as the client will take without
+  //waiting. Returns false on error.
+  bool sendOutput();
+  //Return true if there is output waiting to be sent
+  inline bool hasOutput() const {return itsOutPos<itsOutput.size();}
+
+  //Return true once the connection should be closed
+  inline bool finished() const {return itsError || itsDrop;}
+  //True while a worker thread is servicing a command for us, or with
+  //protocol 2 while we aren't watched and are only waiting for the
+  //workers to finish before the connection is closed
+  bool itsBusy;
+
+  //Return true once the client has switched to protocol 2
+  inline bool framed() const {return itsFramed;}
+  //Take whatever requests and cancellations the client has sent in
+  //frames, so long as it will have no more than theirMaxInFlight
+  //requests outstanding, given it already has 'inflight', and is allowed
+  //to make them. Returns the number of new requests, each of which needs
+  //a worker, and sets 'numbulk' to how many of them are bulk work. A
+  //request to change protocol is answered here, once nothing is
+  //outstanding.
+  int takeRequests(int inflight, int &numbulk);
+  //Give up on all of the outstanding protocol 2 requests
+  void cancelAll();
+  //Most protocol 2 requests a client can have outstanding at once
+  static const int theirMaxInFlight;
+  //Number of protocol 2 requests queued for or being serviced by the
+  //workers. This is kept by the WebMaster.
+  int itsInFlight;
+
+  //Return true if the client has subscribed to the live data
+  inline bool subscribed() const {return itsSubscribed;}
+  //Stop sending live data to the client
+  inline void unsubscribe() {itsSubscribed = false;}
+  //Add any live data the client hasn't had yet to the output buffer,
+  //unless it already has plenty waiting to be sent
+  void feed(LiveFeed *feed);
+  //Where we are in the WebMaster's list of subscribers, or -1
+  int itsSubIndex;
+
+  //Return how many microseconds until the client may make another
+  //command, because it has made all it may or has been sent more than
+  //it may for now, 0 if it may now
+  inline long long throttled() {
+    long long wait = itsRequestBucket.delay();
+    long long bytewait = itsByteBucket.delay();
+    return bytewait>wait ? bytewait : wait;
+  }
+  //Return true if the client has sent something we haven't dealt with
+  inline bool hasInput() const {return !itsInput.empty();}
+  //Where we are in the WebMaster's list of clients waiting to be allowed
+  //another command, or -1
+  int itsHeldIndex;
 
 private:
-  //Close the TCP socket and inform WebMaster we have finished. This
-  //effectively kills the thread and causes self deletion, "The End".
+  //Where a protocol 2 request is up to
+  typedef enum request_state {
+    request_free, request_queued, request_running
+  } request_state;
+
+  //A protocol 2 request, from when we take it from the client until a
+  //worker has finished with it
+  typedef struct request_t {
+    request_state state;
+    //The identifier the client gave it
+    unsigned int id;
+    //The command, as it would be sent in protocol 1
+    string command;
+    //Has the client asked us to give up on it
+    bool cancelled;
+    //Order the requests arrived in
+    long long seq;
+    //Is it for the bulk workers
+    bool bulk;
+  } request_t;
+
+  //Mark the connection to be closed once the current command is done
   void dropConnection();
   //Parse the command and service it
   void serviceCommand(istringstream &command);
 
   //Handle command which wants all data between two argument epochs
   void doBetween(istringstream &command);
+  //Send the periods as a protocol 1.2 reply, a group at a time, then
+  //the trailer. This deletes the periods.
+  void sendChunked(IntegPeriod **data, int count,
+		   bool keepcross, bool keepinputs, bool keepaudio);
   //Handle command which wants all raw data between two argument epochs
   void doRawBetween(istringstream &command);
+  //Send the raw periods with any compressed audio decoded, for clients
+  //using protocol 1.1 which don't understand it
+  void sendRawPlain(const rawslice_t &slice);
+  //Handle command which wants summary rollups between two epochs
+  void doRollup(istringstream &command);
+  //Send the rollups to the client, with a protocol 1.2 trailer if
+  //'trailer' is set, and delete them
+  void sendRollups(Rollup *data, int count, bool trailer);
   //Handle command which wants all data after an epoch in ASCII
-  void doAfterASCII(istringstream &command);
+  void doAfterASCII(istringstream &command, ostream &out);
+  //Write the reply to AFTER for the given epoch
+  void writeAfter(long long epoch, ostream &out);
+  //Handle command which wants new data pushed as it arrives
+  void doSubscribe(istringstream &command);
+  //Get the periods between two epochs from the store, cleaned with the
+  //given clean_mode. The caller must delete them.
+  IntegPeriod **getCleaned(long long start, long long end, int mode,
+			   int &count);
+
+  //Count 'bytes' against the client. Bulk work first waits until the
+  //client is allowed more data, stopping if the request is cancelled,
+  //but other work never waits here and leaves the client in debt.
+  void pace(long long bytes, request_t *req=NULL);
+  //Add to the output buffer, compressed if the client asked for that.
+  //Periods are shuffled first with a 'stride' of sizeof(float).
+  void addOutput(const string &data, int stride=1);
+
+  //Service the oldest bulk, or other, protocol 2 request which hasn't
+  //been started
+  void serviceRequest(bool bulk);
+  //Parse the protocol 2 request and service it
+  void serviceRequest(request_t *req, istringstream &command);
+  //Handle requests for periods, raw periods and rollups with protocol 2
+  void frameBetween(request_t *req, istringstream &command);
+  void frameRawBetween(request_t *req, istringstream &command);
+  void frameRollup(request_t *req, istringstream &command);
+  //Send the rollups in a data frame, then the end frame, and delete them
+  void frameRollups(request_t *req, Rollup *data, int count);
+  //Return true if the client has given up on the request
+  bool cancelled(request_t *req);
+  //Give up on the outstanding request with the given identifier
+  void cancel(unsigned int id);
+  //Send the client a frame whose payload is made up of the pieces, of
+  //the whole batch, or of part of a file. These return false on error.
+  bool sendFrame(unsigned int id, int type, unsigned int count,
+		 const struct iovec *data, int num);
+  bool sendFrame(unsigned int id, int type, unsigned int count,
+		 const string &payload);
+  bool sendFrame(unsigned int id, unsigned int count, PeriodBatch &batch);
+  bool sendFrame(unsigned int id, unsigned int count,
+		 int fd, long long offset, long long len);
+
+  //Read two epochs for a protocol 2 request, putting them in order.
+  //Returns false if they are missing or rubbish.
+  static bool readRange(istringstream &args, long long &start,
+			long long &end);
+  //Return true if a time stamp from the client is believable
+  static inline
+  bool validEpoch(long long epoch) {
+    if (epoch==0) return true;
+    time_t checktime = epoch/1000000;
+    struct tm checkutc;
+    gmtime_r(&checktime, &checkutc);
+    //This program will be retired by 2200 - I'll bet my life on it!
+    return checkutc.tm_year+1900>=1990 && checkutc.tm_year+1900<=2200;
+  }
 
   //Inline for reading, and checking, a time stamp from the client
   inline
@@ -63,34 +261,64 @@ private:
     if (arg.fail()) {
       itsError = true;
       dropConnection();
+      return 0;
     }
 
-    if (res!=0) {
-      //Do a reality check on argument, drop client if rubbish
-      time_t checktime = res/1000000;
-      struct tm *checkutc = gmtime(&checktime);
-      //This program will be retired by 2200 - I'll bet my life on it!
-      if (checkutc->tm_year+1900<1990 || checkutc->tm_year+1900>2200) {
-	dropConnection();
-      }
-    }
+    //Do a reality check on argument, drop client if rubbish
+    if (!validEpoch(res)) dropConnection();
     return res;
   }
 
   //The real fair dinkum socket
   int itsSock;
-  //The TCP connection to our client
+  //The TCP connection to our client, used by the worker threads
   TCPstream itsClient;
   //Socket reference, contains client address, etc.
   SocketAddr itsSocket;
   //The store from which we retrieve data for our client
   StoreMaster *itsStore;
   //The rolling store from which we retrieve raw audio data for our client
-  StoreMaster *itsRawStore;
-  //The connection who did spawn us, and from whom we shall disconnect
+  RawRing *itsRawStore;
+  //The server we belong to
   WebMaster *itsMaster;
   //Have we encounter an error yet
   bool itsError;
+  //Should the connection be closed
+  bool itsDrop;
+  //Has the client finished sending
+  bool itsClosed;
+  //Has the client subscribed to the live data
+  bool itsSubscribed;
+  //Sequence number of the next live period the subscriber needs
+  long long itsSubNext;
+  //Which data the subscriber wants
+  bool itsSubCross, itsSubInputs, itsSubAudio;
+  //Only every n'th live period is sent to the subscriber
+  int itsSubDecimate;
+  //Version of the protocol the client asked for, times ten
+  int itsProtocol;
+  //Has the client switched to protocol 2
+  bool itsFramed;
+  //Slots for the outstanding protocol 2 requests
+  request_t *itsRequests;
+  //Sequence number for the next protocol 2 request
+  long long itsRequestSeq;
+  //Protects the requests, which the workers share with the WebMaster
+  pthread_mutex_t itsRequestLock;
+  //Stops the workers writing frames over the top of each other
+  pthread_mutex_t itsWriteLock;
+  //What the client has sent which we haven't dealt with yet
+  string itsInput;
+  //The command waiting for a worker thread
+  string itsCommand;
+  //Is it bulk work
+  bool itsCommandBulk;
+  //Limits on how many commands the client makes and bytes it is sent
+  TokenBucket itsRequestBucket;
+  TokenBucket itsByteBucket;
+  //Replies which haven't been sent yet, from 'itsOutPos' onwards
+  string itsOutput;
+  string::size_type itsOutPos;
 };
 
 #endif
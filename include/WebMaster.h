@@ -8,10 +8,34 @@
 //
 // $Id: WebMaster.h,v 1.6 2008/03/05 08:10:19 brodo Exp $
 
-//This class opens a listening socket on the specified TCP port and 
-//spawns threaded WebHandler objects, up to some maximum number, when 
-//clients connect. Each of these WebHandlers will service the client
-//for the duration of the TCP connection.
+//This class opens a listening socket on the specified TCP port and
+//services every client connection from a single thread, waiting on all
+//of the sockets at once with epoll. Each client gets a WebHandler which
+//keeps track of the connection. Commands which can be answered straight
+//away are, while any which may take a while, such as BETWEEN, are put
+//in a queue for a small pool of worker threads. So a connection only
+//ties up a thread while one of its commands is actually being serviced.
+//
+//Commands which read a lot of the store, or clean it, are bulk work and
+//go to a pool of workers of their own, which run at a lower priority.
+//So a client asking for a month of cleaned data holds up other bulk
+//work, but not the realtime plots or the Processor. Each client can also
+//be limited in how many commands it makes and how much it is sent (see
+//WebHandler). A client which has made all the commands it is allowed
+//for the moment, or been sent all the data, is held without reading any
+//more from it or giving it a worker, and is taken up again once it is
+//allowed another.
+//
+//A client which switches to protocol 2 can have several requests on
+//the go at once. Each of them is queued for the workers separately and
+//we carry on watching the client, for more requests or to cancel them.
+//
+//Clients which SUBSCRIBE to the live data are also fed from this thread.
+//We watch the LiveFeed for new periods and copy them into the output of
+//each subscriber which has room for them. A subscriber which can't keep
+//up is left behind rather than slowing anyone else down, and is told how
+//many periods it missed. The live data is dealt with before anything
+//else that has happened.
 //
 //The underlaying TCPstream class was developed by: Oleg XX & YY ZZ
 
@@ -19,35 +43,101 @@
 #define _WEBMASTER_HDR_
 
 #include <ThreadedObject.h>
+#include <pthread.h>
+#include <iostream>
+
+using namespace std;
 
 class WebHandler;
 class ConfigFile;
 class StoreMaster;
+class RawRing;
+class LiveFeed;
 
 class WebMaster : public ThreadedObject {
   friend class WebHandler;
+  //Helper function for starting the worker threads, given their pool
+  friend void *webmaster_worker(void*);
 
 public:
   //Default specs for port number and max number of clients is below
   WebMaster(StoreMaster *store, ConfigFile *conf);
-  WebMaster(StoreMaster *store, StoreMaster *rawstore, ConfigFile *conf);
+  WebMaster(StoreMaster *store, RawRing *rawstore, ConfigFile *conf,
+	    LiveFeed *live=NULL);
   virtual ~WebMaster();
 
   //Return the ConfigFile to get system information from.
   //This is used by the WebHandlers.
   ConfigFile *getConfig() {return itsConfig;}
+  //Return the ring of live data for subscribers, may be NULL
+  LiveFeed *getLiveFeed() {return itsLiveFeed;}
+
+  //Write a line of statistics about the server to the stream
+  void writeStats(ostream &out);
 
 private:
-  //Main loop for the WebMaster. Here we open a listening socket
-  //and spawn new WebHandler objects when a client connects
+  //A pool of worker threads and the queue of clients waiting for them
+  typedef struct workpool_t {
+    WebMaster *master;
+    //Is this the pool for bulk work
+    bool bulk;
+    //The worker threads
+    pthread_t *workers;
+    int numworkers;
+    //Signalled when a command is added to the queue
+    pthread_cond_t cond;
+    //Clients with a command waiting for a worker, in order
+    WebHandler **queue;
+    int head;
+    int len;
+    //How many workers are currently servicing a command
+    int busy;
+  } workpool_t;
+
+  //Main loop for the WebMaster. Here we open a listening socket and
+  //wait for anything to happen on it or any of the client connections
   void run();
-  //Clients call this to indicate when they have exited.
-  //We then decrement
-  void disconnect(WebHandler*);
+  //Set up the bits we need, before starting run()
+  void init();
+  //Accept any clients waiting to connect
+  void acceptClients();
+  //Service whatever complete commands a client has sent, until one of
+  //them needs a worker or we have to wait for the client
+  void processInput(WebHandler *client);
+  //Service whatever frames a protocol 2 client has sent. Returns false
+  //if the client has gone back to sending lines.
+  bool processFrames(WebHandler *client);
+  //Pass the client's current command to the worker threads
+  void dispatch(WebHandler *client);
+  //Add the client to the queue for the bulk or the other workers
+  void enqueue(WebHandler *client, bool bulk);
+  //Take back the clients whose commands the workers have finished
+  void collectFinished();
+  //Add or remove the client from the subscribers, if it has changed
+  void updateSubscriber(WebHandler *client);
+  //Add the client to those waiting to be allowed another command, or
+  //take it off, if it isn't already
+  void hold(WebHandler *client);
+  void unhold(WebHandler *client);
+  //Carry on with any held clients which are allowed another command
+  void releaseHeld();
+  //Return how long to wait for events (ms), so that we are back in time
+  //to release the first held client
+  int pollTime();
+  //Pass any new live data to the subscribers
+  void feedSubscribers();
+  //Change which events we wait for on a client, or on the listening
+  //socket if 'client' is NULL
+  void watch(WebHandler *client, int op, unsigned int events);
+  //Close a client connection
+  void disconnect(WebHandler *client);
+  //Main loop of each of the worker threads in the pool
+  void workerLoop(workpool_t &pool);
+
   //Reference to the store where all the data is stored
   StoreMaster *itsStore;
   //Reference to the temporary store for raw audio data
-  StoreMaster *itsRawStore;
+  RawRing *itsRawStore;
   //The port number we should listen on
   int itsPort;
   //How many client connections we currently have
@@ -56,6 +146,44 @@ private:
   int itsMaxClients;
   //The ConfigFile to pull system information from
   ConfigFile *itsConfig;
+  //Ring of live data for subscribers, may be NULL
+  LiveFeed *itsLiveFeed;
+
+  //The socket we accept new connections on
+  int itsListenSock;
+  //Are we currently accepting new connections
+  bool itsListening;
+  //The epoll instance watching all of our sockets
+  int itsEpoll;
+  //Workers write to this pipe to wake us when they finish a command
+  int itsWakePipe[2];
+
+  //The workers for bulk work and for everything else
+  workpool_t itsPool;
+  workpool_t itsBulkPool;
+  //Set false to make the workers exit
+  bool itsWorkersRun;
+  //Protects the queues and worker counts
+  pthread_mutex_t itsQueueLock;
+  //A client can have no more than WebHandler::theirMaxInFlight commands
+  //outstanding, so each queue holds that many for each of itsMaxClients
+  int itsQueueSize;
+  //Clients whose commands the workers have finished
+  WebHandler **itsDone;
+  int itsDoneLen;
+
+  //Clients which have subscribed to the live data
+  WebHandler **itsSubscribers;
+  int itsNumSubscribers;
+  //Clients waiting to be allowed another command
+  WebHandler **itsHeld;
+  int itsNumHeld;
+
+  //Running totals, for STATS
+  long long itsAccepted;
+  long long itsCommands;
+  long long itsWorkerCommands;
+  long long itsBulkCommands;
 };
 
 #endif
@@ -0,0 +1,72 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+//WireCodec compresses what a server sends over a network connection,
+//for clients on slow links which ask for it, using zlib at its fastest
+//setting. The data is sent as a series of blocks, each of them a 12 byte
+//header followed by the compressed bytes. The header holds, all in
+//network byte order, the length of the compressed bytes, the length
+//they decompress to and the shuffle stride (see below), 4 bytes each.
+//
+//All of the blocks on a connection are one zlib stream, which is flushed
+//at the end of every block. So the client can decode each block as soon
+//as it arrives, while each block is still compressed using what came
+//before it.
+//
+//Serialised periods are mostly floats, and the bytes of neighbouring
+//floats look much more alike if they are taken a byte position at a
+//time. So blocks of periods are shuffled before they are compressed,
+//with the first byte of every 4 put together, then the second and so
+//on, and put back in order after they are decompressed. Other data has
+//a stride of 1 and isn't shuffled.
+
+#ifndef _WIRECODEC_HDR_
+#define _WIRECODEC_HDR_
+
+#include <string>
+
+using namespace std;
+
+struct z_stream_s;
+
+class WireCodec {
+public:
+  //Create a codec to compress, or else to decompress, one connection
+  WireCodec(bool compress);
+  ~WireCodec();
+
+  //Compress the data as one or more blocks, shuffled with the stride
+  //first, and append them to 'out'. Returns false on error.
+  bool encode(const char *data, long long len, int stride, string &out);
+
+  //Read a block header. Returns false if it can't be believed.
+  static bool readHeader(const char *header, int &packedlen, int &len,
+			 int &stride);
+  //Decompress the next block, whose header has been read, into 'out'
+  //which must have room for 'len' bytes. Returns false on error.
+  bool decode(const char *packed, int packedlen, char *out, int len,
+	      int stride);
+
+  //Size of a block header
+  static const int theirHeaderSize;
+  //Most data in one block, before it is compressed
+  static const int theirMaxBlock;
+
+private:
+  //The zlib state for the connection
+  struct z_stream_s *itsStream;
+  bool itsCompress;
+  //Set once something has gone wrong, after which the stream is useless
+  bool itsFailed;
+  //Room for shuffling a block
+  char *itsShuffle;
+};
+
+#endif
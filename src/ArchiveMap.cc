@@ -0,0 +1,321 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+#include <ArchiveMap.h>
+#include <AudioCodec.h>
+#include <iostream>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+//Offsets of the fields within a serialised record
+#define OFF_BINS  32
+#define OFF_FLAGS 36
+#define OFF_SPEC  41
+//Length of a record with no spectra or audio
+#define FIXEDLEN  45
+//Largest number of spectral channels we will believe
+#define MAXBINS   (1<<20)
+//Largest number of audio samples per channel we will believe
+#define MAXAUDIOLEN (1<<24)
+
+//The characters which mark each spectrum as saved, in the order they are
+//written, following the RFI flag
+static const char theirSpecChars[view_numspectra] = {'P', 'X', '1', '2'};
+
+
+///////////////////////////////////////////////////////////////////////
+//Return the raw bytes of the given spectrum
+const char *PeriodView::spectrum(view_spectrum which) const
+{
+  if (itsV2) {
+    v2header_t hdr;
+    memcpy(&hdr, itsRec, sizeof(hdr));
+    if (!(hdr.flags&(v2_phase<<which))) return NULL;
+    return itsRec + RecordV2::sectionOffset(hdr, which);
+  }
+  if (itsRec[OFF_FLAGS+1+which]!=theirSpecChars[which]) return NULL;
+  int before = 0;
+  for (int i=0; i<which; i++) {
+    if (itsRec[OFF_FLAGS+1+i]==theirSpecChars[i]) before++;
+  }
+  return itsRec + OFF_SPEC + before*numBins()*sizeof(float);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Return the offset of the audio length field
+int PeriodView::audioOffset() const
+{
+  int nspec = 0;
+  for (int i=0; i<view_numspectra; i++) {
+    if (itsRec[OFF_FLAGS+1+i]==theirSpecChars[i]) nspec++;
+  }
+  return OFF_SPEC + nspec*numBins()*sizeof(float);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Return the number of audio samples for each channel
+int PeriodView::audioLen() const
+{
+  if (itsV2) return getField<int>(44);
+  int len = getField<int>(audioOffset());
+  return (len<0) ? -len : len;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Return true if the audio was saved compressed
+bool PeriodView::audioCompressed() const
+{
+  if (itsV2) return (getField<unsigned int>(36)&v2_packedaudio)!=0;
+  return getField<int>(audioOffset())<0;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Fill out a full IntegPeriod with a copy of this record
+bool PeriodView::get(IntegPeriod &per) const
+{
+  per.timeStamp = timeStamp();
+  per.powerX = powerX();
+  per.power1 = power1();
+  per.power2 = power2();
+  per.amplitude = amplitude();
+  per.phase = phase();
+  per.numBins = numBins();
+  per.RFI = RFI();
+
+  float **dest[view_numspectra] = {&per.phaseSpec, &per.crossSpec,
+				   &per.input1Spec, &per.input2Spec};
+  for (int i=0; i<view_numspectra; i++) {
+    if (*dest[i]!=NULL) {
+      delete[] *dest[i];
+      *dest[i] = NULL;
+    }
+    const char *spec = spectrum((view_spectrum)i);
+    if (spec!=NULL) {
+      *dest[i] = new float[per.numBins];
+      memcpy(*dest[i], spec, per.numBins*sizeof(float));
+    }
+  }
+
+  if (per.rawAudio!=NULL) {
+    delete[] per.rawAudio;
+    per.rawAudio = NULL;
+  }
+  if (itsV2) {
+    v2header_t hdr;
+    memcpy(&hdr, itsRec, sizeof(hdr));
+    const char *audio = itsRec + RecordV2::sectionOffset(hdr, view_numspectra);
+    per.audioLen = hdr.audioLen;
+    if (hdr.audioLen==0) return true;
+    per.rawAudio = new audio_t[2*hdr.audioLen];
+    if (!(hdr.flags&v2_packedaudio)) {
+      memcpy(per.rawAudio, audio, hdr.audioBytes);
+    } else if (!AudioCodec::decode(audio, hdr.audioBytes,
+				   per.rawAudio, per.audioLen)) {
+      delete[] per.rawAudio;
+      per.rawAudio = NULL;
+      per.audioLen = 0;
+      return false;
+    }
+    return true;
+  }
+  int off = audioOffset();
+  int len = getField<int>(off);
+  per.audioLen = (len<0) ? -len : len;
+  if (len>0) {
+    per.rawAudio = new audio_t[2*len];
+    memcpy(per.rawAudio, itsRec+off+sizeof(int), 2*sizeof(audio_t)*len);
+  } else if (len<0) {
+    int packedlen = getField<int>(off+sizeof(int));
+    per.rawAudio = new audio_t[2*per.audioLen];
+    if (!AudioCodec::decode(itsRec+off+2*sizeof(int), packedlen,
+			    per.rawAudio, per.audioLen)) {
+      delete[] per.rawAudio;
+      per.rawAudio = NULL;
+      per.audioLen = 0;
+      return false;
+    }
+  }
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Constructor
+ArchiveMap::ArchiveMap()
+:itsMap(NULL),
+itsMapLen(0),
+itsV2(false),
+itsOffsets(NULL),
+itsCount(0)
+{
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Destructor
+ArchiveMap::~ArchiveMap()
+{
+  close();
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Release the mapping
+void ArchiveMap::close()
+{
+  if (itsMap!=NULL) munmap(itsMap, itsMapLen);
+  if (itsOffsets!=NULL) delete[] itsOffsets;
+  itsMap = NULL;
+  itsMapLen = 0;
+  itsV2 = false;
+  itsOffsets = NULL;
+  itsCount = 0;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Check the record and return its length
+long long ArchiveMap::checkRecord(const char *rec, long long avail)
+{
+  if (avail<FIXEDLEN) return -1;
+  int len, numbins;
+  memcpy(&len, rec, sizeof(int));
+  if (len<FIXEDLEN || len>avail) return -1;
+
+  if (rec[OFF_FLAGS]!='R' && rec[OFF_FLAGS]!=' ') return -1;
+  int nspec = 0;
+  for (int i=0; i<view_numspectra; i++) {
+    char c = rec[OFF_FLAGS+1+i];
+    if (c==theirSpecChars[i]) nspec++;
+    else if (c!=' ') return -1;
+  }
+  memcpy(&numbins, rec+OFF_BINS, sizeof(int));
+  long long specbytes = 0;
+  if (nspec>0) {
+    if (numbins<0 || numbins>MAXBINS) return -1;
+    specbytes = nspec*sizeof(float)*(long long)numbins;
+  }
+  if (FIXEDLEN+specbytes>len) return -1;
+
+  int audiolen;
+  memcpy(&audiolen, rec+OFF_SPEC+specbytes, sizeof(int));
+  long long expected = FIXEDLEN + specbytes;
+  if (audiolen>=0) {
+    expected += 2*sizeof(audio_t)*(long long)audiolen;
+  } else {
+    //Compressed audio, followed by the length of the encoded data
+    if (audiolen<-MAXAUDIOLEN) return -1;
+    if (FIXEDLEN+specbytes+sizeof(int)>(unsigned long long)len) return -1;
+    int packedlen;
+    memcpy(&packedlen, rec+OFF_SPEC+specbytes+sizeof(int), sizeof(int));
+    if (packedlen<0) return -1;
+    expected += sizeof(int) + packedlen;
+  }
+  if (expected!=len) return -1;
+  return len;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Map the named file and find its records
+bool ArchiveMap::open(const char *fname)
+{
+  close();
+
+  int fd = ::open(fname, O_RDONLY);
+  if (fd<0) {
+    cerr << "ERROR opening " << fname << endl;
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st)!=0 || st.st_size==0) {
+    cerr << "ERROR " << fname << " is empty or unreadable\n";
+    ::close(fd);
+    return false;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (map==MAP_FAILED) {
+    perror(("ArchiveMap: " + string(fname)).c_str());
+    return false;
+  }
+  itsMap = (char*)map;
+  itsMapLen = st.st_size;
+
+  //Walk through the records building the table of offsets
+  int size = 1024;
+  itsOffsets = new long long[size];
+  long long pos = 0;
+  if (RecordV2::isFileHeader(itsMap, itsMapLen)) {
+    itsV2 = true;
+    pos = sizeof(v2fileheader_t);
+  }
+  while (pos<itsMapLen) {
+    long long len;
+    if (itsV2) {
+      len = RecordV2::check(itsMap+pos, itsMapLen-pos);
+      if (len<0) {
+	//Records are aligned so look for the next good one
+	long long bad = pos;
+	for (pos+=8; pos<itsMapLen; pos+=8) {
+	  len = RecordV2::check(itsMap+pos, itsMapLen-pos);
+	  if (len>0) break;
+	}
+	cerr << "WARNING: " << fname << " is corrupt from byte " << bad;
+	if (pos<itsMapLen) cerr << ", resuming at byte " << pos << endl;
+	else cerr << ", ignoring the rest of the file\n";
+	if (pos>=itsMapLen) break;
+      }
+    } else {
+      len = checkRecord(itsMap+pos, itsMapLen-pos);
+    }
+    if (len<0) {
+      if (itsCount==0) {
+	cerr << "ERROR " << fname << " does not contain valid data\n";
+	close();
+	return false;
+      }
+      cerr << "WARNING: " << fname << " is corrupt from byte " << pos
+	   << ", ignoring the rest of the file\n";
+      break;
+    }
+    if (itsCount==size) {
+      size *= 2;
+      long long *newoffsets = new long long[size];
+      memcpy(newoffsets, itsOffsets, itsCount*sizeof(long long));
+      delete[] itsOffsets;
+      itsOffsets = newoffsets;
+    }
+    itsOffsets[itsCount++] = pos;
+    pos += len;
+  }
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Return the index of the first record at or after 'epoch'
+int ArchiveMap::find(long long epoch) const
+{
+  int lo = 0, hi = itsCount;
+  while (lo<hi) {
+    int mid = lo + (hi-lo)/2;
+    if ((*this)[mid].timeStamp()<epoch) lo = mid+1;
+    else hi = mid;
+  }
+  return lo;
+}
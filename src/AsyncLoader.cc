@@ -0,0 +1,544 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+#include <AsyncLoader.h>
+#include <IntegPeriod.h>
+#include <ServerPool.h>
+#include <iostream>
+#include <sstream>
+#include <string.h>
+
+const int AsyncLoader::theirBlockSize = 1<<20;
+const int AsyncLoader::theirMaxRecord = 1<<26;
+
+
+///////////////////////////////////////////////////////////////////////
+//Start the receive thread in the AsyncLoader's receive loop
+void *asyncloader_receive(void *arg)
+{
+  ((AsyncLoader*)arg)->receiveLoop();
+  return NULL;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Start a parse thread in the AsyncLoader's parse loop
+void *asyncloader_parse(void *arg)
+{
+  ((AsyncLoader*)arg)->parseLoop();
+  return NULL;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Receives the reply over a connection from the ServerPool
+class AsyncRequest : public PoolRequest {
+public:
+  AsyncRequest(AsyncLoader *loader) :itsLoader(loader) {}
+  bool run(TCPstream &sock) {
+    if (itsLoader->itsNumRanges>0) return itsLoader->receiveMany(sock);
+    //Throw away anything from an attempt on a connection which broke
+    itsLoader->clearBlocks();
+    return itsLoader->receive(sock);
+  }
+private:
+  AsyncLoader *itsLoader;
+};
+
+
+///////////////////////////////////////////////////////////////////////
+//Lets a block of records be read with the usual operator>>
+class BlockBuf : public streambuf {
+public:
+  BlockBuf(char *buf, int len) {setg(buf, buf, buf+len);}
+};
+
+
+///////////////////////////////////////////////////////////////////////
+//Constructor for loading over an established connection
+AsyncLoader::AsyncLoader(TCPstream &sock, int parsers)
+:itsSock(&sock),
+itsPort(0),
+itsStarts(NULL),
+itsEnds(NULL),
+itsNumRanges(0),
+itsRangesSize(0),
+itsBlocks(NULL),
+itsNumBlocks(0),
+itsBlocksSize(0),
+itsNextParse(0),
+itsParsing(0),
+itsFilling(NULL),
+itsReceived(false),
+itsData(NULL),
+itsCount(0),
+itsRangeData(NULL),
+itsRangeCounts(NULL),
+itsOK(false),
+itsDone(false),
+itsStarted(false),
+itsNumParsers(parsers>0 ? parsers : 1)
+{
+  itsParseThreads = new pthread_t[itsNumParsers];
+  pthread_mutex_init(&itsLock, NULL);
+  pthread_cond_init(&itsCond, NULL);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Constructor for loading over a connection from the ServerPool
+AsyncLoader::AsyncLoader(const char *server, int port, int parsers)
+:itsSock(NULL),
+itsServer(server),
+itsPort(port),
+itsStarts(NULL),
+itsEnds(NULL),
+itsNumRanges(0),
+itsRangesSize(0),
+itsBlocks(NULL),
+itsNumBlocks(0),
+itsBlocksSize(0),
+itsNextParse(0),
+itsParsing(0),
+itsFilling(NULL),
+itsReceived(false),
+itsData(NULL),
+itsCount(0),
+itsRangeData(NULL),
+itsRangeCounts(NULL),
+itsOK(false),
+itsDone(false),
+itsStarted(false),
+itsNumParsers(parsers>0 ? parsers : 1)
+{
+  itsParseThreads = new pthread_t[itsNumParsers];
+  pthread_mutex_init(&itsLock, NULL);
+  pthread_cond_init(&itsCond, NULL);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Destructor
+AsyncLoader::~AsyncLoader()
+{
+  if (itsStarted) pthread_join(itsReceiveThread, NULL);
+  if (itsData!=NULL) delete[] itsData;
+  freeRanges();
+  if (itsStarts!=NULL) {
+    delete[] itsStarts;
+    delete[] itsEnds;
+    delete[] itsRangeData;
+    delete[] itsRangeCounts;
+  }
+  if (itsBlocks!=NULL) delete[] itsBlocks;
+  delete[] itsParseThreads;
+  pthread_cond_destroy(&itsCond);
+  pthread_mutex_destroy(&itsLock);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Start loading in the background
+bool AsyncLoader::start(long long start, long long end, int preprocess,
+			loader_callback callback, void *arg)
+{
+  if (!reset()) return false;
+  itsStart = start;
+  itsEnd = end;
+  launch(preprocess, callback, arg);
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Start loading several ranges at once in the background
+bool AsyncLoader::startMany(const long long *start, const long long *end,
+			    int num, int preprocess,
+			    loader_callback callback, void *arg)
+{
+  if (num<=0 || !reset()) return false;
+  //Keep the arrays for next time unless they are too small
+  if (num>itsRangesSize) {
+    if (itsStarts!=NULL) {
+      delete[] itsStarts;
+      delete[] itsEnds;
+      delete[] itsRangeData;
+      delete[] itsRangeCounts;
+    }
+    itsStarts = new long long[num];
+    itsEnds = new long long[num];
+    itsRangeData = new IntegPeriod*[num];
+    itsRangeCounts = new int[num];
+    itsRangesSize = num;
+  }
+  for (int i=0; i<num; i++) {
+    itsStarts[i] = start[i];
+    itsEnds[i] = end[i];
+    itsRangeData[i] = NULL;
+    itsRangeCounts[i] = 0;
+  }
+  itsNumRanges = num;
+  launch(preprocess, callback, arg);
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Tidy up after an earlier load
+bool AsyncLoader::reset()
+{
+  Lock();
+  bool busy = itsStarted && !itsDone;
+  Unlock();
+  if (busy) return false;
+  if (itsStarted) pthread_join(itsReceiveThread, NULL);
+  itsStarted = false;
+  if (itsData!=NULL) delete[] itsData;
+  itsData = NULL;
+  itsCount = 0;
+  freeRanges();
+  itsNumRanges = 0;
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Start the threads
+void AsyncLoader::launch(int preprocess, loader_callback callback, void *arg)
+{
+  itsPreprocess = preprocess;
+  itsCallback = callback;
+  itsCallbackArg = arg;
+  itsReceived = false;
+  itsOK = false;
+  itsDone = false;
+
+  //loadMany decodes the ranges itself
+  if (itsNumRanges==0) {
+    for (int i=0; i<itsNumParsers; i++) {
+      pthread_create(&itsParseThreads[i], NULL, asyncloader_parse,
+		     (void*)this);
+    }
+  }
+  pthread_create(&itsReceiveThread, NULL, asyncloader_receive, (void*)this);
+  itsStarted = true;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Has the load finished
+bool AsyncLoader::finished()
+{
+  Lock();
+  bool res = itsDone;
+  Unlock();
+  return res;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Wait for the load to finish
+bool AsyncLoader::wait()
+{
+  Lock();
+  if (!itsStarted) {
+    Unlock();
+    return false;
+  }
+  while (!itsDone) pthread_cond_wait(&itsCond, &itsLock);
+  bool res = itsOK;
+  Unlock();
+  return res;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Wait for the load and hand over the periods
+bool AsyncLoader::take(IntegPeriod *&data, int &count)
+{
+  bool res = wait();
+  Lock();
+  data = itsData;
+  count = itsCount;
+  itsData = NULL;
+  itsCount = 0;
+  Unlock();
+  return res;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Wait for the load and hand over the periods for each range
+bool AsyncLoader::takeMany(IntegPeriod **data, int *count)
+{
+  bool res = wait();
+  Lock();
+  for (int i=0; i<itsNumRanges; i++) {
+    data[i] = itsRangeData[i];
+    count[i] = itsRangeCounts[i];
+    itsRangeData[i] = NULL;
+    itsRangeCounts[i] = 0;
+  }
+  Unlock();
+  return res;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Main loop of the receive thread
+void AsyncLoader::receiveLoop()
+{
+  bool res;
+  if (itsSock!=NULL) {
+    res = (itsNumRanges>0) ? receiveMany(*itsSock) : receive(*itsSock);
+  } else {
+    AsyncRequest req(this);
+    res = ServerPool::global().perform(itsServer, itsPort, req);
+  }
+
+  if (itsNumRanges==0) {
+    //Let the parse threads finish off what there is and then exit
+    Lock();
+    itsReceived = true;
+    pthread_cond_broadcast(&itsCond);
+    Unlock();
+    for (int i=0; i<itsNumParsers; i++) {
+      pthread_join(itsParseThreads[i], NULL);
+    }
+
+    if (res) res = collect();
+    clearBlocks();
+  }
+
+  Lock();
+  itsOK = res;
+  itsDone = true;
+  pthread_cond_broadcast(&itsCond);
+  Unlock();
+  if (itsCallback!=NULL) itsCallback(this, itsCallbackArg);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Main loop of a parse thread
+void AsyncLoader::parseLoop()
+{
+  while (true) {
+    Lock();
+    while (itsNextParse==itsNumBlocks && !itsReceived) {
+      pthread_cond_wait(&itsCond, &itsLock);
+    }
+    if (itsNextParse==itsNumBlocks) {
+      Unlock();
+      break;
+    }
+    loadblock_t *block = itsBlocks[itsNextParse++];
+    itsParsing++;
+    Unlock();
+
+    BlockBuf buf(block->buf, block->len);
+    istream is(&buf);
+    block->data = new IntegPeriod[block->num];
+    for (int i=0; i<block->num && is.good(); i++) {
+      is >> block->data[i];
+    }
+    block->ok = is.good();
+    delete[] block->buf;
+    block->buf = NULL;
+
+    Lock();
+    itsParsing--;
+    pthread_cond_broadcast(&itsCond);
+    Unlock();
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Ask for the data and read the reply into blocks
+bool AsyncLoader::receive(TCPstream &sock)
+{
+  if (!sock.good()) return false;
+
+  //Ask for the data with protocol 1.2, so it comes in groups. An older
+  //server sends just one group with no trailer.
+  int version = IntegPeriod::negotiate(sock);
+  if (version==0) return false;
+  sock << "BETWEEN " << itsStart << " " << itsEnd << " 0 0 0 "
+       << itsPreprocess << "\n";
+
+  char line[1001];
+  line[1000] = '\0';
+
+  int count = 0;
+  while (true) {
+    sock.getline(line, 1000);
+    if (!sock.good()) {
+      cerr << "ERROR reading from network\n";
+      return false;
+    }
+    //The trailer gives the total and whether all went well
+    if (version>=12 && strncmp(line, "END ", 4)==0) {
+      istringstream trailer(line+4);
+      int total = -1;
+      string status;
+      trailer >> total >> status;
+      if (status!="OK" || total!=count) {
+	cerr << "Server reported an error: " << line+4 << endl;
+	return false;
+      }
+      return true;
+    }
+
+    //Otherwise it is the number of periods in the next group
+    int num = -1;
+    istringstream numstr(line);
+    numstr >> num;
+    if (numstr.fail() || num<0 || count+num>10000000) {
+      cerr << "Silly count returned by server (" << line << ")\n";
+      return false;
+    }
+    for (int i=0; i<num; i++) {
+      //Each record starts with its length, which is all we need
+      int reclen;
+      sock.read((char*)&reclen, sizeof(int));
+      if (!sock.good() || reclen<IntegPeriod::theirHeaderLen ||
+	  reclen>theirMaxRecord) {
+	cerr << "ERROR reading from network\n";
+	return false;
+      }
+      //Hand over the block if the record won't fit
+      if (itsFilling!=NULL && itsFilling->len+reclen>itsFilling->size) {
+	queueBlock();
+      }
+      if (itsFilling==NULL) newBlock(reclen);
+      char *p = itsFilling->buf + itsFilling->len;
+      memcpy(p, &reclen, sizeof(int));
+      sock.read(p+sizeof(int), reclen-sizeof(int));
+      if (!sock.good()) {
+	cerr << "ERROR reading from network\n";
+	return false;
+      }
+      itsFilling->len += reclen;
+      itsFilling->num++;
+      count++;
+    }
+    //Let the parse threads get on with it while the server reads more
+    queueBlock();
+    if (version<12) return true;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Ask for all of the ranges at once and load them
+bool AsyncLoader::receiveMany(TCPstream &sock)
+{
+  //Throw away anything from an attempt on a connection which broke
+  freeRanges();
+  return IntegPeriod::loadMany(itsRangeData, itsRangeCounts,
+			       itsStarts, itsEnds, itsNumRanges,
+			       sock, itsPreprocess);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Delete whatever was loaded for the ranges and not taken
+void AsyncLoader::freeRanges()
+{
+  for (int i=0; i<itsNumRanges; i++) {
+    if (itsRangeData[i]!=NULL) delete[] itsRangeData[i];
+    itsRangeData[i] = NULL;
+    itsRangeCounts[i] = 0;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Start filling a new block big enough for at least 'minsize' bytes
+void AsyncLoader::newBlock(int minsize)
+{
+  itsFilling = new loadblock_t;
+  itsFilling->size = (minsize>theirBlockSize) ? minsize : theirBlockSize;
+  itsFilling->buf = new char[itsFilling->size];
+  itsFilling->len = 0;
+  itsFilling->num = 0;
+  itsFilling->data = NULL;
+  itsFilling->ok = false;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Queue the block being filled for the parse threads
+void AsyncLoader::queueBlock()
+{
+  if (itsFilling==NULL) return;
+  Lock();
+  if (itsNumBlocks==itsBlocksSize) {
+    itsBlocksSize = itsBlocksSize ? 2*itsBlocksSize : 16;
+    loadblock_t **newblocks = new loadblock_t*[itsBlocksSize];
+    for (int i=0; i<itsNumBlocks; i++) newblocks[i] = itsBlocks[i];
+    if (itsBlocks!=NULL) delete[] itsBlocks;
+    itsBlocks = newblocks;
+  }
+  itsBlocks[itsNumBlocks++] = itsFilling;
+  itsFilling = NULL;
+  pthread_cond_broadcast(&itsCond);
+  Unlock();
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Forget all of the blocks
+void AsyncLoader::clearBlocks()
+{
+  Lock();
+  while (itsParsing>0) pthread_cond_wait(&itsCond, &itsLock);
+  for (int i=0; i<itsNumBlocks; i++) {
+    if (itsBlocks[i]->buf!=NULL) delete[] itsBlocks[i]->buf;
+    if (itsBlocks[i]->data!=NULL) delete[] itsBlocks[i]->data;
+    delete itsBlocks[i];
+  }
+  itsNumBlocks = 0;
+  itsNextParse = 0;
+  Unlock();
+  if (itsFilling!=NULL) {
+    delete[] itsFilling->buf;
+    delete itsFilling;
+    itsFilling = NULL;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Put the decoded blocks together into the result
+bool AsyncLoader::collect()
+{
+  int total = 0;
+  for (int i=0; i<itsNumBlocks; i++) {
+    if (!itsBlocks[i]->ok) {
+      cerr << "ERROR decoding data from network\n";
+      return false;
+    }
+    total += itsBlocks[i]->num;
+  }
+  IntegPeriod *data = (total>0) ? new IntegPeriod[total] : NULL;
+  int j = 0;
+  for (int i=0; i<itsNumBlocks; i++) {
+    for (int k=0; k<itsBlocks[i]->num; k++) {
+      data[j++] = std::move(itsBlocks[i]->data[k]);
+    }
+  }
+  Lock();
+  itsData = data;
+  itsCount = total;
+  Unlock();
+  return true;
+}
@@ -0,0 +1,250 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+#include <AudioCodec.h>
+#include <BitStream.h>
+
+//Highest order of fixed predictor we will try
+#define MAXORDER  4
+//Number of residuals which share a Rice parameter
+#define PARTITION 256
+//Rice parameter value which marks a partition stored as plain binary
+#define ESCAPE    31
+//Bits used to store the warm-up samples, enough for the difference
+//between the two channels
+#define WARMBITS  17
+
+//How the second channel is coded
+typedef enum stereo_mode {
+  stereo_independent=0,
+  stereo_side
+} stereo_mode;
+
+
+///////////////////////////////////////////////////////////////////////
+//Compute the successive differences of 'x', which are the residuals of
+//each order of fixed predictor. Order 'k' is written to d+k*n and is
+//valid from index k onward.
+static void differences(const int *x, int n, int *d)
+{
+  for (int i=0; i<n; i++) d[i] = x[i];
+  for (int k=1; k<=MAXORDER; k++) {
+    const int *prev = d+(k-1)*n;
+    int *res = d+k*n;
+    for (int i=k; i<n; i++) res[i] = prev[i]-prev[i-1];
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Choose the predictor order with the smallest residuals. 'cost' returns
+//the sum of the absolute residuals for the chosen order.
+static int chooseOrder(const int *d, int n, long long &cost)
+{
+  int best = 0;
+  cost = 0;
+  if (n<=MAXORDER) {
+    for (int i=0; i<n; i++) cost += (d[i]<0)?-d[i]:d[i];
+    return 0;
+  }
+  for (int k=0; k<=MAXORDER; k++) {
+    const int *res = d+k*n;
+    long long sum = 0;
+    for (int i=MAXORDER; i<n; i++) sum += (res[i]<0)?-res[i]:res[i];
+    if (k==0 || sum<cost) {
+      best = k;
+      cost = sum;
+    }
+  }
+  return best;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Rice code one partition of residuals with the best parameter
+static void writePartition(BitWriter &bw, const int *res, int m)
+{
+  unsigned int u[PARTITION];
+  unsigned long long sum = 0;
+  unsigned int maxu = 0;
+  for (int i=0; i<m; i++) {
+    //Zig-zag so that small negative values are small codes too
+    u[i] = ((unsigned int)res[i]<<1) ^ (unsigned int)(res[i]>>31);
+    sum += u[i];
+    if (u[i]>maxu) maxu = u[i];
+  }
+
+  //Estimate the parameter from the mean and try either side of it
+  int est = 0;
+  while (est<30 && ((unsigned long long)m<<(est+1))<sum) est++;
+  int bestk = -1;
+  unsigned long long bestcost = 0;
+  for (int k=(est>0)?est-1:0; k<=est+1 && k<=30; k++) {
+    unsigned long long cost = (unsigned long long)m*(k+1);
+    for (int i=0; i<m; i++) cost += u[i]>>k;
+    if (bestk<0 || cost<bestcost) {
+      bestk = k;
+      bestcost = cost;
+    }
+  }
+
+  //Noise-like data may be better stored as plain binary
+  int width = 0;
+  while (width<32 && (maxu>>width)!=0) width++;
+  if (5+(unsigned long long)m*width < bestcost) {
+    bw.put(ESCAPE, 5);
+    bw.put(width, 5);
+    for (int i=0; i<m; i++) bw.put(u[i], width);
+  } else {
+    bw.put(bestk, 5);
+    for (int i=0; i<m; i++) bw.putRice(u[i], bestk);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Write one channel given its differences and chosen predictor order
+static void writeChannel(BitWriter &bw, const int *d, int n, int order)
+{
+  bw.put(order, 3);
+  for (int i=0; i<order; i++) bw.put(d[i], WARMBITS);
+  const int *res = d+order*n;
+  for (int start=order; start<n; start+=PARTITION) {
+    int m = n-start;
+    if (m>PARTITION) m = PARTITION;
+    writePartition(bw, res+start, m);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Read one channel of 'n' samples into 'x'
+static void readChannel(BitReader &br, int *x, int n)
+{
+  int order = br.get(3);
+  if (order>MAXORDER || order>n) {
+    br.setBad();
+    return;
+  }
+  for (int i=0; i<order; i++) {
+    int v = br.get(WARMBITS);
+    if (v & (1<<(WARMBITS-1))) v |= ~((1<<WARMBITS)-1);
+    x[i] = v;
+  }
+
+  for (int start=order; start<n && !br.bad(); start+=PARTITION) {
+    int end = start+PARTITION;
+    if (end>n) end = n;
+    int k = br.get(5);
+    int width = 0;
+    if (k==ESCAPE) width = br.get(5);
+    for (int i=start; i<end; i++) {
+      unsigned int u = (k==ESCAPE) ? br.get(width) : br.getRice(k);
+      x[i] = (int)((u>>1) ^ (0u-(u&1)));
+    }
+    //Add the prediction back on to the residuals
+    switch (order) {
+    case 0:
+      break;
+    case 1:
+      for (int i=start; i<end; i++) x[i] += x[i-1];
+      break;
+    case 2:
+      for (int i=start; i<end; i++) x[i] += 2*x[i-1] - x[i-2];
+      break;
+    case 3:
+      for (int i=start; i<end; i++)
+	x[i] += 3*x[i-1] - 3*x[i-2] + x[i-3];
+      break;
+    case 4:
+      for (int i=start; i<end; i++)
+	x[i] += 4*x[i-1] - 6*x[i-2] + 4*x[i-3] - x[i-4];
+      break;
+    }
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Compress stereo audio
+void AudioCodec::encode(const audio_t *in, int numsamples,
+			char *&out, int &outsize, int &outlen)
+{
+  BitWriter bw(out, outsize);
+  int n = numsamples;
+  if (n<=0) {
+    outlen = bw.finish();
+    return;
+  }
+
+  //Channel 1, channel 2 and their difference, then the differences
+  //of each of those
+  int *work = new int[3*n + 3*(MAXORDER+1)*n];
+  int *x1 = work, *x2 = work+n, *side = work+2*n;
+  int *d1 = work+3*n;
+  int *d2 = d1+(MAXORDER+1)*n;
+  int *dside = d2+(MAXORDER+1)*n;
+  for (int i=0; i<n; i++) {
+    x1[i] = in[2*i];
+    x2[i] = in[2*i+1];
+    side[i] = x2[i]-x1[i];
+  }
+  differences(x1, n, d1);
+  differences(x2, n, d2);
+  differences(side, n, dside);
+
+  long long cost1, cost2, costside;
+  int order1 = chooseOrder(d1, n, cost1);
+  int order2 = chooseOrder(d2, n, cost2);
+  int orderside = chooseOrder(dside, n, costside);
+
+  if (costside<cost2) {
+    bw.put(stereo_side, 8);
+    writeChannel(bw, d1, n, order1);
+    writeChannel(bw, dside, n, orderside);
+  } else {
+    bw.put(stereo_independent, 8);
+    writeChannel(bw, d1, n, order1);
+    writeChannel(bw, d2, n, order2);
+  }
+  outlen = bw.finish();
+  delete[] work;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Decompress stereo audio
+bool AudioCodec::decode(const char *in, int inlen,
+			audio_t *out, int numsamples)
+{
+  int n = numsamples;
+  if (n<=0) return true;
+
+  BitReader br(in, inlen);
+  int mode = br.get(8);
+  if (mode!=stereo_independent && mode!=stereo_side) return false;
+
+  int *x1 = new int[2*n];
+  int *x2 = x1+n;
+  readChannel(br, x1, n);
+  if (!br.bad()) readChannel(br, x2, n);
+  if (br.bad()) {
+    delete[] x1;
+    return false;
+  }
+
+  for (int i=0; i<n; i++) {
+    out[2*i] = (audio_t)x1[i];
+    if (mode==stereo_side) out[2*i+1] = (audio_t)(x2[i]+x1[i]);
+    else out[2*i+1] = (audio_t)x2[i];
+  }
+  delete[] x1;
+  return true;
+}
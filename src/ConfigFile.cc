@@ -22,11 +22,22 @@ ConfigFile::ConfigFile(const char *fname)
   itsStoreDir("/tmp/"),
   itsKeepAudio(false),
   itsKeepSpectra(true),
+  itsKeepRollups(true),
+  itsCompactStore(false),
+  itsCompressStore(false),
   itsRawStoreDir("/tmp/sacraw/"),
   itsMaxRawAge(86400000000ll),
   itsStoreRaw(false),
+  itsCompressRaw(false),
   itsServerPort(31234),
   itsMaxClients(5),
+  itsWebWorkers(4),
+  itsBulkWorkers(2),
+  itsBulkSpan(24),
+  itsClientKBytes(0),
+  itsClientRequests(0),
+  itsClientBurst(2.0),
+  itsNetCompress(true),
   itsNumBins(64),
   itsLatitude(-30.3147),
   itsLongitude(149.5616),
@@ -100,6 +111,36 @@ void ConfigFile::parseFile()
       itsIntegTime = val;
     } else if (key=="storedir:") {
       *line >> itsStoreDir;
+    } else if (key=="rollups:") {
+      string val;
+      *line >> val;
+      if (val=="true") itsKeepRollups = true;
+      else if (val=="false") itsKeepRollups = false;
+      else {
+	cerr << "ERROR: Line " << itsLineNum << ": \"rollups:\" expects "
+	  << "a \"true\" or \"false\" argument\n";
+        exit(1);
+      }
+    } else if (key=="compactstore:") {
+      string val;
+      *line >> val;
+      if (val=="true") itsCompactStore = true;
+      else if (val=="false") itsCompactStore = false;
+      else {
+	cerr << "ERROR: Line " << itsLineNum << ": \"compactstore:\" expects "
+	  << "a \"true\" or \"false\" argument\n";
+        exit(1);
+      }
+    } else if (key=="compressstore:") {
+      string val;
+      *line >> val;
+      if (val=="true") itsCompressStore = true;
+      else if (val=="false") itsCompressStore = false;
+      else {
+	cerr << "ERROR: Line " << itsLineNum << ": \"compressstore:\" expects "
+	  << "a \"true\" or \"false\" argument\n";
+        exit(1);
+      }
     } else if (key=="rawstoredir:") {
       *line >> itsRawStoreDir;
     } else if (key=="storeraw:") {
@@ -112,6 +153,16 @@ void ConfigFile::parseFile()
 	  << "a \"true\" or \"false\" argument\n";
         exit(1);
       }
+    } else if (key=="compressraw:") {
+      string val;
+      *line >> val;
+      if (val=="true") itsCompressRaw = true;
+      else if (val=="false") itsCompressRaw = false;
+      else {
+	cerr << "ERROR: Line " << itsLineNum << ": \"compressraw:\" expects "
+	  << "a \"true\" or \"false\" argument\n";
+        exit(1);
+      }
     } else if (key=="maxrawage:") {
       *line >> itsMaxRawAge;
       if (itsMaxRawAge<60 || itsMaxRawAge>86400*7) {
@@ -146,12 +197,76 @@ void ConfigFile::parseFile()
     } else if (key=="maxclients:") {
       int val;
       *line >> val;
-      if (val<0 || val>1000) {
+      if (val<0 || val>10000) {
 	cerr << "ERROR: Line " << itsLineNum << ": \"maxclients:\" expects "
-	  << "an argument between 0 and 1000\n";
+	  << "an argument between 0 and 10000\n";
 	exit(1);
       }
       itsMaxClients = val;
+    } else if (key=="webworkers:") {
+      int val;
+      *line >> val;
+      if (val<1 || val>64) {
+	cerr << "ERROR: Line " << itsLineNum << ": \"webworkers:\" expects "
+	  << "an argument between 1 and 64\n";
+	exit(1);
+      }
+      itsWebWorkers = val;
+    } else if (key=="bulkworkers:") {
+      int val;
+      *line >> val;
+      if (val<1 || val>64) {
+	cerr << "ERROR: Line " << itsLineNum << ": \"bulkworkers:\" expects "
+	  << "an argument between 1 and 64\n";
+	exit(1);
+      }
+      itsBulkWorkers = val;
+    } else if (key=="bulkspan:") {
+      int val;
+      *line >> val;
+      if (val<1 || val>87600) {
+	cerr << "ERROR: Line " << itsLineNum << ": \"bulkspan:\" expects "
+	  << "a number of hours between 1 and 87600\n";
+	exit(1);
+      }
+      itsBulkSpan = val;
+    } else if (key=="clientkbytes:") {
+      int val;
+      *line >> val;
+      if (val<0 || val>10000000) {
+	cerr << "ERROR: Line " << itsLineNum << ": \"clientkbytes:\" expects "
+	  << "an argument between 0 and 10000000\n";
+	exit(1);
+      }
+      itsClientKBytes = val;
+    } else if (key=="clientrequests:") {
+      float val;
+      *line >> val;
+      if (val<0 || val>100000) {
+	cerr << "ERROR: Line " << itsLineNum << ": \"clientrequests:\" expects "
+	  << "an argument between 0 and 100000\n";
+	exit(1);
+      }
+      itsClientRequests = val;
+    } else if (key=="clientburst:") {
+      float val;
+      *line >> val;
+      if (val<0.1 || val>3600) {
+	cerr << "ERROR: Line " << itsLineNum << ": \"clientburst:\" expects "
+	  << "a number of seconds between 0.1 and 3600\n";
+	exit(1);
+      }
+      itsClientBurst = val;
+    } else if (key=="netcompress:") {
+      string val;
+      *line >> val;
+      if (val=="true") itsNetCompress = true;
+      else if (val=="false") itsNetCompress = false;
+      else {
+	cerr << "ERROR: Line " << itsLineNum << ": \"netcompress:\" expects "
+	  << "a \"true\" or \"false\" argument\n";
+        exit(1);
+      }
     } else if (key=="numbins:") {
       int val;
       *line >> val;
@@ -10,6 +10,8 @@
 
 #include <DataForwarder.h>
 #include <IntegPeriod.h>
+#include <AsyncLoader.h>
+#include <ServerPool.h>
 #include <TCPstream.h>
 #include <signal.h>
 #include <unistd.h> //for sleep
@@ -19,6 +21,8 @@ void stayalive(int sig)
   //Do nothing, just don't die from SIGPIPE if a connection drops out
 }
 
+//Most one hour chunks of the backlog we ask the server for at once
+#define BACKLOGCHUNKS 8
 
 
 ///////////////////////////////////////////////////////////////////////
@@ -163,7 +167,10 @@ bool DataForwarder::connectServer()
   if (itsServer.rdbuf()->connect(itsServerSAddr)!=NULL) {
     itsServer.rdbuf()->set_blocking_io(true);
     if (itsServer.good() && itsServer.rdbuf()->is_open() && !itsServer.eof()) {
-      return true;
+      //Agree on the protocol now, before we ask for anything, asking
+      //for compression unless the shared pool has been told not to
+      return IntegPeriod::negotiate(itsServer, itsServerSAddr,
+				    ServerPool::global().getCompress());
     }
   }
   return false;
@@ -187,39 +194,78 @@ bool DataForwarder::connectProxy()
 }
 
 
+///////////////////////////////////////////////////////////////////////
+//Start loading the window of the backlog which begins at 'from'.
+//Returns how many chunks it has, 0 if there are none left before
+//'timenow'.
+static int startWindow(AsyncLoader &loader, timegen_t from, timegen_t timenow)
+{
+  const timegen_t onehour = 3600000000ll;
+  long long starts[BACKLOGCHUNKS], ends[BACKLOGCHUNKS];
+  int num = 0;
+  while (num<BACKLOGCHUNKS && timenow-(from+num*onehour)>onehour) {
+    starts[num] = from + num*onehour;
+    ends[num] = starts[num] + onehour;
+    num++;
+  }
+  if (num==0 || !loader.startMany(starts, ends, num, false)) return 0;
+  return num;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Delete the chunks of a window
+static void freeChunks(IntegPeriod **chunks, int num)
+{
+  for (int c=0; c<num; c++) {
+    if (chunks[c]!=NULL) delete[] chunks[c];
+    chunks[c] = NULL;
+  }
+}
+
+
 ///////////////////////////////////////////////////////////////////////
 //Play "Catch-up" to send a backlog of data to the proxy
 bool DataForwarder::sendBackLog()
 {
-  IntegPeriod *thischunk=NULL;
-  int thischunksize=0;
-
-  //We do the catching up in 1 hour chunks
+  //We do the catching up in 1 hour chunks. Several are asked for at
+  //once over the one connection, so the server can work on them
+  //together, and the next window of them loads in the background while
+  //we send the last one on to the proxy.
   const timegen_t onehour = 3600000000ll;
   timegen_t timenow = getAbs();
 
+  if (timenow-itsLastSent<=onehour) {
+    return itsProxy.good() && !itsProxy.eof();
+  }
+  if (!itsServer.rdbuf()->is_open()) {
+    cerr << "YIKES####";
+    return false;
+  }
 
-
-  while (timenow-itsLastSent>onehour) {
-    if (!itsServer.rdbuf()->is_open()) {
-      cerr << "YIKES####";
-      return false;
-    }
-
-    //Load the data from the telescope data server
-    IntegPeriod::load(thischunk, thischunksize,
-		      itsLastSent, itsLastSent+onehour,
-		      itsServer, false);
+  //Anything it is still loading when we give up is waited for and
+  //thrown away when it goes
+  AsyncLoader loader(itsServer);
+  IntegPeriod *chunks[BACKLOGCHUNKS];
+  int sizes[BACKLOGCHUNKS];
+  int num = startWindow(loader, itsLastSent, timenow);
+  while (num>0) {
+    loader.takeMany(chunks, sizes);
     if (!itsServer.rdbuf()->is_open()) {
       cerr << "FOOBAR!!";
+      freeChunks(chunks, num);
       return false;
     }
 
     //Advance the time counter, whether we got data or not
-    itsLastSent += onehour;
+    itsLastSent += num*onehour;
+    int next = startWindow(loader, itsLastSent, timenow);
 
     //If we got data, send it on to the proxy server
-    if (thischunk!=NULL && thischunksize>0) {
+    for (int c=0; c<num && itsLastSent!=-1; c++) {
+      IntegPeriod *thischunk = chunks[c];
+      int thischunksize = sizes[c];
+      if (thischunk==NULL || thischunksize<=0) continue;
       itsProxy << "SENDING " << thischunksize << endl;
       for (int i=0; i<thischunksize; i++) {
 	itsProxy << thischunk[i];
@@ -227,13 +273,13 @@ bool DataForwarder::sendBackLog()
 	  //Reset this so that we ask the server again next time
 	  itsLastSent = -1;
 	  cerr << "Lost connection to proxy server\n";
-          break;
+	  break;
 	}
       }
-      delete[] thischunk;
-      thischunk = NULL;
-      thischunksize=0;
     }
+    freeChunks(chunks, num);
+    if (itsLastSent==-1) return false;
+    num = next;
   }
 
   if (!itsProxy.good() || itsProxy.eof()) return false;
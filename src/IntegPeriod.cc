@@ -15,12 +15,26 @@
 #include <IntegPeriod.h>
 #include <TimeCoord.h>
 #include <RFI.h>
+#include <TimeAlign.h>
+#include <AudioCodec.h>
+#include <ArchiveMap.h>
+#include <RecordV2.h>
+#include <Frame.h>
+#include <ServerPool.h>
 #include <sstream>
 #include <iostream>
 #include <string>
 #include <time.h>
+#include <string.h>
+#include <stdlib.h>
+#include <utility>
+#include <pthread.h>
+#include <unistd.h>
 #include <assert.h>
 
+//Largest number of audio samples per channel we will believe when reading
+#define MAXAUDIOLEN (1<<24)
+
 ///////////////////////////////////////////////////////////////////////
 //Constructor
 IntegPeriod::IntegPeriod()
@@ -43,6 +57,46 @@ IntegPeriod::IntegPeriod()
 }
 
 
+///////////////////////////////////////////////////////////////////////
+//Copy constructor
+IntegPeriod::IntegPeriod(const IntegPeriod &rhs)
+  :audioLen(0),
+  rawAudio(0),
+  numBins(-1),
+  input1Spec(0),
+  input2Spec(0),
+  crossSpec(0),
+  phaseSpec(0),
+  audio1(0),
+  audio2(0)
+{
+  *this = rhs;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Move constructor
+IntegPeriod::IntegPeriod(IntegPeriod &&rhs)
+  :audioLen(0),
+  rawAudio(0),
+  numBins(-1),
+  input1Spec(0),
+  input2Spec(0),
+  crossSpec(0),
+  phaseSpec(0),
+  power1(0.0),
+  power2(0.0),
+  powerX(0.0),
+  amplitude(0.0),
+  phase(0.0),
+  RFI(false),
+  audio1(0),
+  audio2(0)
+{
+  swap(rhs);
+}
+
+
 ///////////////////////////////////////////////////////////////////////
 //Destructor
 IntegPeriod::~IntegPeriod()
@@ -194,57 +248,125 @@ ostream &operator<<(ostream& os, IntegPeriod& per)
 }
 
 ///////////////////////////////////////////////////////////////////////
-//Operator for saving to a file
-ofstream &operator<<(ofstream& os, const IntegPeriod& per)
+//Serialise the fixed fields at the start of a record
+int IntegPeriod::encodeHeader(const IntegPeriod &per, int len, char *buf)
+{
+  char *p = buf;
+  memcpy(p, &len, sizeof(int));                 p += sizeof(int);
+  memcpy(p, &per.timeStamp, sizeof(long long)); p += sizeof(long long);
+  memcpy(p, &per.powerX, sizeof(float));        p += sizeof(float);
+  memcpy(p, &per.power1, sizeof(float));        p += sizeof(float);
+  memcpy(p, &per.power2, sizeof(float));        p += sizeof(float);
+  memcpy(p, &per.amplitude, sizeof(float));     p += sizeof(float);
+  memcpy(p, &per.phase, sizeof(float));         p += sizeof(float);
+  memcpy(p, &per.numBins, sizeof(int));         p += sizeof(int);
+  //Flag interference and which spectra will follow
+  *p++ = per.RFI        ? 'R' : ' ';
+  *p++ = per.phaseSpec  ? 'P' : ' ';
+  *p++ = per.crossSpec  ? 'X' : ' ';
+  *p++ = per.input1Spec ? '1' : ' ';
+  *p++ = per.input2Spec ? '2' : ' ';
+  return p-buf;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Serialise a period into 'buf' and return its length, or just return
+//the length if 'buf' is NULL. If 'packed' isn't NULL it holds the
+//compressed audio, which is marked by writing the audio length as a
+//negative number followed by the encoded length.
+static int encodeRecord(const IntegPeriod &per, char *buf,
+			const char *packed, int packedlen)
 {
+  const float *spec[4] = {per.phaseSpec, per.crossSpec,
+			  per.input1Spec, per.input2Spec};
+  int speclen = per.numBins*sizeof(float);
   //Caclculate the total length we will save to assist
   //with faster seeks through large files
-  int len = sizeof(long long) + 5*sizeof(float)
-    + 3*sizeof(int) + 5;
-  if (per.phaseSpec)  len += per.numBins*sizeof(float);
-  if (per.crossSpec)  len += per.numBins*sizeof(float);
-  if (per.input1Spec) len += per.numBins*sizeof(float);
-  if (per.input2Spec) len += per.numBins*sizeof(float);
-  if (per.rawAudio)   len += 2*sizeof(audio_t)*per.audioLen;
-
-  //Write the size to the file
-  os.write((char*)&len, sizeof(int));
-
-  //Write the timestamp
-  os.write((char*)&per.timeStamp, sizeof(long long));
-  //Write the powers
-  os.write((char*)&per.powerX, sizeof(float));
-  os.write((char*)&per.power1, sizeof(float));
-  os.write((char*)&per.power2, sizeof(float));
-  os.write((char*)&per.amplitude, sizeof(float));
-  os.write((char*)&per.phase,     sizeof(float));
-  //Write the number of spectral channels
-  os.write((char*)&per.numBins, sizeof(int));
-  //Write if the block has identified interference
-  if (per.RFI)  os << "R"; else os << " ";
-  //Write out which spectra we will be saving
-  if (per.phaseSpec)  os << "P"; else os << " ";
-  if (per.crossSpec)  os << "X"; else os << " ";
-  if (per.input1Spec) os << "1"; else os << " ";
-  if (per.input2Spec) os << "2"; else os << " ";
-  //Write out the spectral data
-  if (per.phaseSpec)
-    os.write((char*)per.phaseSpec,  per.numBins*sizeof(float));
-  if (per.crossSpec)
-    os.write((char*)per.crossSpec,  per.numBins*sizeof(float));
-  if (per.input1Spec)
-    os.write((char*)per.input1Spec, per.numBins*sizeof(float));
-  if (per.input2Spec)
-    os.write((char*)per.input2Spec, per.numBins*sizeof(float));
-  //Write out the raw audio data
-  if (per.rawAudio) {
-    os.write((char*)&per.audioLen, sizeof(int));
-    os.write((char*)per.rawAudio, 2*sizeof(audio_t)*per.audioLen);
+  int len = sizeof(long long) + 5*sizeof(float) + 3*sizeof(int) + 5;
+  for (int i=0; i<4; i++) {
+    if (spec[i]) len += speclen;
+  }
+  if (packed)            len += sizeof(int) + packedlen;
+  else if (per.rawAudio) len += 2*sizeof(audio_t)*per.audioLen;
+  if (buf==NULL) return len;
+
+  char *p = buf + IntegPeriod::encodeHeader(per, len, buf);
+  for (int i=0; i<4; i++) {
+    if (spec[i]==NULL) continue;
+    memcpy(p, spec[i], speclen);
+    p += speclen;
+  }
+  int temp;
+  if (packed) {
+    temp = -per.audioLen;
+    memcpy(p, &temp, sizeof(int));       p += sizeof(int);
+    memcpy(p, &packedlen, sizeof(int));  p += sizeof(int);
+    memcpy(p, packed, packedlen);
+  } else if (per.rawAudio) {
+    memcpy(p, &per.audioLen, sizeof(int)); p += sizeof(int);
+    memcpy(p, per.rawAudio, 2*sizeof(audio_t)*per.audioLen);
   } else {
-    int temp = 0;
-    os.write((char*)&temp, sizeof(int));
+    temp = 0;
+    memcpy(p, &temp, sizeof(int));
+  }
+  return len;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Return the serialised length of the period without compression
+int IntegPeriod::encodedSize(const IntegPeriod &per)
+{
+  return encodeRecord(per, NULL, NULL, 0);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Serialise the period without compression
+char *IntegPeriod::encode(const IntegPeriod &per, char *buf)
+{
+  return buf + encodeRecord(per, buf, NULL, 0);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Write an integration period to any kind of output stream. If 'packaudio'
+//is set any raw audio is compressed. The record is built up in memory
+//and handed to the stream with a single write.
+template <class T>
+static void writePeriod(T &os, const IntegPeriod &per, bool packaudio)
+{
+  //Compress the audio first so we know how long the record will be
+  char *packed = NULL;
+  int packedsize = 0, packedlen = 0;
+  if (packaudio && per.rawAudio && per.audioLen>0) {
+    AudioCodec::encode(per.rawAudio, per.audioLen,
+		       packed, packedsize, packedlen);
+    if (packedlen+(int)sizeof(int) >= 2*(int)sizeof(audio_t)*per.audioLen) {
+      //Didn't help, save it as it is
+      delete[] packed;
+      packed = NULL;
+    }
   }
 
+  //Small records are built on the stack
+  char stackbuf[4096];
+  int len = encodeRecord(per, NULL, packed, packedlen);
+  char *buf = (len<=(int)sizeof(stackbuf)) ? stackbuf : new char[len];
+  encodeRecord(per, buf, packed, packedlen);
+  os.write(buf, len);
+
+  if (buf!=stackbuf) delete[] buf;
+  if (packed!=NULL) delete[] packed;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Operator for saving to a file
+ofstream &operator<<(ofstream& os, const IntegPeriod& per)
+{
+  writePeriod(os, per, false);
   return os;
 }
 
@@ -253,65 +375,26 @@ ofstream &operator<<(ofstream& os, const IntegPeriod& per)
 //Operator for writing across network
 TCPstream &operator<<(TCPstream& os, const IntegPeriod& per)
 {
-  //Caclculate the total length we will save to assist
-  //with faster seeks through large files
-  int len = sizeof(long long) + 5*sizeof(float)
-    + 3*sizeof(int) + 5;
-  if (per.phaseSpec)  len += per.numBins*sizeof(float);
-  if (per.crossSpec)  len += per.numBins*sizeof(float);
-  if (per.input1Spec) len += per.numBins*sizeof(float);
-  if (per.input2Spec) len += per.numBins*sizeof(float);
-  if (per.rawAudio)   len += 2*sizeof(audio_t)*per.audioLen;
-
-  //Write the size to the file
-  os.write((char*)&len, sizeof(int));
-
-  //Write the timestamp
-  os.write((char*)&per.timeStamp, sizeof(long long));
-  //Write the powers
-  os.write((char*)&per.powerX, sizeof(float));
-  os.write((char*)&per.power1, sizeof(float));
-  os.write((char*)&per.power2, sizeof(float));
-  os.write((char*)&per.amplitude, sizeof(float));
-  os.write((char*)&per.phase,     sizeof(float));
-  //Write the number of spectral channels
-  os.write((char*)&per.numBins, sizeof(int));
-  //Write if the block has identified interference
-  if (per.RFI)  os << "R"; else os << " ";
-  //Write out which spectra we will be saving
-  if (per.phaseSpec)  os << "P"; else os << " ";
-  if (per.crossSpec)  os << "X"; else os << " ";
-  if (per.input1Spec) os << "1"; else os << " ";
-  if (per.input2Spec) os << "2"; else os << " ";
-  //Write out the spectral data
-  if (per.phaseSpec)
-    os.write((char*)per.phaseSpec,  per.numBins*sizeof(float));
-  if (per.crossSpec)
-    os.write((char*)per.crossSpec,  per.numBins*sizeof(float));
-  if (per.input1Spec)
-    os.write((char*)per.input1Spec, per.numBins*sizeof(float));
-  if (per.input2Spec)
-    os.write((char*)per.input2Spec, per.numBins*sizeof(float));
-  //Write out the raw audio data
-  if (per.rawAudio) {
-    os.write((char*)&per.audioLen, sizeof(int));
-    os.write((char*)per.rawAudio, 2*sizeof(audio_t)*per.audioLen);
-  } else {
-    int temp = 0;
-    os.write((char*)&temp, sizeof(int));
-  }
-
+  writePeriod(os, per, false);
   return os;
 }
 
 
+///////////////////////////////////////////////////////////////////////
+//Save to any stream, optionally compressing the audio
+void IntegPeriod::save(ostream &os, const IntegPeriod &per, bool packaudio)
+{
+  writePeriod(os, per, packaudio);
+}
+
+
 ///////////////////////////////////////////////////////////////////////
 //Operator for recovering from a serialised state
 istream &operator>>(istream& is, IntegPeriod& per)
 {
-  int tempint;
-  //Read how many bytes, though we don't use it here
-  is.read((char*)&tempint, sizeof(int));
+  int reclen, tempint;
+  //Read how many bytes, which lets us skip a record we can't parse
+  is.read((char*)&reclen, sizeof(int));
   //Read in the time stamp
   is.read((char*)&per.timeStamp, sizeof(long long));
   //Read in the powers
@@ -324,44 +407,25 @@ istream &operator>>(istream& is, IntegPeriod& per)
   //Read the number of spectral channels
   is.read((char*)&per.numBins, sizeof(int));
   //Determine which frequency spectra were saved
-  char tempchar;
-  is.read((char*)&tempchar, sizeof(char));
-  if (tempchar=='R') per.RFI = true;
-  else if (tempchar!=' ') {
-    //cerr << "R:PARSE ERROR WHILE LOADING IntegPeriod (" << tempchar <<")\n";
-    return is;
-  } else {
-      per.RFI = false;
-  }
-
-  bool getP = false;
-  is.read((char*)&tempchar, sizeof(char));
-  if (tempchar=='P') getP = true;
-  else if (tempchar!=' ') {
-    //cerr << "P:PARSE ERROR WHILE LOADING IntegPeriod (" << tempchar <<")\n";
-    return is;
-  }
-  bool getX = false;
-  is.read((char*)&tempchar, sizeof(char));
-  if (tempchar=='X') getX = true;
-  else if (tempchar!=' ') {
-    //cerr << "X:PARSE ERROR WHILE LOADING IntegPeriod\n";
-    return is;
-  }
-  bool get1 = false;
-  is.read((char*)&tempchar, sizeof(char));
-  if (tempchar=='1') get1 = true;
-  else if (tempchar!=' ') {
-    //cerr << "1:PARSE ERROR WHILE LOADING IntegPeriod\n";
-    return is;
-  }
-  bool get2 = false;
-  is.read((char*)&tempchar, sizeof(char));
-  if (tempchar=='2') get2 = true;
-  else if (tempchar!=' ') {
-    //cerr << "2:PARSE ERROR WHILE LOADING IntegPeriod\n";
+  char flags[5];
+  is.read(flags, 5);
+  if (!is.good()) return is;
+  if ((flags[0]!='R' && flags[0]!=' ') || (flags[1]!='P' && flags[1]!=' ') ||
+      (flags[2]!='X' && flags[2]!=' ') || (flags[3]!='1' && flags[3]!=' ') ||
+      (flags[4]!='2' && flags[4]!=' ')) {
+    //Skip the rest of the record so the stream stays on a record
+    //boundary, and let the caller know this one was bad
+    if (reclen>IntegPeriod::theirHeaderLen) {
+      is.ignore(reclen-IntegPeriod::theirHeaderLen);
+    }
+    is.setstate(ios::failbit);
     return is;
   }
+  per.RFI = flags[0]=='R';
+  bool getP = flags[1]=='P';
+  bool getX = flags[2]=='X';
+  bool get1 = flags[3]=='1';
+  bool get2 = flags[4]=='2';
   //Load those spectra which were saved
   if (per.phaseSpec) delete[] per.phaseSpec;
   if (per.crossSpec) delete[] per.crossSpec;
@@ -385,10 +449,37 @@ istream &operator>>(istream& is, IntegPeriod& per)
   }
   //Read length of audio which was saved
   is.read((char*)&tempint, sizeof(int));
-  per.audioLen = tempint;
-  if (tempint != 0) {
+  if (per.rawAudio) {
+    delete[] per.rawAudio;
+    per.rawAudio = 0;
+  }
+  if (tempint>0) {
+    per.audioLen = tempint;
     per.rawAudio = new audio_t[2*tempint];
     is.read((char*)per.rawAudio, 2*sizeof(audio_t)*per.audioLen);
+  } else if (tempint<0) {
+    //The audio was compressed, read and decode it
+    int packedlen;
+    is.read((char*)&packedlen, sizeof(int));
+    if (!is.good() || tempint<-MAXAUDIOLEN || packedlen<0 ||
+	packedlen>(int)(2*sizeof(audio_t)*MAXAUDIOLEN)) {
+      is.setstate(ios::failbit);
+      return is;
+    }
+    char *packed = new char[packedlen];
+    is.read(packed, packedlen);
+    per.audioLen = -tempint;
+    per.rawAudio = new audio_t[2*per.audioLen];
+    if (!is.good() ||
+	!AudioCodec::decode(packed, packedlen, per.rawAudio, per.audioLen)) {
+      delete[] per.rawAudio;
+      per.rawAudio = 0;
+      per.audioLen = 0;
+      is.setstate(ios::failbit);
+    }
+    delete[] packed;
+  } else {
+    per.audioLen = 0;
   }
   return is;
 }
@@ -608,8 +699,33 @@ signed long long IntegPeriod::operator-(IntegPeriod &rhs)
 
 
 ///////////////////////////////////////////////////////////////////////
+//Copy 'len' elements into 'dst', which currently holds 'oldlen'. The
+//existing array is reused if it is already the right size.
+template <class T>
+static void copyBlock(T *&dst, int oldlen, const T *src, int len)
+{
+  if (src==NULL) {
+    if (dst) delete[] dst;
+    dst = NULL;
+    return;
+  }
+  if (len<0) len = 0;
+  if (dst==NULL || oldlen!=len) {
+    if (dst) delete[] dst;
+    dst = new T[len];
+  }
+  memcpy(dst, src, len*sizeof(T));
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Copy another period, reusing our existing buffers where they fit
 void IntegPeriod::operator=(const IntegPeriod &rhs)
 {
+  if (&rhs==this) return;
+  int oldbins = numBins;
+  int oldaudio = audioLen;
+
   numBins = rhs.numBins;
   timeStamp = rhs.timeStamp;
   RFI = rhs.RFI;
@@ -620,103 +736,87 @@ void IntegPeriod::operator=(const IntegPeriod &rhs)
   amplitude = rhs.amplitude;
   phase = rhs.phase;
 
-  //Ensure we remove old data
-  if (phaseSpec) {
-    delete[] phaseSpec;
-    phaseSpec=0;
-  }
-  if (crossSpec) {
-    delete[] crossSpec;
-    crossSpec=0;
-  }
-  if (input1Spec) {
-    delete[] input1Spec;
-    input1Spec=0;
-  }
-  if (input2Spec) {
-    delete[] input2Spec;
-    input2Spec=0;
-  }
-  if (rawAudio) {
-    delete[] rawAudio;
-    rawAudio=0;
-  }
+  copyBlock(phaseSpec, oldbins, rhs.phaseSpec, numBins);
+  copyBlock(crossSpec, oldbins, rhs.crossSpec, numBins);
+  copyBlock(input1Spec, oldbins, rhs.input1Spec, numBins);
+  copyBlock(input2Spec, oldbins, rhs.input2Spec, numBins);
+  copyBlock(rawAudio, 2*oldaudio, rhs.rawAudio, 2*audioLen);
+}
 
-  //Copy the frequency spectra
-  if (rhs.phaseSpec) {
-    phaseSpec = new float[numBins];
-    for (int i=0; i<numBins; i++)
-      phaseSpec[i] = rhs.phaseSpec[i];
-  }
-  if (rhs.crossSpec) {
-    crossSpec = new float[numBins];
-    for (int i=0; i<numBins; i++)
-      crossSpec[i] = rhs.crossSpec[i];
-  }
-  if (rhs.input1Spec) {
-    input1Spec = new float[numBins];
-    for (int i=0; i<numBins; i++)
-      input1Spec[i] = rhs.input1Spec[i];
-  }
-  if (rhs.input2Spec) {
-    input2Spec = new float[numBins];
-    for (int i=0; i<numBins; i++)
-      input2Spec[i] = rhs.input2Spec[i];
-  }
-  if (rhs.rawAudio) {
-    int len = 2*audioLen;
-    rawAudio = new audio_t[len];
-    for (int i=0; i<len; i++)
-      rawAudio[i] = rhs.rawAudio[i];
-  }
+
+///////////////////////////////////////////////////////////////////////
+//Take over the spectra and audio of another period
+void IntegPeriod::operator=(IntegPeriod &&rhs)
+{
+  if (&rhs==this) return;
+  swap(rhs);
+  //Free what we used to hold now, rather than when rhs is destroyed
+  rhs.keepOnly(false, false, false);
+  if (rhs.audio1) delete[] rhs.audio1;
+  if (rhs.audio2) delete[] rhs.audio2;
+  rhs.audio1 = rhs.audio2 = NULL;
+  rhs.audioLen = 0;
+  rhs.numBins = -1;
 }
 
 
+///////////////////////////////////////////////////////////////////////
+//Exchange everything with another period
+void IntegPeriod::swap(IntegPeriod &rhs)
+{
+#define SWAPMEMBER(type, m) { type t = m; m = rhs.m; rhs.m = t; }
+  SWAPMEMBER(int, audioLen);
+  SWAPMEMBER(audio_t*, rawAudio);
+  SWAPMEMBER(long long, timeStamp);
+  SWAPMEMBER(int, numBins);
+  SWAPMEMBER(float*, input1Spec);
+  SWAPMEMBER(float*, input2Spec);
+  SWAPMEMBER(float*, crossSpec);
+  SWAPMEMBER(float*, phaseSpec);
+  SWAPMEMBER(float, power1);
+  SWAPMEMBER(float, power2);
+  SWAPMEMBER(float, powerX);
+  SWAPMEMBER(float, amplitude);
+  SWAPMEMBER(float, phase);
+  SWAPMEMBER(bool, RFI);
+  SWAPMEMBER(float*, audio1);
+  SWAPMEMBER(float*, audio2);
+#undef SWAPMEMBER
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Return a full copy of the period
+IntegPeriod IntegPeriod::clone() const
+{
+  return IntegPeriod(*this);
+}
+
+
+//Loads raw data over a connection from the ServerPool
+class RawRequest : public PoolRequest {
+public:
+  RawRequest(long long start, long long end)
+  :itsStart(start), itsEnd(end), data(NULL), count(0), samprate(0) {}
+  bool run(TCPstream &sock) {
+    return IntegPeriod::loadraw(data, count, itsStart, itsEnd, samprate, sock);
+  }
+  long long itsStart, itsEnd;
+  IntegPeriod *data;
+  int count;
+  int samprate;
+};
+
+
 bool IntegPeriod::loadraw(IntegPeriod *&data, int &count,
 			  long long start, long long end,
                           int &samprate, const char *server, int port)
 {
-  count = 0;
-  data = NULL;
-  bool res = false;
-
-  SocketAddr server_addr = SocketAddr(IPaddress(server), port);
-
-  int listening_socket = socket(AF_INET,SOCK_STREAM,0);
-  if( listening_socket < 0 )
-    CurrentNetCallback::on_error("Socket creation error");
-
-  int value = 1;
-  if( setsockopt(listening_socket, SOL_SOCKET, SO_REUSEADDR,
-		 (char*)&value, sizeof(value)) < 0 )
-    CurrentNetCallback::on_error("setsockopt SO_REUSEADDR error");
-
-  TCPstream dsrc;
-  if (dsrc.rdbuf()->connect(server_addr)!=NULL) {
-      dsrc.rdbuf()->set_blocking_io(true);
-
-      if (dsrc.good() && dsrc.rdbuf()->is_open() && !dsrc.eof()) {
-	  //load the data
-	  res = loadraw(data,count,start,end,samprate,dsrc);
-	  //Ensure network connection is closed
-	  dsrc.flush();
-	  if (dsrc.good()) {
-	      dsrc.close();
-	      cerr << "CLOSED CONNECTION\n";
-	  }
-      } else {
-	  //dsrc.close();
-	  dsrc.rdbuf()->close();
-	  cerr << "CLOSED AFTER ERROR 1\n";
-	  res = false;
-      }
-  } else {
-      dsrc.close();
-      //dsrc.rdbuf()->close();
-      cerr << "CLOSED AFTER ERROR 2\n";
-      res = false;
-  }
-
+  RawRequest req(start, end);
+  bool res = ServerPool::global().perform(server, port, req);
+  data = req.data;
+  count = req.count;
+  if (res) samprate = req.samprate;
   return res;
 }
 
@@ -729,181 +829,467 @@ bool IntegPeriod::loadraw(IntegPeriod *&data, int &count,
   count = 0;
 
   if (sock.good()) {
+      int version = negotiate(sock);
+      if (version==0) return false;
       //Request the data from the network server
       sock << "RAW-BETWEEN " << start << " " << end << endl;
+      if (version<12) {
+	  //An older server sends the count first, then the rate
+	  if (!readCounted(data, count, sock, &samprate)) return false;
+      } else {
+	  //Read the sampling rate
+	  char line[1001];
+	  line[1000] = '\0';
+	  sock.getline(line, 1000);
+	  if (!sock.good() || strncmp(line, "RATE ", 5)!=0) {
+	      cerr << "ERROR reading from network\n";
+	      return false;
+	  }
+	  samprate = atoi(line+5);
 
-      //Read their response line, how many periods will it be sending
-      char line[1001];
-      line[1000] = '\0';
-      sock.getline(line, 1000);
-      istringstream countstr(line);
-      countstr >> count;
-
-      if (count<0 || count>10000000) {
-	  cerr << "Silly count returned by server (" << count << ")\n";
-	  return false;
+	  if (!readChunks(data, count, sock)) return false;
       }
       if (count==0) {
 	  cerr << "Server returned no data for the specified period\n";
-	  return true;
-      }
-
-      cerr << "Server will return " << count << " integration periods\n";
-      data = new IntegPeriod[count];
-
-      //Read the sampling rate
-      sock >> samprate;
-
-      //Some var's to give download %age statistics
-      float printstep = 0.05;
-      float nextprint = 0.0;
-
-      //Read each integration period from the network server
-      for (int i=0; i<count; i++) {
-	  sock >> data[i];
-	  if (!sock.good()) {
-	      cerr << "ERROR reading from network\n";
-	      delete[] data;
-	      return false;
-	  }
-	  if (i/float(count) >= nextprint) {
-	      if (nextprint!=0.0) {
-		cout << "\b\b\b\b\b\b\b\b\b\b\b\b\b\b";
-	      }
-	      cout << (int)(100*i/float(count)) << "%" << flush;
-              nextprint += printstep;
-	  }
+      } else {
+	  cerr << "Server returned " << count << " integration periods\n";
       }
-      cout << "\b\b\b\b\b\b\b\b\b\b\b\b";
-      cout << "100%  OK\n";
-      cerr << "OK\n";
       return true;
   } else return false;
 }
 
 
+//Loads data over a connection from the ServerPool
+class LoadRequest : public PoolRequest {
+public:
+  LoadRequest(long long start, long long end, int preprocess)
+  :itsStart(start), itsEnd(end), itsPreprocess(preprocess),
+  data(NULL), count(0) {}
+  bool run(TCPstream &sock) {
+    return IntegPeriod::load(data, count, itsStart, itsEnd, sock,
+			     itsPreprocess);
+  }
+  long long itsStart, itsEnd;
+  int itsPreprocess;
+  IntegPeriod *data;
+  int count;
+};
+
+
 bool IntegPeriod::load(IntegPeriod *&data, int &count,
 		       long long start, long long end,
 		       const char *server, int port,
-		       bool preprocess)
+		       int preprocess)
 {
-  count = 0;
-  data = NULL;
-  bool res = false;
-
-  SocketAddr server_addr = SocketAddr(IPaddress(server), port);
-
-  int listening_socket = socket(AF_INET,SOCK_STREAM,0);
-  if( listening_socket < 0 )
-    CurrentNetCallback::on_error("Socket creation error");
-
-  int value = 1;
-  if( setsockopt(listening_socket, SOL_SOCKET, SO_REUSEADDR,
-		 (char*)&value, sizeof(value)) < 0 )
-    CurrentNetCallback::on_error("setsockopt SO_REUSEADDR error");
-
-  TCPstream dsrc;
-  if (dsrc.rdbuf()->connect(server_addr)!=NULL) {
-      dsrc.rdbuf()->set_blocking_io(true);
-
-      if (dsrc.good() && dsrc.rdbuf()->is_open() && !dsrc.eof()) {
-	  //load the data
-	  res = load(data,count,start,end,dsrc,preprocess);
-	  //Ensure network connection is closed
-	  dsrc.flush();
-	  if (dsrc.good()) {
-	      dsrc.close();
-	      cerr << "CLOSED CONNECTION\n";
-	  }
-      } else {
-	  //dsrc.close();
-	  dsrc.rdbuf()->close();
-	  cerr << "CLOSED AFTER ERROR 1\n";
-	  res = false;
-      }
-  } else {
-      dsrc.close();
-      //dsrc.rdbuf()->close();
-      cerr << "CLOSED AFTER ERROR 2\n";
-      res = false;
-  }
-
+  LoadRequest req(start, end, preprocess);
+  bool res = ServerPool::global().perform(server, port, req);
+  data = req.data;
+  count = req.count;
   return res;
 }
 
 bool IntegPeriod::load(IntegPeriod *&data, int &count,
 		       long long start, long long end,
-		       TCPstream &sock, bool preprocess)
+		       TCPstream &sock, int preprocess)
 {
   data = NULL;
   count = 0;
 
   if (sock.good()) {
-      //Request the data from the network server
-      sock << "BETWEEN " << start << " "<< end << " 0 0 0 ";
-      if (preprocess) sock << "1\n";
-      else sock << "0\n";
-
-      //Read their response line, how many periods will it be sending
-      char line[1001];
-      line[1000] = '\0';
-      sock.getline(line, 1000);
-      istringstream countstr(line);
-      countstr >> count;
-
-      if (count<0 || count>10000000) {
-	  cerr << "Silly count returned by server (" << count << ")\n";
-	  return false;
+      //Request the data from the network server. With protocol 1.2 it
+      //sends the periods as it reads them rather than all at the end.
+      int version = negotiate(sock);
+      if (version==0) return false;
+      sock << "BETWEEN " << start << " "<< end << " 0 0 0 "
+	   << preprocess << "\n";
+
+      if (version<12) {
+	  if (!readCounted(data, count, sock)) return false;
+      } else {
+	  if (!readChunks(data, count, sock)) return false;
       }
       if (count==0) {
 	  cerr << "Server returned no data for the specified period\n";
-	  return true;
+      } else {
+	  cout << "Server returned " << count << " integration periods\n";
       }
+      return true;
+  } else return false;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Ask the server for a version of the protocol and wait for its reply,
+//which is returned times ten or 0 if the connection failed. If
+//'compress' is set the server is also asked to compress what it sends,
+//unless it is already doing so.
+static int askProtocol(TCPstream &sock, const char *version, bool compress)
+{
+  bool compressed = sock.rdbuf()->decompressing();
+  //Older servers ignore anything after the version
+  sock << "PROTOCOL " << version;
+  if (compress && !compressed) sock << " zlib";
+  sock << "\n";
+  sock.flush();
+
+  char line[1001];
+  line[1000] = '\0';
+  sock.getline(line, 1000);
+  if (!sock.good()) return 0;
+  istringstream reply(line);
+  string word, option;
+  float agreed = 0;
+  reply >> word >> agreed;
+  if (reply.fail() || word!="PROTOCOL") {
+      cerr << "Strange reply from server (" << line << ")\n";
+      sock.setstate(ios::badbit);
+      return 0;
+  }
+  reply >> option;
+  //The reply itself wasn't compressed but everything after it is
+  if (option=="zlib" && !compressed) sock.rdbuf()->decompress_input();
+  return (int)(10*agreed+0.5);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Agree on the protocol with the server if it hasn't been already
+int IntegPeriod::negotiate(TCPstream &sock, bool compress)
+{
+  int version = sock.rdbuf()->get_protocol();
+  if (version>0) return version;
+  if (!sock.good()) return 0;
+
+  version = askProtocol(sock, "1.2", compress);
+  if (version==0) {
+      cerr << "Server closed the connection when asked for protocol 1.2\n";
+      return 0;
+  }
+  version = (version>=12) ? 12 : 11;
+  sock.rdbuf()->set_protocol(version);
+  return version;
+}
 
-      cout << "Server will return " << count << " integration periods\n";
-      data = new IntegPeriod[count];
 
-      float printstep = 0.05;
-      float nextprint = 0.0;
+///////////////////////////////////////////////////////////////////////
+//Agree on the protocol for a new connection, connecting again if the
+//server is too old to know how
+bool IntegPeriod::negotiate(TCPstream &sock, const SocketAddr &addr,
+			    bool compress)
+{
+  if (negotiate(sock, compress)>0) return true;
+  if (sock.rdbuf()->expired()) return false;
+
+  cerr << "Connecting again to use protocol 1.1\n";
+  if (sock.rdbuf()->is_open()) sock.close();
+  sock.clear();
+  if (sock.rdbuf()->connect(addr)==NULL) return false;
+  sock.rdbuf()->set_blocking_io(true);
+  sock.rdbuf()->set_protocol(11);
+  return sock.good();
+}
+
 
-      //Read each integration period from the network server
-      for (int i=0; i<count; i++) {
-	  if (i/float(count) >= nextprint) {
-	      if (nextprint!=0.0) {
-		cout << "\b\b\b\b\b\b\b\b\b\b\b\b\b\b";
-	      }
-	      cout << (int)(100*i/float(count)) << "%" << flush;
-              nextprint += printstep;
+///////////////////////////////////////////////////////////////////////
+//Make sure the array holding 'count' periods has room for 'need',
+//doubling its size so we don't copy too often
+static void makeRoom(IntegPeriod *&data, int count, int &size, int need)
+{
+  if (need<=size) return;
+  size = (2*size>need) ? 2*size : need;
+  IntegPeriod *newdata = new IntegPeriod[size];
+  for (int i=0; i<count; i++) newdata[i] = std::move(data[i]);
+  if (data!=NULL) delete[] data;
+  data = newdata;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Read the groups of periods in a protocol 1.2 reply
+bool IntegPeriod::readChunks(IntegPeriod *&data, int &count,
+			     TCPstream &sock)
+{
+  int size = 0;
+  char line[1001];
+  line[1000] = '\0';
+  while (true) {
+      sock.getline(line, 1000);
+      if (!sock.good()) {
+	  cerr << "ERROR reading from network\n";
+	  break;
+      }
+      //The trailer gives the total and whether all went well
+      if (strncmp(line, "END ", 4)==0) {
+	  istringstream trailer(line+4);
+	  int total = -1;
+	  string status;
+	  trailer >> total >> status;
+	  if (status!="OK" || total!=count) {
+	      cerr << "Server reported an error: " << line+4 << endl;
+	      break;
 	  }
-	  sock >> data[i];
-	  if (!sock.good()) {
-	      cerr << "ERROR reading from network\n";
+	  if (count==0 && data!=NULL) {
 	      delete[] data;
-	      return false;
+	      data = NULL;
 	  }
+	  return true;
       }
-      cout << "\b\b\b\b\b\b\b\b\b\b\b\b";
-      cout << "100%  OK\n";
-      return true;
-  } else return false;
+
+      //Otherwise it is the number of periods in the next group
+      int num = -1;
+      istringstream numstr(line);
+      numstr >> num;
+      if (numstr.fail() || num<0 || count+num>10000000) {
+	  cerr << "Silly count returned by server (" << line << ")\n";
+	  break;
+      }
+      makeRoom(data, count, size, count+num);
+      for (int i=0; i<num; i++) {
+	  sock >> data[count];
+	  if (!sock.good()) break;
+	  count++;
+      }
+      if (!sock.good()) {
+	  cerr << "ERROR reading from network\n";
+	  break;
+      }
+  }
+  if (data!=NULL) delete[] data;
+  data = NULL;
+  count = 0;
+  return false;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Read a protocol 1.1 reply
+bool IntegPeriod::readCounted(IntegPeriod *&data, int &count,
+			      TCPstream &sock, int *samprate)
+{
+  //Read their response line, how many periods will it be sending
+  char line[1001];
+  line[1000] = '\0';
+  sock.getline(line, 1000);
+  istringstream countstr(line);
+  countstr >> count;
+
+  if (!sock.good() || countstr.fail() || count<0 || count>10000000) {
+      cerr << "Silly count returned by server (" << line << ")\n";
+      count = 0;
+      return false;
+  }
+  if (count==0) return true;
+
+  if (samprate!=NULL) sock >> *samprate;
+  data = new IntegPeriod[count];
+  for (int i=0; i<count; i++) {
+      sock >> data[i];
+      if (!sock.good()) {
+	  cerr << "ERROR reading from network\n";
+	  delete[] data;
+	  data = NULL;
+	  count = 0;
+	  return false;
+      }
+  }
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Send the server a protocol 2 frame
+void IntegPeriod::sendFrame(TCPstream &sock, unsigned int id, int type,
+			    const string &payload)
+{
+  frame_t frame = {(unsigned int)payload.size(), id, type, 0};
+  char header[FRAME_HEADER];
+  packFrame(frame, header);
+  sock.write(header, FRAME_HEADER);
+  sock.write(payload.data(), payload.size());
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Load several ranges over the one connection
+bool IntegPeriod::loadMany(IntegPeriod **data, int *count,
+			   const long long *start, const long long *end,
+			   int num, TCPstream &sock, int preprocess)
+{
+  for (int i=0; i<num; i++) {
+      data[i] = NULL;
+      count[i] = 0;
+  }
+  if (!sock.good()) return false;
+  if (num<=0) return true;
+
+  //Only ask for protocol 2 once we know the server won't simply close
+  //the connection, and if it doesn't know that either ask for each
+  //range in turn
+  int version = negotiate(sock);
+  if (version==0) return false;
+  //Whether the replies are compressed was settled with the first version
+  if (version>=12) version = askProtocol(sock, "2.0", false);
+  if (version==0) {
+      cerr << "ERROR reading from network\n";
+      return false;
+  }
+  if (version<20) {
+      bool res = true;
+      for (int i=0; i<num && sock.good(); i++) {
+	  if (!load(data[i], count[i], start[i], end[i], sock, preprocess)) {
+	      res = false;
+	  }
+      }
+      return res;
+  }
+
+  //Stay a few requests ahead of the replies. The server won't work on
+  //more than this at once anyway.
+  const int window = 16;
+  int *size = new int[num];
+  bool *ok = new bool[num];
+  for (int i=0; i<num; i++) {
+      size[i] = 0;
+      ok[i] = false;
+  }
+  int sent = 0, done = 0;
+  while (done<num) {
+      for (; sent<num && sent-done<window; sent++) {
+	  ostringstream request;
+	  request << "BETWEEN " << start[sent] << " " << end[sent]
+		  << " 0 0 0 " << preprocess;
+	  sendFrame(sock, sent+1, frame_request, request.str());
+      }
+      sock.flush();
+
+      //Read the next frame, whichever request it belongs to
+      char header[FRAME_HEADER];
+      sock.read(header, FRAME_HEADER);
+      if (!sock.good()) break;
+      frame_t frame;
+      unpackFrame(header, frame);
+      int i = (int)frame.id - 1;
+      if (frame.type==frame_data && i>=0 && i<sent) {
+	  if (frame.count>10000000 || count[i]+(int)frame.count>10000000) {
+	      cerr << "Silly count returned by server (" << frame.count << ")\n";
+	      break;
+	  }
+	  makeRoom(data[i], count[i], size[i], count[i]+frame.count);
+	  for (unsigned int j=0; j<frame.count; j++) {
+	      sock >> data[i][count[i]];
+	      if (!sock.good()) break;
+	      count[i]++;
+	  }
+	  if (!sock.good()) break;
+	  continue;
+      }
+
+      //Anything else has a short message as its payload
+      string payload(frame.length, '\0');
+      if (frame.length>0) sock.read(&payload[0], frame.length);
+      if (!sock.good()) break;
+      if (i<0 || i>=sent) {
+	  cerr << "Server sent an unexpected frame: " << payload << endl;
+	  break;
+      }
+      if (frame.type==frame_end && (int)frame.count==count[i]) {
+	  ok[i] = true;
+      } else {
+	  cerr << "Server reported an error: " << payload << endl;
+      }
+      done++;
+  }
+
+  bool res = (done==num);
+  if (res) {
+      //Go back to lines, so the connection can be used as before
+      sendFrame(sock, num+1, frame_request, "PROTOCOL 1.2");
+      sock.flush();
+      char header[FRAME_HEADER];
+      sock.read(header, FRAME_HEADER);
+      frame_t frame;
+      unpackFrame(header, frame);
+      string payload(sock.good() ? frame.length : 0, '\0');
+      if (sock.good() && frame.length>0 && frame.length<=1000) {
+	  sock.read(&payload[0], frame.length);
+      }
+      if (!sock.good() || frame.type!=frame_end ||
+	  payload!="PROTOCOL 1.2") {
+	  cerr << "Server would not go back to protocol 1.2\n";
+	  res = false;
+      }
+  } else {
+      cerr << "ERROR reading from network\n";
+  }
+  //The connection is no use to anyone else if it is still in protocol 2
+  if (!res) sock.setstate(ios::badbit);
+
+  int total = 0;
+  for (int i=0; i<num; i++) {
+      if (!ok[i]) res = false;
+      if (!ok[i] || count[i]==0) {
+	  if (data[i]!=NULL) delete[] data[i];
+	  data[i] = NULL;
+	  count[i] = 0;
+      }
+      total += count[i];
+  }
+  delete[] size;
+  delete[] ok;
+  cout << "Server returned " << total << " integration periods\n";
+  return res;
 }
 
 
+///////////////////////////////////////////////////////////////////////
+//If there is audio, then reprocess the period and delete the audio.
+//Use the loadraw command if you want to play audio...
+static void reprocessAudio(IntegPeriod &per, bool keepaudio,
+			   bool &firstaudio)
+{
+  if (per.rawAudio!=NULL) {
+    if (firstaudio) {
+      firstaudio = false;
+      cerr << "Found raw audio data: REPROCESSING DATA\n";
+    }
+    per.doCorrelations();
+    if (!keepaudio) {
+      //Free up the memory
+      per.keepOnly(1,1,0);
+    }
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Load all periods from the named file
 bool IntegPeriod::load(IntegPeriod *&data, int &count, const char *infile, bool keepaudio)
 {
   data = NULL;
   count = 0;
 
-  ifstream tfile(infile, ios::in|ios::binary);
-  if (!tfile.good()) {
-    cerr << "ERROR opening " << infile << endl;
-    return false;
+  //Map the file so we can find out how many periods there are
+  ArchiveMap archive;
+  if (!archive.open(infile)) return false;
+
+  //Allocate all of the periods at once and fill them straight from
+  //the mapped file
+  bool firstaudio = true;
+  data = new IntegPeriod[archive.size()];
+  for (int i=0; i<archive.size(); i++) {
+    if (!archive[i].get(data[i])) {
+      cerr << "WARNING: Could not decode the audio for period " << i
+	   << " of " << infile << endl;
+    }
+    reprocessAudio(data[i], keepaudio, firstaudio);
   }
-  bool res = load(data,count,tfile,keepaudio);
-  tfile.close();
-  return res;
+  count = archive.size();
+  return true;
 }
 
+
+///////////////////////////////////////////////////////////////////////
+//Load all periods from the current position of the stream
 bool IntegPeriod::load(IntegPeriod *&data, int &count, ifstream &infile, bool keepaudio)
 {
   data = NULL;
@@ -914,50 +1300,71 @@ bool IntegPeriod::load(IntegPeriod *&data, int &count, ifstream &infile, bool ke
     return false;
   }
 
-  int arrlen = 1;
-  data = new IntegPeriod[arrlen];
-
-  bool firstaudio = true;
-
-  while (infile.good() && !infile.eof() ){//  && count<3600) { //HACK
-    infile >> data[count];
-    if (!infile.good() || infile.eof()) {
-      if (count==0) {
-	cerr << "ERROR2 bad file stream given as argument\n";
-	return false;
-      } else break;
-    }
-    count++;
-
-    //If there is audio, then reprocess the period and delete the
-    //audio. Use the loadraw command if you want to play audio...
-    if (data[count-1].rawAudio!=NULL) {
-      if (firstaudio) {
-        firstaudio = false;
-        cerr << "Found raw audio data: REPROCESSING DATA\n";
-      }
-      data[count-1].doCorrelations();
-      if (!keepaudio) {
-        //Free up the memory
-        data[count-1].keepOnly(1,1,0);
-      }
+  //See which version of the format the file uses
+  streampos start = infile.tellg();
+  char filehdr[sizeof(v2fileheader_t)];
+  infile.read(filehdr, sizeof(filehdr));
+  bool v2 = infile.good() && RecordV2::isFileHeader(filehdr, sizeof(filehdr));
+  infile.clear();
+  if (v2) start += sizeof(v2fileheader_t);
+  infile.seekg(start);
+
+  //Count the periods using their length fields, so that we only
+  //need to allocate the array once
+  int numpers = 0;
+  while (true) {
+    int len;
+    if (v2) {
+      v2header_t hdr;
+      infile.read((char*)&hdr, sizeof(hdr));
+      if (!infile.good() || hdr.magic!=RecordV2::theirMagic ||
+	  hdr.length<sizeof(hdr)) break;
+      len = hdr.length-sizeof(hdr);
+    } else {
+      infile.read((char*)&len, sizeof(int));
+      if (!infile.good() || len<(int)sizeof(int)) break;
+      len -= sizeof(int);
     }
+    infile.seekg(len, ios::cur);
+    if (!infile.good()) break;
+    numpers++;
+  }
+  infile.clear();
+  infile.seekg(start);
+  if (numpers==0) {
+    cerr << "ERROR2 bad file stream given as argument\n";
+    return false;
+  }
 
-    if (count==arrlen) {
-      //time to double the array size
-      arrlen*=2;
-      IntegPeriod *tdata = new IntegPeriod[arrlen];
-      //and copy the old data over
-      for (int i=0; i<count; i++) {
-	tdata[i] = data[i];
+  bool firstaudio = true;
+  data = new IntegPeriod[numpers];
+  for (int i=0; i<numpers && infile.good(); i++) {
+    if (v2) {
+      if (!RecordV2::read(infile, data[count])) {
+	if (infile.eof()) break;
+	//The length was checked above so we can carry on after it
+	cerr << "WARNING: Skipping damaged period " << i << endl;
+	infile.clear();
+	continue;
       }
-      delete[] data;
-      data = tdata;
+    } else {
+      infile >> data[count];
+      if (!infile.good()) break;
     }
+    reprocessAudio(data[count], keepaudio, firstaudio);
+    count++;
+  }
+  if (count==0) {
+    cerr << "ERROR2 bad file stream given as argument\n";
+    delete[] data;
+    data = NULL;
+    return false;
   }
   return true;
 }
 
+///////////////////////////////////////////////////////////////////////
+//Merge two sorted sets of periods, moving them into the result
 void IntegPeriod::merge(IntegPeriod *&resdata, int &rescount,
 			IntegPeriod *data1, int count1,
 			IntegPeriod *data2, int count2)
@@ -967,112 +1374,456 @@ void IntegPeriod::merge(IntegPeriod *&resdata, int &rescount,
 
   int c1=0, c2=0;
   for (int i=0; i<rescount; i++) {
-    if (c1<count1 && c2<count2 && data1[c1].timeStamp<=data2[c2].timeStamp) {
-      resdata[i] = data1[c1];
-      c1++;
-    } else if (c1<count1 && c2<count2 && data1[c1].timeStamp>data2[c2].timeStamp) {
-      resdata[i] = data2[c2];
-      c2++;
-    } else if (c1<count1) {
-      resdata[i] = data1[c1];
+    if (c2>=count2 ||
+	(c1<count1 && data1[c1].timeStamp<=data2[c2].timeStamp)) {
+      resdata[i] = std::move(data1[c1]);
       c1++;
     } else {
-      resdata[i] = data2[c2];
+      resdata[i] = std::move(data2[c2]);
       c2++;
     }
   }
 }
 
+
+///////////////////////////////////////////////////////////////////////
+//Return true if the next period of set 'a' comes before that of set
+//'b'. Ties go to the earlier set so the merge is stable.
+static inline bool mergeBefore(IntegPeriod **data, const int *pos,
+			       int a, int b)
+{
+  long long ta = data[a][pos[a]].timeStamp;
+  long long tb = data[b][pos[b]].timeStamp;
+  return ta<tb || (ta==tb && a<b);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Restore the heap of set numbers below entry 'i'
+static void mergeSift(int *heap, int heaplen, int i,
+		      IntegPeriod **data, const int *pos)
+{
+  while (true) {
+    int best = i;
+    int l = 2*i+1, r = 2*i+2;
+    if (l<heaplen && mergeBefore(data, pos, heap[l], heap[best])) best = l;
+    if (r<heaplen && mergeBefore(data, pos, heap[r], heap[best])) best = r;
+    if (best==i) return;
+    int t = heap[i];
+    heap[i] = heap[best];
+    heap[best] = t;
+    i = best;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Merge any number of sorted sets, moving them into the result
+void IntegPeriod::merge(IntegPeriod *&resdata, int &rescount,
+			IntegPeriod **data, const int *counts, int num)
+{
+  resdata = NULL;
+  rescount = 0;
+  //Keep a heap of the sets which still have periods left, ordered by
+  //the time stamp of the next period in each
+  int *heap = new int[num>0 ? num : 1];
+  int *pos = new int[num>0 ? num : 1];
+  int heaplen = 0;
+  for (int i=0; i<num; i++) {
+    pos[i] = 0;
+    if (data[i]==NULL || counts[i]<=0) continue;
+    rescount += counts[i];
+    heap[heaplen++] = i;
+  }
+  if (rescount>0) {
+    for (int i=heaplen/2-1; i>=0; i--) mergeSift(heap, heaplen, i, data, pos);
+
+    resdata = new IntegPeriod[rescount];
+    for (int i=0; i<rescount; i++) {
+      int s = heap[0];
+      resdata[i] = std::move(data[s][pos[s]]);
+      pos[s]++;
+      if (pos[s]==counts[s]) heap[0] = heap[--heaplen];
+      mergeSift(heap, heaplen, 0, data, pos);
+    }
+  }
+  delete[] heap;
+  delete[] pos;
+}
+
+
+//Below this many periods the index is sorted in a single thread
+#define PARALLELSORT 65536
+//Most threads to use for sorting
+#define MAXSORTTHREADS 8
+
+//A range of the index to be sorted or merged by one thread
+typedef struct sortjob_t {
+  const long long *keys;
+  int *src;
+  int *dst;
+  int lo, mid, hi;
+} sortjob_t;
+
+
+///////////////////////////////////////////////////////////////////////
+//Merge the sorted runs src[lo,mid) and src[mid,hi) into dst[lo,hi)
+static void mergeRuns(const long long *keys, const int *src, int *dst,
+		      int lo, int mid, int hi)
+{
+  int a = lo, b = mid, k = lo;
+  while (a<mid && b<hi) {
+    if (keys[src[a]]<=keys[src[b]]) dst[k++] = src[a++];
+    else dst[k++] = src[b++];
+  }
+  while (a<mid) dst[k++] = src[a++];
+  while (b<hi)  dst[k++] = src[b++];
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Stable bottom up merge sort of src[lo,hi) by the keys, using dst as
+//scratch space. The sorted range is left in src.
+static void sortRange(const long long *keys, int *src, int *dst,
+		      int lo, int hi)
+{
+  int *order = src, *temp = dst;
+  for (int width=1; width<hi-lo; width*=2) {
+    for (int l=lo; l<hi; l+=2*width) {
+      int mid = l+width<hi ? l+width : hi;
+      int h = l+2*width<hi ? l+2*width : hi;
+      mergeRuns(keys, order, temp, l, mid, h);
+    }
+    int *t = order;
+    order = temp;
+    temp = t;
+  }
+  if (order!=src) memcpy(src+lo, order+lo, (hi-lo)*sizeof(int));
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Thread to sort one chunk of the index
+static void *sortThread(void *arg)
+{
+  sortjob_t *job = (sortjob_t*)arg;
+  sortRange(job->keys, job->src, job->dst, job->lo, job->hi);
+  return NULL;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Thread to merge one pair of sorted chunks
+static void *mergeThread(void *arg)
+{
+  sortjob_t *job = (sortjob_t*)arg;
+  mergeRuns(job->keys, job->src, job->dst, job->lo, job->mid, job->hi);
+  return NULL;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Run each job in its own thread, doing the first one ourself
+static void runJobs(void *(*func)(void*), sortjob_t *jobs, int num)
+{
+  pthread_t *threads = new pthread_t[num];
+  bool *started = new bool[num];
+  for (int i=1; i<num; i++) {
+    started[i] = pthread_create(&threads[i], NULL, func, &jobs[i])==0;
+    //If we couldn't get a thread just do the work here
+    if (!started[i]) func(&jobs[i]);
+  }
+  func(&jobs[0]);
+  for (int i=1; i<num; i++) {
+    if (started[i]) pthread_join(threads[i], NULL);
+  }
+  delete[] threads;
+  delete[] started;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Stable sort of the indices in 'order' by the given keys, in parallel
+//if there are enough of them. 'temp' must be the same size. Returns
+//whichever array ends up sorted.
+static int *sortOrder(const long long *keys, int *order, int *temp, int count)
+{
+  int nthreads = 1;
+  if (count>=PARALLELSORT) {
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads>MAXSORTTHREADS) nthreads = MAXSORTTHREADS;
+    if (nthreads<1) nthreads = 1;
+  }
+  if (nthreads==1) {
+    sortRange(keys, order, temp, 0, count);
+    return order;
+  }
+
+  //Sort a chunk of the index in each thread
+  int chunk = (count+nthreads-1)/nthreads;
+  sortjob_t *jobs = new sortjob_t[nthreads];
+  int numjobs = 0;
+  for (int lo=0; lo<count; lo+=chunk) {
+    sortjob_t &job = jobs[numjobs++];
+    job.keys = keys;
+    job.src = order;
+    job.dst = temp;
+    job.lo = lo;
+    job.hi = lo+chunk<count ? lo+chunk : count;
+  }
+  runJobs(sortThread, jobs, numjobs);
+
+  //Then merge neighbouring chunks in pairs until only one is left
+  for (int width=chunk; width<count; width*=2) {
+    numjobs = 0;
+    for (int lo=0; lo<count; lo+=2*width) {
+      sortjob_t &job = jobs[numjobs++];
+      job.keys = keys;
+      job.src = order;
+      job.dst = temp;
+      job.lo = lo;
+      job.mid = lo+width<count ? lo+width : count;
+      job.hi = lo+2*width<count ? lo+2*width : count;
+    }
+    runJobs(mergeThread, jobs, numjobs);
+    int *t = order;
+    order = temp;
+    temp = t;
+  }
+  delete[] jobs;
+  return order;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Reverse the order of data[lo,hi)
+static void reversePeriods(IntegPeriod *data, int lo, int hi)
+{
+  for (hi--; lo<hi; lo++, hi--) data[lo].swap(data[hi]);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Sort by time stamp, moving the periods into place
 void IntegPeriod::sort(IntegPeriod *&data, int count)
 {
   if (count<=1) return;
-    
-  // Break the data in half
-  int middle=count/2;
-  int rlen;
-  if (count>2*middle)
-    rlen=middle+1;
-  else
-    rlen=middle;
-  
-  // Sort the left half
-  IntegPeriod *left = new IntegPeriod[middle];
-  for (int i=0; i<middle; i++) {
-    left[i]=data[i];
-  }
-  sort(left, middle);
-  
-  // Sort the right half
-  IntegPeriod *right = new IntegPeriod[rlen];
-  for (int i=0; i<rlen; i++) {
-    right[i]=data[middle+i];
-  }
-  sort(right, rlen);
-  
-  // Merge the results
-  IntegPeriod *resdata;
-  int reslen;
-  merge(resdata, reslen, left, middle, right, rlen);
-  
-  delete[] data;
-  delete[] left;
-  delete[] right;
-  data = resdata;
+
+  //Look for the common cases of data which is already sorted, or which
+  //is two sorted runs the wrong way round, as when LST wraps
+  int breaks = 0, wrap = 0;
+  for (int i=1; i<count && breaks<2; i++) {
+    if (data[i].timeStamp<data[i-1].timeStamp) {
+      breaks++;
+      wrap = i;
+    }
+  }
+  if (breaks==0) return;
+  if (breaks==1 && data[count-1].timeStamp<data[0].timeStamp) {
+    //Rotate the second run round to the front
+    reversePeriods(data, 0, wrap);
+    reversePeriods(data, wrap, count);
+    reversePeriods(data, 0, count);
+    return;
+  }
+
+  //Sort the time stamps rather than shuffling whole periods around
+  long long *keys = new long long[count];
+  int *order = new int[count];
+  int *temp = new int[count];
+  for (int i=0; i<count; i++) {
+    keys[i] = data[i].timeStamp;
+    order[i] = i;
+  }
+  int *sorted = sortOrder(keys, order, temp, count);
+
+  //Now apply the permutation, following each cycle with one spare
+  //period. Entries are marked as done by pointing them at themselves.
+  for (int i=0; i<count; i++) {
+    if (sorted[i]==i) continue;
+    IntegPeriod spare(std::move(data[i]));
+    int j = i;
+    while (sorted[j]!=i) {
+      int next = sorted[j];
+      data[j] = std::move(data[next]);
+      sorted[j] = j;
+      j = next;
+    }
+    data[j] = std::move(spare);
+    sorted[j] = j;
+  }
+  delete[] keys;
+  delete[] order;
+  delete[] temp;
+}
+
+
+//Four floats at a time, which gcc maps onto SSE or NEON where it can
+typedef float v4sf __attribute__((vector_size(16)));
+
+
+///////////////////////////////////////////////////////////////////////
+//Add a spectrum to a running sum
+static void addSpectrum(float *sum, const float *spec, int len)
+{
+  int i = 0;
+  for (; i+4<=len; i+=4) {
+    v4sf a, b;
+    memcpy(&a, sum+i, sizeof(a));
+    memcpy(&b, spec+i, sizeof(b));
+    a += b;
+    memcpy(sum+i, &a, sizeof(a));
+  }
+  for (; i<len; i++) sum[i] += spec[i];
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Return a new spectrum holding the mean of a running sum
+static float *meanSpectrum(const float *sum, int len, int count)
+{
+  float *res = new float[len];
+  v4sf div = {(float)count, (float)count, (float)count, (float)count};
+  int i = 0;
+  for (; i+4<=len; i+=4) {
+    v4sf a;
+    memcpy(&a, sum+i, sizeof(a));
+    a /= div;
+    memcpy(res+i, &a, sizeof(a));
+  }
+  for (; i<len; i++) res[i] = sum[i]/(float)count;
+  return res;
 }
 
 
 /////////////////////////////////////////////////////////////////
-//Erk.
+//Accumulate the periods in a single pass, writing out only the
+//integration periods which actually contain some data. The visibility
+//is summed as in-phase and quadrature parts, and any spectra which
+//every accumulated period has are averaged too.
 void IntegPeriod::integrate(IntegPeriod *&res, int &reslen,
 			    IntegPeriod *data, int size,
 			    long long period, bool keeprfi)
 {
   res = NULL;
   reslen = 0;
+  if (data==NULL || size<=0 || period<=0) return;
   long long epoch = data[0].timeStamp;
   long long endepoch = data[size-1].timeStamp;
 
-  //This is space inefficient if data is sparse wrt specified period
-  int num = (endepoch-epoch)/period + 2;
-  if (num<=0) return;
-
-  res = new IntegPeriod[num];
-
-  long long start, stop;
-  int counter = 0, i=0;
+  //Each output period uses at least one input period, so start with a
+  //guess and grow the output only if we need to
+  long long maxres = (endepoch-epoch)/period + 2;
+  if (maxres<=0) return;
+  if (maxres>size) maxres = size;
+  int ressize = maxres<256 ? maxres : 256;
+  res = new IntegPeriod[ressize];
+
+  //The spectra we know how to average, and their running sums
+  float *IntegPeriod::*specs[4] = {&IntegPeriod::phaseSpec,
+				   &IntegPeriod::crossSpec,
+				   &IntegPeriod::input1Spec,
+				   &IntegPeriod::input2Spec};
+  float *specsum[4] = {NULL, NULL, NULL, NULL};
+  bool speckeep[4];
+  int specsize = 0;
+
+  int i = 0;
   bool done = false;
-
   //Represents the start and stop epochs of "this" integration period
-  start = epoch - (epoch%period);
-  stop = start+period;
+  long long start = epoch - (epoch%period);
+  long long stop = start+period;
 
   while (i<size && start<endepoch && !done) {
     int numaccum = 0;
-    res[counter].timeStamp = start;
+    long long ts = start;
+    float sumX = 0.0, sum1 = 0.0, sum2 = 0.0, sumI = 0.0, sumQ = 0.0;
+    bool rfi = false;
+    int numbins = -1;
     //Add in all the period that should be averaged together
-    for (;i<size&&!done&&epoch<=stop; i++) {
-      if (!data[i].RFI || keeprfi) {
-        res[counter] += data[i];
+    for (; i<size && !done && epoch<=stop; i++) {
+      const IntegPeriod &per = data[i];
+      if (!per.RFI || keeprfi) {
+	//Take the earliest timestamp
+	if (ts>per.timeStamp || ts==0) ts = per.timeStamp;
+	sumX = sumX + per.powerX;
+	sum1 = sum1 + per.power1;
+	sum2 = sum2 + per.power2;
+	sumI = sumI + per.amplitude*cos(per.phase);
+	sumQ = sumQ + per.amplitude*sin(per.phase);
+	if (per.RFI) rfi = true;
+
+	//Sum any spectra while they all agree in size
+	if (numaccum==0) {
+	  numbins = per.numBins;
+	  if (numbins>specsize) {
+	    for (int s=0; s<4; s++) {
+	      if (specsum[s]) delete[] specsum[s];
+	      specsum[s] = NULL;
+	    }
+	    specsize = numbins;
+	  }
+	  for (int s=0; s<4; s++) {
+	    speckeep[s] = numbins>0 && per.*specs[s]!=NULL;
+	    if (!speckeep[s]) continue;
+	    if (specsum[s]==NULL) specsum[s] = new float[specsize];
+	    memcpy(specsum[s], per.*specs[s], numbins*sizeof(float));
+	  }
+	} else {
+	  for (int s=0; s<4; s++) {
+	    if (!speckeep[s]) continue;
+	    if (per.*specs[s]==NULL || per.numBins!=numbins) speckeep[s] = false;
+	    else addSpectrum(specsum[s], per.*specs[s], numbins);
+	  }
+	}
 	numaccum++;
       }
 
       if (i+1<size) {
 	epoch = data[i+1].timeStamp;
       } else {
-	done=true;
+	done = true;
       }
     }
+
     if (numaccum>0) {
-      res[counter]/=numaccum;
+      if (reslen==ressize) {
+	//Out of room, so move what we have into a bigger array
+	ressize = 2*ressize<maxres ? 2*ressize : maxres;
+	IntegPeriod *newres = new IntegPeriod[ressize];
+	for (int j=0; j<reslen; j++) newres[j] = std::move(res[j]);
+	delete[] res;
+	res = newres;
+      }
+      IntegPeriod &out = res[reslen];
+      out.timeStamp = ts;
+      out.powerX = sumX/(float)numaccum;
+      out.power1 = sum1/(float)numaccum;
+      out.power2 = sum2/(float)numaccum;
+      out.amplitude = sqrt(sumI*sumI + sumQ*sumQ)/(float)numaccum;
+      out.phase = atan2(sumQ, sumI);
+      out.RFI = rfi;
+      out.numBins = numbins;
+      for (int s=0; s<4; s++) {
+	if (speckeep[s]) out.*specs[s] = meanSpectrum(specsum[s], numbins, numaccum);
+      }
       //Only advance counter if there were some data
-      counter++;
+      reslen++;
     }
     //Advance to the next integration period
     start += period;
     stop  += period;
+    //Jump straight over any gap in the data
+    if (!done && epoch>stop) {
+      long long skip = (epoch-stop+period-1)/period;
+      start += skip*period;
+      stop  += skip*period;
+    }
     if (stop>endepoch) stop=endepoch;
   }
-  reslen = counter;
+  for (int s=0; s<4; s++) {
+    if (specsum[s]) delete[] specsum[s];
+  }
   if (reslen==0) {
     delete[] res;
     res = NULL;
@@ -1127,7 +1878,8 @@ void IntegPeriod::write(const IntegPeriod *data, int datlen,
 void IntegPeriod::write(const IntegPeriod *data, int datlen,
 			ofstream &datfile)
 {
-  for (int i=0; i<datlen; i++) datfile << data[i];
+  RecordV2::writeFileHeader(datfile);
+  for (int i=0; i<datlen; i++) RecordV2::save(datfile, data[i]);
 }
 
 
@@ -1191,22 +1943,19 @@ void IntegPeriod::writeWAVE(const IntegPeriod *data, int datlen,
 void IntegPeriod::rescale(IntegPeriod *data, int datlen,
 			  IntegPeriod *ref, int reflen)
 {
-  timegen_t xt[datlen];
-  timegen_t yt[reflen];
   double m1=0.0, m2=0.0;
   int counter = 0;
 
-  for (int i=0; i<reflen; i++) yt[i] = ref[i].timeStamp;
-  for (int i=0; i<datlen; i++) xt[i] = data[i].timeStamp;
-
+  int *map = TimeAlign::mutual(data, datlen, ref, reflen);
   for (int i=0; i<datlen; i++) {
-    int j = matchTimes(i, xt, datlen, yt, reflen);
+    int j = map[i];
     if (j!=-1) {
       m1 += data[i].power1/ref[j].power1;
       m2 += data[i].power2/ref[j].power1;
       counter++;
     }
   }
+  if (map!=NULL) delete[] map;
 
   if (counter>0) {
     m1 /= (float)counter;
@@ -1271,12 +2020,12 @@ int IntegPeriod::purgeFlagged(IntegPeriod *&res, int &reslen,
     if (!data[i].RFI) reslen++;
   }
   if (reslen==0) return 0;
-  //Then go through and copy those ones over
+  //Then go through and move those ones over
   res = new IntegPeriod[reslen];
   int j=0;
   for (int i=0; i<datalen; i++) {
     if (!data[i].RFI) {
-      res[j] = data[i];
+      res[j] = std::move(data[i]);
       j++;
     }
   }
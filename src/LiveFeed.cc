@@ -0,0 +1,184 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+#include <LiveFeed.h>
+#include <IntegPeriod.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+
+///////////////////////////////////////////////////////////////////////
+//Constructor
+LiveFeed::LiveFeed(int size)
+:itsSize(size>0 ? size : 1),
+itsHead(0),
+itsSignalled(false)
+{
+  pthread_mutex_init(&itsLock, NULL);
+  itsSlots = new liveslot_t[itsSize];
+  for (int i=0; i<itsSize; i++) {
+    itsSlots[i].live = NULL;
+    for (int j=0; j<8; j++) itsSlots[i].havecoded[j] = false;
+  }
+  if (pipe(itsWakePipe)<0) {
+    perror("LiveFeed");
+    itsWakePipe[0] = itsWakePipe[1] = -1;
+  } else {
+    for (int i=0; i<2; i++) {
+      fcntl(itsWakePipe[i], F_SETFL, fcntl(itsWakePipe[i], F_GETFL, 0)|O_NONBLOCK);
+    }
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Destructor
+LiveFeed::~LiveFeed()
+{
+  for (int i=0; i<itsSize; i++) {
+    liveper_t *live = itsSlots[i].live;
+    if (live && release(live)) {
+      delete live->per;
+      delete live;
+    }
+  }
+  delete[] itsSlots;
+  if (itsWakePipe[0]>=0) {
+    close(itsWakePipe[0]);
+    close(itsWakePipe[1]);
+  }
+  pthread_mutex_destroy(&itsLock);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Add a copy of the period to the ring
+void LiveFeed::put(const IntegPeriod &per)
+{
+  //Make the copy before we take the lock so readers aren't held up
+  liveper_t *newlive = new liveper_t;
+  newlive->per = new IntegPeriod(per);
+  newlive->refs = 1;
+  string oldcoded[8];
+
+  Lock();
+  liveslot_t &slot = itsSlots[itsHead%itsSize];
+  liveper_t *oldlive = slot.live;
+  //A reader still serialising the old period will delete it instead
+  bool dropold = (oldlive!=NULL && release(oldlive));
+  slot.live = newlive;
+  for (int j=0; j<8; j++) {
+    //Keep the old strings to free once we've let go of the lock
+    oldcoded[j].swap(slot.coded[j]);
+    slot.havecoded[j] = false;
+  }
+  itsHead++;
+  bool wake = !itsSignalled;
+  itsSignalled = true;
+  Unlock();
+
+  if (dropold) {
+    delete oldlive->per;
+    delete oldlive;
+  }
+  if (wake && itsWakePipe[1]>=0) {
+    char c = 0;
+    if (write(itsWakePipe[1], &c, 1)<0) perror("LiveFeed");
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Return the sequence number the next period will be given
+long long LiveFeed::head()
+{
+  Lock();
+  long long res = itsHead;
+  Unlock();
+  return res;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Return the sequence number of the oldest period still in the ring
+long long LiveFeed::oldest()
+{
+  Lock();
+  long long res = (itsHead>itsSize) ? itsHead-itsSize : 0;
+  Unlock();
+  return res;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Append period 'seq', serialised with only the data asked for
+bool LiveFeed::get(long long seq, bool cross, bool inputs, bool audio,
+		   string &out)
+{
+  int form = (cross?1:0) | (inputs?2:0) | (audio?4:0);
+  Lock();
+  if (seq<0 || seq>=itsHead || seq<itsHead-itsSize) {
+    Unlock();
+    return false;
+  }
+  liveslot_t &slot = itsSlots[seq%itsSize];
+  if (slot.havecoded[form]) {
+    out += slot.coded[form];
+    Unlock();
+    return true;
+  }
+  //First reader to want this form, so serialise it for everyone. Hold
+  //on to the period so it can't be deleted while we work on it.
+  liveper_t *live = slot.live;
+  live->refs++;
+  Unlock();
+
+  IntegPeriod temp(*live->per);
+  temp.keepOnly(cross, inputs, audio);
+  string coded(IntegPeriod::encodedSize(temp), '\0');
+  IntegPeriod::encode(temp, &coded[0]);
+  out += coded;
+
+  Lock();
+  //Only keep it if the period hasn't been overwritten meanwhile
+  if (slot.live==live && !slot.havecoded[form]) {
+    slot.coded[form].swap(coded);
+    slot.havecoded[form] = true;
+  }
+  bool drop = release(live);
+  Unlock();
+  if (drop) {
+    delete live->per;
+    delete live;
+  }
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Let go of the period, which must be done while holding the lock
+bool LiveFeed::release(liveper_t *live)
+{
+  live->refs--;
+  return live->refs==0;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Clear the wake up notice
+void LiveFeed::clearWake()
+{
+  Lock();
+  char buf[64];
+  while (itsWakePipe[0]>=0 && read(itsWakePipe[0], buf, sizeof(buf))>0);
+  itsSignalled = false;
+  Unlock();
+}
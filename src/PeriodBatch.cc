@@ -0,0 +1,230 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+#include <PeriodBatch.h>
+#include <AudioCodec.h>
+#include <sys/uio.h>
+#include <string.h>
+
+
+///////////////////////////////////////////////////////////////////////
+//Constructor
+PeriodBatch::PeriodBatch(bool packaudio)
+:itsPackAudio(packaudio),
+itsCount(0),
+itsLength(0),
+itsLocalLen(0),
+itsLocalSize(4096),
+itsNumPieces(0),
+itsPiecesSize(64),
+itsNumPacked(0),
+itsPackedSize(0)
+{
+  itsLocal = new char[itsLocalSize];
+  itsPieces = new piece_t[itsPiecesSize];
+  itsPacked = NULL;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Destructor
+PeriodBatch::~PeriodBatch()
+{
+  clear();
+  delete[] itsLocal;
+  delete[] itsPieces;
+  if (itsPacked!=NULL) delete[] itsPacked;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Forget everything in the batch
+void PeriodBatch::clear()
+{
+  for (int i=0; i<itsNumPacked; i++) delete[] itsPacked[i];
+  itsNumPacked = 0;
+  itsNumPieces = 0;
+  itsLocalLen = 0;
+  itsLength = 0;
+  itsCount = 0;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Make room for another piece
+PeriodBatch::piece_t &PeriodBatch::newPiece()
+{
+  if (itsNumPieces==itsPiecesSize) {
+    itsPiecesSize *= 2;
+    piece_t *newpieces = new piece_t[itsPiecesSize];
+    memcpy(newpieces, itsPieces, itsNumPieces*sizeof(piece_t));
+    delete[] itsPieces;
+    itsPieces = newpieces;
+  }
+  return itsPieces[itsNumPieces++];
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Append bytes to our own buffer
+void PeriodBatch::addLocal(const void *data, int len)
+{
+  if (itsLocalLen+len>itsLocalSize) {
+    while (itsLocalLen+len>itsLocalSize) itsLocalSize *= 2;
+    char *newlocal = new char[itsLocalSize];
+    memcpy(newlocal, itsLocal, itsLocalLen);
+    delete[] itsLocal;
+    itsLocal = newlocal;
+  }
+  memcpy(itsLocal+itsLocalLen, data, len);
+
+  //Extend the last piece if it ends where this one starts
+  if (itsNumPieces>0) {
+    piece_t &last = itsPieces[itsNumPieces-1];
+    if (last.ptr==NULL && last.offset+last.len==itsLocalLen) {
+      last.len += len;
+      itsLocalLen += len;
+      itsLength += len;
+      return;
+    }
+  }
+  piece_t &p = newPiece();
+  p.ptr = NULL;
+  p.offset = itsLocalLen;
+  p.len = len;
+  itsLocalLen += len;
+  itsLength += len;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Append a reference to someone else's data
+void PeriodBatch::addRef(const void *data, long long len)
+{
+  if (len<=0) return;
+  piece_t &p = newPiece();
+  p.ptr = (const char*)data;
+  p.offset = 0;
+  p.len = len;
+  itsLength += len;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Add a period to the end of the batch
+void PeriodBatch::add(const IntegPeriod &per)
+{
+  //Compress the audio if we can
+  char *packed = NULL;
+  int packedsize = 0, packedlen = 0;
+  if (itsPackAudio && per.rawAudio && per.audioLen>0) {
+    AudioCodec::encode(per.rawAudio, per.audioLen,
+		       packed, packedsize, packedlen);
+    if (packedlen+(int)sizeof(int) >= 2*(int)sizeof(audio_t)*per.audioLen) {
+      delete[] packed;
+      packed = NULL;
+    } else {
+      if (itsNumPacked==itsPackedSize) {
+	itsPackedSize = (itsPackedSize==0) ? 16 : 2*itsPackedSize;
+	char **newpacked = new char*[itsPackedSize];
+	if (itsPacked!=NULL) {
+	  memcpy(newpacked, itsPacked, itsNumPacked*sizeof(char*));
+	  delete[] itsPacked;
+	}
+	itsPacked = newpacked;
+      }
+      itsPacked[itsNumPacked++] = packed;
+    }
+  }
+
+  const float *spec[4] = {per.phaseSpec, per.crossSpec,
+			  per.input1Spec, per.input2Spec};
+  int speclen = per.numBins*sizeof(float);
+  int len = IntegPeriod::theirHeaderLen + sizeof(int);
+  for (int i=0; i<4; i++) {
+    if (spec[i]) len += speclen;
+  }
+  if (packed)            len += sizeof(int) + packedlen;
+  else if (per.rawAudio) len += 2*sizeof(audio_t)*per.audioLen;
+
+  char header[IntegPeriod::theirHeaderLen];
+  IntegPeriod::encodeHeader(per, len, header);
+  addLocal(header, IntegPeriod::theirHeaderLen);
+  for (int i=0; i<4; i++) {
+    if (spec[i]) addRef(spec[i], speclen);
+  }
+  if (packed) {
+    int temp[2] = {-per.audioLen, packedlen};
+    addLocal(temp, 2*sizeof(int));
+    addRef(packed, packedlen);
+  } else if (per.rawAudio) {
+    addLocal(&per.audioLen, sizeof(int));
+    addRef(per.rawAudio, 2*sizeof(audio_t)*per.audioLen);
+  } else {
+    int temp = 0;
+    addLocal(&temp, sizeof(int));
+  }
+  itsCount++;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Add a period which is already serialised
+void PeriodBatch::addRecord(const char *rec, long long len)
+{
+  addRef(rec, len);
+  itsCount++;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Write the batch to the stream as a single block
+void PeriodBatch::write(ostream &os)
+{
+  if (itsLength==0) return;
+  char *buf = new char[itsLength];
+  char *p = buf;
+  for (int i=0; i<itsNumPieces; i++) {
+    const piece_t &pc = itsPieces[i];
+    memcpy(p, (pc.ptr==NULL) ? itsLocal+pc.offset : pc.ptr, pc.len);
+    p += pc.len;
+  }
+  os.write(buf, itsLength);
+  delete[] buf;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Send the batch straight to the socket
+bool PeriodBatch::send(TCPstream &sock, const char *prefix, int prefixlen)
+{
+  if (prefix==NULL) prefixlen = 0;
+  if (itsLength+prefixlen==0) return sock.good();
+  struct iovec *iov = new struct iovec[itsNumPieces+1];
+  int num = 0;
+  if (prefixlen>0) {
+    iov[num].iov_base = (void*)prefix;
+    iov[num].iov_len = prefixlen;
+    num++;
+  }
+  for (int i=0; i<itsNumPieces; i++, num++) {
+    const piece_t &pc = itsPieces[i];
+    iov[num].iov_base = (void*)((pc.ptr==NULL) ? itsLocal+pc.offset : pc.ptr);
+    iov[num].iov_len = pc.len;
+  }
+  //The periods are mostly floats, which compress better shuffled
+  long long res = sock.rdbuf()->writev_direct(iov, num, sizeof(float));
+  delete[] iov;
+  if (res!=itsLength+prefixlen) {
+    sock.setstate(ios::badbit);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,331 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+#include <PeriodSeries.h>
+#include <math.h>
+#include <string.h>
+
+
+///////////////////////////////////////////////////////////////////////
+//Constructor
+PeriodSeries::PeriodSeries()
+:timeStamp(NULL),
+powerX(NULL),
+power1(NULL),
+power2(NULL),
+amplitude(NULL),
+phase(NULL),
+RFI(NULL),
+itsSize(0)
+{
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Constructor
+PeriodSeries::PeriodSeries(int size)
+:timeStamp(NULL),
+powerX(NULL),
+power1(NULL),
+power2(NULL),
+amplitude(NULL),
+phase(NULL),
+RFI(NULL),
+itsSize(0)
+{
+  resize(size);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Constructor
+PeriodSeries::PeriodSeries(const IntegPeriod *data, int count)
+:timeStamp(NULL),
+powerX(NULL),
+power1(NULL),
+power2(NULL),
+amplitude(NULL),
+phase(NULL),
+RFI(NULL),
+itsSize(0)
+{
+  set(data, count);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Copy constructor
+PeriodSeries::PeriodSeries(const PeriodSeries &rhs)
+:timeStamp(NULL),
+powerX(NULL),
+power1(NULL),
+power2(NULL),
+amplitude(NULL),
+phase(NULL),
+RFI(NULL),
+itsSize(0)
+{
+  *this = rhs;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Destructor
+PeriodSeries::~PeriodSeries()
+{
+  release();
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Free the columns
+void PeriodSeries::release()
+{
+  if (timeStamp) delete[] timeStamp;
+  if (powerX)    delete[] powerX;
+  if (power1)    delete[] power1;
+  if (power2)    delete[] power2;
+  if (amplitude) delete[] amplitude;
+  if (phase)     delete[] phase;
+  if (RFI)       delete[] RFI;
+  timeStamp = NULL;
+  powerX = power1 = power2 = amplitude = phase = NULL;
+  RFI = NULL;
+  itsSize = 0;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Change the number of periods
+void PeriodSeries::resize(int size)
+{
+  release();
+  if (size<=0) return;
+  itsSize = size;
+  timeStamp = new long long[size];
+  powerX    = new float[size];
+  power1    = new float[size];
+  power2    = new float[size];
+  amplitude = new float[size];
+  phase     = new float[size];
+  RFI       = new bool[size];
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Copy another series
+void PeriodSeries::operator=(const PeriodSeries &rhs)
+{
+  if (&rhs==this) return;
+  resize(rhs.itsSize);
+  if (itsSize==0) return;
+  memcpy(timeStamp, rhs.timeStamp, itsSize*sizeof(long long));
+  memcpy(powerX,    rhs.powerX,    itsSize*sizeof(float));
+  memcpy(power1,    rhs.power1,    itsSize*sizeof(float));
+  memcpy(power2,    rhs.power2,    itsSize*sizeof(float));
+  memcpy(amplitude, rhs.amplitude, itsSize*sizeof(float));
+  memcpy(phase,     rhs.phase,     itsSize*sizeof(float));
+  memcpy(RFI,       rhs.RFI,       itsSize*sizeof(bool));
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Exchange contents with another series
+void PeriodSeries::swap(PeriodSeries &rhs)
+{
+  long long *tempts = timeStamp;
+  timeStamp = rhs.timeStamp;
+  rhs.timeStamp = tempts;
+  float **mine[5] = {&powerX, &power1, &power2, &amplitude, &phase};
+  float **theirs[5] = {&rhs.powerX, &rhs.power1, &rhs.power2,
+		       &rhs.amplitude, &rhs.phase};
+  for (int i=0; i<5; i++) {
+    float *temp = *mine[i];
+    *mine[i] = *theirs[i];
+    *theirs[i] = temp;
+  }
+  bool *temprfi = RFI;
+  RFI = rhs.RFI;
+  rhs.RFI = temprfi;
+  int tempsize = itsSize;
+  itsSize = rhs.itsSize;
+  rhs.itsSize = tempsize;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Replace the contents with the given periods
+void PeriodSeries::set(const IntegPeriod *data, int count)
+{
+  resize(count);
+  for (int i=0; i<itsSize; i++) {
+    timeStamp[i] = data[i].timeStamp;
+    powerX[i]    = data[i].powerX;
+    power1[i]    = data[i].power1;
+    power2[i]    = data[i].power2;
+    amplitude[i] = data[i].amplitude;
+    phase[i]     = data[i].phase;
+    RFI[i]       = data[i].RFI;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Copy the series into an existing array
+void PeriodSeries::get(IntegPeriod *data) const
+{
+  for (int i=0; i<itsSize; i++) {
+    data[i].timeStamp = timeStamp[i];
+    data[i].powerX    = powerX[i];
+    data[i].power1    = power1[i];
+    data[i].power2    = power2[i];
+    data[i].amplitude = amplitude[i];
+    data[i].phase     = phase[i];
+    data[i].RFI       = RFI[i];
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Return a new array of IntegPeriods holding the series
+IntegPeriod *PeriodSeries::toPeriods() const
+{
+  if (itsSize==0) return NULL;
+  IntegPeriod *res = new IntegPeriod[itsSize];
+  get(res);
+  return res;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Copy just the RFI flags into an existing array
+void PeriodSeries::copyFlags(IntegPeriod *data) const
+{
+  for (int i=0; i<itsSize; i++) data[i].RFI = RFI[i];
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Fill 'res' with the unflagged periods
+int PeriodSeries::purgeFlagged(PeriodSeries &res) const
+{
+  int keep = 0;
+  for (int i=0; i<itsSize; i++) {
+    if (!RFI[i]) keep++;
+  }
+  PeriodSeries temp(keep);
+  int j = 0;
+  for (int i=0; i<itsSize; i++) {
+    if (RFI[i]) continue;
+    temp.timeStamp[j] = timeStamp[i];
+    temp.powerX[j]    = powerX[i];
+    temp.power1[j]    = power1[i];
+    temp.power2[j]    = power2[i];
+    temp.amplitude[j] = amplitude[i];
+    temp.phase[j]     = phase[i];
+    temp.RFI[j]       = false;
+    j++;
+  }
+  int purged = itsSize-keep;
+  res.swap(temp);
+  return purged;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Accumulate the periods into bins of the given duration. The bins are
+//formed exactly as IntegPeriod::integrate does so the results match.
+void PeriodSeries::integrate(PeriodSeries &res, long long period,
+			     bool keeprfi) const
+{
+  if (itsSize==0 || period<=0) {
+    res.resize(0);
+    return;
+  }
+  long long epoch = timeStamp[0];
+  long long endepoch = timeStamp[itsSize-1];
+
+  //Each bin uses at least one period so we never need more than that
+  long long num = (endepoch-epoch)/period + 2;
+  if (num<=0) {
+    res.resize(0);
+    return;
+  }
+  PeriodSeries temp(num<itsSize ? num : itsSize);
+
+  int counter = 0, i = 0;
+  bool done = false;
+  //Represents the start and stop epochs of "this" integration period
+  long long start = epoch - (epoch%period);
+  long long stop = start+period;
+
+  while (i<itsSize && start<endepoch && !done) {
+    int numaccum = 0;
+    long long ts = start;
+    float sumX = 0.0, sum1 = 0.0, sum2 = 0.0, sumI = 0.0, sumQ = 0.0;
+    bool rfi = false;
+    //Add in all the period that should be averaged together
+    for (; i<itsSize && !done && epoch<=stop; i++) {
+      if (!RFI[i] || keeprfi) {
+	//Take the earliest timestamp
+	if (ts>timeStamp[i] || ts==0) ts = timeStamp[i];
+	sumX = sumX + powerX[i];
+	sum1 = sum1 + power1[i];
+	sum2 = sum2 + power2[i];
+	sumI = sumI + amplitude[i]*cos(phase[i]);
+	sumQ = sumQ + amplitude[i]*sin(phase[i]);
+	if (RFI[i]) rfi = true;
+	numaccum++;
+      }
+      if (i+1<itsSize) {
+	epoch = timeStamp[i+1];
+      } else {
+	done = true;
+      }
+    }
+    if (numaccum>0) {
+      temp.timeStamp[counter] = ts;
+      temp.powerX[counter]    = sumX/(float)numaccum;
+      temp.power1[counter]    = sum1/(float)numaccum;
+      temp.power2[counter]    = sum2/(float)numaccum;
+      temp.amplitude[counter] = sqrt(sumI*sumI + sumQ*sumQ)/(float)numaccum;
+      temp.phase[counter]     = atan2(sumQ, sumI);
+      temp.RFI[counter]       = rfi;
+      //Only advance counter if there were some data
+      counter++;
+    }
+    //Advance to the next integration period
+    start += period;
+    stop  += period;
+    //Jump straight over any gap in the data
+    if (!done && epoch>stop) {
+      long long skip = (epoch-stop+period-1)/period;
+      start += skip*period;
+      stop  += skip*period;
+    }
+    if (stop>endepoch) stop=endepoch;
+  }
+  //Trim off the unused entries
+  temp.itsSize = counter;
+  if (counter==0) temp.release();
+  res.swap(temp);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Return a new array of the time stamps in hours
+float *PeriodSeries::hours(long long offset) const
+{
+  float *res = new float[itsSize>0 ? itsSize : 1];
+  for (int i=0; i<itsSize; i++) {
+    res[i] = (timeStamp[i]-offset)/float(3600000000.0);
+  }
+  return res;
+}
@@ -15,6 +15,8 @@
 #include <Processor.h>
 #include <IntegPeriod.h>
 #include <StoreMaster.h>
+#include <RawRing.h>
+#include <LiveFeed.h>
 #include <ConfigFile.h>
 #include <iostream>
 #include <fstream>
@@ -25,11 +27,12 @@
 //Constructor
 Processor::Processor(Buf<IntegPeriod*> *source,
                      StoreMaster *sinc,
-                     StoreMaster *rawsinc,
+                     RawRing *rawsinc,
                      float gain1, float gain2)
 :itsInBuf(source),
 itsOutBuf(sinc),
 itsRawOutBuf(rawsinc),
+itsLiveFeed(NULL),
 itsLastEpoch(-1),
 itsGain1(gain1),
 itsGain2(gain2),
@@ -60,11 +63,10 @@ void Processor::run()
     //Calculate the frequency spectra of the input audio
     intper.doCorrelations(itsGain1, itsGain2);
 
-    if (itsRawOutBuf!=NULL) {
-      IntegPeriod *intpernostrip = new IntegPeriod();
-      *intpernostrip = intper;
-      itsRawOutBuf->put(intpernostrip);
-    }
+    //The raw ring saves its own copy, before we strip anything
+    if (itsRawOutBuf!=NULL) itsRawOutBuf->put(intper);
+    //As do any clients watching the live data
+    if (itsLiveFeed!=NULL) itsLiveFeed->put(intper);
     //Discard all data which we do not wish to write to disk
     strip(&intper);
     //Give the data to the data storage component
@@ -12,37 +12,76 @@
 
 #include <RFI.h>
 #include <IntegPeriod.h>
+#include <PeriodSeries.h>
+#include <TimeAlign.h>
 #include <math.h>
+#include <string.h>
 #include <assert.h>
 
+//Number of periods around each one whose median it is compared with
+#define MEDIANWINDOW 11
+
 
 /////////////////////////////////////////////////////////////////
 //Applies an automated cleaning suite to the specified data
-void cleanData(IntegPeriod *&res, int &rescount,
-	       IntegPeriod *data, int count)
+void cleanData(PeriodSeries &res, PeriodSeries &data, clean_mode mode)
 {
-  if (data==NULL || count==0) return;
-
-  res = NULL;
-  rescount = 0;
-  IntegPeriod *tempdata = NULL, *tempdata2 = NULL;
-  int tempcount = 0, tempcount2 = 0;
+  res.resize(0);
+  if (data.size()==0) return;
 
-  markOutliers(data, count, 2.0, 10);
-  IntegPeriod::purgeFlagged(tempdata, tempcount, data, count);
-  if (tempdata==NULL || tempcount==0) return;
+  PeriodSeries tempdata, tempdata2;
+  if (mode==clean_none) {
+    data.integrate(res, 10000000);
+    return;
+  } else if (mode==clean_median) {
+    medianClean(res, data, 4.0, 10000000);
+    return;
+  }
 
+  markOutliers(data, 2.0, 10);
+  data.purgeFlagged(tempdata);
+  if (tempdata.size()==0) return;
 
-  powerClean(tempdata, tempcount, 1.15, 10);
-  IntegPeriod::purgeFlagged(tempdata2, tempcount2, tempdata, tempcount);
-  delete[] tempdata;
-  if (tempdata2==NULL || tempcount2==0) return;
+  powerClean(tempdata, 1.15, 10);
+  tempdata.purgeFlagged(tempdata2);
+  if (tempdata2.size()==0) return;
 
   //Perform second pass
-  markOutliers(tempdata2, tempcount2, 5.0, 40, false);
-  //IntegPeriod::purgeFlagged(res, rescount, tempdata2, tempcount2);
-  IntegPeriod::integrate(res, rescount, tempdata2, tempcount2, 10000000);
-  delete[] tempdata2;
+  markOutliers(tempdata2, 5.0, 40, false);
+  tempdata2.integrate(res, 10000000);
+}
+
+
+/////////////////////////////////////////////////////////////////
+//Remove the periods too far above the local median and integrate the rest
+void medianClean(PeriodSeries &res, PeriodSeries &data, float sigma,
+		 long long inttime)
+{
+  res.resize(0);
+  if (data.size()==0) return;
+
+  //The median isn't pulled about by the RFI so one short pass will do
+  markMedianOutliers(data, sigma, MEDIANWINDOW);
+  PeriodSeries tempdata;
+  data.purgeFlagged(tempdata);
+  tempdata.integrate(res, inttime);
+}
+
+
+/////////////////////////////////////////////////////////////////
+//Applies an automated cleaning suite to the specified data
+void cleanData(IntegPeriod *&res, int &rescount,
+	       IntegPeriod *data, int count, clean_mode mode)
+{
+  res = NULL;
+  rescount = 0;
+  if (data==NULL || count==0) return;
+
+  PeriodSeries cols(data, count), clean;
+  cleanData(clean, cols, mode);
+  cols.copyFlags(data);
+  res = clean.toPeriods();
+  rescount = clean.size();
 }
 
 
@@ -85,235 +124,475 @@ float getSD(float mean, float *v, int start, int len)
 }
 
 
-/////////////////////////////////////////////////////////////////
-//Flag outlayers and maybe any noisy periods
-void markOutliers(IntegPeriod *data, int size, float sigma,
-		  int len, bool sdnazi)
-{
-  if (len>=size) {
-    //Don't bother flagging any if there's not much data
-    return;
-  }
-  int halflen = len/2;
-  double tempmax, mean, sd;
-  int end = size-halflen;
-  int count = 0;
-  float magic = 20;
+//Recalculate the sliding sums from scratch after this many steps
+#define RESYNCSTEPS 1024
+//Decisions closer to the threshold than these fractions of the mean
+//and of the standard deviation are redone with the exact sums, so that
+//they always agree with getAvg() and getSD()
+#define MEANTOL 1e-6
+#define SDTOL   1e-4
+//Periods with a standard deviation more than 1/SDNAZI of their mean
+//are flagged when 'sdnazi' is set
+#define SDNAZI 20
 
-  float ref[size];
 
-  //Look at the first input channel
-  for (int i=0; i<size; i++) ref[i] = data[i].power1;
-  //Process the leading data
-  mean = getAvg(ref, 0, len);
-  sd   = getSD(mean, ref, 0, len);
-  tempmax = mean+sigma*sd;
-  for (int i=0; i<halflen; i++) {
-    if (!data[i].RFI && (ref[i]>tempmax || (sdnazi && sd>mean/magic))) {
-      data[i].RFI = true;
-      count++;
+/////////////////////////////////////////////////////////////////
+//Mean and variance of a window of values which slides along a column
+//one value at a time. Moving the window costs the same whatever its
+//length, rather than needing the whole window to be summed again.
+class SlidingStats {
+public:
+  SlidingStats(float *v, int len)
+    :itsV(v), itsLen(len), itsStart(0) {resync();}
+
+  //Slide the window along by one value
+  inline void step() {
+    double oldv = itsV[itsStart], newv = itsV[itsStart+itsLen];
+    itsStart++;
+    if (++itsSteps>=RESYNCSTEPS) {
+      resync();
+      return;
     }
+    //Welford's update for replacing one value in the window
+    double delta = newv-oldv;
+    double newmean = itsMean + delta/itsLen;
+    itsM2 += delta*((newv-newmean)+(oldv-itsMean));
+    itsMean = newmean;
+    if (itsM2<0.0) itsM2 = 0.0;
+    if (!isfinite(itsMean) || !isfinite(itsM2)) resync();
   }
-  //Process the bulk middle section of the samples
-  for (int i=halflen; i<end; i++) {
-    //Calculate stddev and mean for data centered on this point
-    mean = getAvg(ref, i-halflen, len);
-    sd   = getSD(mean, ref, i-halflen, len);
-    tempmax = mean+sigma*sd;
-
-    if (!data[i].RFI && (ref[i]>tempmax || (sdnazi && sd>mean/magic))) {
-      data[i].RFI = true;
-      count++;
-    }
+  //Return where the window currently starts
+  inline int start() const {return itsStart;}
+  //Return the mean of the window
+  inline double mean() const {return itsMean;}
+  //Return the sum of squared differences from a given mean
+  inline double sumSq(double mean) const {
+    double d = itsMean-mean;
+    return itsM2 + itsLen*d*d;
   }
-  //And use that last value for the remaining data
-  for (int i=end; i<size; i++) {
-    if (!data[i].RFI && (ref[i]>tempmax || (sdnazi && sd>mean/magic))) {
-      data[i].RFI = true;
-      count++;
+
+private:
+  //Calculate the sums for the current window from scratch
+  void resync() {
+    double sum = 0.0;
+    for (int i=0; i<itsLen; i++) sum += itsV[itsStart+i];
+    itsMean = sum/itsLen;
+    itsM2 = 0.0;
+    for (int i=0; i<itsLen; i++) {
+      double d = itsV[itsStart+i]-itsMean;
+      itsM2 += d*d;
     }
+    itsSteps = 0;
   }
 
-  //Look at the second input channel
-  for (int i=0; i<size; i++) ref[i] = data[i].power2;
+  float *itsV;
+  int itsLen;
+  int itsStart;
+  int itsSteps;
+  double itsMean;
+  double itsM2;
+};
+
+
+/////////////////////////////////////////////////////////////////
+//Return true if the value is more than 'sigma' standard deviations
+//above the given local mean, or if the data are too noisy
+static inline bool isOutlier(float v, double mean, double sd,
+			     float sigma, bool sdnazi)
+{
+  double tempmax = mean+sigma*sd;
+  return v>tempmax || (sdnazi && sd>mean/(float)SDNAZI);
+}
+
+
+/////////////////////////////////////////////////////////////////
+//Check a value against a window using the sliding sums, unless it is
+//too close to call in which case the window is summed exactly
+static bool isOutlier(float *ref, int i, const SlidingStats &stats,
+		      int len, float sigma, bool sdnazi)
+{
+  //Round as getAvg and getSD would, since getSD works from the float mean
+  double mean = (float)stats.mean();
+  double sd = (float)sqrt(stats.sumSq(mean)/(float)len);
+  double tempmax = mean+sigma*sd;
+  double tol = MEANTOL*fabs(mean)*(1+fabs(sigma)) + SDTOL*fabs(sigma*sd);
+  if (fabs(ref[i]-tempmax)<=tol ||
+      (sdnazi && fabs(sd-mean/(float)SDNAZI)<=MEANTOL*fabs(mean)+SDTOL*sd)) {
+    mean = getAvg(ref, stats.start(), len);
+    sd   = getSD(mean, ref, stats.start(), len);
+  }
+  return isOutlier(ref[i], mean, sd, sigma, sdnazi);
+}
+
+
+/////////////////////////////////////////////////////////////////
+//Flag values in either column more than 'sigma' standard deviations
+//above the local mean, returning how many new flags were raised. Both
+//columns are worked through together, in one pass.
+static int flagOutliers(float *ref1, float *ref2, bool *flags, int size,
+			float sigma, int len, bool sdnazi)
+{
+  float *refs[2] = {ref1, ref2};
+  int halflen = len/2;
+  int end = size-halflen;
+  int count = 0;
+  double mean[2], sd[2];
+
   //Process the leading data
-  mean = getAvg(ref, 0, len);
-  sd   = getSD(mean, ref, 0, len);
-  tempmax = mean+sigma*sd;
+  for (int c=0; c<2; c++) {
+    mean[c] = getAvg(refs[c], 0, len);
+    sd[c]   = getSD(mean[c], refs[c], 0, len);
+  }
   for (int i=0; i<halflen; i++) {
-    if (!data[i].RFI && (ref[i]>tempmax || (sdnazi && sd>mean/magic))) {
-      data[i].RFI = true;
-      count++;
+    for (int c=0; c<2; c++) {
+      if (!flags[i] && isOutlier(refs[c][i], mean[c], sd[c], sigma, sdnazi)) {
+	flags[i] = true;
+	count++;
+      }
     }
   }
-  //Process the bulk middle section of the samples
+  //Process the bulk middle section of the samples, using the stats of
+  //the window centred on each point
+  SlidingStats stats1(ref1, len), stats2(ref2, len);
+  SlidingStats *stats[2] = {&stats1, &stats2};
   for (int i=halflen; i<end; i++) {
-    //Calculate stddev and mean for data centered on this point
-    mean = getAvg(ref, i-halflen, len);
-    sd   = getSD(mean, ref, i-halflen, len);
-    tempmax = mean+sigma*sd;
-
-    if (!data[i].RFI && (ref[i]>tempmax || (sdnazi && sd>mean/magic))) {
-      if (!data[i].RFI) {
-	data[i].RFI = true;
+    if (i>halflen) {
+      stats1.step();
+      stats2.step();
+    }
+    for (int c=0; c<2; c++) {
+      if (!flags[i] && isOutlier(refs[c], i, *stats[c], len, sigma, sdnazi)) {
+	flags[i] = true;
 	count++;
       }
     }
   }
-  //And use that last value for the remaining data
+  //And use that last window for the remaining data
+  for (int c=0; c<2; c++) {
+    mean[c] = getAvg(refs[c], end-1-halflen, len);
+    sd[c]   = getSD(mean[c], refs[c], end-1-halflen, len);
+  }
   for (int i=end; i<size; i++) {
-    if (!data[i].RFI && (ref[i]>tempmax || (sdnazi && sd>mean/magic))) {
-      data[i].RFI = true;
-      count++;
+    for (int c=0; c<2; c++) {
+      if (!flags[i] && isOutlier(refs[c][i], mean[c], sd[c], sigma, sdnazi)) {
+	flags[i] = true;
+	count++;
+      }
     }
   }
-
-  if (count>0) cerr << "Removed " << count << " of " << size << " periods possibly contaminated by RFI\n";
+  return count;
 }
 
 
 /////////////////////////////////////////////////////////////////
-//Flag data more than 'cutoff' times the local mean
-void powerClean(IntegPeriod *data, int size, float cutoff, int len)
+//Flag outlayers and maybe any noisy periods
+void markOutliers(PeriodSeries &data, float sigma, int len, bool sdnazi)
 {
+  int size = data.size();
   if (len>=size) {
     //Don't bother flagging any if there's not much data
     return;
   }
+  int count = flagOutliers(data.power1, data.power2, data.RFI,
+			   size, sigma, len, sdnazi);
+
+  if (count>0) cerr << "Removed " << count << " of " << size << " periods possibly contaminated by RFI\n";
+}
+
+
+/////////////////////////////////////////////////////////////////
+//Flag outlayers and maybe any noisy periods
+void markOutliers(IntegPeriod *data, int size, float sigma,
+		  int len, bool sdnazi)
+{
+  if (len>=size) return;
+  PeriodSeries cols(data, size);
+  markOutliers(cols, sigma, len, sdnazi);
+  cols.copyFlags(data);
+}
+
+
+/////////////////////////////////////////////////////////////////
+//Check a value against the local mean using the sliding sums, unless
+//it is too close to call in which case the window is summed exactly
+static bool isHigh(float *ref, int i, const SlidingStats &stats,
+		   int len, float cutoff)
+{
+  double mean = (float)stats.mean();
+  if (fabs(ref[i]-cutoff*mean) <=
+      MEANTOL*(fabs(ref[i])+fabs(cutoff*mean))) {
+    mean = getAvg(ref, stats.start(), len);
+  }
+  return ref[i]/mean>cutoff;
+}
+
+
+/////////////////////////////////////////////////////////////////
+//Flag values in either column more than 'cutoff' times the local mean,
+//returning how many were flagged. Periods already flagged before we
+//started are flagged and counted again for the first column, as they
+//always have been, but not for the second.
+static int flagPower(float *ref1, float *ref2, bool *flags, int size,
+		     float cutoff, int len)
+{
+  float *refs[2] = {ref1, ref2};
   int halflen = len/2;
-  double mean;
   int end = size-halflen;
   int count = 0;
+  double mean[2];
 
-  float ref[size];
-
-  //Look at the first input channel
-  for (int i=0; i<size; i++) ref[i] = data[i].power1;
   //Process the leading data
-  mean = getAvg(ref, 0, len);
+  for (int c=0; c<2; c++) mean[c] = getAvg(refs[c], 0, len);
   for (int i=0; i<halflen; i++) {
-    if (ref[i]/mean>cutoff) {
-      data[i].RFI = true;
-      count++;
+    for (int c=0; c<2; c++) {
+      if (refs[c][i]/mean[c]>cutoff && (c==0 || !flags[i])) {
+	flags[i] = true;
+	count++;
+      }
     }
   }
   //Process the bulk middle section of the samples
+  SlidingStats stats1(ref1, len), stats2(ref2, len);
+  SlidingStats *stats[2] = {&stats1, &stats2};
   for (int i=halflen; i<end; i++) {
-    //Calculate stddev and mean for data centered on this point
-    mean = getAvg(ref, i-halflen, len);
-    if (ref[i]/mean>cutoff) {
-      data[i].RFI = true;
-      count++;
+    if (i>halflen) {
+      stats1.step();
+      stats2.step();
+    }
+    for (int c=0; c<2; c++) {
+      if ((c==0 || !flags[i]) && isHigh(refs[c], i, *stats[c], len, cutoff)) {
+	flags[i] = true;
+	count++;
+      }
     }
   }
-  //And use that last value for the remaining data
+  //And use that last window for the remaining data
+  for (int c=0; c<2; c++) mean[c] = getAvg(refs[c], end-1-halflen, len);
   for (int i=end; i<size; i++) {
-    if (ref[i]/mean>cutoff) {
-      data[i].RFI = true;
-      count++;
+    for (int c=0; c<2; c++) {
+      if (refs[c][i]/mean[c]>cutoff && (c==0 || !flags[i])) {
+	flags[i] = true;
+	count++;
+      }
     }
   }
+  return count;
+}
 
-  //Look at the second input channel
-  for (int i=0; i<size; i++) ref[i] = data[i].power2;
-  //Process the leading data
-  mean = getAvg(ref, 0, len);
-  for (int i=0; i<halflen; i++) {
-    if (ref[i]/mean>cutoff && !data[i].RFI) {
-      data[i].RFI = true;
-      count++;
-    }
+
+/////////////////////////////////////////////////////////////////
+//Flag data more than 'cutoff' times the local mean
+void powerClean(PeriodSeries &data, float cutoff, int len)
+{
+  int size = data.size();
+  if (len>=size) {
+    //Don't bother flagging any if there's not much data
+    return;
   }
-  //Process the bulk middle section of the samples
-  for (int i=halflen; i<end; i++) {
-    //Calculate stddev and mean for data centered on this point
-    mean = getAvg(ref, i-halflen, len);
-    if (ref[i]/mean>cutoff && !data[i].RFI) {
-	data[i].RFI = true;
-	count++;
-    }
+  int count = flagPower(data.power1, data.power2, data.RFI,
+			size, cutoff, len);
+
+  if (count>0) cerr << "Removed " << count << " of " << size << " too far from local mean\n";
+}
+
+
+/////////////////////////////////////////////////////////////////
+//Flag data more than 'cutoff' times the local mean
+void powerClean(IntegPeriod *data, int size, float cutoff, int len)
+{
+  if (len>=size) return;
+  PeriodSeries cols(data, size);
+  powerClean(cols, cutoff, len);
+  cols.copyFlags(data);
+}
+
+
+//Scale which makes the median absolute deviation of gaussian noise an
+//estimate of its standard deviation
+#define MADSCALE 1.4826
+//Smallest deviation we will believe, as a fraction of the median, so
+//that flat or quantised data isn't flagged for the slightest wobble
+#define MADFLOOR 1e-6
+
+
+/////////////////////////////////////////////////////////////////
+//Order statistics of a window of values which slides along a column.
+//The window is kept sorted, so finding where a value goes or comes out
+//is a binary search and the k'th smallest value is just looked up. Only
+//the values after it in the window have to be shuffled along, which is
+//a single short memmove for the window lengths we use.
+class OrderWindow {
+public:
+  OrderWindow(int len)
+    :itsCount(0) {itsVals = new float[len];}
+  ~OrderWindow() {delete[] itsVals;}
+
+  //Add a value to the window
+  inline void add(float v) {
+    int p = lowerBound(v);
+    memmove(itsVals+p+1, itsVals+p, (itsCount-p)*sizeof(float));
+    itsVals[p] = v;
+    itsCount++;
   }
-  //And use that last value for the remaining data
-  for (int i=end; i<size; i++) {
-    if (ref[i]/mean>cutoff && !data[i].RFI) {
-      data[i].RFI = true;
-      count++;
+  //Take a value which is in the window back out of it
+  inline void remove(float v) {
+    int p = lowerBound(v);
+    memmove(itsVals+p, itsVals+p+1, (itsCount-p-1)*sizeof(float));
+    itsCount--;
+  }
+  //Return how many values are in the window
+  inline int count() const {return itsCount;}
+  //Return the k'th smallest value in the window, counting from zero
+  inline float kth(int k) const {return itsVals[k];}
+
+private:
+  //Sort order for the window, with any NaNs last
+  static inline bool before(float a, float b) {
+    return isnan(b) ? !isnan(a) : a<b;
+  }
+  //Return the position of the first value not before 'v'
+  int lowerBound(float v) const {
+    int lo = 0, hi = itsCount;
+    while (lo<hi) {
+      int mid = (lo+hi)/2;
+      if (before(itsVals[mid], v)) lo = mid+1;
+      else hi = mid;
     }
+    return lo;
   }
 
-  if (count>0) cerr << "Removed " << count << " of " << size << " too far from local mean\n";
+  //The values in the window, in order
+  float *itsVals;
+  int itsCount;
+};
+
+
+/////////////////////////////////////////////////////////////////
+//Return the k'th smallest absolute deviation from the median. Below the
+//median the deviations increase as we walk down the sorted window and
+//above it as we walk up, so this is the k'th smallest of two sorted
+//sequences which we find by bisection without forming either of them.
+static double kthDeviation(const OrderWindow &win, double median, int k)
+{
+  int na = win.count()/2, nb = win.count()-na;
+  #define LOWDEV(j) (median-win.kth(na-1-(j)))
+  #define HIGHDEV(j) (win.kth(na+(j))-median)
+  int lo = (k+1>nb) ? k+1-nb : 0;
+  int hi = (k+1<na) ? k+1 : na;
+  while (lo<hi) {
+    int i = (lo+hi)/2;
+    if (LOWDEV(i)<HIGHDEV(k-i)) lo = i+1;
+    else hi = i;
+  }
+  double res = -1.0;
+  if (lo>0) res = LOWDEV(lo-1);
+  if (k+1-lo>0 && HIGHDEV(k-lo)>res) res = HIGHDEV(k-lo);
+  #undef LOWDEV
+  #undef HIGHDEV
+  return res;
 }
 
 
 /////////////////////////////////////////////////////////////////
-//Find closest match or return -1
-int nearest(int i, timegen_t *a, int alen,
-	    timegen_t *b, int blen, timegen_t cutoff)
+//Find the median and median absolute deviation of the window
+static void medianMAD(const OrderWindow &win, double &median, double &mad)
 {
-  if (a==NULL || alen==0 || b==NULL || blen==0) return -1;
-
-  //Need to match up appropriate samples
-  //Dodgy slow implementation too
-  int b2=-1;
-  bool first = true;
-  long long bestdiff = 0;
-  for (int b1=0; b1<blen; b1++) {
-    long long thisdiff = a[i] - b[b1];
-    if (thisdiff<0) thisdiff = -thisdiff; //Get absolute
-    //Compare this with best
-    if (thisdiff<bestdiff || first) {
-      bestdiff = thisdiff;
-      b2 = b1;
-      first = false;
-    }
+  int w = win.count(), h = w/2;
+  if (w%2) {
+    median = win.kth(h);
+    mad = kthDeviation(win, median, h);
+  } else {
+    median = 0.5*((double)win.kth(h-1)+win.kth(h));
+    mad = 0.5*(kthDeviation(win, median, h-1)+kthDeviation(win, median, h));
   }
-  if (cutoff!=0 && bestdiff>cutoff) return -1;
-  return b2;
 }
 
 
 /////////////////////////////////////////////////////////////////
-//Find bidirectional closest match or return -1
-int matchTimes(int i, timegen_t *a, int alen,
-	              timegen_t *b, int blen)
+//Return the level above which values count as outliers
+static inline double medianLimit(const OrderWindow &win, float sigma)
 {
-  if (a==NULL || alen==0 || b==NULL || blen==0) return -1;
-
-  //Need to match up appropriate samples
-  //Dodgy slow implementation too
-  int b2=-1, a1=-1;
-
-  long long bestdiff = a[i] - b[0];
-  for (int b1=0; b1<blen; b1++) {
-    long long thisdiff = a[i] - b[b1];
-    if (thisdiff<0) thisdiff = -thisdiff; //Get absolute
-    //Compare this with best
-    if (thisdiff<=bestdiff) {
-      bestdiff = thisdiff;
-      b2 = b1;
+  double median, mad;
+  medianMAD(win, median, mad);
+  if (mad<MADFLOOR*fabs(median)) mad = MADFLOOR*fabs(median);
+  return median+sigma*MADSCALE*mad;
+}
+
+
+/////////////////////////////////////////////////////////////////
+//Flag values in either column more than 'sigma' robust standard
+//deviations above the local median, returning how many new flags were
+//raised. The windows are placed as flagOutliers places them.
+static int flagMedian(float *ref1, float *ref2, bool *flags, int size,
+		      float sigma, int len)
+{
+  float *refs[2] = {ref1, ref2};
+  int halflen = len/2;
+  int end = size-halflen;
+  int count = 0;
+  double limit[2];
+
+  OrderWindow win1(len), win2(len);
+  OrderWindow *wins[2] = {&win1, &win2};
+  for (int i=0; i<len; i++) {
+    win1.add(ref1[i]);
+    win2.add(ref2[i]);
+  }
+  //Process the leading data
+  for (int c=0; c<2; c++) limit[c] = medianLimit(*wins[c], sigma);
+  for (int i=0; i<halflen; i++) {
+    for (int c=0; c<2; c++) {
+      if (!flags[i] && refs[c][i]>limit[c]) {
+	flags[i] = true;
+	count++;
+      }
     }
   }
-  if (b2==-1) return -1;
-
-  //Then also check if this ref epoch is closest to the data
-  long long backdiff = a[0] - b[b2];
-  if (backdiff<0) backdiff = -backdiff; //Get absolute
-  for (int a2=0; a2<alen; a2++) {
-    long long thisdiff = a[a2] - b[b2];
-      if (thisdiff<0) thisdiff = -thisdiff; //Get absolute
-      //Compare this with best
-      if (thisdiff<=backdiff) {
-	backdiff = thisdiff;
-	a1 = a2;
+  //Process the bulk middle section, using the window centred on each
+  //point. The last of these windows is kept for the trailing data.
+  for (int i=halflen; i<size; i++) {
+    if (i>halflen && i<end) {
+      for (int c=0; c<2; c++) {
+	wins[c]->remove(refs[c][i-halflen-1]);
+	wins[c]->add(refs[c][i-halflen-1+len]);
+	limit[c] = medianLimit(*wins[c], sigma);
       }
+    }
+    for (int c=0; c<2; c++) {
+      if (!flags[i] && refs[c][i]>limit[c]) {
+	flags[i] = true;
+	count++;
+      }
+    }
   }
+  return count;
+}
+
 
-  if (i!=a1) {
-    //Not the closest match in both directions
-    //cerr << "failed " << a[a1].timeStamp << "\t" << b[b1].timeStamp << endl;
-    return -1;
+/////////////////////////////////////////////////////////////////
+//Flag data more than 'sigma' robust deviations above the local median
+void markMedianOutliers(PeriodSeries &data, float sigma, int len)
+{
+  int size = data.size();
+  if (len>=size) {
+    //Don't bother flagging any if there's not much data
+    return;
   }
-  return b2;
+  int count = flagMedian(data.power1, data.power2, data.RFI,
+			 size, sigma, len);
+
+  if (count>0) cerr << "Removed " << count << " of " << size << " too far above local median\n";
+}
+
+
+/////////////////////////////////////////////////////////////////
+//Flag data more than 'sigma' robust deviations above the local median
+void markMedianOutliers(IntegPeriod *data, int size, float sigma, int len)
+{
+  if (len>=size) return;
+  PeriodSeries cols(data, size);
+  markMedianOutliers(cols, sigma, len);
+  cols.copyFlags(data);
 }
 
 
@@ -332,14 +611,16 @@ void matchTimes(float *adata, timegen_t *atimes, int alen,
   bres = new float[maxlen];
   restime = new timegen_t[maxlen];
 
+  int *map = TimeAlign::mutual(atimes, alen, btimes, blen);
   for (int i=0; i<alen; i++) {
-    int j = matchTimes(i, atimes, alen, btimes, blen);
+    int j = map[i];
     if (j==-1) continue;
     ares[reslen] = adata[i];
     bres[reslen] = bdata[j];
     restime[reslen] = atimes[i];
     reslen++;
   }
+  delete[] map;
 }
 
 
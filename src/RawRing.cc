@@ -0,0 +1,311 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+#include <RawRing.h>
+#include <IntegPeriod.h>
+#include <sstream>
+#include <iostream>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+static const char *theirRingMagic = "SACRING";
+//Most periods we will return for a single request
+#define MAXRESULTS 1000000
+
+//Header at the start of the ring file
+typedef struct ringheader_t {
+  char magic[8];
+  int version;
+  //Number of entries in the index
+  int numslots;
+  //Length of the data area
+  long long datasize;
+  //Position in the data area to write the next period. Positions count
+  //the bytes written since the ring was created, the offset within the
+  //data area is the position modulo 'datasize'
+  long long head;
+  //Sequence numbers of the oldest period in the ring and the next
+  long long first;
+  long long next;
+} ringheader_t;
+
+//Index entry describing one period in the ring
+typedef struct ringslot_t {
+  long long timeStamp;
+  long long pos;
+  int len;
+  int reserved;
+} ringslot_t;
+
+
+///////////////////////////////////////////////////////////////////////
+//Return where the data area starts for an index with 'numslots' entries
+static long long dataOffset(int numslots)
+{
+  long long len = sizeof(ringheader_t) + numslots*sizeof(ringslot_t);
+  long long page = sysconf(_SC_PAGESIZE);
+  return ((len+page-1)/page)*page;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Constructor
+RawRing::RawRing(string fname, long long maxage,
+		 int samprate, int integtime, int numbins)
+:itsFileName(fname),
+itsCompressAudio(false),
+itsMap(NULL),
+itsMapLen(0),
+itsHeader(NULL),
+itsIndex(NULL),
+itsData(NULL),
+itsGuard(0)
+{
+  pthread_mutex_init(&itsLock, NULL);
+
+  //Work out the most space a period may take and how many we need
+  if (integtime<1) integtime = 1;
+  long long numpers = maxage/(1000ll*integtime) + 1;
+  long long audiolen = ((long long)samprate*integtime)/1000 + 1;
+  long long perlen = sizeof(long long) + 5*sizeof(float)
+    + 4*sizeof(int) + 5 + 4ll*numbins*sizeof(float)
+    + 2*sizeof(audio_t)*audiolen;
+  long long datasize = numpers*perlen;
+  //Compressed periods are smaller so the index allows for more of them
+  int numslots = 2*numpers;
+  long long total = dataOffset(numslots) + datasize;
+
+  //Don't hand out the last minute of data before it is overwritten
+  itsGuard = perlen*(60000/integtime + 1);
+  if (itsGuard>datasize/2) itsGuard = datasize/2;
+
+  int fd = open(fname.c_str(), O_RDWR|O_CREAT, 0644);
+  if (fd<0) {
+    perror(("RawRing: " + fname).c_str());
+    return;
+  }
+
+  //See if there is a usable ring from a previous run
+  struct stat st;
+  bool reuse = false;
+  if (fstat(fd, &st)==0 && st.st_size==total) {
+    itsMap = (char*)mmap(NULL, total, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (itsMap==MAP_FAILED) itsMap = NULL;
+    if (itsMap!=NULL) {
+      ringheader_t *hdr = (ringheader_t*)itsMap;
+      if (strncmp(hdr->magic, theirRingMagic, 8)==0 && hdr->version==1 &&
+	  hdr->numslots==numslots && hdr->datasize==datasize &&
+	  hdr->first<=hdr->next && hdr->next-hdr->first<=numslots) {
+	reuse = true;
+      } else {
+	munmap(itsMap, total);
+	itsMap = NULL;
+      }
+    }
+  }
+
+  if (!reuse) {
+    cerr << "RawRing: Creating " << total/1048576 << "MB ring " << fname << endl;
+    if (!create(fd, numslots, datasize)) {
+      close(fd);
+      return;
+    }
+    itsMap = (char*)mmap(NULL, total, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (itsMap==MAP_FAILED) {
+      perror("RawRing: mmap");
+      itsMap = NULL;
+      close(fd);
+      return;
+    }
+  }
+  //We don't need the file handle once it has been mapped
+  close(fd);
+
+  itsMapLen = total;
+  itsHeader = (ringheader_t*)itsMap;
+  itsIndex = (ringslot_t*)(itsMap + sizeof(ringheader_t));
+  itsData = itsMap + dataOffset(numslots);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Destructor
+RawRing::~RawRing()
+{
+  if (itsMap!=NULL) {
+    msync(itsMap, itsMapLen, MS_SYNC);
+    munmap(itsMap, itsMapLen);
+  }
+  pthread_mutex_destroy(&itsLock);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Create a new empty ring file of the given size
+bool RawRing::create(int fd, int numslots, long long datasize)
+{
+  long long total = dataOffset(numslots) + datasize;
+  //Discard any old contents, then reserve all of the space now so
+  //that we can't run out of disk later on
+  if (ftruncate(fd, 0)!=0) {
+    perror("RawRing: ftruncate");
+    return false;
+  }
+  int err = posix_fallocate(fd, 0, total);
+  if (err!=0) {
+    cerr << "RawRing: Could not allocate " << total << " bytes for "
+	 << itsFileName << ": " << strerror(err) << endl;
+    return false;
+  }
+
+  ringheader_t hdr;
+  memset(&hdr, 0, sizeof(ringheader_t));
+  strncpy(hdr.magic, theirRingMagic, 8);
+  hdr.version = 1;
+  hdr.numslots = numslots;
+  hdr.datasize = datasize;
+  if (pwrite(fd, &hdr, sizeof(ringheader_t), 0)!=sizeof(ringheader_t)) {
+    perror("RawRing: write");
+    return false;
+  }
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Return the index slot for the given sequence number
+inline ringslot_t &RawRing::slot(long long seq)
+{
+  return itsIndex[seq%itsHeader->numslots];
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Append a copy of the period to the ring
+void RawRing::put(const IntegPeriod &per)
+{
+  if (!isOpen()) return;
+
+  //Serialise the period before we take the lock
+  ostringstream oss;
+  IntegPeriod::save(oss, per, itsCompressAudio);
+  string rec = oss.str();
+  long long len = rec.length();
+
+  Lock();
+  ringheader_t *hdr = itsHeader;
+  if (len>hdr->datasize) {
+    Unlock();
+    cerr << "RawRing: Period of " << len << " bytes is too big for the ring\n";
+    return;
+  }
+  //Periods never straddle the end of the data area
+  long long pos = hdr->head;
+  long long offset = pos%hdr->datasize;
+  if (offset+len>hdr->datasize) pos += hdr->datasize-offset;
+
+  //Forget the periods we are about to overwrite
+  while (hdr->first<hdr->next &&
+	 (slot(hdr->first).pos<pos+len-hdr->datasize ||
+	  hdr->next-hdr->first>=hdr->numslots)) {
+    hdr->first++;
+  }
+  memcpy(itsData + pos%hdr->datasize, rec.data(), len);
+
+  ringslot_t &s = slot(hdr->next);
+  s.timeStamp = per.timeStamp;
+  s.pos = pos;
+  s.len = len;
+  hdr->head = pos+len;
+  hdr->next++;
+  Unlock();
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Return the first sequence number with a time stamp at or after 'epoch'
+long long RawRing::findSeq(long long epoch)
+{
+  long long lo = itsHeader->first, hi = itsHeader->next;
+  while (lo<hi) {
+    long long mid = lo + (hi-lo)/2;
+    if (slot(mid).timeStamp<epoch) lo = mid+1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Find all periods between the given times
+void RawRing::slice(long long start, long long end, rawslice_t &res)
+{
+  res.count = 0;
+  res.start[0] = res.start[1] = NULL;
+  res.len[0] = res.len[1] = 0;
+  res.pos = 0;
+  if (!isOpen()) return;
+
+  Lock();
+  ringheader_t *hdr = itsHeader;
+  //Skip the oldest periods since they are about to be overwritten
+  long long oldest = hdr->first;
+  while (oldest<hdr->next &&
+	 slot(oldest).pos<hdr->head-hdr->datasize+itsGuard) {
+    oldest++;
+  }
+  long long a = findSeq(start);
+  if (a<oldest) a = oldest;
+  long long b = (end==0) ? hdr->next : findSeq(end+1);
+  if (b-a>MAXRESULTS) b = a+MAXRESULTS;
+  if (a>=b) {
+    Unlock();
+    return;
+  }
+
+  res.count = b-a;
+  res.pos = slot(a).pos;
+  long long endpos = slot(b-1).pos + slot(b-1).len;
+  long long offset = res.pos%hdr->datasize;
+  long long wrap = res.pos - offset + hdr->datasize;
+  res.start[0] = itsData + offset;
+  if (endpos<=wrap) {
+    res.len[0] = endpos-res.pos;
+  } else {
+    //The slice wraps, find the last period before the end of the ring
+    long long lo = a, hi = b;
+    while (lo<hi) {
+      long long mid = lo + (hi-lo)/2;
+      if (slot(mid).pos<wrap) lo = mid+1;
+      else hi = mid;
+    }
+    res.len[0] = slot(lo-1).pos + slot(lo-1).len - res.pos;
+    res.start[1] = itsData;
+    res.len[1] = endpos-wrap;
+  }
+  Unlock();
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Check the data in the slice hasn't been overwritten
+bool RawRing::stillValid(const rawslice_t &sl)
+{
+  if (sl.count==0 || !isOpen()) return true;
+  Lock();
+  bool res = sl.pos >= itsHeader->head-itsHeader->datasize;
+  Unlock();
+  return res;
+}
@@ -0,0 +1,278 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+#include <RecordV2.h>
+#include <IntegPeriod.h>
+#include <ArchiveMap.h>
+#include <AudioCodec.h>
+#include <pthread.h>
+#include <string.h>
+
+static const char *theirFileMagic = "SACDATA";
+//Spells "REC2" in the file
+const unsigned int RecordV2::theirMagic = 0x32434552;
+//Largest record we will believe
+#define MAXRECORD (1<<30)
+//Largest number of spectral channels we will believe
+#define MAXBINS   (1<<20)
+//Number of spectra a record may hold
+#define NUMSPEC   4
+
+//Round up to a multiple of 8 bytes
+static inline long long pad8(long long len)
+{
+  return (len+7)&~7ll;
+}
+
+//Lookup table for the software CRC, built on first use
+static unsigned int theirCRCTable[256];
+static pthread_once_t theirCRCOnce = PTHREAD_ONCE_INIT;
+
+
+///////////////////////////////////////////////////////////////////////
+//Build the table for the reflected Castagnoli polynomial
+static void initCRCTable()
+{
+  for (unsigned int i=0; i<256; i++) {
+    unsigned int c = i;
+    for (int k=0; k<8; k++) c = (c&1) ? (c>>1)^0x82F63B78 : (c>>1);
+    theirCRCTable[i] = c;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Calculate the CRC a byte at a time
+static unsigned int crcSoftware(unsigned int crc, const char *data,
+				long long len)
+{
+  pthread_once(&theirCRCOnce, initCRCTable);
+  const unsigned char *p = (const unsigned char*)data;
+  for (long long i=0; i<len; i++) {
+    crc = theirCRCTable[(crc^p[i])&0xff] ^ (crc>>8);
+  }
+  return crc;
+}
+
+
+#if defined(__x86_64__)
+///////////////////////////////////////////////////////////////////////
+//Calculate the CRC with the SSE4.2 instruction, eight bytes at a time
+__attribute__((target("sse4.2")))
+static unsigned int crcHardware(unsigned int crc, const char *data,
+				long long len)
+{
+  unsigned long long c = crc;
+  for (; len>=8; len-=8, data+=8) {
+    unsigned long long v;
+    memcpy(&v, data, sizeof(v));
+    c = __builtin_ia32_crc32di(c, v);
+  }
+  crc = (unsigned int)c;
+  for (; len>0; len--, data++) {
+    crc = __builtin_ia32_crc32qi(crc, (unsigned char)*data);
+  }
+  return crc;
+}
+#endif
+
+
+///////////////////////////////////////////////////////////////////////
+//Calculate the CRC32C of a block
+unsigned int RecordV2::crc32c(const char *data, long long len,
+			      unsigned int crc)
+{
+  crc = ~crc;
+#if defined(__x86_64__)
+  static bool hardware = __builtin_cpu_supports("sse4.2");
+  if (hardware) return ~crcHardware(crc, data, len);
+#endif
+  return ~crcSoftware(crc, data, len);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Write the file header
+void RecordV2::writeFileHeader(ostream &os)
+{
+  v2fileheader_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  strncpy(hdr.magic, theirFileMagic, 8);
+  hdr.version = 2;
+  os.write((char*)&hdr, sizeof(hdr));
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Check for a version 2 file header
+bool RecordV2::isFileHeader(const char *data, long long len)
+{
+  if (len<(long long)sizeof(v2fileheader_t)) return false;
+  v2fileheader_t hdr;
+  memcpy(&hdr, data, sizeof(hdr));
+  return strncmp(hdr.magic, theirFileMagic, 8)==0 && hdr.version==2;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Return the offset of a section within a record
+long long RecordV2::sectionOffset(const v2header_t &hdr, int section)
+{
+  long long off = sizeof(v2header_t);
+  long long speclen = pad8(hdr.numBins*(long long)sizeof(float));
+  for (int i=0; i<section && i<NUMSPEC; i++) {
+    if (hdr.flags&(v2_phase<<i)) off += speclen;
+  }
+  return off;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Write a period as a version 2 record
+void RecordV2::save(ostream &os, const IntegPeriod &per, bool packaudio)
+{
+  static const char zeros[8] = {0,0,0,0,0,0,0,0};
+  v2header_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = theirMagic;
+  hdr.timeStamp = per.timeStamp;
+  hdr.powerX = per.powerX;
+  hdr.power1 = per.power1;
+  hdr.power2 = per.power2;
+  hdr.amplitude = per.amplitude;
+  hdr.phase = per.phase;
+  hdr.numBins = per.numBins;
+  if (per.RFI) hdr.flags |= v2_rfi;
+
+  const float *spec[NUMSPEC] = {per.phaseSpec, per.crossSpec,
+				per.input1Spec, per.input2Spec};
+  int speclen = 0;
+  for (int i=0; i<NUMSPEC; i++) {
+    if (spec[i]!=NULL) hdr.flags |= (v2_phase<<i);
+  }
+  if (hdr.flags&(v2_phase|v2_cross|v2_input1|v2_input2)) {
+    speclen = per.numBins*sizeof(float);
+  }
+
+  //Compress the audio if that was requested and actually helps
+  char *packed = NULL;
+  int packedsize = 0, packedlen = 0;
+  const char *audio = NULL;
+  if (per.rawAudio!=NULL && per.audioLen>0) {
+    hdr.audioLen = per.audioLen;
+    hdr.audioBytes = 2*sizeof(audio_t)*per.audioLen;
+    audio = (const char*)per.rawAudio;
+    if (packaudio) {
+      AudioCodec::encode(per.rawAudio, per.audioLen,
+			 packed, packedsize, packedlen);
+      if (packedlen<hdr.audioBytes) {
+	hdr.flags |= v2_packedaudio;
+	hdr.audioBytes = packedlen;
+	audio = packed;
+      }
+    }
+  }
+
+  long long length = sizeof(v2header_t);
+  for (int i=0; i<NUMSPEC; i++) {
+    if (spec[i]!=NULL) length += pad8(speclen);
+  }
+  length += pad8(hdr.audioBytes);
+  hdr.length = length;
+
+  //Checksum everything with the crc field still zero
+  unsigned int crc = crc32c((char*)&hdr, sizeof(hdr));
+  for (int i=0; i<NUMSPEC; i++) {
+    if (spec[i]==NULL) continue;
+    crc = crc32c((const char*)spec[i], speclen, crc);
+    crc = crc32c(zeros, pad8(speclen)-speclen, crc);
+  }
+  if (audio!=NULL) {
+    crc = crc32c(audio, hdr.audioBytes, crc);
+    crc = crc32c(zeros, pad8(hdr.audioBytes)-hdr.audioBytes, crc);
+  }
+  hdr.crc = crc;
+
+  os.write((char*)&hdr, sizeof(hdr));
+  for (int i=0; i<NUMSPEC; i++) {
+    if (spec[i]==NULL) continue;
+    os.write((const char*)spec[i], speclen);
+    os.write(zeros, pad8(speclen)-speclen);
+  }
+  if (audio!=NULL) {
+    os.write(audio, hdr.audioBytes);
+    os.write(zeros, pad8(hdr.audioBytes)-hdr.audioBytes);
+  }
+  if (packed!=NULL) delete[] packed;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Check a record and return its length
+long long RecordV2::check(const char *rec, long long avail)
+{
+  if (avail<(long long)sizeof(v2header_t)) return -1;
+  v2header_t hdr;
+  memcpy(&hdr, rec, sizeof(hdr));
+  if (hdr.magic!=theirMagic || hdr.length<sizeof(v2header_t) ||
+      hdr.length>MAXRECORD || hdr.length%8!=0 || hdr.length>avail) {
+    return -1;
+  }
+  int nspec = 0;
+  for (int i=0; i<NUMSPEC; i++) {
+    if (hdr.flags&(v2_phase<<i)) nspec++;
+  }
+  if (nspec>0 && (hdr.numBins<0 || hdr.numBins>MAXBINS)) return -1;
+  if (hdr.audioLen<0 || hdr.audioBytes<0) return -1;
+  if (!(hdr.flags&v2_packedaudio) &&
+      hdr.audioBytes!=2*(long long)sizeof(audio_t)*hdr.audioLen) {
+    return -1;
+  }
+  if (sectionOffset(hdr, NUMSPEC)+pad8(hdr.audioBytes)!=hdr.length) {
+    return -1;
+  }
+
+  //Finally check the contents haven't been damaged
+  unsigned int crc = hdr.crc;
+  hdr.crc = 0;
+  unsigned int actual = crc32c((char*)&hdr, sizeof(hdr));
+  actual = crc32c(rec+sizeof(hdr), hdr.length-sizeof(hdr), actual);
+  if (actual!=crc) return -1;
+  return hdr.length;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Read a record from a stream
+bool RecordV2::read(istream &is, IntegPeriod &per)
+{
+  v2header_t hdr;
+  is.read((char*)&hdr, sizeof(hdr));
+  if (!is.good()) return false;
+  if (hdr.magic!=theirMagic || hdr.length<sizeof(v2header_t) ||
+      hdr.length>MAXRECORD || hdr.length%8!=0) {
+    //We can't trust the length, so can't find the next record
+    is.setstate(ios::failbit);
+    return false;
+  }
+
+  //Read the whole record so that we can check it
+  char *rec = new char[hdr.length];
+  memcpy(rec, &hdr, sizeof(hdr));
+  is.read(rec+sizeof(hdr), hdr.length-sizeof(hdr));
+  if (!is.good()) {
+    delete[] rec;
+    return false;
+  }
+  bool res = check(rec, hdr.length)>0 && PeriodView(rec, true).get(per);
+  delete[] rec;
+  if (!res) is.setstate(ios::failbit);
+  return res;
+}
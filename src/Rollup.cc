@@ -0,0 +1,376 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+//Summary statistics of the integration periods within a time bucket.
+
+#include <Rollup.h>
+#include <IntegPeriod.h>
+#include <ServerPool.h>
+#include <sstream>
+#include <string.h>
+#include <iostream>
+#include <math.h>
+
+///////////////////////////////////////////////////////////////////////
+//Constructor
+Rollup::Rollup()
+{
+  clear(0, 0);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Reset to an empty bucket
+void Rollup::clear(long long start, long long length)
+{
+  timeStamp = start;
+  period = length;
+  count = 0;
+  numRFI = 0;
+  for (int i=0; i<rollup_numfields; i++) {
+    sum[i] = 0.0;
+    min[i] = 0.0;
+    max[i] = 0.0;
+  }
+  sumI = sumQ = 0.0;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Accumulate an integration period into this bucket
+void Rollup::add(const IntegPeriod &per)
+{
+  float vals[rollup_numfields];
+  vals[rollup_power1] = per.power1;
+  vals[rollup_power2] = per.power2;
+  vals[rollup_powerX] = per.powerX;
+  vals[rollup_amplitude] = per.amplitude;
+
+  for (int i=0; i<rollup_numfields; i++) {
+    sum[i] += vals[i];
+    if (count==0 || vals[i]<min[i]) min[i] = vals[i];
+    if (count==0 || vals[i]>max[i]) max[i] = vals[i];
+  }
+  sumI += per.amplitude*cos(per.phase);
+  sumQ += per.amplitude*sin(per.phase);
+  if (per.RFI) numRFI++;
+  count++;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Combine the statistics from another bucket into this one
+void Rollup::add(const Rollup &rhs)
+{
+  if (rhs.count==0) return;
+  for (int i=0; i<rollup_numfields; i++) {
+    sum[i] += rhs.sum[i];
+    if (count==0 || rhs.min[i]<min[i]) min[i] = rhs.min[i];
+    if (count==0 || rhs.max[i]>max[i]) max[i] = rhs.max[i];
+  }
+  sumI += rhs.sumI;
+  sumQ += rhs.sumQ;
+  numRFI += rhs.numRFI;
+  count += rhs.count;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Return the mean phase of the accumulated visibilities
+float Rollup::meanPhase() const
+{
+  if (sumI==0.0 && sumQ==0.0) return 0.0;
+  return atan2(sumQ, sumI);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Fill out an IntegPeriod with the mean values from this bucket
+void Rollup::toIntegPeriod(IntegPeriod &per) const
+{
+  per.timeStamp = timeStamp;
+  per.power1 = mean(rollup_power1);
+  per.power2 = mean(rollup_power2);
+  per.powerX = mean(rollup_powerX);
+  per.amplitude = mean(rollup_amplitude);
+  per.phase = meanPhase();
+  //Only flag the bucket if every period within it was flagged
+  per.RFI = (count>0 && numRFI==count);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Convert an array of rollups to an array of mean IntegPeriods
+void Rollup::toIntegPeriods(IntegPeriod *&res, int &reslen,
+			    const Rollup *data, int count)
+{
+  res = NULL;
+  reslen = 0;
+  if (data==NULL || count<=0) return;
+
+  res = new IntegPeriod[count];
+  for (int i=0; i<count; i++) {
+    if (data[i].count==0) continue;
+    data[i].toIntegPeriod(res[reslen]);
+    reslen++;
+  }
+  if (reslen==0) {
+    delete[] res;
+    res = NULL;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Merge consecutive rollups into buckets of the given length
+void Rollup::rebin(Rollup *data, int &count, long long length)
+{
+  if (data==NULL || count<=0 || length<=0) return;
+
+  int out = 0;
+  for (int i=0; i<count; i++) {
+    long long start = data[i].timeStamp - (data[i].timeStamp%length);
+    long long dur = (data[i].period>length)?data[i].period:length;
+    if (out>0 && data[out-1].timeStamp==start) {
+      //This belongs in the bucket we are currently building
+      data[out-1].add(data[i]);
+    } else {
+      //Start a new output bucket
+      if (out!=i) data[out] = data[i];
+      data[out].timeStamp = start;
+      data[out].period = dur;
+      out++;
+    }
+  }
+  count = out;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Write the fields of a rollup to any kind of output stream
+template <class T>
+static void writeRollup(T &os, const Rollup &roll)
+{
+  os.write((char*)&roll.timeStamp, sizeof(long long));
+  os.write((char*)&roll.period, sizeof(long long));
+  os.write((char*)&roll.count, sizeof(int));
+  os.write((char*)&roll.numRFI, sizeof(int));
+  os.write((char*)roll.sum, rollup_numfields*sizeof(double));
+  os.write((char*)roll.min, rollup_numfields*sizeof(float));
+  os.write((char*)roll.max, rollup_numfields*sizeof(float));
+  os.write((char*)&roll.sumI, sizeof(double));
+  os.write((char*)&roll.sumQ, sizeof(double));
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Operator for saving to a file
+ofstream &operator<<(ofstream& os, const Rollup& roll)
+{
+  writeRollup(os, roll);
+  return os;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Operator for writing across network
+TCPstream &operator<<(TCPstream& os, const Rollup& roll)
+{
+  writeRollup(os, roll);
+  return os;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Save in the same form as operator<< to any stream
+void Rollup::save(ostream &os, const Rollup &roll)
+{
+  writeRollup(os, roll);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Operator for recovering from a serialised state
+istream &operator>>(istream& is, Rollup& roll)
+{
+  is.read((char*)&roll.timeStamp, sizeof(long long));
+  is.read((char*)&roll.period, sizeof(long long));
+  is.read((char*)&roll.count, sizeof(int));
+  is.read((char*)&roll.numRFI, sizeof(int));
+  is.read((char*)roll.sum, rollup_numfields*sizeof(double));
+  is.read((char*)roll.min, rollup_numfields*sizeof(float));
+  is.read((char*)roll.max, rollup_numfields*sizeof(float));
+  is.read((char*)&roll.sumI, sizeof(double));
+  is.read((char*)&roll.sumQ, sizeof(double));
+  return is;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Loads rollups over a connection from the ServerPool
+class RollupRequest : public PoolRequest {
+public:
+  RollupRequest(long long start, long long end, long long resolution,
+		int maxbuckets)
+  :itsStart(start), itsEnd(end), itsResolution(resolution),
+  itsMaxBuckets(maxbuckets), data(NULL), count(0) {}
+  bool run(TCPstream &sock) {
+    if (itsMaxBuckets>0)
+      return Rollup::loadBuckets(data, count, itsStart, itsEnd,
+				 itsMaxBuckets, sock);
+    return Rollup::load(data, count, itsStart, itsEnd, itsResolution, sock);
+  }
+  long long itsStart, itsEnd, itsResolution;
+  int itsMaxBuckets;
+  Rollup *data;
+  int count;
+};
+
+
+///////////////////////////////////////////////////////////////////////
+//Load rollups from the named network server
+bool Rollup::load(Rollup *&data, int &count,
+		  long long start, long long end, long long resolution,
+		  const char *server, int port)
+{
+  RollupRequest req(start, end, resolution, 0);
+  bool res = ServerPool::global().perform(server, port, req);
+  data = req.data;
+  count = req.count;
+  return res;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Load rollups over an established network connection
+bool Rollup::load(Rollup *&data, int &count,
+		  long long start, long long end, long long resolution,
+		  TCPstream &sock)
+{
+  data = NULL;
+  count = 0;
+
+  if (!sock.good()) return false;
+
+  //Request the data from the network server
+  sock << "ROLLUP " << start << " " << end << " " << resolution << endl;
+
+  //Read their response line, how many rollups will it be sending
+  char line[1001];
+  line[1000] = '\0';
+  sock.getline(line, 1000);
+  istringstream countstr(line);
+  countstr >> count;
+
+  if (countstr.fail() || count<0 || count>10000000) {
+    cerr << "Silly rollup count returned by server (" << line << ")\n";
+    count = 0;
+    return false;
+  }
+  if (count==0) {
+    cerr << "Server returned no rollups for the specified period\n";
+    return true;
+  }
+
+  cout << "Server will return " << count << " rollups\n";
+  data = new Rollup[count];
+  for (int i=0; i<count; i++) {
+    sock >> data[i];
+    if (!sock.good()) {
+      cerr << "ERROR reading from network\n";
+      delete[] data;
+      data = NULL;
+      count = 0;
+      return false;
+    }
+  }
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Load a limited number of rollups from a network server
+bool Rollup::loadBuckets(Rollup *&data, int &count,
+			 long long start, long long end, int maxbuckets,
+			 const char *server, int port)
+{
+  if (maxbuckets<1) {
+    data = NULL;
+    count = 0;
+    return false;
+  }
+  RollupRequest req(start, end, 0, maxbuckets);
+  bool res = ServerPool::global().perform(server, port, req);
+  data = req.data;
+  count = req.count;
+  return res;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Load a limited number of rollups over an established connection
+bool Rollup::loadBuckets(Rollup *&data, int &count,
+			 long long start, long long end, int maxbuckets,
+			 TCPstream &sock)
+{
+  data = NULL;
+  count = 0;
+
+  if (!sock.good() || maxbuckets<1) return false;
+
+  //Ask for the summaries with protocol 1.2, so there is a trailer.
+  //Servers which only know 1.1 can't send summaries either.
+  int version = IntegPeriod::negotiate(sock);
+  if (version==0) return false;
+  if (version<12) {
+    cerr << "Server is too old to summarise the data\n";
+    return false;
+  }
+  sock << "BETWEEN " << start << " " << end << " 0 0 0 0 "
+       << maxbuckets << endl;
+
+  char line[1001];
+  line[1000] = '\0';
+
+  //Read their response line, how many rollups will it be sending
+  sock.getline(line, 1000);
+  istringstream countstr(line);
+  countstr >> count;
+  if (countstr.fail() || count<0 || count>maxbuckets) {
+    cerr << "Silly rollup count returned by server (" << line << ")\n";
+    count = 0;
+    return false;
+  }
+
+  if (count>0) data = new Rollup[count];
+  for (int i=0; i<count; i++) {
+    sock >> data[i];
+    if (!sock.good()) break;
+  }
+  //Check the trailer to be sure we got them all
+  if (sock.good()) sock.getline(line, 1000);
+  istringstream trailer(line);
+  string end_word, status;
+  int total = -1;
+  trailer >> end_word >> total >> status;
+  if (!sock.good() || end_word!="END" || total!=count || status!="OK") {
+    cerr << "ERROR reading from network\n";
+    if (data!=NULL) delete[] data;
+    data = NULL;
+    count = 0;
+    return false;
+  }
+  if (count==0) {
+    cerr << "Server returned no rollups for the specified period\n";
+  } else {
+    cout << "Server returned " << count << " rollups\n";
+  }
+  return true;
+}
@@ -0,0 +1,219 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+#include <SegmentStream.h>
+#include <TimeSeriesCodec.h>
+#include <string.h>
+
+static const char *theirSegMagic = "SACSEG1";
+
+///////////////////////////////////////////////////////////////////////
+//Constructor
+SegmentBuf::SegmentBuf()
+:itsMinute(SEG_MINUTES),
+itsBuf(NULL),
+itsBufSize(0),
+itsRaw(NULL),
+itsRawSize(0),
+itsBase(0)
+{
+  setg(NULL, NULL, NULL);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Destructor
+SegmentBuf::~SegmentBuf()
+{
+  if (itsBuf!=NULL) delete[] itsBuf;
+  if (itsRaw!=NULL) delete[] itsRaw;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Read the header from a segment and check that it makes sense
+bool SegmentBuf::readHeader(istream &in, segheader_t &hdr)
+{
+  in.read((char*)&hdr, sizeof(segheader_t));
+  if (in.fail()) return false;
+  if (strncmp(hdr.magic, theirSegMagic, 8)!=0 || hdr.version!=1 ||
+      hdr.numminutes!=SEG_MINUTES) {
+    return false;
+  }
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Fill out a header for an empty segment
+void SegmentBuf::initHeader(segheader_t &hdr, long long daystart)
+{
+  memset(&hdr, 0, sizeof(segheader_t));
+  strncpy(hdr.magic, theirSegMagic, 8);
+  hdr.version = 1;
+  hdr.numminutes = SEG_MINUTES;
+  hdr.daystart = daystart;
+  for (int m=0; m<=SEG_MINUTES; m++) hdr.offsets[m] = sizeof(segheader_t);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Read and decode the data for one minute
+bool SegmentBuf::readMinute(istream &in, const segheader_t &hdr, int minute,
+			    char *&out, int &outsize, int &outlen,
+			    char *&raw, int &rawsize)
+{
+  outlen = 0;
+  long long len = hdr.offsets[minute+1] - hdr.offsets[minute];
+  if (len<=0) return true;
+  if (len>0x7fffffffll) return false;
+
+  in.clear();
+  in.seekg(hdr.offsets[minute]);
+  if (hdr.encoding[minute]==seg_plain) {
+    if (outsize<len) {
+      if (out!=NULL) delete[] out;
+      out = new char[len];
+      outsize = len;
+    }
+    in.read(out, len);
+    if (in.gcount()!=len) return false;
+    outlen = len;
+  } else if (hdr.encoding[minute]==seg_timeseries) {
+    if (rawsize<len) {
+      if (raw!=NULL) delete[] raw;
+      raw = new char[len];
+      rawsize = len;
+    }
+    in.read(raw, len);
+    if (in.gcount()!=len) return false;
+    if (!TimeSeriesCodec::decode(raw, len, out, outsize, outlen)) {
+      return false;
+    }
+  } else {
+    //An encoding which we don't understand
+    return false;
+  }
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Open the segment ready to read from the minute containing 'epoch'
+bool SegmentBuf::open(const char *fname, long long epoch)
+{
+  itsFile.open(fname, ios::binary);
+  if (itsFile.fail() || !readHeader(itsFile, itsHeader)) return false;
+
+  //Find the first minute from the argument onward which has data
+  long long m = (epoch - itsHeader.daystart)/60000000;
+  if (m<0) m = 0;
+  for (; m<SEG_MINUTES; m++) {
+    if (itsHeader.offsets[m+1]>itsHeader.offsets[m]) break;
+  }
+  if (m>=SEG_MINUTES) return false;
+  //The data is loaded when it is first read
+  itsMinute = m;
+  itsBase = 0;
+  setg(itsBuf, itsBuf, itsBuf);
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Load the next minute which has any data
+bool SegmentBuf::loadMinute()
+{
+  while (itsMinute<SEG_MINUTES) {
+    int m = itsMinute++;
+    if (itsHeader.offsets[m+1]<=itsHeader.offsets[m]) continue;
+
+    int len;
+    if (!readMinute(itsFile, itsHeader, m, itsBuf, itsBufSize, len,
+		    itsRaw, itsRawSize)) {
+      cerr << "SegmentBuf: Could not read data for minute " << m
+	   << " of segment, skipping the rest of the day\n";
+      break;
+    }
+    if (len==0) continue;
+    itsBase += egptr()-eback();
+    setg(itsBuf, itsBuf, itsBuf+len);
+    return true;
+  }
+  //Nothing left, leave the stream positioned at the end
+  itsMinute = SEG_MINUTES;
+  itsBase += egptr()-eback();
+  setg(itsBuf, itsBuf, itsBuf);
+  return false;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Get more data when the current minute has been consumed
+SegmentBuf::int_type SegmentBuf::underflow()
+{
+  if (gptr()<egptr()) return traits_type::to_int_type(*gptr());
+  if (!loadMinute()) return traits_type::eof();
+  return traits_type::to_int_type(*gptr());
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Skip relative to the current position
+SegmentBuf::pos_type SegmentBuf::seekoff(off_type off, ios_base::seekdir dir,
+					 ios_base::openmode which)
+{
+  if (dir!=ios_base::cur || !(which&ios_base::in)) {
+    return pos_type(off_type(-1));
+  }
+  off_type avail = egptr()-gptr();
+  if (off<0 && -off>gptr()-eback()) {
+    //Records never span minutes so we shouldn't need to go back further
+    return pos_type(off_type(-1));
+  }
+  if (off<=avail) {
+    setg(eback(), gptr()+off, egptr());
+    return pos_type(itsBase + (gptr()-eback()));
+  }
+  //Skip over as many minutes as necessary
+  off -= avail;
+  while (loadMinute()) {
+    avail = egptr()-eback();
+    if (off<=avail) {
+      setg(eback(), eback()+off, egptr());
+      return pos_type(itsBase + off);
+    }
+    off -= avail;
+  }
+  //Past the end, as for a file the next read will find the end
+  return pos_type(itsBase);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Constructor
+SegmentStream::SegmentStream()
+:istream(NULL)
+{
+  init(&itsSegBuf);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Open the named segment
+bool SegmentStream::open(const char *fname, long long epoch)
+{
+  if (!itsSegBuf.open(fname, epoch)) {
+    setstate(ios::failbit);
+    return false;
+  }
+  clear();
+  return true;
+}
@@ -0,0 +1,333 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+#include <ServerPool.h>
+#include <IntegPeriod.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <sstream>
+
+const int ServerPool::theirMaxIdle = 16;
+const int ServerPool::theirMaxPerServer = 4;
+
+
+///////////////////////////////////////////////////////////////////////
+//Constructor
+ServerPool::ServerPool(int connecttimeout, int replytimeout)
+:itsConns(NULL),
+itsNumConns(0),
+itsConnsSize(0),
+itsConnectTimeout(connecttimeout),
+itsReplyTimeout(replytimeout),
+itsCompress(true)
+{
+  pthread_mutex_init(&itsLock, NULL);
+  pthread_cond_init(&itsCond, NULL);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Destructor
+ServerPool::~ServerPool()
+{
+  for (int i=0; i<itsNumConns; i++) {
+    if (itsConns[i].sock->is_open()) itsConns[i].sock->close();
+    delete itsConns[i].sock;
+  }
+  delete[] itsConns;
+  pthread_cond_destroy(&itsCond);
+  pthread_mutex_destroy(&itsLock);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Change the timeouts
+void ServerPool::setTimeouts(int connecttimeout, int replytimeout)
+{
+  Lock();
+  itsConnectTimeout = connecttimeout;
+  itsReplyTimeout = replytimeout;
+  Unlock();
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Say whether to ask for compression
+void ServerPool::setCompress(bool compress)
+{
+  Lock();
+  itsCompress = compress;
+  Unlock();
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Return the pool shared by the whole program
+ServerPool &ServerPool::global()
+{
+  static ServerPool *pool = makeGlobal();
+  return *pool;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Make the shared pool, letting a mirror on a fast network do without
+//compression
+ServerPool *ServerPool::makeGlobal()
+{
+  ServerPool *pool = new ServerPool();
+  const char *compress = getenv("SAC_NETCOMPRESS");
+  if (compress!=NULL && string(compress)=="false") pool->setCompress(false);
+  return pool;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Make the request to the server, trying again if a kept connection broke
+bool ServerPool::perform(const string &server, int port, PoolRequest &req)
+{
+  bool reused;
+  TCPstream *sock = acquire(server, port, reused);
+  if (sock==NULL) return false;
+
+  bool res = req.run(*sock);
+  if (!res && reused && !sock->good() && !sock->rdbuf()->expired()) {
+    //The server probably dropped the connection while we kept it, so
+    //the request deserves another go on a new one
+    release(sock, false);
+    sock = acquire(server, port, reused);
+    if (sock==NULL) return false;
+    res = req.run(*sock);
+  }
+  //A failed request may have left part of a reply unread
+  release(sock, res && sock->good());
+  return res;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Ask the server where its telescope is
+bool ServerPool::getLocation(double &longitude, double &latitude,
+			     const string &server, int port)
+{
+  class LocationRequest : public PoolRequest {
+  public:
+    double lon, lat;
+    bool run(TCPstream &sock) {
+      sock << "LOCATION\n";
+      sock.flush();
+      //Read the whole line so nothing is left for the next request
+      string line;
+      getline(sock, line);
+      if (!sock.good()) return false;
+      istringstream str(line);
+      str >> lon >> lat;
+      return !str.fail();
+    }
+  } req;
+
+  if (!perform(server, port, req)) return false;
+  longitude = req.lon;
+  latitude = req.lat;
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Close all of the connections which aren't in use
+void ServerPool::closeIdle()
+{
+  Lock();
+  int j = 0;
+  for (int i=0; i<itsNumConns; i++) {
+    if (itsConns[i].busy) {
+      itsConns[j++] = itsConns[i];
+    } else {
+      itsConns[i].sock->close();
+      delete itsConns[i].sock;
+    }
+  }
+  itsNumConns = j;
+  Unlock();
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Take a spare connection to the server, or make a new one
+TCPstream *ServerPool::acquire(const string &server, int port, bool &reused)
+{
+  Lock();
+  while (true) {
+    int inuse = 0;
+    for (int i=0; i<itsNumConns; i++) {
+      poolconn_t &conn = itsConns[i];
+      if (conn.port!=port || conn.server!=server) continue;
+      if (conn.busy) {
+	inuse++;
+	continue;
+      }
+
+      //Make sure the server hasn't closed it, or sent something we
+      //weren't expecting, while it sat here
+      char c;
+      int fd = conn.sock->rdbuf()->get_handle();
+      int res = recv(fd, &c, 1, MSG_PEEK|MSG_DONTWAIT);
+      bool stale = res>=0 || (errno!=EAGAIN && errno!=EWOULDBLOCK)
+	|| conn.sock->rdbuf()->in_avail()>0;
+      if (stale) {
+	conn.sock->close();
+	delete conn.sock;
+	itsConns[i] = itsConns[--itsNumConns];
+	i--;
+	continue;
+      }
+      conn.busy = true;
+      reused = true;
+      TCPstream *sock = conn.sock;
+      Unlock();
+      return sock;
+    }
+    if (inuse<theirMaxPerServer) break;
+    //Wait for someone to finish with a connection to this server
+    pthread_cond_wait(&itsCond, &itsLock);
+  }
+
+  //Take a place for the new connection, so it counts while we connect
+  if (itsNumConns==itsConnsSize) {
+    itsConnsSize = itsConnsSize ? 2*itsConnsSize : 4;
+    poolconn_t *newconns = new poolconn_t[itsConnsSize];
+    for (int i=0; i<itsNumConns; i++) newconns[i] = itsConns[i];
+    delete[] itsConns;
+    itsConns = newconns;
+  }
+  TCPstream *sock = new TCPstream();
+  poolconn_t &conn = itsConns[itsNumConns++];
+  conn.server = server;
+  conn.port = port;
+  conn.sock = sock;
+  conn.busy = true;
+  Unlock();
+
+  //Connect without holding the lock, it may take a while
+  if (!connect(sock, server, port) || !handshake(sock, server, port)) {
+    release(sock, false);
+    return NULL;
+  }
+  reused = false;
+  return sock;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Agree on the protocol for a new connection
+bool ServerPool::handshake(TCPstream *sock, const string &server, int port)
+{
+  Lock();
+  bool compress = itsCompress;
+  Unlock();
+  if (IntegPeriod::negotiate(*sock, compress)>0) return true;
+  if (sock->rdbuf()->expired()) return false;
+
+  //The server is too old to know how, so connect again and use 1.1
+  cerr << "Connecting again to use protocol 1.1\n";
+  if (sock->is_open()) sock->close();
+  sock->clear();
+  if (!connect(sock, server, port)) return false;
+  sock->rdbuf()->set_protocol(11);
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Give the connection back
+void ServerPool::release(TCPstream *sock, bool keep)
+{
+  Lock();
+  int idle = 0;
+  for (int i=0; i<itsNumConns; i++) {
+    if (!itsConns[i].busy) idle++;
+  }
+  for (int i=0; i<itsNumConns; i++) {
+    if (itsConns[i].sock!=sock) continue;
+    if (keep && idle<theirMaxIdle) {
+      itsConns[i].busy = false;
+    } else {
+      if (sock->is_open()) sock->close();
+      delete sock;
+      itsConns[i] = itsConns[--itsNumConns];
+    }
+    break;
+  }
+  pthread_cond_broadcast(&itsCond);
+  Unlock();
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Connect to the server, giving up after the connect timeout
+bool ServerPool::connect(TCPstream *sock, const string &server, int port)
+{
+  Lock();
+  int connecttimeout = itsConnectTimeout;
+  int replytimeout = itsReplyTimeout;
+  Unlock();
+
+  //Name lookups use static data, so only do one at a time
+  static pthread_mutex_t resolvelock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_mutex_lock(&resolvelock);
+  SocketAddr server_addr = SocketAddr(IPaddress(server.c_str()), port);
+  pthread_mutex_unlock(&resolvelock);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd<0) {
+    perror("ServerPool");
+    return false;
+  }
+
+  //Connect in the background so that we can stop waiting
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags|O_NONBLOCK);
+  int res = ::connect(fd, (sockaddr*)server_addr, sizeof(sockaddr_in));
+  if (res<0 && errno==EINPROGRESS) {
+    pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    do {
+      res = poll(&pfd, 1, connecttimeout>0 ? connecttimeout : -1);
+    } while (res<0 && errno==EINTR);
+    if (res==0) {
+      cerr << "Timed out connecting to " << server << ":" << port << endl;
+      ::close(fd);
+      return false;
+    }
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+    if (res>0 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen)==0) {
+      errno = err;
+      res = err ? -1 : 0;
+    }
+  }
+  if (res<0) {
+    cerr << "Could not connect to " << server << ":" << port << ": "
+	 << strerror(errno) << endl;
+    ::close(fd);
+    return false;
+  }
+
+  sock->rdbuf()->attach(fd);
+  sock->rdbuf()->set_blocking_io(true);
+  if (replytimeout>0) sock->rdbuf()->set_timeout(replytimeout);
+  return true;
+}
@@ -13,6 +13,7 @@
 #include <IntegPeriod.h>
 #include <PlotArea.h>
 #include <RFI.h>
+#include <TimeAlign.h>
 #include <iostream>
 #include <math.h>
 #include <cstdlib>
@@ -187,13 +188,14 @@ void SolarFlare::calibrateReference()
 {
   double ratio = 0.0;
   int count = 0;
+  int *mapping = TimeAlign::mutual(radiometer_lst, num_radiometer,
+				   reference_lst, num_reference);
   for (int rad=0; rad<num_radiometer; rad++) {
     //Don't bother matching if it is outside the time range
     if (!inRange(radiometer_lst[rad], reference_cals, num_reference_cals))
       continue;
     //Get the nearest reference point to this radiometer point
-    int ref = matchTimes(rad, radiometer_lst, num_radiometer,
-			 reference_lst, num_reference);
+    int ref = mapping[rad];
     //No suitable match
     if (ref==-1 || !inRange(reference_lst[ref], reference_cals, num_reference_cals))
       continue;
@@ -203,6 +205,7 @@ void SolarFlare::calibrateReference()
     ratio += radiometer[rad]/reference[ref];
     count++;
   }
+  if (mapping!=NULL) delete[] mapping;
   if (count==0) {
     cerr << "SolarFlare:calibrateReference: No points could be used for calibration!\n";
   } else {
@@ -255,10 +258,11 @@ void SolarFlare::getAbsorption()
   absorption_ut  = new timegen_t[num_radiometer];
   int count = 0;
 
+  int *mapping = TimeAlign::nearest(radiometer_lst, num_radiometer,
+				    reference_lst, num_reference, 120000000);
   for (int rad=0; rad<num_radiometer; rad++) {
     //Get the nearest reference point to this radiometer point
-    int ref = nearest(rad, radiometer_lst, num_radiometer,
-		      reference_lst, num_reference, 120000000);
+    int ref = mapping[rad];
     if (ref==-1) continue; //No nearest match
 
     //Measure the absorption caused by the flare
@@ -269,6 +273,7 @@ void SolarFlare::getAbsorption()
 
     count++;
   }
+  if (mapping!=NULL) delete[] mapping;
   num_absorption = count;
 }
 
@@ -662,12 +667,13 @@ timegen_t SolarFlare::determineTau()
     double asum = 0.0;
     double gsum = 0.0;
     int count = 0;
+    int *mapping = TimeAlign::nearest(thesetimes, num_absorption,
+				      goes_ut, num_goes, 31000000);
     for (int a=0; a<num_absorption; a++) {
       if (!isnan(absorption[a]) && absorption[a]>0
 	  && inRange(thesetimes[a], goes_cals, num_goes_cals)) {
 	//Get the nearest reference point to this radiometer point
-	int ref = nearest(a, thesetimes, num_absorption,
-			  goes_ut, num_goes, 31000000);
+	int ref = mapping[a];
 	//Check if there was a suitable match
 	if (ref!=-1 && inRange(goes_ut[ref], goes_cals, num_goes_cals)) {
 	  asum += absorption[a];
@@ -678,6 +684,7 @@ timegen_t SolarFlare::determineTau()
 	}
       }
     }
+    if (mapping!=NULL) delete[] mapping;
     if (count!=0) {
       //cout << thiscorr <<"\t"<< count <<"\t"<< asum <<"\t"<< gsum;
       //thiscorr = (thiscorr/count)/((asum/count)*(gsum/count));
@@ -847,12 +854,9 @@ void SolarFlare::displayFitAndGOES(int plotarea)
 //Make mappings between GOES and absorption timestamps
 void SolarFlare::makeMappings()
 {
-  nearest_mapping = new int[num_absorption];
-  matched_mapping = new int[num_absorption];
-
-  for (int a=0; a<num_absorption; a++) {
-    //Get the nearest reference point to this radiometer point
-    nearest_mapping[a] = nearest(a, absorption_ut, num_absorption, goes_ut, num_goes, 90000000);
-    matched_mapping[a] = matchTimes(a, absorption_ut, num_absorption, goes_ut, num_goes);
-  }
+  //Get the nearest GOES point to each absorption point
+  nearest_mapping = TimeAlign::nearest(absorption_ut, num_absorption,
+				       goes_ut, num_goes, 90000000);
+  matched_mapping = TimeAlign::mutual(absorption_ut, num_absorption,
+				      goes_ut, num_goes);
 }
@@ -0,0 +1,45 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+#include <StoreCompactor.h>
+#include <StoreMaster.h>
+#include <unistd.h> //for sleep
+
+///////////////////////////////////////////////////////////////////////
+//Constructor
+StoreCompactor::StoreCompactor(StoreMaster *store)
+:itsStore(store)
+{
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Destructor
+StoreCompactor::~StoreCompactor()
+{  }
+
+
+///////////////////////////////////////////////////////////////////////
+//Compact each closed day in turn, then check occasionally for new ones
+void StoreCompactor::run()
+{
+  //Detach our thread
+  pthread_detach(itsThread);
+
+  while (itsKeepRunning) {
+    if (itsStore->compact()) {
+      //There may be a backlog of days, but give the disk a breather
+      sleep(1);
+    } else {
+      //Nothing left to do, the next day won't close for a while
+      sleep(600);
+    }
+  }
+}
@@ -10,6 +10,10 @@
 
 #include <StoreMaster.h>
 #include <IntegPeriod.h>
+#include <Rollup.h>
+#include <PeriodBatch.h>
+#include <SegmentStream.h>
+#include <TimeSeriesCodec.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -17,11 +21,27 @@
 #include <dirent.h>
 #include <assert.h>
 #include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+
+static const long long theirDayLength = 86400000000ll;
+
+///////////////////////////////////////////////////////////////////////
+//Return true if the filename is that of a day segment
+static bool isSegmentName(const string &fname)
+{
+  int len = strlen(SEG_NAME);
+  return (int)fname.size()>=len && fname.substr(fname.size()-len)==SEG_NAME;
+}
 
 //Static Members
 //Maximum number of integration periods to return for any request. This is to
 //prevent bad requests consuming all the memory and crashing the program.
 const int StoreMaster::theirMaxResults = 1000000;
+//Bucket lengths of the rollup tiers: 10 seconds, 1 minute, 10 minutes, 1 hour
+const long long StoreMaster::theirRollupTiers[] = {10000000ll, 60000000ll,
+						   600000000ll, 3600000000ll};
+const int StoreMaster::theirNumRollupTiers = 4;
 
 
 ///////////////////////////////////////////////////////////////////////
@@ -35,6 +55,10 @@ itsSaveBuf(itsSaveBufSize),
 itsNumQueued(0),
 itsStoreBufSize(storebufsize),
 itsStoreBuf(itsStoreBufSize),
+itsKeepRollups(false),
+itsRollups(new Rollup[theirNumRollupTiers]),
+itsCompressSegments(false),
+itsCompressAudio(false),
 itsMaxDataAge(maxage)
 {
   //assert(itsStoreBufSize>=itsSaveBufSize);
@@ -64,6 +88,10 @@ itsSaveBuf(itsSaveBufSize),
 itsNumQueued(0),
 itsStoreBufSize(storebufsize),
 itsStoreBuf(itsStoreBufSize),
+itsKeepRollups(false),
+itsRollups(new Rollup[theirNumRollupTiers]),
+itsCompressSegments(false),
+itsCompressAudio(false),
 itsMaxDataAge(maxage)
 {
   //assert(itsStoreBufSize>=itsSaveBufSize);
@@ -90,9 +118,17 @@ StoreMaster::~StoreMaster()
   flush();
   //Get lock, and then destroy it
   Lock();
+  //Save the partially complete rollups, they will be merged with
+  //the remainder of their bucket when read back
+  if (itsKeepRollups) {
+    pthread_mutex_lock(&itsDirLock);
+    for (int t=0; t<theirNumRollupTiers; t++) saveRollup(t);
+    pthread_mutex_unlock(&itsDirLock);
+  }
   pthread_mutex_destroy(&itsLock);
   //Free all allocated memory
   delete[] itsSaveDir;
+  delete[] itsRollups;
 }
 
 
@@ -138,6 +174,7 @@ void StoreMaster::flush(bool havelock)
 
     //Save each queued IntegPeriod which shares the same
     //destination file name as that which we determined above
+    PeriodBatch batch(itsCompressAudio);
     for (;epoch<=newest && res; epoch++) {
       //Get the next data to be saved from the buffer
       IntegPeriod *saveper = itsSaveBuf.get(epoch);
@@ -152,10 +189,13 @@ void StoreMaster::flush(bool havelock)
         //Time to change the destination file
         break;
       }
-      //Write the data to disk
-      datfile << (*saveper);
+      //Queue the data to be written to disk
+      batch.add(*saveper);
+      //And update the summaries
+      if (itsKeepRollups) addRollup(saveper);
     }
-    //Flush the data to disk and close the file
+    //Write the whole group at once, flush it to disk and close the file
+    if (res) batch.write(datfile);
     datfile.flush();
     datfile.close();
   }
@@ -238,13 +278,12 @@ IntegPeriod *StoreMaster::get(long long epoch)
     }
   } else {
     //It is older than the oldest in memory, we need to check the disk
-    ifstream *infile;
+    istream *infile;
     if (findEpoch(epoch, infile)) {
       //We found the requested data, allocate memory and load from file
       res = new IntegPeriod;
       *infile >> (*res);
       //Finished with the file
-      infile->close();
       delete infile;
     }
   }
@@ -253,148 +292,245 @@ IntegPeriod *StoreMaster::get(long long epoch)
 }
 
 
+///////////////////////////////////////////////////////////////////////
+//Append a period to an array, doubling the size of the array if it
+//is already full
+static void addPeriod(IntegPeriod **&data, int &count, int &size,
+		      IntegPeriod *per)
+{
+  if (count==size) {
+    size = (size==0) ? 10 : 2*size;
+    IntegPeriod **newdata = new IntegPeriod*[size];
+    for (int i=0; i<count; i++) newdata[i] = data[i];
+    if (data) delete[] data;
+    data = newdata;
+  }
+  data[count++] = per;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Collects the periods from a scan into an array, for get()
+class PeriodCollector : public PeriodVisitor {
+public:
+  PeriodCollector(int maxcount)
+  :itsData(NULL), itsCount(0), itsSize(0), itsMaxCount(maxcount) {}
+
+  bool visit(IntegPeriod *per) {
+    addPeriod(itsData, itsCount, itsSize, per);
+    //Stop once we have exceeded the allowed number of results
+    return itsCount<=itsMaxCount;
+  }
+
+  IntegPeriod **itsData;
+  int itsCount;
+  int itsSize;
+  int itsMaxCount;
+};
+
+
 ///////////////////////////////////////////////////////////////////////
 //Get all data newer than the specified epoch
 IntegPeriod **StoreMaster::get(long long startepoch,
 			       long long endepoch,
 			       int &count)
 {
-  int ressize = 10;
-  IntegPeriod **res = new IntegPeriod*[ressize];
-  count = 0;
-  bool buffull = false;
+  PeriodCollector collector(theirMaxResults);
+  scan(startepoch, endepoch, collector);
+  count = collector.itsCount;
+  return collector.itsData;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Pass each period between the given times to the visitor, in order
+bool StoreMaster::scan(long long startepoch,
+		       long long endepoch,
+		       PeriodVisitor &visitor)
+{
+  return scan(startepoch, endepoch, visitor, NULL);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//As for scan, but with runs from the minute files passed as spans
+bool StoreMaster::scanSpans(long long startepoch,
+			    long long endepoch,
+			    SpanVisitor &visitor)
+{
+  return scan(startepoch, endepoch, visitor, &visitor);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Pass the periods to the visitor, or to 'spans' as runs where we can
+bool StoreMaster::scan(long long startepoch,
+		       long long endepoch,
+		       PeriodVisitor &visitor,
+		       SpanVisitor *spans)
+{
+  bool pastend = false;
+  bool stopped = false;
   bool inmemory = false;
   bool havelock = false;
   bool firstfile = true;
   long long epoch = startepoch;
+  //Periods found while we hold the lock, which are passed on once we
+  //have let it go so the visitor can't hold up new data
+  IntegPeriod **held = NULL;
+  int numheld = 0, heldsize = 0;
 
   Lock();
-//  cerr << "Request for " << startepoch << " oldest is " << itsOldest << " newest is " << itsNewest << endl;
   //Grab a timestamp for the oldest data in memory
   long long oldest = itsOldest;
   if (itsOldest!=0 && epoch>=itsOldest && epoch<itsNewest) {
     inmemory = true;
+    havelock = true;
+  } else {
+    //Unlock memory storage so new data can be inserted while we load
+    Unlock();
   }
-  //Unlock memory storage so new data can be inserted. while we load from disk
-  Unlock();
 
   //We loop through all files between the specified epoch and the
   //present pulling out the requested data
-  ifstream *infile;
-  while (!buffull&&!inmemory) {
+  istream *infile = NULL;
+  while (!pastend && !stopped && !inmemory) {
     //Open the appropriate file
     if (firstfile) {
       firstfile = false;
       //Try to open the first file
-      if (!findEpoch(epoch, infile)) {
+      long long lastepoch;
+      if (findEpoch(epoch, infile, lastepoch)) {
+	//Continue from the last minute covered by this handle
+	epoch = lastepoch;
+      } else {
 	//File didn't exist, move along to the next
-	if (!(epoch = nextFile(epoch, infile))) {
-	  if (!havelock) Lock();
-	  break;
-	}
+	if (!(epoch = nextFile(epoch, infile))) break;
       }
     } else {
       //Try to open the next file
-      if (!(epoch = nextFile(epoch, infile))) {
-	if (!havelock) Lock();
-	break;
+      if (!(epoch = nextFile(epoch, infile))) break;
+    }
+
+    //Pass on what we can of a minute file without reading it, which
+    //leaves any periods close to the memory cache to be read below
+    if (spans!=NULL && !havelock && dynamic_cast<ifstream*>(infile)!=NULL) {
+      if (!spanFile(epoch, infile, endepoch, oldest, *spans, pastend)) {
+	stopped = true;
       }
     }
 
     //Load the data from the current file
-    while (!infile->eof()&&!buffull&&!inmemory) {
-      res[count] = new IntegPeriod;
-      *infile >> (*res[count]);
+    while (!infile->eof() && !pastend && !stopped && !inmemory) {
+      IntegPeriod *per = new IntegPeriod;
+      *infile >> (*per);
       if (infile->eof()) {
 	//If we had an EOF the last period loaded will be invalid
-	delete res[count];
-      } else {
-	//If we are close to data in the memory cache get the lock
-	//so that we can ensure we don't miss any periods
-	if (!havelock && oldest!=0 && res[count]->timeStamp>=oldest) {
-	  Lock();
-	  havelock = true;
-	}
-	//Check if the current data, and all more recent, is cached
-	if (havelock && itsOldest!=0 && res[count]->timeStamp>=itsOldest) {
-	  delete res[count];
-	  inmemory = true;
-	} else if (endepoch!=0 && res[count]->timeStamp>endepoch) {
-          //We have reached the last data requested
-	  delete res[count];
-	  buffull = true;
-	} else {
-	  count++;
-	  //Check if we have exceeded the allowed number of results
-	  if (count>theirMaxResults) buffull = true;
-	  if (count==ressize && !buffull) {
-	    //We have filled the output array, so double it's size
-	    ressize*=2;
-	    IntegPeriod **newres = new IntegPeriod*[ressize];
-	    //Copy all existing data over to new storage array
-	    for (int i=0; i<count; i++) newres[i] = res[i];
-	    delete[] res;
-	    res = newres;
-	  }
-	}
+	delete per;
+	continue;
+      }
+      //If we are close to data in the memory cache get the lock
+      //so that we can ensure we don't miss any periods
+      if (!havelock && oldest!=0 && per->timeStamp>=oldest) {
+	Lock();
+	havelock = true;
+      }
+      //Check if the current data, and all more recent, is cached
+      if (havelock && itsOldest!=0 && per->timeStamp>=itsOldest) {
+	delete per;
+	inmemory = true;
+      } else if (endepoch!=0 && per->timeStamp>endepoch) {
+	//We have reached the last data requested
+	delete per;
+	pastend = true;
+      } else if (havelock) {
+	//Keep it until we let go of the lock
+	addPeriod(held, numheld, heldsize, per);
+      } else if (!visitor.visit(per)) {
+	stopped = true;
       }
     }
-    //Finished with this file
-    infile->close();
   }
-  Unlock();
+  //Finished with the last file
+  if (infile!=NULL) delete infile;
+  if (!havelock) Lock();
 
   //We have loaded all data from disk, now add any still in memory
-  if (!buffull && itsOldest!=0) {
-    int last  = itsStoreBuf.getOldest();
+  if (!pastend && !stopped && itsOldest!=0) {
+    int last = itsStoreBuf.getOldest();
     int newest = itsStoreBuf.getEpoch();
-
-    //Find the first data older than the requested epoch
     assert(last<=newest);
-    while (last<=newest) {
-      IntegPeriod *loadper = itsStoreBuf.get(last);
-      if (loadper->timeStamp>=startepoch) {
-	break;
-      }
-      last++;
-    }
-    //If not returning all recent data find the last datum we will return
-    if (endepoch!=0) {
-      //Find the first data older than the requested epoch
-      while (newest>last && (*itsStoreBuf.get(newest))>endepoch) {
-	newest--;
-      }
+    for (; last<=newest; last++) {
+      int e = last;
+      IntegPeriod *loadper = itsStoreBuf.get(e);
+      if (loadper==NULL || loadper->timeStamp<startepoch) continue;
+      if (endepoch!=0 && loadper->timeStamp>endepoch) break;
+      //Clone each of the data we are going to return
+      IntegPeriod *per = new IntegPeriod;
+      (*per) = (*loadper);
+      addPeriod(held, numheld, heldsize, per);
     }
+  }
+  Unlock();
 
-    //Count how many buffered periods are stored in memory
-//    cerr << count + newest-last+1 << " = " << count << "+" <<newest-last+1<<endl;
-    count += newest - last + 1;
-    //Ensure there is room for the extra data
-    if (count>ressize) {
-      IntegPeriod **newres = new IntegPeriod*[count];
-      //Copy all existing data over to new storage array
-      for (int i=0; i<ressize; i++) newres[i] = res[i];
-      delete[] res;
-      res = newres;
-      ressize = count;
-    }
-    int initval = count-newest+last-1;
-    for (int i=initval; i<count; i++) {
-      //Clone each of the data we are going to return
-      IntegPeriod *loadper = itsStoreBuf.get(last);
-      if (loadper==NULL) break;
-      res[i] = new IntegPeriod;
-      (*res[i]) = (*loadper);
-      last++;
+  //Now pass on whatever we found while we had the lock
+  for (int i=0; i<numheld; i++) {
+    if (stopped) delete held[i];
+    else if (!visitor.visit(held[i])) stopped = true;
+  }
+  if (held) delete[] held;
+  return !stopped;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Pass on the run of whole periods from the current place in a minute file
+bool StoreMaster::spanFile(long long fileepoch, istream *infile,
+			   long long endepoch, long long oldest,
+			   SpanVisitor &visitor, bool &pastend)
+{
+  long long start = infile->tellg();
+  if (start<0) return true;
+  ostringstream filename;
+  toFileName(fileepoch, filename);
+  int fd = open(filename.str().c_str(), O_RDONLY);
+  if (fd<0) return true;
+  struct stat info;
+  if (fstat(fd, &info)<0) {
+    close(fd);
+    return true;
+  }
+
+  //Step through the records by their lengths, stopping at anything the
+  //visitor shouldn't get in one piece
+  long long offset = start;
+  int count = 0;
+  const int readsize = sizeof(int)+sizeof(long long);
+  char head[readsize];
+  while (offset+readsize<=info.st_size) {
+    if (pread(fd, head, readsize, offset)!=readsize) break;
+    int size;
+    long long tstamp;
+    memcpy(&size, head, sizeof(int));
+    memcpy(&tstamp, head+sizeof(int), sizeof(long long));
+    //A record which is damaged or still being written is left for the
+    //usual reading, as is anything close to the memory cache
+    if (size<IntegPeriod::theirHeaderLen || offset+size>info.st_size) break;
+    if (oldest!=0 && tstamp>=oldest) break;
+    if (endepoch!=0 && tstamp>endepoch) {
+      pastend = true;
+      break;
     }
+    offset += size;
+    count++;
   }
 
-//  Unlock();
-  //Check if we created the array for nothing
-  if (count==0 && res) {
-    delete[] res;
-    res = NULL;
+  bool res = true;
+  if (count>0) {
+    res = visitor.visitSpan(fd, start, offset-start, count);
+    infile->seekg(offset);
   }
+  close(fd);
   return res;
 }
 
@@ -429,6 +565,47 @@ void StoreMaster::toFileName(long long epoch, ostringstream &output)
 }
 
 
+///////////////////////////////////////////////////////////////////////
+//Return the filename of the segment holding the day containing 'epoch'
+void StoreMaster::toSegmentName(long long epoch, ostringstream &output)
+{
+  time_t filetime = epoch/1000000;
+  struct tm utc;
+  gmtime_r(&filetime, &utc);
+  //Base directory given to the program
+  output << itsSaveDir;
+  //Year
+  output << 1900+utc.tm_year << "/";
+  //Month
+  int temp = utc.tm_mon+1;
+  if (temp<10) output << "0" << temp << "/";
+  else output << temp << "/";
+  //Day of month
+  temp = utc.tm_mday;
+  if (temp<10) output << "0" << temp << "/";
+  else output << temp << "/";
+  //The segment itself
+  output << SEG_NAME;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Open a segment positioned at the first data at or after 'epoch's minute
+bool StoreMaster::openSegment(string fname, long long epoch,
+			      istream *&infile)
+{
+  //Reading from here will return the rest of the day
+  SegmentStream *segfile = new SegmentStream();
+  if (segfile->open(fname.c_str(), epoch)) {
+    infile = segfile;
+    return true;
+  }
+  delete segfile;
+  infile = NULL;
+  return false;
+}
+
+
 ///////////////////////////////////////////////////////////////////////
 //Ensure all directories in the given path exist
 bool StoreMaster::checkDirs(ostringstream &arg)
@@ -466,14 +643,24 @@ bool StoreMaster::checkDirs(ostringstream &arg)
 
 ///////////////////////////////////////////////////////////////////////
 //
-bool StoreMaster::checkFile(long long epoch, ifstream *&infile)
+bool StoreMaster::checkFile(long long epoch, istream *&infile,
+			    long long &lastepoch)
 {
+  //A compacted day takes precedence over any stray minute files
+  ostringstream segname;
+  toSegmentName(epoch, segname);
+  if (openSegment(segname.str(), epoch, infile)) {
+    lastepoch = epoch - epoch%theirDayLength + theirDayLength - 60000000;
+    return true;
+  }
+
   //Get the file name of where to look for the given epoch
   ostringstream filename;
   toFileName(epoch, filename);
   //Try to open the file
   //infile->open(filename.str().c_str(), ios::nocreate|ios::binary);
   infile = new ifstream(filename.str().c_str(), ios::binary);
+  lastepoch = epoch;
 
   bool res = true;
   if (infile->fail()) res = false;
@@ -502,7 +689,17 @@ bool StoreMaster::checkFile(long long epoch)
 
 ///////////////////////////////////////////////////////////////////////
 //
-bool StoreMaster::findEpoch(long long epoch, ifstream *&infile)
+bool StoreMaster::findEpoch(long long epoch, istream *&infile)
+{
+  long long lastepoch;
+  return findEpoch(epoch, infile, lastepoch);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+bool StoreMaster::findEpoch(long long epoch, istream *&infile,
+			    long long &lastepoch)
 {
   bool res = false;
   long long tstamp;
@@ -510,7 +707,7 @@ bool StoreMaster::findEpoch(long long epoch, ifstream *&infile)
 
   pthread_mutex_lock(&itsDirLock);
   //First check if a file exists for the specified epoch
-  if (checkFile(epoch, infile)) {
+  if (checkFile(epoch, infile, lastepoch)) {
     while (!infile->eof()&&!res) {
       //Read just the size and timestamp from the file
       int size;
@@ -527,10 +724,11 @@ bool StoreMaster::findEpoch(long long epoch, ifstream *&infile)
 	res = true;
       }
     }
-    //Close the file if we didn't find what we wanted
-    if (!res) {
-      infile->close();
-    }
+  }
+  //Close the file if we didn't find what we wanted
+  if (!res) {
+    delete infile;
+    infile = NULL;
   }
   pthread_mutex_unlock(&itsDirLock);
   ///TODO: Check start of next file
@@ -566,38 +764,51 @@ long long StoreMaster::prevFile(long long epoch, ifstream *&infile)
 
 ///////////////////////////////////////////////////////////////////////
 //
-long long StoreMaster::nextFile(long long epoch, ifstream *&infile)
+long long StoreMaster::nextFile(long long epoch, istream *&infile)
 {
   ostringstream filename;
   pthread_mutex_lock(&itsDirLock);
 
   //Add 60 seconds to the given epoch
   long long testepoch = epoch+60000000;
+  long long lastepoch;
+  istream *testfile = NULL;
   //check if the next (consecutive) file exists
-  if (checkFile(testepoch)) {
-    //Consecutive file DOES exists, open it and finish
-    toFileName(testepoch, filename);
-    //infile->open(filename.str().c_str(), ios::nocreate|ios::binary);
+  if (checkFile(testepoch, testfile, lastepoch)) {
+    //Consecutive file DOES exists, use it and finish
     if (infile!=NULL) delete infile;
-    infile = new ifstream(filename.str().c_str(), ios::binary);
-    epoch = testepoch;
+    infile = testfile;
+    epoch = lastepoch;
   } else {
+    if (testfile!=NULL) delete testfile;
     //The next file didn't exist, we have to search to see which is
     //the next data saved to disk.
-    if (searchForward(epoch, filename)) {
+    long long fileepoch;
+    if (searchForward(epoch, filename, fileepoch)) {
       epoch = 0;
       if (infile!=NULL) delete infile;
-      infile = new ifstream(filename.str().c_str(), ios::binary);
-      infile->seekg(sizeof(int));
-      if (*infile) {
-	//If the file is ok, read a timestamp
-	infile->read((char*)&epoch, sizeof(long long));
-	//And then return to the start of the file
-	infile->seekg(0);
+      infile = NULL;
+      string fname = filename.str();
+      if (isSegmentName(fname)) {
+	//The next data is in a compacted day, the handle covers the
+	//rest of the day
+	if (openSegment(fname, fileepoch, infile)) {
+	  epoch = fileepoch - fileepoch%theirDayLength
+	    + theirDayLength - 60000000;
+	}
       } else {
+	infile = new ifstream(fname.c_str(), ios::binary);
+	infile->seekg(sizeof(int));
+	if (*infile) {
+	  //If the file is ok, read a timestamp
+	  infile->read((char*)&epoch, sizeof(long long));
+	  //And then return to the start of the file
+	  infile->seekg(0);
+	} else {
 cerr << "FILE IS BAD";
-	//Could not open the discovered file
-	epoch = 0;
+	  //Could not open the discovered file
+	  epoch = 0;
+	}
       }
     } else {
       //No next file was found
@@ -635,9 +846,10 @@ int bidigit(const dirent *entry)
 ///////////////////////////////////////////////////////////////////////
 //Recurse the directories and find first data file after 'epoch's
 //This is one hell of a routine!
-bool StoreMaster::searchForward(long long epoch, ostringstream &output)
+bool StoreMaster::searchForward(long long epoch, ostringstream &output,
+				long long &fileepoch)
 {
-  return fileAfter(itsSaveDir, epoch, output);
+  return fileAfter(itsSaveDir, epoch, output, fileepoch);
 }
 
 
@@ -645,12 +857,14 @@ bool StoreMaster::searchForward(long long epoch, ostringstream &output)
 //Recurse the specified directory, find first data file after 'epoch's
 bool StoreMaster::fileAfter(string basedir,
 			    long long epoch,
-			    ostringstream &output)
+			    ostringstream &output,
+			    long long &fileepoch)
 {
   bool done = false;
   time_t searchtime = epoch/1000000;
   struct tm *searchutc = gmtime(&searchtime);
   bool sameday = true, samemonth = true;
+  int argminute = 60*searchutc->tm_hour + searchutc->tm_min;
 
   //These hold a string form of the argument time
   ostringstream argyear, argmonth, argday, argfile;
@@ -752,6 +966,26 @@ bool StoreMaster::fileAfter(string basedir,
 	daydir << monthdir.str() << dayslist[day]->d_name << "/";
 	//cerr << "daydir is " << daydir.str() << endl;
 
+	//If the day has been compacted check the index of the segment
+	ostringstream segname;
+	segname << daydir.str() << SEG_NAME;
+	ifstream segfile(segname.str().c_str(), ios::binary);
+	segheader_t hdr;
+	if (!segfile.fail() && SegmentBuf::readHeader(segfile, hdr)) {
+	  int m = sameday ? argminute+1 : 0;
+	  for (; m<SEG_MINUTES; m++) {
+	    if (hdr.offsets[m+1]>hdr.offsets[m]) break;
+	  }
+	  if (m<SEG_MINUTES) {
+	    output << segname.str();
+	    fileepoch = hdr.daystart + m*60000000ll;
+	    done = true;
+	    sameday = false;
+	    break;
+	  }
+	}
+	segfile.close();
+
 	//Finally get a listing of what files are present
 	dirent **fileslist;
 	int numfiles = scandir(daydir.str().c_str(), &fileslist,
@@ -769,6 +1003,7 @@ bool StoreMaster::fileAfter(string basedir,
 	//If there are any files left we have found the answer
 	if (startfile<numfiles) {
 	  output << daydir.str() << fileslist[startfile]->d_name;
+	  fileepoch = fromFileName(output.str());
 	  ostringstream foo;
 	  //cerr << "file is " << output.str() << " files=" << numfiles<<endl;
           done = true;
@@ -874,11 +1109,24 @@ void StoreMaster::removeOldData()
   //Our objective is now to remove all files between t and itsMaxDataAge
   while (true) {
     ostringstream fname;
-    if (!searchForward(latest, fname)) break;
+    timeAbs_t fage;
+    if (!searchForward(latest, fname, fage)) break;
     //cerr << "Found File: " << fname.str() << endl;
 
-    //We found a file. Now find out what epoch it represents
-    timeAbs_t fage = fromFileName(fname.str());
+    string name = fname.str();
+    if (isSegmentName(name)) {
+      //A compacted day can only be removed once all of it has expired
+      timeAbs_t dayend = fage - fage%theirDayLength + theirDayLength;
+      if (fage>latest && dayend<=expiry) {
+	if (unlink(name.c_str())!=0) {
+	  perror(("StoreMaster:removeOldData:"+name).c_str());
+	  break;
+	}
+	continue;
+      } else break;
+    }
+
+    //We found a file. The epoch it represents came from the name
     if (fage==-1) {
       cerr << "StoreMaster:removeOldData: WARNING: filename not understood:\n"
 	<< "\t" << fname.str() << endl
@@ -901,3 +1149,459 @@ void StoreMaster::removeOldData()
     } else break; //No files need deleting at the moment
   }
 }
+
+
+///////////////////////////////////////////////////////////////////////
+//Count the minute files in a day directory and return their total size
+static long long dayFileSize(string daydir, int &numfiles)
+{
+  long long total = 0;
+  dirent **fileslist;
+  numfiles = scandir(daydir.c_str(), &fileslist, quaddigit, alphasort);
+  for (int i=0; i<numfiles; i++) {
+    struct stat buf;
+    if (stat((daydir+fileslist[i]->d_name).c_str(), &buf)==0) {
+      total += buf.st_size;
+    }
+    free(fileslist[i]);
+  }
+  if (numfiles>=0) free(fileslist);
+  else numfiles = 0;
+  return total;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Compact the oldest closed day which still has minute files
+bool StoreMaster::compact()
+{
+  //Only days which finished at least an hour ago are closed, no more
+  //data should be arriving for them
+  time_t cutofftime = (getAbs()-3600000000ll)/1000000;
+  struct tm utc;
+  gmtime_r(&cutofftime, &utc);
+  ostringstream cutoff;
+  cutoff << 1900+utc.tm_year << "/";
+  if (utc.tm_mon+1<10) cutoff << "0";
+  cutoff << utc.tm_mon+1 << "/";
+  if (utc.tm_mday<10) cutoff << "0";
+  cutoff << utc.tm_mday;
+
+  bool res = false, done = false;
+  dirent **yearslist;
+  int numyears = scandir(itsSaveDir, &yearslist, quaddigit, alphasort);
+  for (int year=0; year<numyears; year++) {
+    string yearname = yearslist[year]->d_name;
+    dirent **monthslist;
+    int nummonths = scandir((itsSaveDir+yearname).c_str(), &monthslist,
+			    bidigit, alphasort);
+    for (int month=0; month<nummonths; month++) {
+      string monthname = yearname + "/" + monthslist[month]->d_name;
+      dirent **dayslist;
+      int numdays = scandir((itsSaveDir+monthname).c_str(), &dayslist,
+			    bidigit, alphasort);
+      for (int day=0; day<numdays; day++) {
+	string dayname = monthname + "/" + dayslist[day]->d_name;
+	//The days are sorted so there is nothing closed beyond here
+	if (done || dayname>=cutoff.str()) {
+	  done = true;
+	} else {
+	  int numfiles;
+	  dayFileSize(itsSaveDir+dayname+"/", numfiles);
+	  if (numfiles>0) {
+	    //Move on to the next day if this one couldn't be compacted
+	    res = compactDay(itsSaveDir+dayname+"/");
+	    done = res;
+	  }
+	}
+	free(dayslist[day]);
+      }
+      if (numdays>=0) free(dayslist);
+      free(monthslist[month]);
+    }
+    if (nummonths>=0) free(monthslist);
+    free(yearslist[year]);
+  }
+  if (numyears>=0) free(yearslist);
+
+  return res;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Pack all minute files in the given day directory into its segment
+bool StoreMaster::compactDay(string daydir)
+{
+  string segname = daydir + SEG_NAME;
+  string tmpname = segname + ".tmp";
+
+  //Note what we are about to compact so we can tell if it changes
+  int numfiles;
+  long long totalsize = dayFileSize(daydir, numfiles);
+
+  segheader_t hdr, oldhdr;
+  SegmentBuf::initHeader(hdr, -1);
+
+  //Any existing segment for the day is merged with the minute files
+  ifstream oldseg(segname.c_str(), ios::binary);
+  bool haveold = !oldseg.fail() && SegmentBuf::readHeader(oldseg, oldhdr);
+  if (haveold) hdr.daystart = oldhdr.daystart;
+
+  ofstream segfile(tmpname.c_str(), ios::out|ios::trunc|ios::binary);
+  if (segfile.fail()) {
+    cerr << "StoreMaster:compactDay: could not create " << tmpname << endl;
+    return false;
+  }
+  //Leave room for the header, it is written once the offsets are known
+  segfile.write((char*)&hdr, sizeof(segheader_t));
+
+  const int readsize = sizeof(int)+sizeof(long long);
+  //Buffers for the plain records of each minute and their encoded form
+  char *plain = NULL, *enc = NULL, *raw = NULL;
+  int plainsize = 0, encsize = 0, rawsize = 0;
+  bool res = true;
+  long long offset = sizeof(segheader_t);
+  for (int m=0; m<SEG_MINUTES && res; m++) {
+    hdr.offsets[m] = offset;
+    int plainlen = 0;
+    //Start with any data which the old segment held for this minute
+    if (haveold && !SegmentBuf::readMinute(oldseg, oldhdr, m, plain,
+					   plainsize, plainlen, raw, rawsize)) {
+      cerr << "StoreMaster:compactDay: could not read minute " << m
+	   << " from " << segname << endl;
+      res = false;
+      break;
+    }
+
+    //Then append each complete record from the minute file
+    ostringstream minname;
+    minname << daydir;
+    if (m/60<10) minname << "0";
+    minname << m/60;
+    if (m%60<10) minname << "0";
+    minname << m%60;
+    ifstream minfile(minname.str().c_str(), ios::binary);
+    while (!minfile.fail()) {
+      int size;
+      long long tstamp;
+      if (plainsize-plainlen<readsize) {
+	//Need a larger buffer for the header
+	plainsize = 2*plainsize+65536;
+	char *newbuf = new char[plainsize];
+	if (plainlen>0) memcpy(newbuf, plain, plainlen);
+	if (plain!=NULL) delete[] plain;
+	plain = newbuf;
+      }
+      char *rec = plain+plainlen;
+      minfile.read(rec, readsize);
+      if (minfile.gcount()!=readsize) break;
+      memcpy(&size, rec, sizeof(int));
+      memcpy(&tstamp, rec+sizeof(int), sizeof(long long));
+      if (size<readsize || size>100000000) {
+	cerr << "StoreMaster:compactDay: bad record in "
+	     << minname.str() << endl;
+	break;
+      }
+      if (plainsize-plainlen<size) {
+	//Need a larger buffer for this record
+	plainsize = 2*plainsize+size;
+	char *newbuf = new char[plainsize];
+	memcpy(newbuf, plain, plainlen+readsize);
+	delete[] plain;
+	plain = newbuf;
+	rec = plain+plainlen;
+      }
+      minfile.read(rec+readsize, size-readsize);
+      if (minfile.gcount()!=size-readsize) {
+	//Probably an interrupted write, the rest of the file is useless
+	cerr << "StoreMaster:compactDay: discarding partial record in "
+	     << minname.str() << endl;
+	break;
+      }
+      if (hdr.daystart==-1) hdr.daystart = tstamp - tstamp%theirDayLength;
+      plainlen += size;
+    }
+    if (plainlen==0) continue;
+
+    //Write the data for this minute, compressed if that is worthwhile
+    int enclen = 0;
+    if (itsCompressSegments &&
+	TimeSeriesCodec::encode(plain, plainlen, enc, encsize, enclen) &&
+	enclen<plainlen) {
+      hdr.encoding[m] = seg_timeseries;
+      segfile.write(enc, enclen);
+      offset += enclen;
+    } else {
+      hdr.encoding[m] = seg_plain;
+      segfile.write(plain, plainlen);
+      offset += plainlen;
+    }
+  }
+  hdr.offsets[SEG_MINUTES] = offset;
+  if (plain!=NULL) delete[] plain;
+  if (enc!=NULL) delete[] enc;
+  if (raw!=NULL) delete[] raw;
+  oldseg.close();
+
+  if (!res || hdr.daystart==-1) {
+    if (res) cerr << "StoreMaster:compactDay: no valid data in " << daydir << endl;
+    segfile.close();
+    unlink(tmpname.c_str());
+    return false;
+  }
+
+  //Now that the index is complete we can write the real header
+  segfile.seekp(0);
+  segfile.write((char*)&hdr, sizeof(segheader_t));
+  segfile.close();
+  //Ensure the segment is on the disk before the minute files go
+  int fd = open(tmpname.c_str(), O_RDONLY);
+  if (segfile.fail() || fd<0 || fsync(fd)!=0) {
+    perror(("StoreMaster:compactDay:"+tmpname).c_str());
+    if (fd>=0) close(fd);
+    unlink(tmpname.c_str());
+    return false;
+  }
+  close(fd);
+
+  //Swap the segment in for the minute files while no one is reading
+  pthread_mutex_lock(&itsDirLock);
+  int newnumfiles;
+  if (dayFileSize(daydir, newnumfiles)!=totalsize || newnumfiles!=numfiles) {
+    //Something was written while we were busy, try again later
+    pthread_mutex_unlock(&itsDirLock);
+    unlink(tmpname.c_str());
+    return false;
+  }
+  if (rename(tmpname.c_str(), segname.c_str())!=0) {
+    perror(("StoreMaster:compactDay:"+segname).c_str());
+    pthread_mutex_unlock(&itsDirLock);
+    unlink(tmpname.c_str());
+    return false;
+  }
+  dirent **fileslist;
+  numfiles = scandir(daydir.c_str(), &fileslist, quaddigit, alphasort);
+  for (int i=0; i<numfiles; i++) {
+    if (unlink((daydir+fileslist[i]->d_name).c_str())!=0) {
+      perror(("StoreMaster:compactDay:"+daydir+fileslist[i]->d_name).c_str());
+    }
+    free(fileslist[i]);
+  }
+  if (numfiles>=0) free(fileslist);
+  pthread_mutex_unlock(&itsDirLock);
+
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Return the filename where rollups for the given tier and day are kept
+void StoreMaster::rollupFileName(int tier, long long epoch,
+				 ostringstream &output)
+{
+  time_t filetime = epoch/1000000;
+  struct tm utc;
+  gmtime_r(&filetime, &utc);
+  //Rollups live in their own tree under the base directory
+  output << itsSaveDir << "rollup/" << theirRollupTiers[tier]/1000000 << "/";
+  //Year
+  output << 1900+utc.tm_year << "/";
+  //Month
+  int temp = utc.tm_mon+1;
+  if (temp<10) output << "0" << temp << "/";
+  else output << temp << "/";
+  //Day of month
+  temp = utc.tm_mday;
+  if (temp<10) output << "0" << temp;
+  else output << temp;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Accumulate the given period into each rollup tier
+void StoreMaster::addRollup(IntegPeriod *per)
+{
+  for (int t=0; t<theirNumRollupTiers; t++) {
+    long long length = theirRollupTiers[t];
+    long long start = per->timeStamp - (per->timeStamp%length);
+    if (itsRollups[t].count==0 || itsRollups[t].timeStamp!=start) {
+      //This period belongs to a new bucket, save the old one
+      saveRollup(t);
+      itsRollups[t].clear(start, length);
+    }
+    itsRollups[t].add(*per);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Append the current bucket for the tier to file. Needs the dir lock.
+void StoreMaster::saveRollup(int tier)
+{
+  if (itsRollups[tier].count==0) return;
+
+  ostringstream oss;
+  rollupFileName(tier, itsRollups[tier].timeStamp, oss);
+  if (!checkDirs(oss)) {
+    cerr << "Warning, could not make directory for rollup file\n";
+    return;
+  }
+  ofstream rollfile(oss.str().c_str(), ios::app|ios::out|ios::binary);
+  if (rollfile.fail()) {
+    cerr << "Warning, could not open rollup file for writing\n"
+	 << "\t" << oss.str() << "\n";
+    return;
+  }
+  rollfile << itsRollups[tier];
+  rollfile.close();
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Accumulates the periods from a scan into buckets, for getRollup()
+class RollupBuilder : public PeriodVisitor {
+public:
+  RollupBuilder(Rollup *data, int size, long long length)
+  :itsData(data), itsCount(0), itsSize(size), itsLength(length) {}
+
+  bool visit(IntegPeriod *per) {
+    long long bucket = per->timeStamp - (per->timeStamp%itsLength);
+    if (itsCount==0 || itsData[itsCount-1].timeStamp!=bucket) {
+      if (itsCount==itsSize) {
+	itsSize*=2;
+	Rollup *newdata = new Rollup[itsSize];
+	for (int j=0; j<itsCount; j++) newdata[j] = itsData[j];
+	delete[] itsData;
+	itsData = newdata;
+      }
+      itsData[itsCount].clear(bucket, itsLength);
+      itsCount++;
+    }
+    itsData[itsCount-1].add(*per);
+    delete per;
+    return true;
+  }
+
+  Rollup *itsData;
+  int itsCount;
+  int itsSize;
+  long long itsLength;
+};
+
+
+///////////////////////////////////////////////////////////////////////
+//Get summary rollups covering the given range of times
+Rollup *StoreMaster::getRollup(long long start, long long end,
+			       long long resolution, int &count)
+{
+  count = 0;
+  if (resolution<=0) return NULL;
+
+  //Find the coarsest tier which still satisfies the resolution
+  int tier = -1;
+  if (itsKeepRollups) {
+    for (int t=0; t<theirNumRollupTiers; t++) {
+      if (theirRollupTiers[t]<=resolution) tier = t;
+    }
+  }
+
+  int ressize = 64;
+  Rollup *res = new Rollup[ressize];
+
+  if (tier==-1) {
+    //No tier is fine enough, build the buckets from the raw data as it
+    //is read, so we never hold more than one period of it
+    RollupBuilder builder(res, ressize, resolution);
+    scan(start, end, builder);
+    res = builder.itsData;
+    count = builder.itsCount;
+  } else {
+    long long length = theirRollupTiers[tier];
+    const long long oneday = 86400000000ll;
+    long long last = (end!=0)?end:getAbs();
+    //Read the file for each day in the range
+    for (long long day=start-(start%oneday); day<=last; day+=oneday) {
+      ostringstream fname;
+      rollupFileName(tier, day, fname);
+      pthread_mutex_lock(&itsDirLock);
+      ifstream rollfile(fname.str().c_str(), ios::binary);
+      while (rollfile.good() && count<theirMaxResults) {
+	Rollup temp;
+	rollfile >> temp;
+	//An incomplete record may be waiting at the end of the file
+	if (rollfile.fail()) break;
+	if (temp.timeStamp+length<=start || (end!=0 && temp.timeStamp>end))
+	  continue;
+	if (count==ressize) {
+	  ressize*=2;
+	  Rollup *newres = new Rollup[ressize];
+	  for (int j=0; j<count; j++) newres[j] = res[j];
+	  delete[] res;
+	  res = newres;
+	}
+	res[count] = temp;
+	count++;
+      }
+      pthread_mutex_unlock(&itsDirLock);
+    }
+
+    //Add the bucket which is still being accumulated
+    Lock();
+    Rollup current = itsRollups[tier];
+    Unlock();
+    if (current.count>0 && current.timeStamp+length>start
+	&& (end==0 || current.timeStamp<=end)) {
+      if (count==ressize) {
+	ressize++;
+	Rollup *newres = new Rollup[ressize];
+	for (int j=0; j<count; j++) newres[j] = res[j];
+	delete[] res;
+	res = newres;
+      }
+      res[count] = current;
+      count++;
+    }
+
+    //Merge up to the requested resolution
+    Rollup::rebin(res, count, resolution);
+  }
+
+  //Check if we created the array for nothing
+  if (count==0) {
+    delete[] res;
+    res = NULL;
+  }
+  return res;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Return the bucket length giving no more than 'maxbuckets' buckets
+long long StoreMaster::bucketLength(long long start, long long end,
+				    int maxbuckets)
+{
+  if (maxbuckets<1) maxbuckets = 1;
+  long long last = (end!=0) ? end : getAbs();
+  if (last<start) last = start;
+  long long range = last-start;
+
+  long long length = range/maxbuckets + 1;
+  for (int pass=0; pass<2; pass++) {
+    //Round up to a multiple of the coarsest tier which fits, which may
+    //then let a coarser tier fit
+    while (itsKeepRollups) {
+      long long step = 1;
+      for (int t=0; t<theirNumRollupTiers; t++) {
+	if (theirRollupTiers[t]<=length) step = theirRollupTiers[t];
+      }
+      if (length%step==0) break;
+      length = ((length+step-1)/step)*step;
+    }
+    if (last/length - start/length + 1 <= maxbuckets) break;
+    //The buckets are aligned to multiples of their length, so the range
+    //straddles one more bucket than we wanted. Make them long enough
+    //that it can't.
+    length = (maxbuckets>1) ? range/(maxbuckets-1) + 1 : last + 1;
+  }
+  return length;
+}
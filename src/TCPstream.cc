@@ -24,6 +24,7 @@
 #endif
 
 #include "TCPstream.h"
+#include "WireCodec.h"
 #include <errno.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -36,6 +37,9 @@
 
 #if defined(unix)
 #include <unistd.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <limits.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <sys/file.h>
@@ -309,6 +313,12 @@ ostream& operator << (ostream& os, const SocketAddr& addr)
 			// A constructor that doesn't do much...
 TCPbuf::TCPbuf(void)
 : socket_handle(-1),
+gave_up(false),
+protocol(0),
+zout(0),
+zin(0),
+zblock(0),
+zraw_pos(0),
 buf_ptr(0)
 {
 }
@@ -391,12 +401,29 @@ TCPbuf* TCPbuf::accept(int listening_socket, SocketAddr& peeraddr)
 }
 
 
+			// Take over a socket which has already been
+			// connected, eg by an accept() made elsewhere
+TCPbuf* TCPbuf::attach(int connected_socket)
+{
+  if( is_open() || connected_socket < 0 )
+    return 0;
+  socket_handle = connected_socket;
+
+  set_blocking_io(!CurrentNetCallback::async_io_hint());
+#if !defined(B_BEOS_VERSION)
+  set_sock_opt(TCP_NODELAY,true,IPPROTO_TCP);
+#endif
+  return this;
+}
+
+
 				// Close the socket
 TCPbuf* TCPbuf::close(void)
 {
   assert( socket_handle >= 0 );
   const int socket_being_closed = socket_handle;
   socket_handle = -1;
+  release_buffer();
   return has_failed(SOCKETclose(socket_being_closed)) ? 0 : this;
 }
 
@@ -404,6 +431,27 @@ TCPbuf::~TCPbuf(void)
 {
   if( is_open() )
       close();
+  release_buffer();
+}
+
+			// Free the buffer, so that nothing is left
+			// pointing into it if the TCPbuf is connected
+			// again and a new one is made. A new
+			// connection starts without compression, an
+			// expired timeout or an agreed protocol.
+void TCPbuf::release_buffer(void)
+{
+  setg(0,0,0);
+  setp(0,0);
+  setb(0,0,false);
+  if( buf_ptr )
+    free(buf_ptr), buf_ptr = 0;
+  gave_up = false;
+  protocol = 0;
+  delete zout, zout = 0;
+  delete zin, zin = 0;
+  delete [] zblock, zblock = 0;
+  zraw.clear(), zraw_pos = 0;
 }
 
 
@@ -432,6 +480,34 @@ void TCPbuf::set_blocking_io(const bool onoff)
 }
 
 
+			// Give up on blocking reads and writes after
+			// the given time, in milliseconds
+void TCPbuf::set_timeout(const int msec)
+{
+  struct timeval tv;
+  tv.tv_sec = msec/1000;
+  tv.tv_usec = (msec%1000)*1000;
+  has_failed( ::setsockopt(socket_handle, SOL_SOCKET, SO_RCVTIMEO,
+			   (char*)&tv, sizeof(tv)) );
+  has_failed( ::setsockopt(socket_handle, SOL_SOCKET, SO_SNDTIMEO,
+			   (char*)&tv, sizeof(tv)) );
+}
+
+			// A blocking socket only returns EAGAIN when
+			// its timeout has expired, otherwise we just
+			// have to wait
+bool TCPbuf::timed_out(void)
+{
+  if( errno != EAGAIN && errno != EWOULDBLOCK )
+    return false;
+  const int arg = ::fcntl(socket_handle,F_GETFL,0);
+  const bool waited = arg >= 0 && !(arg & O_NONBLOCK);
+  if( waited )
+    gave_up = true;
+  return waited;
+}
+
+
 			// A set of overloaded functions to get
 			// a bool or int socket's option
 int TCPbuf::get_sock_opt(const int opt_name, const int, const int level)
@@ -498,7 +574,7 @@ int TCPbuf::write(const char * buffer, const int n)
     if( char_written > 0 )
       buffer += char_written;
     else
-      if( char_written < 0 && !(SOCKET_WOULDBLOCK()) )
+      if( char_written < 0 && (!(SOCKET_WOULDBLOCK()) || timed_out()) )
         return EOF; //has_failed(char_written),
       else
         CurrentNetCallback::yield();
@@ -524,13 +600,77 @@ int TCPbuf::read(char * buffer, const int n)
     const int char_read = SOCKETread(socket_handle,buffer,n);
     if( char_read >= 0 )
       return char_read;
-    if( SOCKET_WOULDBLOCK() )
+    if( SOCKET_WOULDBLOCK() && !timed_out() )
       CurrentNetCallback::yield();
     else
       return EOF;
   }
 }
 
+			// Compress a block and write it out, a piece
+			// at a time so that a large block needn't be
+			// compressed all at once
+bool TCPbuf::write_packed(const char * buffer, const long long n,
+			  const int stride)
+{
+  string packed;
+  for(long long done = 0; done < n; )
+  {
+    const long long left = n - done;
+    const int chunk = left > WireCodec::theirMaxBlock ?
+    		      WireCodec::theirMaxBlock : left;
+    packed.clear();
+    if( !zout->encode(buffer + done, chunk, stride, packed) ||
+	write(packed.data(), packed.size()) != (int)packed.size() )
+      return false;
+    done += chunk;
+  }
+  return true;
+}
+
+			// Read from the socket until at least n
+			// compressed bytes are waiting in zraw
+bool TCPbuf::read_raw(const size_t n)
+{
+  while( zraw.size() - zraw_pos < n )
+  {
+    if( zraw_pos > 0 )			// Drop what has been used
+      zraw.erase(0,zraw_pos), zraw_pos = 0;
+    const size_t have = zraw.size();
+    const size_t want = n - have > BSIZE ? n - have : BSIZE;
+    zraw.resize(have + want);
+    const int count = read(&zraw[have],want);
+    zraw.resize(have + (count > 0 ? count : 0));
+    if( count <= 0 )
+      return false;
+  }
+  return true;
+}
+
+			// Read the next compressed block and
+			// decompress it into zblock, skipping any
+			// which turn out to be empty
+int TCPbuf::read_packed(void)
+{
+  const int header = WireCodec::theirHeaderSize;
+  for(;;)
+  {
+    int packedlen, len, stride;
+    if( !read_raw(header) )
+      return EOF;
+    if( !WireCodec::readHeader(zraw.data() + zraw_pos,packedlen,len,stride) )
+      return fputs("TCPbuf: bad compressed block\n",stderr), EOF;
+    if( !read_raw(header + packedlen) )
+      return EOF;
+    if( !zin->decode(zraw.data() + zraw_pos + header,packedlen,
+		     zblock,len,stride) )
+      return fputs("TCPbuf: compressed data is corrupt\n",stderr), EOF;
+    zraw_pos += header + packedlen;
+    if( len > 0 )
+      return len;
+  }
+}
+
 /*
  *------------------------------------------------------------------------
  *               Implementing the standard streambuf protocol
@@ -606,6 +746,8 @@ int TCPbuf::sync(void)
   assert( n >= 0 );
   if( n == 0 )
     return 0;
+  if( zout )
+    return write_packed(pbase(), n, 1) ? (pbump(-n), 0) : EOF;
   return write(pbase(), n) == n ? (pbump(-n), 0) : EOF;
 }
 
@@ -632,6 +774,137 @@ int TCPbuf::overflow(int ch)
   return 0;
 }
 
+			// Write out a block directly, bypassing the
+			// put area, for large blocks which are
+			// already in memory. Anything already in the
+			// put area is sent first to keep the order
+int TCPbuf::write_direct(const char * buffer, const int n)
+{
+  if( sync() == EOF )
+    return EOF;
+  if( zout )
+    return write_packed(buffer, n, 1) ? n : EOF;
+  return write(buffer, n);
+}
+
+			// Write out a list of blocks directly with as
+			// few system calls as possible, bypassing the
+			// put area like write_direct()
+long long TCPbuf::writev_direct(struct iovec * iov, int count,
+				const int stride)
+{
+  if( sync() == EOF || !is_open() )
+    return EOF;
+
+  long long total = 0;
+  if( zout )
+  {
+    			// The blocks have to be compressed together,
+    			// so gather them up a compressed block's
+    			// worth at a time
+    const int size = WireCodec::theirMaxBlock;
+    char * gather = new char[size];
+    int fill = 0;
+    bool ok = true;
+    for(int i = 0; i < count && ok; i++)
+    {
+      const char * data = (const char *)iov[i].iov_base;
+      size_t left = iov[i].iov_len;
+      while( left > 0 && ok )
+      {
+	const size_t chunk = left > (size_t)(size - fill) ? size - fill : left;
+	memcpy(gather + fill, data, chunk);
+	fill += chunk, data += chunk, left -= chunk, total += chunk;
+	if( fill == size )
+	  ok = write_packed(gather, fill, stride), fill = 0;
+      }
+    }
+    if( ok && fill > 0 )
+      ok = write_packed(gather, fill, stride);
+    delete [] gather;
+    return ok ? total : EOF;
+  }
+
+
+  while( count > 0 )
+  {
+    const int batch = count > IOV_MAX ? IOV_MAX : count;
+    ssize_t char_written = ::writev(socket_handle,iov,batch);
+    if( char_written < 0 )
+    {
+      if( !(SOCKET_WOULDBLOCK()) || timed_out() )
+        return EOF;
+      CurrentNetCallback::yield();
+      continue;
+    }
+    total += char_written;
+    				// Skip the blocks which were completely
+    				// sent and trim a partially sent one
+    while( count > 0 && char_written >= (ssize_t)iov->iov_len )
+      char_written -= iov->iov_len, iov++, count--;
+    if( count > 0 )
+    {
+      iov->iov_base = (char*)iov->iov_base + char_written;
+      iov->iov_len -= char_written;
+    }
+  }
+  return total;
+}
+
+
+			// Send part of a file straight to the socket,
+			// after anything waiting in the put area
+long long TCPbuf::sendfile_direct(int fd, long long offset, long long len,
+				  const int stride)
+{
+  if( sync() == EOF || !is_open() )
+    return EOF;
+
+  long long total = 0;
+  if( zout )
+  {
+    			// The data has to be compressed on its way,
+    			// so read it in a compressed block at a time
+    const int size = WireCodec::theirMaxBlock;
+    char * chunk = new char[size];
+    bool ok = true;
+    while( ok && total < len )
+    {
+      const long long left = len - total;
+      const ssize_t char_read = ::pread(fd, chunk, left > size ? size : left,
+					offset + total);
+      if( char_read < 0 && errno == EINTR )
+	continue;
+      if( char_read <= 0 )		// The file is shorter than we thought
+	break;
+      ok = write_packed(chunk, char_read, stride);
+      total += char_read;
+    }
+    delete [] chunk;
+    return ok ? total : EOF;
+  }
+
+
+  off_t pos = offset;
+  while( total < len )
+  {
+    const long long left = len - total;
+    const size_t batch = left > (1<<30) ? (1<<30) : left;
+    ssize_t char_written = ::sendfile(socket_handle,fd,&pos,batch);
+    if( char_written < 0 )
+    {
+      if( !(SOCKET_WOULDBLOCK()) || timed_out() )
+        return EOF;
+      CurrentNetCallback::yield();
+      continue;
+    }
+    if( char_written == 0 )		// The file is shorter than we thought
+      break;
+    total += char_written;
+  }
+  return total;
+}
+
 #if 0
 			// Optimization: writing out a memory block
 			// directly, bypassing the put area
@@ -666,12 +939,56 @@ int TCPbuf::underflow(void)
     doallocate();
   
   assert( base() );
+  if( zin )		// The get area is the decompressed block
+  {
+    const int count = read_packed();
+    setg(zblock,zblock,zblock + (count <= 0 ? 0 : count));
+    setp(base(),base());
+    return count <= 0 ? EOF : *(unsigned char*)gptr();
+  }
   const int count = read(base(),ebuf() - base());
   setg(base(),base(),base() + (count <= 0 ? 0 : count));
   setp(base(),base());		// no put area - do overflow on the first put
   return count <= 0 ? EOF : *(unsigned char*)gptr();
 }
 
+			// Start compressing everything we send,
+			// once what has already been put has gone
+			// out as it was
+void TCPbuf::compress_output(void)
+{
+  if( zout )
+    return;
+  sync();
+  zout = new WireCodec(true);
+}
+
+			// Start decompressing everything we receive.
+			// Anything already read past the point where
+			// the other end started compressing is
+			// compressed, so it is kept for read_packed()
+void TCPbuf::decompress_input(void)
+{
+  if( zin )
+    return;
+  zin = new WireCodec(false);
+  zblock = new char[WireCodec::theirMaxBlock];
+  zraw.clear(), zraw_pos = 0;
+  if( gptr() < egptr() )
+    zraw.assign(gptr(), egptr() - gptr());
+  setg(base(),base(),base());
+}
+
+			// Append data to 'out' just as it would be
+			// written to the socket
+bool TCPbuf::pack(const char * data, const long long n, string & out,
+		  const int stride)
+{
+  if( !zout )
+    return out.append(data, n), true;
+  return zout->encode(data, n, stride, out);
+}
+
 			// Allocate a new buffer
 int TCPbuf::doallocate(void)
 {
@@ -755,5 +1072,4 @@ void TCPstream::close(void)
 {
   if( !rdbuf()->close() )
       set(ios::failbit);
-  if (rdbuf()->buf_ptr) free(rdbuf()->buf_ptr);
 }
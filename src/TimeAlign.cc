@@ -0,0 +1,176 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+#include <TimeAlign.h>
+#include <IntegPeriod.h>
+#include <stdlib.h>
+
+
+//A time stamp and where it came from, for sorting
+typedef struct timeidx_t {
+  timegen_t t;
+  int i;
+} timeidx_t;
+
+
+///////////////////////////////////////////////////////////////////////
+//Order by time, then by position
+static int compareTimes(const void *a, const void *b)
+{
+  const timeidx_t *ta = (const timeidx_t*)a, *tb = (const timeidx_t*)b;
+  if (ta->t<tb->t) return -1;
+  if (ta->t>tb->t) return 1;
+  return ta->i - tb->i;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Return the order to visit the samples in, or NULL if already sorted
+int *TimeAlign::order(const timegen_t *t, int len)
+{
+  int i = 1;
+  while (i<len && t[i-1]<=t[i]) i++;
+  if (i>=len) return NULL;
+
+  timeidx_t *temp = new timeidx_t[len];
+  for (i=0; i<len; i++) {
+    temp[i].t = t[i];
+    temp[i].i = i;
+  }
+  qsort(temp, len, sizeof(timeidx_t), compareTimes);
+  int *res = new int[len];
+  for (i=0; i<len; i++) res[i] = temp[i].i;
+  delete[] temp;
+  return res;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Walk through both series in time order, matching each sample of 'a'
+//with whichever neighbouring time in 'b' is nearer
+void TimeAlign::nearest(int *map, const timegen_t *a, int alen,
+			const int *aord, const timegen_t *b, int blen,
+			const int *bord, timegen_t cutoff, tie_t tie)
+{
+  //Collapse runs of equal times in 'b', keeping the index which the
+  //tie break would pick from each run
+  timegen_t *gtime = new timegen_t[blen];
+  int *gidx = new int[blen];
+  int ng = 0;
+  for (int k=0; k<blen; k++) {
+    int j = bord ? bord[k] : k;
+    if (ng>0 && gtime[ng-1]==b[j]) {
+      if (tie==last_tie) gidx[ng-1] = j;
+      continue;
+    }
+    gtime[ng] = b[j];
+    gidx[ng] = j;
+    ng++;
+  }
+
+  int g = 0;
+  for (int k=0; k<alen; k++) {
+    int i = aord ? aord[k] : k;
+    timegen_t t = a[i];
+    //Find the first time in 'b' which isn't before this one
+    while (g<ng && gtime[g]<t) g++;
+
+    int best = -1;
+    timegen_t bestdiff = 0;
+    if (g<ng) {
+      best = gidx[g];
+      bestdiff = gtime[g]-t;
+    }
+    if (g>0) {
+      timegen_t diff = t-gtime[g-1];
+      if (best==-1 || diff<bestdiff ||
+	  (diff==bestdiff && (tie==first_tie ? gidx[g-1]<best
+			                      : gidx[g-1]>best))) {
+	best = gidx[g-1];
+	bestdiff = diff;
+      }
+    }
+    if (cutoff!=0 && bestdiff>cutoff) best = -1;
+    map[i] = best;
+  }
+
+  delete[] gtime;
+  delete[] gidx;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Map each sample of 'a' to the nearest sample of 'b'
+int *TimeAlign::nearest(const timegen_t *a, int alen,
+			const timegen_t *b, int blen,
+			timegen_t cutoff, tie_t tie)
+{
+  if (a==NULL || alen<=0) return NULL;
+  int *res = new int[alen];
+  if (b==NULL || blen<=0) {
+    for (int i=0; i<alen; i++) res[i] = -1;
+    return res;
+  }
+
+  int *aord = order(a, alen);
+  int *bord = order(b, blen);
+  nearest(res, a, alen, aord, b, blen, bord, cutoff, tie);
+  if (aord) delete[] aord;
+  if (bord) delete[] bord;
+  return res;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Map each sample of 'a' to the nearest sample of 'b', where they are
+//nearest to each other
+int *TimeAlign::mutual(const timegen_t *a, int alen,
+		       const timegen_t *b, int blen,
+		       tie_t fwdtie, tie_t backtie)
+{
+  if (a==NULL || alen<=0) return NULL;
+  int *res = new int[alen];
+  if (b==NULL || blen<=0) {
+    for (int i=0; i<alen; i++) res[i] = -1;
+    return res;
+  }
+
+  int *aord = order(a, alen);
+  int *bord = order(b, blen);
+  int *back = new int[blen];
+  nearest(res, a, alen, aord, b, blen, bord, 0, fwdtie);
+  nearest(back, b, blen, bord, a, alen, aord, 0, backtie);
+  for (int i=0; i<alen; i++) {
+    if (res[i]!=-1 && back[res[i]]!=i) res[i] = -1;
+  }
+  delete[] back;
+  if (aord) delete[] aord;
+  if (bord) delete[] bord;
+  return res;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Map each period of 'a' to the nearest period of 'b', where they are
+//nearest to each other
+int *TimeAlign::mutual(const IntegPeriod *a, int alen,
+		       const IntegPeriod *b, int blen,
+		       tie_t fwdtie, tie_t backtie)
+{
+  if (a==NULL || alen<=0) return NULL;
+  timegen_t *at = new timegen_t[alen];
+  timegen_t *bt = new timegen_t[blen>0 ? blen : 1];
+  for (int i=0; i<alen; i++) at[i] = a[i].timeStamp;
+  for (int i=0; b!=NULL && i<blen; i++) bt[i] = b[i].timeStamp;
+  int *res = mutual(at, alen, b ? bt : NULL, blen, fwdtie, backtie);
+  delete[] at;
+  delete[] bt;
+  return res;
+}
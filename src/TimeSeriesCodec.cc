@@ -0,0 +1,386 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+#include <TimeSeriesCodec.h>
+#include <IntegPeriod.h>
+#include <BitStream.h>
+#include <string.h>
+
+//Offsets of the fields within a serialised record
+#define OFF_TIME  4
+#define OFF_POWER 12
+#define OFF_BINS  32
+#define OFF_FLAGS 36
+#define OFF_SPEC  41
+//Length of a record with no spectra or audio
+#define FIXEDLEN  45
+//Number of different spectra a record may hold
+#define NUMSPEC   4
+//Largest number of spectral channels we will believe
+#define MAXBINS   (1<<20)
+
+//The characters which mark each flag as set, in the order they are written
+static const char theirFlagChars[5] = {'R', 'P', 'X', '1', '2'};
+
+
+//The previous value of a float field and the window of meaningful bits
+typedef struct xorstate_t {
+  unsigned int prev;
+  int lead;
+  int trail;
+} xorstate_t;
+
+///////////////////////////////////////////////////////////////////////
+//Reset the state of a float field, as at the start of a block
+static inline void resetXor(xorstate_t &st)
+{
+  st.prev = 0;
+  //Ensures the first non-zero XOR can't use the previous window
+  st.lead = 32;
+  st.trail = 0;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Write a float (as its bit pattern) XORed against its previous value
+static inline void putXor(BitWriter &bw, xorstate_t &st, unsigned int val)
+{
+  unsigned int x = val ^ st.prev;
+  st.prev = val;
+  if (x==0) {
+    bw.put(0, 1);
+    return;
+  }
+  int lead = __builtin_clz(x);
+  int trail = __builtin_ctz(x);
+  if (lead>=st.lead && trail>=st.trail) {
+    //The meaningful bits fit in the window of the previous value
+    bw.put(2, 2);
+    bw.put(x>>st.trail, 32-st.lead-st.trail);
+  } else {
+    //Need to describe a new window
+    int len = 32-lead-trail;
+    bw.put(3, 2);
+    bw.put(lead, 5);
+    bw.put(len-1, 5);
+    bw.put(x>>trail, len);
+    st.lead = lead;
+    st.trail = trail;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Read a float written by putXor
+static inline unsigned int getXor(BitReader &br, xorstate_t &st)
+{
+  if (br.get(1)==0) return st.prev;
+  if (br.get(1)==0) {
+    int len = 32-st.lead-st.trail;
+    if (len<1) {
+      br.setBad();
+      return st.prev;
+    }
+    st.prev ^= br.get(len)<<st.trail;
+  } else {
+    int lead = br.get(5);
+    int len = br.get(5)+1;
+    int trail = 32-lead-len;
+    if (trail<0) {
+      br.setBad();
+      return st.prev;
+    }
+    st.prev ^= br.get(len)<<trail;
+    st.lead = lead;
+    st.trail = trail;
+  }
+  return st.prev;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Write a timestamp as the difference between successive deltas
+static inline void putTime(BitWriter &bw, long long &prevts,
+			   long long &prevdelta, long long ts)
+{
+  long long delta = ts - prevts;
+  long long dod = delta - prevdelta;
+  prevts = ts;
+  prevdelta = delta;
+  if (dod==0) {
+    bw.put(0, 1);
+  } else if (dod>=-64 && dod<64) {
+    bw.put(2, 2);
+    bw.put((unsigned int)dod, 7);
+  } else if (dod>=-8192 && dod<8192) {
+    bw.put(6, 3);
+    bw.put((unsigned int)dod, 14);
+  } else if (dod>=-524288 && dod<524288) {
+    bw.put(14, 4);
+    bw.put((unsigned int)dod, 20);
+  } else {
+    bw.put(15, 4);
+    bw.put64((unsigned long long)dod);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Sign extend the lowest 'n' bits of 'val'
+static inline long long signExtend(unsigned int val, int n)
+{
+  long long res = val;
+  if (res & (1ll<<(n-1))) res -= (1ll<<n);
+  return res;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Read a timestamp written by putTime
+static inline long long getTime(BitReader &br, long long &prevts,
+				long long &prevdelta)
+{
+  long long dod;
+  if (br.get(1)==0) dod = 0;
+  else if (br.get(1)==0) dod = signExtend(br.get(7), 7);
+  else if (br.get(1)==0) dod = signExtend(br.get(14), 14);
+  else if (br.get(1)==0) dod = signExtend(br.get(20), 20);
+  else dod = (long long)br.get64();
+  prevdelta += dod;
+  prevts += prevdelta;
+  return prevts;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Check that a serialised record is well formed and return its length
+static bool checkRecord(const char *rec, int avail, int &len)
+{
+  if (avail<FIXEDLEN) return false;
+  memcpy(&len, rec, sizeof(int));
+  if (len<FIXEDLEN || len>avail) return false;
+  int numbins;
+  memcpy(&numbins, rec+OFF_BINS, sizeof(int));
+  int numspec = 0;
+  for (int i=0; i<5; i++) {
+    char c = rec[OFF_FLAGS+i];
+    if (c!=' ' && c!=theirFlagChars[i]) return false;
+    if (i>0 && c!=' ') numspec++;
+  }
+  long long specbytes = 0;
+  if (numspec>0) {
+    if (numbins<0 || numbins>MAXBINS) return false;
+    specbytes = (long long)numspec*numbins*sizeof(float);
+  }
+  if (OFF_SPEC+specbytes+sizeof(int)>(unsigned long long)len) return false;
+  int audiolen;
+  memcpy(&audiolen, rec+OFF_SPEC+specbytes, sizeof(int));
+  if (audiolen<0) return false;
+  long long expected = FIXEDLEN + specbytes + 2*sizeof(audio_t)*(long long)audiolen;
+  return expected==len;
+}
+
+
+//State shared by the encoder and decoder for the spectra
+typedef struct specstate_t {
+  int numbins;
+  xorstate_t *bins[NUMSPEC];
+} specstate_t;
+
+///////////////////////////////////////////////////////////////////////
+//Reset the spectra state for a new number of bins
+static void resizeSpec(specstate_t &st, int numbins)
+{
+  for (int s=0; s<NUMSPEC; s++) {
+    if (st.bins[s]!=NULL) delete[] st.bins[s];
+    st.bins[s] = NULL;
+    if (numbins>0 && numbins<=MAXBINS) {
+      st.bins[s] = new xorstate_t[numbins];
+      for (int b=0; b<numbins; b++) resetXor(st.bins[s][b]);
+    }
+  }
+  st.numbins = numbins;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Compress a block of serialised IntegPeriods
+bool TimeSeriesCodec::encode(const char *in, int inlen,
+			     char *&out, int &outsize, int &outlen)
+{
+  outlen = 0;
+  //First ensure that we understand all of the records
+  int numrecs = 0;
+  for (int pos=0; pos<inlen; numrecs++) {
+    int len;
+    if (!checkRecord(in+pos, inlen-pos, len)) return false;
+    pos += len;
+  }
+
+  BitWriter bw(out, outsize);
+  bw.put(numrecs, 32);
+  bw.put(inlen, 32);
+
+  long long prevts = 0, prevdelta = 0;
+  xorstate_t powers[5];
+  for (int i=0; i<5; i++) resetXor(powers[i]);
+  int prevbins = 0, prevaudio = 0;
+  specstate_t spec;
+  memset(&spec, 0, sizeof(specstate_t));
+
+  const char *rec = in;
+  for (int r=0; r<numrecs; r++) {
+    int len, numbins, audiolen;
+    long long ts;
+    unsigned int val;
+    memcpy(&len, rec, sizeof(int));
+    memcpy(&ts, rec+OFF_TIME, sizeof(long long));
+    putTime(bw, prevts, prevdelta, ts);
+    for (int i=0; i<5; i++) {
+      memcpy(&val, rec+OFF_POWER+i*sizeof(float), sizeof(float));
+      putXor(bw, powers[i], val);
+    }
+
+    memcpy(&numbins, rec+OFF_BINS, sizeof(int));
+    if (numbins==prevbins) {
+      bw.put(0, 1);
+    } else {
+      bw.put(1, 1);
+      bw.put(numbins, 32);
+      prevbins = numbins;
+    }
+    if (numbins!=spec.numbins) resizeSpec(spec, numbins);
+
+    unsigned int flags = 0;
+    for (int i=0; i<5; i++) {
+      flags <<= 1;
+      if (rec[OFF_FLAGS+i]!=' ') flags |= 1;
+    }
+    bw.put(flags, 5);
+
+    //Each spectral channel is predicted by the same channel last time
+    const char *data = rec+OFF_SPEC;
+    for (int s=0; s<NUMSPEC; s++) {
+      if (rec[OFF_FLAGS+1+s]==' ') continue;
+      for (int b=0; b<numbins; b++) {
+	memcpy(&val, data, sizeof(float));
+	putXor(bw, spec.bins[s][b], val);
+	data += sizeof(float);
+      }
+    }
+
+    memcpy(&audiolen, data, sizeof(int));
+    data += sizeof(int);
+    if (audiolen==prevaudio) {
+      bw.put(0, 1);
+    } else {
+      bw.put(1, 1);
+      bw.put(audiolen, 32);
+      prevaudio = audiolen;
+    }
+    for (int i=0; i<2*audiolen; i++) {
+      audio_t sample;
+      memcpy(&sample, data, sizeof(audio_t));
+      bw.put((unsigned short)sample, 16);
+      data += sizeof(audio_t);
+    }
+    rec += len;
+  }
+  resizeSpec(spec, 0);
+
+  outlen = bw.finish();
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Decompress a block of serialised IntegPeriods
+bool TimeSeriesCodec::decode(const char *in, int inlen,
+			     char *&out, int &outsize, int &outlen)
+{
+  outlen = 0;
+  BitReader br(in, inlen);
+  int numrecs = br.get(32);
+  int plainlen = br.get(32);
+  if (br.bad() || numrecs<0 || plainlen<0) return false;
+  if (outsize<plainlen) {
+    if (out!=NULL) delete[] out;
+    out = new char[plainlen];
+    outsize = plainlen;
+  }
+
+  long long prevts = 0, prevdelta = 0;
+  xorstate_t powers[5];
+  for (int i=0; i<5; i++) resetXor(powers[i]);
+  int numbins = 0, audiolen = 0;
+  specstate_t spec;
+  memset(&spec, 0, sizeof(specstate_t));
+
+  int pos = 0;
+  for (int r=0; r<numrecs && !br.bad(); r++) {
+    long long ts = getTime(br, prevts, prevdelta);
+    unsigned int powvals[5];
+    for (int i=0; i<5; i++) powvals[i] = getXor(br, powers[i]);
+    if (br.get(1)) numbins = br.get(32);
+    unsigned int flags = br.get(5);
+
+    int numspec = 0;
+    for (int s=0; s<NUMSPEC; s++) if (flags & (1<<(3-s))) numspec++;
+    if (numspec>0 && (numbins<0 || numbins>MAXBINS)) {
+      br.setBad();
+      break;
+    }
+    if (numbins!=spec.numbins) resizeSpec(spec, numbins);
+    long long specbytes = numspec>0 ? (long long)numspec*numbins*sizeof(float) : 0;
+    //Ensure the fixed fields and spectra fit in the output
+    if (pos+OFF_SPEC+specbytes+(long long)sizeof(int)>plainlen) {
+      br.setBad();
+      break;
+    }
+
+    char *rec = out+pos;
+    memcpy(rec+OFF_TIME, &ts, sizeof(long long));
+    memcpy(rec+OFF_POWER, powvals, 5*sizeof(float));
+    memcpy(rec+OFF_BINS, &numbins, sizeof(int));
+    for (int i=0; i<5; i++) {
+      rec[OFF_FLAGS+i] = (flags & (1<<(4-i))) ? theirFlagChars[i] : ' ';
+    }
+    char *data = rec+OFF_SPEC;
+    for (int s=0; s<NUMSPEC; s++) {
+      if (!(flags & (1<<(3-s)))) continue;
+      for (int b=0; b<numbins; b++) {
+	unsigned int val = getXor(br, spec.bins[s][b]);
+	memcpy(data, &val, sizeof(float));
+	data += sizeof(float);
+      }
+    }
+
+    if (br.get(1)) audiolen = br.get(32);
+    long long len = FIXEDLEN + specbytes + 2*sizeof(audio_t)*(long long)audiolen;
+    if (audiolen<0 || pos+len>plainlen) {
+      br.setBad();
+      break;
+    }
+    memcpy(data, &audiolen, sizeof(int));
+    data += sizeof(int);
+    for (int i=0; i<2*audiolen; i++) {
+      audio_t sample = (audio_t)(unsigned short)br.get(16);
+      memcpy(data, &sample, sizeof(audio_t));
+      data += sizeof(audio_t);
+    }
+    int intlen = len;
+    memcpy(rec, &intlen, sizeof(int));
+    pos += len;
+  }
+  resizeSpec(spec, 0);
+
+  outlen = pos;
+  return !br.bad() && pos==plainlen;
+}
@@ -0,0 +1,90 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+#include <TokenBucket.h>
+#include <time.h>
+
+
+///////////////////////////////////////////////////////////////////////
+//Return a time in microseconds which only ever goes forwards
+static long long monotonicNow()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000ll + ts.tv_nsec/1000;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Constructor
+TokenBucket::TokenBucket(double rate, double burst)
+{
+  pthread_mutex_init(&itsLock, NULL);
+  setRate(rate, burst);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Destructor
+TokenBucket::~TokenBucket()
+{
+  pthread_mutex_destroy(&itsLock);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Change the rate and burst size
+void TokenBucket::setRate(double rate, double burst)
+{
+  Lock();
+  itsRate = (rate>0) ? rate : 0;
+  itsBurst = (burst>0) ? burst : 0;
+  itsLevel = itsBurst;
+  itsLast = monotonicNow();
+  Unlock();
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Add the tokens which have arrived since we last looked
+void TokenBucket::refill()
+{
+  long long now = monotonicNow();
+  itsLevel += itsRate*(now-itsLast)/1000000.0;
+  if (itsLevel>itsBurst) itsLevel = itsBurst;
+  itsLast = now;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Take the tokens, going into debt if there aren't enough
+void TokenBucket::take(double num)
+{
+  if (itsRate<=0) return;
+  Lock();
+  refill();
+  itsLevel -= num;
+  Unlock();
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Return how long until the bucket is out of debt
+long long TokenBucket::delay()
+{
+  if (itsRate<=0) return 0;
+  Lock();
+  refill();
+  long long res = 0;
+  //Only allow a use while there is something in the bucket
+  if (itsLevel<=0) res = (long long)(-itsLevel*1000000.0/itsRate) + 1;
+  Unlock();
+  return res;
+}
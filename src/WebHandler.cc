@@ -11,86 +11,410 @@
 #include <WebHandler.h>
 #include <WebMaster.h>
 #include <StoreMaster.h>
+#include <RawRing.h>
 #include <IntegPeriod.h>
+#include <Rollup.h>
 #include <TCPstream.h>
 #include <ConfigFile.h>
 #include <RFI.h>
+#include <ArchiveMap.h>
+#include <PeriodBatch.h>
+#include <LiveFeed.h>
+#include <Frame.h>
+#include <TimeCoord.h>
 #include <unistd.h> //for sleep
 #include <stdlib.h> //for free
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <assert.h>
+#include <utility>
+
+//Approximate number of bytes to send to the client in each write
+#define BATCHBYTES (4<<20)
+//Longest command line we will accept from a client
+#define MAXLINE 1000
+//Most live data to hold for a subscriber which isn't keeping up (bytes)
+#define MAXSUBOUTPUT (1<<20)
+//Number of periods in the first and largest groups of a chunked reply
+#define FIRSTCHUNK 16
+#define MAXCHUNK 4096
+//Newest version of the protocol we understand, times ten
+#define PROTOCOL 20
+//Most we read from a protocol 2 client before dealing with it (bytes)
+#define MAXFRAMEINPUT (1<<16)
+//Longest a worker sleeps at once while pacing a client (microseconds)
+#define PACESLICE 200000
+
+//Static Members
+//Most protocol 2 requests a client can have outstanding at once
+const int WebHandler::theirMaxInFlight = 16;
+
+
+///////////////////////////////////////////////////////////////////////
+//Return the version of the protocol to use, times ten, when the client
+//asks for 'version'
+static int chooseProtocol(float version, bool ok)
+{
+  int asked = (int)(version*10+0.5);
+  if (!ok || asked<11) asked = 11;
+  //There was never a 1.3, the version after 1.2 is 2.0
+  if (asked>12 && asked<20) asked = 12;
+  return (asked<PROTOCOL) ? asked : PROTOCOL;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Add a frame with the given payload to the end of 'out'
+static void appendFrame(string &out, unsigned int id, int type,
+			unsigned int count, const string &payload)
+{
+  frame_t frame = {(unsigned int)payload.size(), id, type, count};
+  char header[FRAME_HEADER];
+  packFrame(frame, header);
+  out.append(header, FRAME_HEADER);
+  out += payload;
+}
 
 
 ///////////////////////////////////////////////////////////////////////
 //Constructor
-WebHandler::WebHandler(int listening_socket, StoreMaster *store,
-		       StoreMaster *rawstore, WebMaster *master)
-:ThreadedObject(),
-itsSock(listening_socket),
+WebHandler::WebHandler(int sock, const SocketAddr &peer, StoreMaster *store,
+		       RawRing *rawstore, WebMaster *master)
+:itsBusy(false),
+itsInFlight(0),
+itsSubIndex(-1),
+itsHeldIndex(-1),
+itsSock(sock),
 itsClient(),
-itsSocket(IPaddress(),1),
+itsSocket(peer),
 itsStore(store),
 itsRawStore(rawstore),
 itsMaster(master),
-itsError(false)
-{  }
+itsError(false),
+itsDrop(false),
+itsClosed(false),
+itsSubscribed(false),
+itsSubNext(0),
+itsSubCross(false),
+itsSubInputs(false),
+itsSubAudio(false),
+itsSubDecimate(1),
+itsProtocol(11),
+itsFramed(false),
+itsRequestSeq(0),
+itsCommandBulk(false),
+itsOutPos(0)
+{
+  pthread_mutex_init(&itsRequestLock, NULL);
+  pthread_mutex_init(&itsWriteLock, NULL);
+  itsRequests = new request_t[theirMaxInFlight];
+  for (int i=0; i<theirMaxInFlight; i++) {
+    itsRequests[i].state = request_free;
+  }
+  itsClient.rdbuf()->attach(itsSock);
+  //The workers write to the socket so it needs to block. We read and
+  //send without waiting by asking for that on each call.
+  itsClient.rdbuf()->set_blocking_io(true);
+  //Each client gets the same allowance
+  ConfigFile *config = itsMaster->getConfig();
+  double burst = config->getClientBurst();
+  double requests = config->getClientRequests();
+  itsRequestBucket.setRate(requests, requests*burst>1 ? requests*burst : 1);
+  double bytes = 1024.0*config->getClientKBytes();
+  itsByteBucket.setRate(bytes, bytes*burst);
+  cerr << "New Connection from " << itsSocket << endl;
+}
 
 
 ///////////////////////////////////////////////////////////////////////
 //Destructor
 WebHandler::~WebHandler()
-{  }
+{
+  if (itsDrop && !itsError) {
+    //Tell the client why, if it will listen
+    string error;
+    if (itsFramed) appendFrame(error, 0, frame_error, 0, "protocol error");
+    else error = "\nERROR\n";
+    addOutput(error);
+    sendOutput();
+  }
+  //Ensure TCP link is closed
+  itsClient.flush();
+  itsClient.close();
+  delete[] itsRequests;
+  pthread_mutex_destroy(&itsRequestLock);
+  pthread_mutex_destroy(&itsWriteLock);
+
+  //Print an appropriate message
+  if (itsError) {
+    cerr << "Lost Connection to " << itsSocket << endl;
+  } else {
+//    cerr << "Closed Connection to " << itsSocket << endl;
+  }
+}
 
 
 ///////////////////////////////////////////////////////////////////////
-//
-void WebHandler::run()
+//Read whatever the client has sent without waiting
+bool WebHandler::readInput()
 {
-  //Detach our thread
-  pthread_detach(itsThread);
+  char buf[4096];
+  while (true) {
+    //Leave the rest of a protocol 2 client's requests in the socket
+    //until we have dealt with these
+    if (itsFramed && itsInput.size()>=MAXFRAMEINPUT) break;
+    int n = recv(itsSock, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n>0) {
+      itsInput.append(buf, n);
+      continue;
+    }
+    if (n<0 && errno==EINTR) continue;
+    if (n<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) break;
+    //The client has finished sending, or the connection has failed
+    if (n==0) {
+      itsClosed = true;
+      break;
+    }
+    itsError = true;
+    return false;
+  }
+  //Don't let a client without any newlines fill up our memory
+  if (!itsFramed &&
+      itsInput.size()>MAXLINE && itsInput.find('\n')==string::npos) {
+    itsError = true;
+    return false;
+  }
+  return true;
+}
 
-  //Wait here until we get a new connection
-  itsClient.rdbuf()->accept(itsSock,itsSocket);
-  itsClient.rdbuf()->set_blocking_io(true);
 
-  cerr << "New Connection from " << itsSocket << endl;
+///////////////////////////////////////////////////////////////////////
+//Take the next complete command line from what the client has sent
+bool WebHandler::nextLine(string &line)
+{
+  string::size_type end = itsInput.find('\n');
+  if (end==string::npos) return false;
+  line.assign(itsInput, 0, end);
+  itsInput.erase(0, end+1);
+  if (line.size()>0 && line[line.size()-1]=='\r') line.erase(line.size()-1);
+  return true;
+}
 
-  while (itsKeepRunning && !itsError && itsClient.good()) {
-    //Read a command line from the client connection /// timeout?
-    char line[1001];
-    line[1000] = '\0';
-    itsClient.getline(line, 1000);
-    if (line[0]=='\0' || line[0]=='\r' || line[0]=='\n') continue;
-    cerr << "\nLINE IS: " << line << "\n";
-    //Create a string stream from the client's command
-    istringstream command(line);
-    //Parse and service the command
-    serviceCommand(command);
+
+///////////////////////////////////////////////////////////////////////
+//Return true if an AFTER command only wants the most recent period
+static bool isLatest(const string &line)
+{
+  istringstream args(line);
+  string directive;
+  long long epoch = -1;
+  args >> directive >> epoch;
+  return !args.fail() && epoch==0;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Service the command now if it is cheap
+bool WebHandler::quickCommand(const string &line)
+{
+  if (line.size()>MAXLINE) {
+    itsError = true;
+    return true;
+  }
+  cerr << "\nLINE IS: " << line << "\n";
+  itsRequestBucket.take(1);
+  istringstream command(line);
+  string directive;
+  command >> directive;
+  //Check for error
+  if (command.fail()) {
+    itsError = true;
+    return true;
   }
 
-  //Ensure connection is closed and exit thread
-  dropConnection();
+  //Anything else would get mixed up with the live data
+  if (itsSubscribed && directive != "UNSUBSCRIBE") {
+    cerr << directive << endl;
+    dropConnection();
+    return true;
+  }
+
+  ostringstream reply;
+  bool compress = false;
+  if (directive == "LOCATION") {
+    ConfigFile *config = itsMaster->getConfig();
+    reply << config->getLongitude() << "\t"
+	  << config->getLatitude() << endl;
+  } else if (directive == "VERSION") {
+    //Return the server and IntegPeriod version
+    reply << "SAC 1.1\n";
+  } else if (directive == "PROTOCOL") {
+    //Use the version the client asked for, if we know it
+    float version = 0;
+    command >> version;
+    itsProtocol = chooseProtocol(version, !command.fail());
+    //The client may also ask for everything we send to be compressed
+    string option;
+    command >> option;
+    compress = (option=="zlib" && itsMaster->getConfig()->getNetCompress());
+    reply << "PROTOCOL " << itsProtocol/10 << "." << itsProtocol%10;
+    if (compress) reply << " zlib";
+    reply << endl;
+    //From now on the client sends frames
+    if (itsProtocol>=20) itsFramed = true;
+  } else if (directive == "STATS") {
+    itsMaster->writeStats(reply);
+  } else if (directive == "SUBSCRIBE") {
+    doSubscribe(command);
+  } else if (directive == "UNSUBSCRIBE") {
+    //Mark the end of the live data, which may be followed by replies
+    itsSubscribed = false;
+    reply << "END\n";
+  } else if (directive == "AFTER" && isLatest(line)) {
+    //Only the most recent period is wanted, which is quick to find
+    doAfterASCII(command, reply);
+  } else if (directive == "BETWEEN" || directive == "RAW-BETWEEN" ||
+	     directive == "AFTER" || directive == "ROLLUP") {
+    //These may take a while so they need a worker
+    itsCommand = line;
+    itsCommandBulk = isBulk(line);
+    return false;
+  } else {
+    cerr << directive << endl;
+    dropConnection();
+    return true;
+  }
+  addOutput(reply.str());
+  //The reply which agrees to compression is the last thing sent as it is
+  if (compress) itsClient.rdbuf()->compress_output();
+  return true;
 }
 
 
 ///////////////////////////////////////////////////////////////////////
-//Ensure TCP connection is closed and exit our thread
-void WebHandler::dropConnection()
+//Return true if the command should be left to the bulk workers
+bool WebHandler::isBulk(const string &line)
 {
-  itsClient << "\nERROR\n";
-  //Ensure TCP link is closed
+  istringstream args(line);
+  string directive;
+  long long start = 0, end = 0;
+  args >> directive;
+  if (directive=="AFTER") {
+    args >> start;
+  } else if (directive=="BETWEEN" || directive=="RAW-BETWEEN") {
+    args >> start >> end;
+  } else {
+    //Anything else is quick or only reads the summaries
+    return false;
+  }
+  //Rubbish is turned away without reading anything
+  if (args.fail() || !validEpoch(start) || !validEpoch(end)) return false;
+
+  if (directive=="BETWEEN") {
+    bool keep;
+    int cleandata = clean_none, buckets = 0;
+    args >> keep >> keep >> keep >> cleandata;
+    if (args.fail()) cleandata = clean_none;
+    else args >> buckets;
+    //Summaries for a plot are cheap however long the range
+    if (!args.fail() && buckets>0) return false;
+    //Cleaning means holding and going over the whole range at once
+    if (cleandata!=clean_none) return true;
+  }
+
+  //Otherwise it depends how much of the store it covers, all of it if
+  //there is no start
+  if (start==0) return true;
+  if (end==0) end = getAbs();
+  long long span = itsMaster->getConfig()->getBulkSpan()*3600000000ll;
+  return end-start>span;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Service the command kept by quickCommand()
+void WebHandler::serviceCommand(bool bulk)
+{
+  if (itsFramed) {
+    serviceRequest(bulk);
+    return;
+  }
+  istringstream command(itsCommand);
+  serviceCommand(command);
   itsClient.flush();
-  itsClient.close();
+  if (!itsClient.good()) itsError = true;
+}
 
-  //Print an appropriate message
-  if (itsError) {
-    cerr << "Lost Connection to " << itsSocket << endl;
-  } else {
-//    cerr << "Closed Connection to " << itsSocket << endl;
+
+///////////////////////////////////////////////////////////////////////
+//Send as much of the output buffer as the client will take
+bool WebHandler::sendOutput()
+{
+  while (itsOutPos<itsOutput.size()) {
+    int n = send(itsSock, itsOutput.data()+itsOutPos,
+		 itsOutput.size()-itsOutPos, MSG_DONTWAIT|MSG_NOSIGNAL);
+    if (n>0) {
+      itsOutPos += n;
+      //This isn't held back, but it still counts against the client
+      itsByteBucket.take(n);
+      continue;
+    }
+    if (n<0 && errno==EINTR) continue;
+    if (n<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+      //Don't keep what has been sent if more is being added behind it
+      if (itsOutPos>=65536) {
+	itsOutput.erase(0, itsOutPos);
+	itsOutPos = 0;
+      }
+      return true;
+    }
+    itsError = true;
+    return false;
   }
+  itsOutput.erase();
+  itsOutPos = 0;
+  return true;
+}
+
 
-  //Disconnect from the WebMaster, our job is over
-  itsKeepRunning = false;
-  itsMaster->disconnect(this);
-  pthread_exit(NULL);
+///////////////////////////////////////////////////////////////////////
+//Add to the output buffer, compressed if the client asked for that
+void WebHandler::addOutput(const string &data, int stride)
+{
+  //A worker may be compressing a reply of its own
+  pthread_mutex_lock(&itsWriteLock);
+  if (!itsClient.rdbuf()->pack(data.data(), data.size(), itsOutput, stride)) {
+    itsError = true;
+  }
+  pthread_mutex_unlock(&itsWriteLock);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Mark the connection to be closed once the current command is done
+void WebHandler::dropConnection()
+{
+  itsDrop = true;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Count the bytes against the client, first waiting until it is allowed
+//more if we are a bulk worker
+void WebHandler::pace(long long bytes, request_t *req)
+{
+  if (!itsByteBucket.limited()) return;
+  //The other workers carry on and the WebMaster holds the client before
+  //its next command until the debt is paid off
+  bool bulk = (req!=NULL) ? req->bulk : itsCommandBulk;
+  long long wait;
+  while (bulk && !finished() && (req==NULL || !cancelled(req)) &&
+	 (wait=itsByteBucket.delay())>0) {
+    //Wake now and then in case the client has gone
+    usleep(wait<PACESLICE ? wait : PACESLICE);
+  }
+  itsByteBucket.take(bytes);
 }
 
 
@@ -112,14 +436,9 @@ void WebHandler::serviceCommand(istringstream &command)
   } else if (directive == "RAW-BETWEEN") {
     doRawBetween(command);
   } else if (directive == "AFTER") {
-    doAfterASCII(command);
-  } else if (directive == "LOCATION") {
-    ConfigFile *config = itsMaster->getConfig();
-    itsClient << config->getLongitude() << "\t"
-              << config->getLatitude() << endl;
-  } else if (directive == "VERSION") {
-    //Return the server and IntegPeriod version
-    itsClient << "SAC 1.1\n";
+    doAfterASCII(command, itsClient);
+  } else if (directive == "ROLLUP") {
+    doRollup(command);
   } else {
     cerr << directive << endl;
     dropConnection();
@@ -127,6 +446,175 @@ void WebHandler::serviceCommand(istringstream &command)
 }
 
 
+///////////////////////////////////////////////////////////////////////
+//Sends periods to the client in the groups used by protocol 1.2. The
+//groups start small, so the client gets the first data straight away,
+//and grow as the reply goes on. For protocol 2 each group is sent as a
+//data frame instead, and we stop if the client cancels the request.
+//Runs of periods straight from the store's files are sent as groups of
+//their own with sendfile.
+class ChunkSender : public SpanVisitor {
+public:
+  ChunkSender(WebHandler *handler, bool cross, bool inputs, bool audio)
+  :itsClient(handler->itsClient),
+  itsHandler(handler),
+  itsRequest(NULL),
+  itsCross(cross),
+  itsInputs(inputs),
+  itsAudio(audio),
+  itsCount(0),
+  itsTotal(0),
+  itsChunk(FIRSTCHUNK),
+  itsError(false),
+  itsCancelled(false)
+  {
+    itsData = new IntegPeriod*[MAXCHUNK];
+  }
+
+  //Send the reply to a protocol 2 request
+  ChunkSender(WebHandler *handler, WebHandler::request_t *req,
+	      bool cross, bool inputs, bool audio)
+  :itsClient(handler->itsClient),
+  itsHandler(handler),
+  itsRequest(req),
+  itsCross(cross),
+  itsInputs(inputs),
+  itsAudio(audio),
+  itsCount(0),
+  itsTotal(0),
+  itsChunk(FIRSTCHUNK),
+  itsError(false),
+  itsCancelled(false)
+  {
+    itsData = new IntegPeriod*[MAXCHUNK];
+  }
+
+  ~ChunkSender() {
+    for (int i=0; i<itsCount; i++) delete itsData[i];
+    delete[] itsData;
+  }
+
+  //Take the next period and send the group if it is big enough
+  bool visit(IntegPeriod *per) {
+    if (itsRequest!=NULL && itsHandler->cancelled(itsRequest)) {
+      itsCancelled = true;
+      delete per;
+      return false;
+    }
+    //Discard any data which the client doesn't want
+    per->keepOnly(itsCross, itsInputs, itsAudio);
+    itsData[itsCount++] = per;
+    itsBatch.add(*per);
+    if (itsCount>=itsChunk || itsBatch.length()>=BATCHBYTES) flush();
+    return !itsError;
+  }
+
+  //Send the run of periods from the file as a group of its own
+  bool visitSpan(int fd, long long offset, long long len, int count) {
+    if (itsRequest!=NULL && itsHandler->cancelled(itsRequest)) {
+      itsCancelled = true;
+      return false;
+    }
+    flush();
+    if (itsError) return false;
+    itsHandler->pace(len, itsRequest);
+    if (itsRequest!=NULL) {
+      itsError = !itsHandler->sendFrame(itsRequest->id, count, fd, offset, len);
+    } else {
+      itsClient << count << endl;
+      if (!itsClient.good() ||
+	  itsClient.rdbuf()->sendfile_direct(fd, offset, len,
+					     sizeof(float))!=len) {
+	itsError = true;
+      }
+    }
+    itsTotal += count;
+    return !itsError;
+  }
+
+  //Send what is left and the trailer. Returns false on error.
+  bool finish() {
+    flush();
+    if (itsError) return false;
+    if (itsRequest!=NULL) {
+      if (itsCancelled) {
+	itsError = !itsHandler->sendFrame(itsRequest->id, frame_error, itsTotal,
+					  "cancelled");
+      } else {
+	itsError = !itsHandler->sendFrame(itsRequest->id, frame_end, itsTotal,
+					  "");
+      }
+    } else {
+      itsClient << "END " << itsTotal << " OK" << endl;
+      if (!itsClient.good()) itsError = true;
+    }
+    return !itsError;
+  }
+
+private:
+  //Send the current group
+  void flush() {
+    if (itsCount>0 && !itsError) {
+      itsHandler->pace(itsBatch.length(), itsRequest);
+      if (itsRequest!=NULL) {
+	itsError = !itsHandler->sendFrame(itsRequest->id, itsCount, itsBatch);
+      } else {
+	itsClient << itsCount << endl;
+	if (!itsClient.good() || !itsBatch.send(itsClient)) itsError = true;
+      }
+      itsTotal += itsCount;
+    }
+    itsBatch.clear();
+    for (int i=0; i<itsCount; i++) delete itsData[i];
+    itsCount = 0;
+    if (itsChunk<MAXCHUNK) itsChunk *= 2;
+  }
+
+  TCPstream &itsClient;
+  WebHandler *itsHandler;
+  //The request for a protocol 2 reply, otherwise NULL
+  WebHandler::request_t *itsRequest;
+  bool itsCross, itsInputs, itsAudio;
+  //The periods in the current group
+  IntegPeriod **itsData;
+  int itsCount;
+  PeriodBatch itsBatch;
+  //Number of periods sent so far
+  int itsTotal;
+  //Number of periods to put in the current group
+  int itsChunk;
+  bool itsError;
+  //Did we stop because the client cancelled the request
+  bool itsCancelled;
+};
+
+
+///////////////////////////////////////////////////////////////////////
+//Pass the periods to the visitor until it has had enough, then delete
+//the array and any periods it didn't take
+static void visitAll(PeriodVisitor &visitor, IntegPeriod **data, int count)
+{
+  int i = 0;
+  for (; data!=NULL && i<count; i++) {
+    if (!visitor.visit(data[i])) break;
+  }
+  //Clean up any we didn't get to
+  for (i++; data!=NULL && i<count; i++) delete data[i];
+  if (data!=NULL) delete[] data;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Send the periods as a protocol 1.2 reply
+void WebHandler::sendChunked(IntegPeriod **data, int count,
+			     bool keepcross, bool keepinputs, bool keepaudio)
+{
+  ChunkSender sender(this, keepcross, keepinputs, keepaudio);
+  visitAll(sender, data, count);
+  if (!sender.finish()) itsError = true;
+}
+
+
 ///////////////////////////////////////////////////////////////////////
 //Handle command which wants all data between two argument epochs
 void WebHandler::doBetween(istringstream &command)
@@ -134,6 +622,7 @@ void WebHandler::doBetween(istringstream &command)
   //Read the argument epochs from the command stream
   unsigned long long sinceepoch = readepoch(command);
   unsigned long long endepoch = readepoch(command);
+  if (finished()) return;
   if (endepoch<sinceepoch && endepoch!=0) {
     unsigned long long temp = sinceepoch;
     sinceepoch = endepoch;
@@ -141,37 +630,55 @@ void WebHandler::doBetween(istringstream &command)
   }
 
   //Read which data the client wishes to be returned
-  bool keepcross, keepinputs, keepaudio, cleandata;
+  bool keepcross, keepinputs, keepaudio;
   command >> keepcross >> keepinputs >> keepaudio;
   if (command.fail()) {
     itsError = true;
     dropConnection();
+    return;
   }
 
+  //Cleaning is optional, 1 for the usual cleaning or 2 for median based
+  int cleandata;
   command >> cleandata;
-  if (command.fail()) cleandata = false;
+  if (command.fail() || cleandata<clean_none || cleandata>clean_median) {
+    cleandata = clean_none;
+  }
 
-  //Get the requested data from the store
-  int count;
-  IntegPeriod **data = itsStore->get(sinceepoch, endepoch, count);
+  //If the client only wants so many points across the range, for a
+  //plot, send it summaries rather than every period
+  int buckets;
+  command >> buckets;
+  if (!command.fail() && buckets>0) {
+    long long length = itsStore->bucketLength(sinceepoch, endepoch, buckets);
+    int count;
+    Rollup *data = itsStore->getRollup(sinceepoch, endepoch, length, count);
+    sendRollups(data, count, itsProtocol>=12);
+    return;
+  }
 
-  if (cleandata && data!=NULL && count>0) {
-    IntegPeriod *tempdata = NULL, *tdata=new IntegPeriod[count];
-    for (int i=0; i<count; i++) {
-      tdata[i] = *data[i];
-      delete data[i];
+  //With protocol 1.2 the periods can be sent as they are read, unless
+  //they need to be cleaned which has to be done all at once. If the
+  //client wants them just as they are stored they don't even need to
+  //be read.
+  if (itsProtocol>=12 && !cleandata) {
+    ChunkSender sender(this, keepcross, keepinputs, keepaudio);
+    if (keepcross && keepinputs && keepaudio) {
+      itsStore->scanSpans(sinceepoch, endepoch, sender);
+    } else {
+      itsStore->scan(sinceepoch, endepoch, sender);
     }
-    delete[] data;
+    if (!sender.finish()) itsError = true;
+    return;
+  }
 
-    int tempcount;
-    cleanData(tempdata, tempcount, tdata, count);
-    cerr << "DONE CLEANING";
+  //Get the requested data from the store
+  int count;
+  IntegPeriod **data = getCleaned(sinceepoch, endepoch, cleandata, count);
 
-    count = tempcount;
-    data = new IntegPeriod*[count];
-    for (int i=0; i<count; i++) data[i] = new IntegPeriod(tempdata[i]);
-    delete[] tempdata;
-    delete[] tdata;
+  if (itsProtocol>=12) {
+    sendChunked(data, count, keepcross, keepinputs, keepaudio);
+    return;
   }
 
   //Inform the client how many periods, possibly 0, we will send
@@ -180,14 +687,17 @@ void WebHandler::doBetween(istringstream &command)
   if (!itsClient.good()) {itsError=true;}
   //If there was no data we have nothing to send
   if (data!=NULL && !itsError) {
-    int i=0;
-    //Send each integration period unless there is an error
-    for (i=0; i<count && !itsError; i++) {
+    //Send the periods in batches, each with a single write
+    PeriodBatch batch;
+    for (int i=0; i<count && !itsError; i++) {
       //Discard any data which the client doesn't want
       data[i]->keepOnly(keepcross, keepinputs, keepaudio);
-      //Send the data to the client
-      itsClient << (*data[i]);
-      if (!itsClient.good()) {itsError=true;}
+      batch.add(*data[i]);
+      if (batch.length()>=BATCHBYTES || i==count-1) {
+	pace(batch.length());
+	if (!batch.send(itsClient)) {itsError=true;}
+	batch.clear();
+      }
     }
     if (!itsClient.good()) {itsError=true;}
   }
@@ -200,57 +710,214 @@ void WebHandler::doBetween(istringstream &command)
 }
 
 
+///////////////////////////////////////////////////////////////////////
+//Get the periods between two epochs from the store, cleaned as asked
+IntegPeriod **WebHandler::getCleaned(long long start, long long end,
+				     int mode, int &count)
+{
+  IntegPeriod **data = itsStore->get(start, end, count);
+
+  if (mode!=clean_none && data!=NULL && count>0) {
+    IntegPeriod *tempdata = NULL, *tdata=new IntegPeriod[count];
+    for (int i=0; i<count; i++) {
+      tdata[i] = std::move(*data[i]);
+      delete data[i];
+    }
+    delete[] data;
+
+    int tempcount;
+    cleanData(tempdata, tempcount, tdata, count, (clean_mode)mode);
+    cerr << "DONE CLEANING";
+
+    count = tempcount;
+    data = new IntegPeriod*[count];
+    for (int i=0; i<count; i++) data[i] = new IntegPeriod(std::move(tempdata[i]));
+    delete[] tempdata;
+    delete[] tdata;
+  }
+  return data;
+}
+
+
 ///////////////////////////////////////////////////////////////////////
 //Handle command which wants all RAW data between two argument epochs
 void WebHandler::doRawBetween(istringstream &command)
 {
   if (itsRawStore==NULL) {
     cerr << "Cannot service request for RAW data: NO RAW STORE\n";
-    itsClient << "0\n";
+    if (itsProtocol>=12) {
+      itsClient << "RATE " << itsMaster->getConfig()->getSampRate() << endl
+		<< "END 0 ERROR no raw data store\n";
+    } else {
+      itsClient << "0\n";
+    }
     return;
   }
 
   //Read the argument epochs from the command stream
   unsigned long long sinceepoch = readepoch(command);
   unsigned long long endepoch = readepoch(command);
+  if (finished()) return;
   if (endepoch<sinceepoch && endepoch!=0) {
     unsigned long long temp = sinceepoch;
     sinceepoch = endepoch;
     endepoch = temp;
   }
 
-  //Get the requested data from the RAW store
-  int count;
-  IntegPeriod **data = itsRawStore->get(sinceepoch, endepoch, count);
+  //Find where the requested data is in the RAW ring
+  rawslice_t slice;
+  itsRawStore->slice(sinceepoch, endepoch, slice);
+  ConfigFile *config = itsMaster->getConfig();
+  //With protocol 1.2 the sampling rate comes first, on its own line
+  if (itsProtocol>=12) itsClient << "RATE " << config->getSampRate() << endl;
   //Inform the client how many periods, possibly 0, we will send
-  itsClient << count << endl;
+  if (itsProtocol<12 || slice.count>0) itsClient << slice.count << endl;
   //Ensure we could write to client okay
   if (!itsClient.good()) {itsError=true;}
   //If there was no data we have nothing to send
-  if (data!=NULL && !itsError) {
+  if (slice.count>0 && !itsError) {
     //Tell the client what our sampling rate is
-    ConfigFile *config = itsMaster->getConfig();
-    itsClient << config->getSampRate();
-    int i=0;
-    //Send each integration period unless there is an error
-    for (i=0; i<count && !itsError; i++) {
-      //Send the data to the client
-      itsClient << (*data[i]);
-      if (!itsClient.good()) {itsError=true;}
+    if (itsProtocol<12) itsClient << config->getSampRate();
+    //Clients before protocol 1.2 can't decode compressed audio
+    if (itsProtocol<12) sendRawPlain(slice);
+    //Otherwise the periods are already serialised in the ring, so send
+    //them straight from there
+    for (int i=0; i<2 && itsProtocol>=12 && !itsError; i++) {
+      const char *data = slice.start[i];
+      long long len = slice.len[i];
+      while (len>0 && !itsError) {
+	int chunk = (len>BATCHBYTES) ? BATCHBYTES : len;
+	pace(chunk);
+	if (itsClient.rdbuf()->write_direct(data, chunk)!=chunk) {
+	  itsError = true;
+	}
+	data += chunk;
+	len -= chunk;
+      }
     }
-    if (!itsClient.good()) {itsError=true;}
+    //If new data overwrote what we were sending the client has garbage
+    if (!itsError && !itsRawStore->stillValid(slice)) {
+      cerr << "WebHandler: RAW data was overwritten while being sent\n";
+      //With protocol 1.2 we can just tell the client, otherwise the
+      //only way to let it know is to drop the connection
+      if (itsProtocol>=12) {
+	itsClient << "END " << slice.count << " ERROR overwritten" << endl;
+	return;
+      }
+      itsError = true;
+    }
+  }
+  if (itsProtocol>=12 && !itsError) {
+    itsClient << "END " << slice.count << " OK" << endl;
+    if (!itsClient.good()) itsError = true;
   }
+}
 
-  //Clean up data, if there is any
-  if (data!=NULL) {
-    for (int i=0;i<count; i++) delete data[i];
-    delete[] data;
+
+///////////////////////////////////////////////////////////////////////
+//Send the raw periods with any compressed audio decoded
+void WebHandler::sendRawPlain(const rawslice_t &slice)
+{
+  PeriodBatch batch;
+  //Periods we had to decode, which the batch refers to until it is sent
+  IntegPeriod **decoded = new IntegPeriod*[MAXCHUNK];
+  int numdecoded = 0;
+  for (int i=0; i<2 && !itsError; i++) {
+    const char *rec = slice.start[i];
+    long long avail = slice.len[i];
+    while (avail>0 && !itsError) {
+      long long len = ArchiveMap::checkRecord(rec, avail);
+      if (len<0) {
+	cerr << "WebHandler: Corrupt period in the RAW ring\n";
+	itsError = true;
+	break;
+      }
+      PeriodView view(rec);
+      if (view.audioCompressed()) {
+	IntegPeriod *per = new IntegPeriod();
+	decoded[numdecoded++] = per;
+	if (!view.get(*per)) {
+	  cerr << "WebHandler: Could not decode audio from the RAW ring\n";
+	  itsError = true;
+	  break;
+	}
+	batch.add(*per);
+      } else {
+	//Plain periods can still be sent straight from the ring
+	batch.addRecord(rec, len);
+      }
+      rec += len;
+      avail -= len;
+
+      bool last = avail==0 && (i==1 || slice.len[1]==0);
+      if (last || batch.length()>=BATCHBYTES || numdecoded==MAXCHUNK) {
+	pace(batch.length());
+	if (!batch.send(itsClient)) itsError = true;
+	batch.clear();
+	for (int j=0; j<numdecoded; j++) delete decoded[j];
+	numdecoded = 0;
+      }
+    }
+  }
+  for (int j=0; j<numdecoded; j++) delete decoded[j];
+  delete[] decoded;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Handle command which wants summary rollups between two argument epochs
+void WebHandler::doRollup(istringstream &command)
+{
+  //Read the argument epochs from the command stream
+  unsigned long long sinceepoch = readepoch(command);
+  unsigned long long endepoch = readepoch(command);
+  if (finished()) return;
+  if (endepoch<sinceepoch && endepoch!=0) {
+    unsigned long long temp = sinceepoch;
+    sinceepoch = endepoch;
+    endepoch = temp;
+  }
+  //Read the length of each bucket the client wants
+  long long resolution;
+  command >> resolution;
+  if (command.fail() || resolution<=0) {
+    itsError = true;
+    dropConnection();
+    return;
+  }
+
+  //Get the summaries from the store
+  int count;
+  Rollup *data = itsStore->getRollup(sinceepoch, endepoch, resolution, count);
+  sendRollups(data, count, false);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Send the rollups to the client and delete them
+void WebHandler::sendRollups(Rollup *data, int count, bool trailer)
+{
+  //Inform the client how many rollups, possibly 0, we will send
+  itsClient << count << endl;
+  //Ensure we could write to client okay
+  if (!itsClient.good()) {itsError=true;}
+  //Send each rollup unless there is an error
+  for (int i=0; data!=NULL && i<count && !itsError; i++) {
+    itsClient << data[i];
+    if (!itsClient.good()) {itsError=true;}
   }
+  if (trailer && !itsError) {
+    itsClient << "END " << count << " OK" << endl;
+    if (!itsClient.good()) {itsError=true;}
+  }
+
+  if (data!=NULL) delete[] data;
 }
 
 
+///////////////////////////////////////////////////////////////////////
 //Handle command which wants all data after an epoch in ASCII
-void WebHandler::doAfterASCII(istringstream &command)
+void WebHandler::doAfterASCII(istringstream &command, ostream &out)
 {
   //Read the argument epoch from the command stream
   unsigned long long epoch = readepoch(command);
@@ -259,7 +926,15 @@ void WebHandler::doAfterASCII(istringstream &command)
     itsError = true;
     dropConnection();
   }
+  if (finished()) return;
+  writeAfter(epoch, out);
+}
 
+
+///////////////////////////////////////////////////////////////////////
+//Write the reply to AFTER for the given epoch
+void WebHandler::writeAfter(long long epoch, ostream &out)
+{
   int numdata = 0;
   IntegPeriod **data = NULL;
 
@@ -275,12 +950,12 @@ void WebHandler::doAfterASCII(istringstream &command)
   }
 
   if (numdata==0 || data==NULL) {
-    itsClient << "0\n";
+    out << "0\n";
   } else {
     //Tell client how many lines we will return
-    itsClient << numdata << endl;
+    out << numdata << endl;
     for (int i=0; i<numdata; i++) {
-      itsClient << data[i]->timeStamp << " "
+      out << data[i]->timeStamp << " "
 	<< data[i]->power1 << " " << data[i]->power2 << " "
 	<< data[i]->powerX << endl;
       //And delete
@@ -289,3 +964,479 @@ void WebHandler::doAfterASCII(istringstream &command)
     delete[] data;
   }
 }
+
+
+///////////////////////////////////////////////////////////////////////
+//Handle command which wants new data pushed as it arrives
+void WebHandler::doSubscribe(istringstream &command)
+{
+  //Read which data the client wishes to be sent
+  bool keepcross, keepinputs, keepaudio;
+  command >> keepcross >> keepinputs >> keepaudio;
+  if (command.fail()) {
+    itsError = true;
+    dropConnection();
+    return;
+  }
+  //Decimation is optional, the default is to send every period
+  int decimate;
+  command >> decimate;
+  if (command.fail() || decimate<1) decimate = 1;
+
+  itsSubCross = keepcross;
+  itsSubInputs = keepinputs;
+  itsSubAudio = keepaudio;
+  itsSubDecimate = decimate;
+  //Start with the next period to arrive
+  LiveFeed *live = itsMaster->getLiveFeed();
+  itsSubNext = (live!=NULL) ? live->head() : 0;
+  itsSubscribed = true;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Add any live data the client hasn't had yet to the output buffer
+void WebHandler::feed(LiveFeed *live)
+{
+  if (!itsSubscribed || live==NULL) return;
+  long long head = live->head();
+  if (itsSubNext>=head) return;
+  //Leave the client to catch up if it already has plenty to send
+  if (itsOutput.size()-itsOutPos>=MAXSUBOUTPUT) return;
+
+  //If the client fell too far behind tell it how much it missed
+  long long oldest = live->oldest();
+  if (itsSubNext<oldest) {
+    ostringstream notice;
+    notice << "LAG " << oldest-itsSubNext << endl;
+    addOutput(notice.str());
+    itsSubNext = oldest;
+  }
+
+  //Collect the periods then send them like a reply to BETWEEN
+  string data;
+  int count = 0;
+  for (; itsSubNext<head; itsSubNext++) {
+    if (itsOutput.size()-itsOutPos+data.size()>=MAXSUBOUTPUT) break;
+    if (itsSubNext%itsSubDecimate!=0) continue;
+    //If it has just been overwritten we'll report it next time
+    if (!live->get(itsSubNext, itsSubCross, itsSubInputs, itsSubAudio, data)) {
+      break;
+    }
+    count++;
+  }
+  if (count>0) {
+    ostringstream header;
+    header << count << endl;
+    addOutput(header.str());
+    addOutput(data, sizeof(float));
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Take whatever requests and cancellations the client has sent in frames
+int WebHandler::takeRequests(int inflight, int &numbulk)
+{
+  int num = 0;
+  numbulk = 0;
+  while (!finished() && itsInput.size()>=FRAME_HEADER) {
+    frame_t frame;
+    unpackFrame(itsInput.data(), frame);
+    //None of ours are this long so we must have lost our place
+    if (frame.length>MAXLINE) {
+      cerr << "WebHandler: Bad frame from " << itsSocket << endl;
+      dropConnection();
+      break;
+    }
+    if (itsInput.size()<FRAME_HEADER+frame.length) break;
+
+    if (frame.type==frame_cancel) {
+      cancel(frame.id);
+    } else if (frame.type==frame_request) {
+      //Leave it until the client has fewer outstanding, and is allowed
+      //to ask for more
+      if (inflight+num>=theirMaxInFlight || throttled()>0) break;
+      itsRequestBucket.take(1);
+      string line(itsInput, FRAME_HEADER, frame.length);
+      istringstream command(line);
+      string directive;
+      command >> directive;
+      if (directive=="PROTOCOL") {
+	//Everything asked for before has to be finished first
+	if (inflight+num>0) break;
+	itsInput.erase(0, FRAME_HEADER+frame.length);
+	float version = 0;
+	command >> version;
+	itsProtocol = chooseProtocol(version, !command.fail());
+	ostringstream reply;
+	reply << "PROTOCOL " << itsProtocol/10 << "." << itsProtocol%10;
+	string out;
+	appendFrame(out, frame.id, frame_end, 0, reply.str());
+	addOutput(out);
+	itsFramed = (itsProtocol>=20);
+	//Anything after this is in lines again
+	if (!itsFramed) break;
+	continue;
+      }
+
+      //Put it in a free slot for the workers. The slots still in use
+      //are all counted in 'inflight' so there must be one.
+      bool bulk = isBulk(line);
+      pthread_mutex_lock(&itsRequestLock);
+      request_t *req = NULL;
+      for (int i=0; i<theirMaxInFlight && req==NULL; i++) {
+	if (itsRequests[i].state==request_free) req = &itsRequests[i];
+      }
+      assert(req!=NULL);
+      req->state = request_queued;
+      req->id = frame.id;
+      req->command = line;
+      req->cancelled = false;
+      req->seq = itsRequestSeq++;
+      req->bulk = bulk;
+      pthread_mutex_unlock(&itsRequestLock);
+      num++;
+      if (bulk) numbulk++;
+    } else {
+      cerr << "WebHandler: Unknown frame type " << frame.type
+	   << " from " << itsSocket << endl;
+      dropConnection();
+      break;
+    }
+    itsInput.erase(0, FRAME_HEADER+frame.length);
+  }
+  return num;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Give up on all of the outstanding protocol 2 requests
+void WebHandler::cancelAll()
+{
+  pthread_mutex_lock(&itsRequestLock);
+  for (int i=0; i<theirMaxInFlight; i++) itsRequests[i].cancelled = true;
+  pthread_mutex_unlock(&itsRequestLock);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Give up on the outstanding request with the given identifier
+void WebHandler::cancel(unsigned int id)
+{
+  pthread_mutex_lock(&itsRequestLock);
+  for (int i=0; i<theirMaxInFlight; i++) {
+    if (itsRequests[i].state!=request_free && itsRequests[i].id==id) {
+      itsRequests[i].cancelled = true;
+    }
+  }
+  pthread_mutex_unlock(&itsRequestLock);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Return true if the client has given up on the request
+bool WebHandler::cancelled(request_t *req)
+{
+  pthread_mutex_lock(&itsRequestLock);
+  bool res = req->cancelled;
+  pthread_mutex_unlock(&itsRequestLock);
+  return res;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Service the oldest protocol 2 request of the kind which hasn't been
+//started
+void WebHandler::serviceRequest(bool bulk)
+{
+  pthread_mutex_lock(&itsRequestLock);
+  request_t *req = NULL;
+  for (int i=0; i<theirMaxInFlight; i++) {
+    if (itsRequests[i].state==request_queued && itsRequests[i].bulk==bulk &&
+	(req==NULL || itsRequests[i].seq<req->seq)) {
+      req = &itsRequests[i];
+    }
+  }
+  assert(req!=NULL);
+  req->state = request_running;
+  pthread_mutex_unlock(&itsRequestLock);
+
+  //The slot is ours until we free it, so the command won't change
+  istringstream command(req->command);
+  serviceRequest(req, command);
+
+  pthread_mutex_lock(&itsRequestLock);
+  req->state = request_free;
+  pthread_mutex_unlock(&itsRequestLock);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Parse the protocol 2 request and service it
+void WebHandler::serviceRequest(request_t *req, istringstream &command)
+{
+  string directive;
+  command >> directive;
+  if (cancelled(req)) {
+    sendFrame(req->id, frame_error, 0, "cancelled");
+    return;
+  }
+
+  //Replies which are text in protocol 1 come back in the end frame
+  ostringstream reply;
+  if (directive == "BETWEEN") {
+    frameBetween(req, command);
+    return;
+  } else if (directive == "RAW-BETWEEN") {
+    frameRawBetween(req, command);
+    return;
+  } else if (directive == "ROLLUP") {
+    frameRollup(req, command);
+    return;
+  } else if (directive == "LOCATION") {
+    ConfigFile *config = itsMaster->getConfig();
+    reply << config->getLongitude() << "\t"
+	  << config->getLatitude() << endl;
+  } else if (directive == "VERSION") {
+    reply << "SAC 1.1\n";
+  } else if (directive == "STATS") {
+    itsMaster->writeStats(reply);
+  } else if (directive == "AFTER") {
+    long long epoch;
+    command >> epoch;
+    if (command.fail() || !validEpoch(epoch)) {
+      sendFrame(req->id, frame_error, 0, "bad time");
+      return;
+    }
+    writeAfter(epoch, reply);
+  } else if (directive == "SUBSCRIBE" || directive == "UNSUBSCRIBE") {
+    sendFrame(req->id, frame_error, 0, "not available with protocol 2");
+    return;
+  } else {
+    sendFrame(req->id, frame_error, 0, "unknown command");
+    return;
+  }
+  sendFrame(req->id, frame_end, 0, reply.str());
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Handle a protocol 2 request for all data between two epochs
+void WebHandler::frameBetween(request_t *req, istringstream &command)
+{
+  long long start, end;
+  if (!readRange(command, start, end)) {
+    sendFrame(req->id, frame_error, 0, "bad time");
+    return;
+  }
+  bool keepcross, keepinputs, keepaudio;
+  command >> keepcross >> keepinputs >> keepaudio;
+  if (command.fail()) {
+    sendFrame(req->id, frame_error, 0, "bad arguments");
+    return;
+  }
+  //Cleaning and the number of buckets are optional, as for protocol 1
+  int cleandata;
+  command >> cleandata;
+  if (command.fail() || cleandata<clean_none || cleandata>clean_median) {
+    cleandata = clean_none;
+  }
+  int buckets;
+  command >> buckets;
+  if (!command.fail() && buckets>0) {
+    long long length = itsStore->bucketLength(start, end, buckets);
+    int count;
+    Rollup *data = itsStore->getRollup(start, end, length, count);
+    frameRollups(req, data, count);
+    return;
+  }
+
+  ChunkSender sender(this, req, keepcross, keepinputs, keepaudio);
+  if (cleandata==clean_none && keepcross && keepinputs && keepaudio) {
+    itsStore->scanSpans(start, end, sender);
+  } else if (cleandata==clean_none) {
+    itsStore->scan(start, end, sender);
+  } else {
+    int count;
+    IntegPeriod **data = getCleaned(start, end, cleandata, count);
+    visitAll(sender, data, count);
+  }
+  sender.finish();
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Handle a protocol 2 request for all raw data between two epochs
+void WebHandler::frameRawBetween(request_t *req, istringstream &command)
+{
+  if (itsRawStore==NULL) {
+    sendFrame(req->id, frame_error, 0, "no raw data store");
+    return;
+  }
+  long long start, end;
+  if (!readRange(command, start, end)) {
+    sendFrame(req->id, frame_error, 0, "bad time");
+    return;
+  }
+
+  rawslice_t slice;
+  itsRawStore->slice(start, end, slice);
+  if (slice.count>0) {
+    //The periods are already serialised in the ring, so they can be
+    //sent straight from there in a single frame
+    if (slice.len[0]+slice.len[1]>0xffffffffll) {
+      sendFrame(req->id, frame_error, 0, "too much data");
+      return;
+    }
+    struct iovec iov[2];
+    for (int i=0; i<2; i++) {
+      iov[i].iov_base = (void*)slice.start[i];
+      iov[i].iov_len = slice.len[i];
+    }
+    pace(slice.len[0]+slice.len[1], req);
+    if (!sendFrame(req->id, frame_data, slice.count, iov, 2)) return;
+    //If new data overwrote what we were sending the client has garbage
+    if (!itsRawStore->stillValid(slice)) {
+      cerr << "WebHandler: RAW data was overwritten while being sent\n";
+      sendFrame(req->id, frame_error, slice.count, "overwritten");
+      return;
+    }
+  }
+  //The client needs our sampling rate to make sense of the audio
+  ostringstream rate;
+  rate << "RATE " << itsMaster->getConfig()->getSampRate();
+  sendFrame(req->id, frame_end, slice.count, rate.str());
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Handle a protocol 2 request for rollups between two epochs
+void WebHandler::frameRollup(request_t *req, istringstream &command)
+{
+  long long start, end;
+  if (!readRange(command, start, end)) {
+    sendFrame(req->id, frame_error, 0, "bad time");
+    return;
+  }
+  long long resolution;
+  command >> resolution;
+  if (command.fail() || resolution<=0) {
+    sendFrame(req->id, frame_error, 0, "bad arguments");
+    return;
+  }
+  int count;
+  Rollup *data = itsStore->getRollup(start, end, resolution, count);
+  frameRollups(req, data, count);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Send the rollups in a data frame, then the end frame, and delete them
+void WebHandler::frameRollups(request_t *req, Rollup *data, int count)
+{
+  if (data==NULL) count = 0;
+  bool ok = true;
+  if (count>0) {
+    ostringstream out;
+    for (int i=0; i<count; i++) Rollup::save(out, data[i]);
+    string payload = out.str();
+    pace(payload.size(), req);
+    ok = sendFrame(req->id, frame_data, count, payload);
+  }
+  if (ok) sendFrame(req->id, frame_end, count, "");
+  if (data!=NULL) delete[] data;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Read two epochs for a protocol 2 request, putting them in order
+bool WebHandler::readRange(istringstream &args, long long &start,
+			   long long &end)
+{
+  args >> start >> end;
+  if (args.fail() || !validEpoch(start) || !validEpoch(end)) return false;
+  if (end<start && end!=0) {
+    long long temp = start;
+    start = end;
+    end = temp;
+  }
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Send the client a frame whose payload is made up of the pieces
+bool WebHandler::sendFrame(unsigned int id, int type, unsigned int count,
+			   const struct iovec *data, int num)
+{
+  long long len = 0;
+  for (int i=0; i<num; i++) len += data[i].iov_len;
+  frame_t frame = {(unsigned int)len, id, type, count};
+  char header[FRAME_HEADER];
+  packFrame(frame, header);
+  struct iovec *iov = new struct iovec[num+1];
+  iov[0].iov_base = header;
+  iov[0].iov_len = FRAME_HEADER;
+  for (int i=0; i<num; i++) iov[i+1] = data[i];
+
+  //Other workers may be replying to the client's other requests
+  pthread_mutex_lock(&itsWriteLock);
+  bool res = !itsError &&
+    itsClient.rdbuf()->writev_direct(iov, num+1)==FRAME_HEADER+len;
+  if (!res) itsError = true;
+  pthread_mutex_unlock(&itsWriteLock);
+  delete[] iov;
+  return res;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Send the client a frame with the given payload
+bool WebHandler::sendFrame(unsigned int id, int type, unsigned int count,
+			   const string &payload)
+{
+  struct iovec iov;
+  iov.iov_base = (void*)payload.data();
+  iov.iov_len = payload.size();
+  return sendFrame(id, type, count, &iov, payload.empty() ? 0 : 1);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Send the client a data frame holding the whole batch
+bool WebHandler::sendFrame(unsigned int id, unsigned int count,
+			   PeriodBatch &batch)
+{
+  frame_t frame = {(unsigned int)batch.length(), id, frame_data, count};
+  char header[FRAME_HEADER];
+  packFrame(frame, header);
+
+  pthread_mutex_lock(&itsWriteLock);
+  bool res = !itsError && batch.send(itsClient, header, FRAME_HEADER);
+  if (!res) itsError = true;
+  pthread_mutex_unlock(&itsWriteLock);
+  return res;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Send the client a data frame holding part of a file
+bool WebHandler::sendFrame(unsigned int id, unsigned int count,
+			   int fd, long long offset, long long len)
+{
+  frame_t frame = {(unsigned int)len, id, frame_data, count};
+  char header[FRAME_HEADER];
+  packFrame(frame, header);
+  struct iovec iov;
+  iov.iov_base = header;
+  iov.iov_len = FRAME_HEADER;
+
+  pthread_mutex_lock(&itsWriteLock);
+  bool res = !itsError &&
+    itsClient.rdbuf()->writev_direct(&iov, 1)==FRAME_HEADER &&
+    itsClient.rdbuf()->sendfile_direct(fd, offset, len, sizeof(float))==len;
+  if (!res) itsError = true;
+  pthread_mutex_unlock(&itsWriteLock);
+  return res;
+}
@@ -13,10 +13,36 @@
 #include <TCPstream.h>
 #include <StoreMaster.h>
 #include <ConfigFile.h>
+#include <LiveFeed.h>
 #include <iostream>
 #include <unistd.h>
 #include <signal.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+
+//Most events to take from epoll at once
+#define MAXEVENTS 64
+//How long to wait for events before checking if we should exit (ms)
+#define POLLTIME 1000
+//How much nicer the bulk workers are than the rest of the program
+#define BULKNICE 10
+
+
+///////////////////////////////////////////////////////////////////////
+//Start a worker thread in the WebMaster's worker loop
+void *webmaster_worker(void *arg)
+{
+  WebMaster::workpool_t *pool = (WebMaster::workpool_t*)arg;
+  pool->master->workerLoop(*pool);
+  return NULL;
+}
 
 
 WebMaster::WebMaster(StoreMaster *store, ConfigFile *conf)
@@ -26,98 +52,574 @@ itsRawStore(NULL),
 itsPort(conf->getServerPort()),
 itsNumClients(0),
 itsMaxClients(conf->getMaxClients()),
-itsConfig(conf)
+itsConfig(conf),
+itsLiveFeed(NULL)
 {
+  init();
 }
 
 
 WebMaster::WebMaster(StoreMaster *store,
-		     StoreMaster *rawstore,
-		     ConfigFile *conf)
+		     RawRing *rawstore,
+		     ConfigFile *conf,
+		     LiveFeed *live)
 :ThreadedObject(),
 itsStore(store),
 itsRawStore(rawstore),
 itsPort(conf->getServerPort()),
 itsNumClients(0),
 itsMaxClients(conf->getMaxClients()),
-itsConfig(conf)
+itsConfig(conf),
+itsLiveFeed(live)
 {
+  init();
 }
 
 
 WebMaster::~WebMaster()
 {
+  delete[] itsPool.queue;
+  delete[] itsBulkPool.queue;
+  delete[] itsDone;
+  delete[] itsSubscribers;
+  delete[] itsHeld;
+  pthread_mutex_destroy(&itsQueueLock);
+  pthread_cond_destroy(&itsPool.cond);
+  pthread_cond_destroy(&itsBulkPool.cond);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Set up the bits we need, before starting run()
+void WebMaster::init()
+{
+  itsListenSock = -1;
+  itsListening = false;
+  itsEpoll = -1;
+  itsWakePipe[0] = itsWakePipe[1] = -1;
+  itsWorkersRun = false;
+  pthread_mutex_init(&itsQueueLock, NULL);
+  int qsize = (itsMaxClients>0) ? itsMaxClients : 1;
+  itsQueueSize = qsize*WebHandler::theirMaxInFlight;
+  workpool_t *pools[2] = {&itsPool, &itsBulkPool};
+  for (int i=0; i<2; i++) {
+    pools[i]->master = this;
+    pools[i]->bulk = (pools[i]==&itsBulkPool);
+    pools[i]->workers = NULL;
+    pthread_cond_init(&pools[i]->cond, NULL);
+    pools[i]->queue = new WebHandler*[itsQueueSize];
+    pools[i]->head = pools[i]->len = pools[i]->busy = 0;
+  }
+  itsPool.numworkers = itsConfig->getWebWorkers();
+  itsBulkPool.numworkers = itsConfig->getBulkWorkers();
+  itsDone = new WebHandler*[itsQueueSize];
+  itsSubscribers = new WebHandler*[qsize];
+  itsNumSubscribers = 0;
+  itsHeld = new WebHandler*[qsize];
+  itsNumHeld = 0;
+  itsDoneLen = 0;
+  itsAccepted = itsCommands = itsWorkerCommands = itsBulkCommands = 0;
 }
 
+
 void dontdie(int sig)
 {
   //Do nothing, just don't die from SIGPIPE if a connection drops out
 }
 
+
+///////////////////////////////////////////////////////////////////////
+//Main loop, waiting for something to happen on any socket
 void WebMaster::run()
 {
   //Listen for a connection from anyone
   SocketAddr server_addr = SocketAddr(IPaddress(), itsPort);
 
-  int listening_socket = socket(AF_INET,SOCK_STREAM,0);
-  if( listening_socket < 0 )
+  itsListenSock = socket(AF_INET,SOCK_STREAM,0);
+  if( itsListenSock < 0 )
     CurrentNetCallback::on_error("Socket creation error");
 
   int value = 1;
-  if( setsockopt(listening_socket, SOL_SOCKET, SO_REUSEADDR,
+  if( setsockopt(itsListenSock, SOL_SOCKET, SO_REUSEADDR,
 		 (char*)&value, sizeof(value)) < 0 )
     CurrentNetCallback::on_error("setsockopt SO_REUSEADDR error");
 
-  if( bind(listening_socket, (sockaddr *)server_addr,sizeof(server_addr)) < 0 )
+  if( bind(itsListenSock, (sockaddr *)server_addr,sizeof(server_addr)) < 0 )
     CurrentNetCallback::on_error("Socket binding error");
 
-  //Queue at most 5 clients before refusing connections
-  if( listen(listening_socket, 5) < 0 )
+  //We accept clients as soon as they arrive so only need a short queue
+  if( listen(itsListenSock, 64) < 0 )
     CurrentNetCallback::on_error("Socket listen error");
+  fcntl(itsListenSock, F_SETFL, fcntl(itsListenSock, F_GETFL, 0)|O_NONBLOCK);
 
   //Ensure we don't crash from any broken pipes (SIGPIPE:13)
   signal(13 , dontdie);
 
+  //Set up epoll to watch the listening socket and the wake up pipe
+  itsEpoll = epoll_create(MAXEVENTS);
+  if (itsEpoll<0 || pipe(itsWakePipe)<0) {
+    perror("WebMaster");
+    itsKeepRunning = false;
+    return;
+  }
+  for (int i=0; i<2; i++) {
+    fcntl(itsWakePipe[i], F_SETFL, fcntl(itsWakePipe[i], F_GETFL, 0)|O_NONBLOCK);
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = &itsWakePipe;
+  epoll_ctl(itsEpoll, EPOLL_CTL_ADD, itsWakePipe[0], &ev);
+  watch(NULL, EPOLL_CTL_ADD, EPOLLIN);
+  itsListening = true;
+  //And the live data, if there is any
+  if (itsLiveFeed!=NULL) {
+    ev.events = EPOLLIN;
+    ev.data.ptr = itsLiveFeed;
+    epoll_ctl(itsEpoll, EPOLL_CTL_ADD, itsLiveFeed->getWakeFd(), &ev);
+  }
+
+  //Start the worker threads
+  itsWorkersRun = true;
+  workpool_t *pools[2] = {&itsPool, &itsBulkPool};
+  for (int p=0; p<2; p++) {
+    pools[p]->workers = new pthread_t[pools[p]->numworkers];
+    for (int i=0; i<pools[p]->numworkers; i++) {
+      pthread_create(&pools[p]->workers[i], NULL, webmaster_worker,
+		     (void*)pools[p]);
+    }
+  }
+
   //Main loop
+  struct epoll_event events[MAXEVENTS];
   while (itsKeepRunning) {
-    //Check if we want to spawn any more servers
-    Lock();
-    if (itsNumClients>=itsMaxClients) {
-      //We're not interested, wait to allow others to disconnect
-      Unlock();
-      sleep(1);
-      //Go and check again
-      continue;
+    int num = epoll_wait(itsEpoll, events, MAXEVENTS, pollTime());
+    if (num<0) {
+      if (errno==EINTR) continue;
+      perror("WebMaster");
+      break;
+    }
+    //The live data goes out before we do anything else
+    for (int i=0; i<num; i++) {
+      if (itsLiveFeed!=NULL && events[i].data.ptr==itsLiveFeed) {
+	feedSubscribers();
+      }
+    }
+    for (int i=0; i<num; i++) {
+      if (events[i].data.ptr==NULL) {
+	acceptClients();
+      } else if (events[i].data.ptr==&itsWakePipe) {
+	collectFinished();
+      } else if (events[i].data.ptr==itsLiveFeed) {
+	continue;
+      } else {
+	WebHandler *client = (WebHandler*)events[i].data.ptr;
+	bool ok = true;
+	if (events[i].events&EPOLLOUT) ok = client->sendOutput();
+	if (ok && (events[i].events&(EPOLLIN|EPOLLHUP|EPOLLERR))) {
+	  ok = client->readInput();
+	}
+	if (ok) processInput(client);
+	else disconnect(client);
+      }
+    }
+    releaseHeld();
+  }
+
+  cerr << "WebMaster Exitting\n";
+  //Stop the workers once they finish what they are doing
+  pthread_mutex_lock(&itsQueueLock);
+  itsWorkersRun = false;
+  for (int p=0; p<2; p++) pthread_cond_broadcast(&pools[p]->cond);
+  pthread_mutex_unlock(&itsQueueLock);
+  for (int p=0; p<2; p++) {
+    for (int i=0; i<pools[p]->numworkers; i++) {
+      pthread_join(pools[p]->workers[i], NULL);
+    }
+    delete[] pools[p]->workers;
+    pools[p]->workers = NULL;
+  }
+
+  close(itsListenSock);
+  close(itsEpoll);
+  close(itsWakePipe[0]);
+  close(itsWakePipe[1]);
+  //Kill our thread, we have finished
+  itsKeepRunning = false;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Accept any clients waiting to connect
+void WebMaster::acceptClients()
+{
+  while (itsNumClients<itsMaxClients) {
+    SocketAddr peer(IPaddress(), 1);
+    socklen_t len = sizeof(peer);
+    int sock = accept(itsListenSock, (sockaddr *)peer, &len);
+    if (sock<0) {
+      if (errno==EINTR || errno==ECONNABORTED) continue;
+      if (errno!=EAGAIN && errno!=EWOULDBLOCK) perror("WebMaster: accept");
+      return;
     }
-    Unlock();
 
-    //We have one more client, keep track of this
-    Lock();
+    WebHandler *client = new WebHandler(sock, peer, itsStore,
+					itsRawStore, this);
     itsNumClients++;
+    itsAccepted++;
     assert(itsNumClients>=0&&itsNumClients<=itsMaxClients);
-    Unlock();
+    watch(client, EPOLL_CTL_ADD, EPOLLIN);
+  }
+  //We're full, so leave any others waiting until someone disconnects
+  if (itsListening) {
+    watch(NULL, EPOLL_CTL_MOD, 0);
+    itsListening = false;
+  }
+}
+
 
-    //Spawn a new client handler to manage the new connection
-    WebHandler *newhandler = new WebHandler(listening_socket,itsStore,
-					    itsRawStore,this);
-    newhandler->start();
+///////////////////////////////////////////////////////////////////////
+//Service whatever complete commands the client has sent
+void WebMaster::processInput(WebHandler *client)
+{
+  //Protocol 2 clients send frames rather than lines
+  if (client->framed() && processFrames(client)) return;
+
+  string line;
+  //Wait for any earlier replies to go before starting on more commands
+  while (!client->finished() && !client->hasOutput() &&
+	 !client->framed() && client->throttled()==0 &&
+	 client->nextLine(line)) {
+    if (line.empty()) continue;
+    itsCommands++;
+    if (!client->quickCommand(line)) {
+      //The worker will tell us when it's done
+      dispatch(client);
+      return;
+    }
+    updateSubscriber(client);
+    if (!client->sendOutput()) break;
+  }
+  //The client may have just switched to protocol 2
+  if (client->framed() && !client->hasOutput() && processFrames(client)) {
+    return;
   }
+  //Top up a subscriber with any live data it hasn't had yet
+  if (client->subscribed() && !client->finished()) {
+    client->feed(itsLiveFeed);
+    client->sendOutput();
+  }
+  //A client which has made all the commands it is allowed to for now
+  //has to wait before we take any more
+  bool held = client->hasInput() && client->throttled()>0;
+  //Close once we've answered everything, if the client has gone. A
+  //subscriber may have finished sending but still wants the data.
+  if (client->finished() ||
+      (client->closed() && !client->hasOutput() && !client->subscribed() &&
+       !held)) {
+    disconnect(client);
+    return;
+  }
+  //If the client isn't keeping up wait until it is ready for more. Once
+  //it has closed its side there is nothing more to read.
+  unsigned int events = EPOLLIN;
+  if (client->hasOutput()) events = EPOLLOUT;
+  else if (client->closed() || held) events = 0;
+  watch(client, EPOLL_CTL_MOD, events);
+  if (held) hold(client);
+  else unhold(client);
+}
 
-  cerr << "WebMaster Exitting\n";
-  close(listening_socket);
-  //Kill our thread, we have finished
-  itsKeepRunning = false;
+
+///////////////////////////////////////////////////////////////////////
+//Service whatever frames a protocol 2 client has sent
+bool WebMaster::processFrames(WebHandler *client)
+{
+  //Wait for a reply to changing protocol to go before taking more
+  if (!client->finished() && !client->hasOutput()) {
+    int numbulk;
+    int num = client->takeRequests(client->itsInFlight, numbulk);
+    itsCommands += num;
+    for (int i=0; i<num; i++) {
+      client->itsInFlight++;
+      enqueue(client, i<numbulk);
+    }
+    //Anything else the client has sent is in lines
+    if (!client->framed()) return false;
+  }
+
+  //Requests left because the client isn't allowed them yet
+  bool held = client->hasInput() && client->throttled()>0;
+  //Close once everything is finished, if the client has gone
+  if (client->finished() ||
+      (client->closed() && client->itsInFlight==0 && !client->hasOutput() &&
+       !held)) {
+    if (client->itsInFlight==0) {
+      disconnect(client);
+    } else if (!client->itsBusy) {
+      //Stop watching it and close it once the workers are done
+      unhold(client);
+      watch(client, EPOLL_CTL_DEL, 0);
+      client->itsBusy = true;
+      client->cancelAll();
+    }
+    return true;
+  }
+  //Stop reading if the client already has as many requests going as it
+  //can, collectFinished() will bring us back, or if it has to wait
+  unsigned int events = EPOLLIN;
+  if (client->hasOutput()) events = EPOLLOUT;
+  else if (client->closed() || held ||
+	   client->itsInFlight>=WebHandler::theirMaxInFlight) events = 0;
+  watch(client, EPOLL_CTL_MOD, events);
+  if (held) hold(client);
+  else unhold(client);
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Pass the client's current command to the worker threads
+void WebMaster::dispatch(WebHandler *client)
+{
+  //The worker has the connection to itself until it is done
+  client->itsBusy = true;
+  unhold(client);
+  watch(client, EPOLL_CTL_DEL, 0);
+  enqueue(client, client->bulkCommand());
 }
 
 
+///////////////////////////////////////////////////////////////////////
+//Add the client to the queue for the bulk or the other workers
+void WebMaster::enqueue(WebHandler *client, bool bulk)
+{
+  itsWorkerCommands++;
+  if (bulk) itsBulkCommands++;
+
+  workpool_t &pool = bulk ? itsBulkPool : itsPool;
+  pthread_mutex_lock(&itsQueueLock);
+  assert(pool.len<itsQueueSize);
+  pool.queue[(pool.head+pool.len)%itsQueueSize] = client;
+  pool.len++;
+  pthread_cond_signal(&pool.cond);
+  pthread_mutex_unlock(&itsQueueLock);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Take back the clients whose commands the workers have finished
+void WebMaster::collectFinished()
+{
+  char buf[256];
+  while (read(itsWakePipe[0], buf, sizeof(buf))>0);
+
+  pthread_mutex_lock(&itsQueueLock);
+  int num = itsDoneLen;
+  WebHandler *done[num>0 ? num : 1];
+  for (int i=0; i<num; i++) done[i] = itsDone[i];
+  itsDoneLen = 0;
+  pthread_mutex_unlock(&itsQueueLock);
+
+  for (int i=0; i<num; i++) {
+    WebHandler *client = done[i];
+    if (client->framed()) {
+      //One less request outstanding
+      client->itsInFlight--;
+      if (!client->itsBusy) processInput(client);
+      else if (client->itsInFlight==0) disconnect(client);
+      continue;
+    }
+    client->itsBusy = false;
+    if (client->finished()) {
+      disconnect(client);
+    } else {
+      //Carry on with anything else the client has already sent
+      watch(client, EPOLL_CTL_ADD, EPOLLIN);
+      processInput(client);
+    }
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Add or remove the client from the subscribers, if it has changed
+void WebMaster::updateSubscriber(WebHandler *client)
+{
+  if (client->subscribed() && client->itsSubIndex<0) {
+    client->itsSubIndex = itsNumSubscribers;
+    itsSubscribers[itsNumSubscribers++] = client;
+  } else if (!client->subscribed() && client->itsSubIndex>=0) {
+    //Move the last subscriber into the gap
+    WebHandler *last = itsSubscribers[--itsNumSubscribers];
+    itsSubscribers[client->itsSubIndex] = last;
+    last->itsSubIndex = client->itsSubIndex;
+    client->itsSubIndex = -1;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Add the client to those waiting to be allowed another command
+void WebMaster::hold(WebHandler *client)
+{
+  if (client->itsHeldIndex>=0) return;
+  client->itsHeldIndex = itsNumHeld;
+  itsHeld[itsNumHeld++] = client;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Take the client off those waiting to be allowed another command
+void WebMaster::unhold(WebHandler *client)
+{
+  if (client->itsHeldIndex<0) return;
+  //Move the last held client into the gap
+  WebHandler *last = itsHeld[--itsNumHeld];
+  itsHeld[client->itsHeldIndex] = last;
+  last->itsHeldIndex = client->itsHeldIndex;
+  client->itsHeldIndex = -1;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Carry on with any held clients which are allowed another command
+void WebMaster::releaseHeld()
+{
+  //Go backwards since a client we take off is replaced by the last one,
+  //which we will have done already
+  for (int i=itsNumHeld-1; i>=0; i--) {
+    WebHandler *client = itsHeld[i];
+    if (client->throttled()>0) continue;
+    unhold(client);
+    processInput(client);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Return how long to wait for events
+int WebMaster::pollTime()
+{
+  int res = POLLTIME;
+  for (int i=0; i<itsNumHeld; i++) {
+    long long wait = itsHeld[i]->throttled()/1000 + 1;
+    if (wait<res) res = wait;
+  }
+  return res;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Pass any new live data to the subscribers
+void WebMaster::feedSubscribers()
+{
+  itsLiveFeed->clearWake();
+  //Go backwards since a subscriber which disconnects is replaced by the
+  //last one, which we will have done already
+  for (int i=itsNumSubscribers-1; i>=0; i--) {
+    processInput(itsSubscribers[i]);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Change which events we wait for on a client or the listening socket
+void WebMaster::watch(WebHandler *client, int op, unsigned int events)
+{
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = client;
+  int sock = (client==NULL) ? itsListenSock : client->getSocket();
+  if (epoll_ctl(itsEpoll, op, sock, &ev)<0) perror("WebMaster: epoll_ctl");
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Close a client connection
 void WebMaster::disconnect(WebHandler *deadman)
 {
-  Lock();
+  if (!deadman->itsBusy) watch(deadman, EPOLL_CTL_DEL, 0);
+  unhold(deadman);
+  if (deadman->itsSubIndex>=0) {
+    deadman->unsubscribe();
+    updateSubscriber(deadman);
+  }
+  delete deadman;
   //One less client active now
   itsNumClients--;
   assert(itsNumClients>=0&&itsNumClients<=itsMaxClients);
-  Unlock();
-  //We have finished with that handler
-  /// Probably illegal to delete this than return to it as caller
-  delete deadman;
+  //Make sure we are accepting connections again
+  if (!itsListening && itsNumClients<itsMaxClients) {
+    watch(NULL, EPOLL_CTL_MOD, EPOLLIN);
+    itsListening = true;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Main loop of each of the worker threads in the pool
+void WebMaster::workerLoop(workpool_t &pool)
+{
+  //Bulk work gives way to the Processor and the rest of the server
+  if (pool.bulk &&
+      setpriority(PRIO_PROCESS, syscall(SYS_gettid), BULKNICE)<0) {
+    perror("WebMaster: setpriority");
+  }
+
+  pthread_mutex_lock(&itsQueueLock);
+  while (true) {
+    while (itsWorkersRun && pool.len==0) {
+      pthread_cond_wait(&pool.cond, &itsQueueLock);
+    }
+    if (!itsWorkersRun) break;
+    WebHandler *client = pool.queue[pool.head];
+    pool.head = (pool.head+1)%itsQueueSize;
+    pool.len--;
+    pool.busy++;
+    pthread_mutex_unlock(&itsQueueLock);
+
+    client->serviceCommand(pool.bulk);
+
+    pthread_mutex_lock(&itsQueueLock);
+    pool.busy--;
+    itsDone[itsDoneLen++] = client;
+    //Wake up the main loop to take the client back, unless another
+    //worker has already done so
+    if (itsDoneLen==1) {
+      char c = 0;
+      if (write(itsWakePipe[1], &c, 1)<0 && errno!=EAGAIN) {
+	perror("WebMaster: wake");
+      }
+    }
+  }
+  pthread_mutex_unlock(&itsQueueLock);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Write a line of statistics about the server to the stream
+void WebMaster::writeStats(ostream &out)
+{
+  pthread_mutex_lock(&itsQueueLock);
+  int busy = itsPool.busy, queued = itsPool.len;
+  int bulkbusy = itsBulkPool.busy, bulkqueued = itsBulkPool.len;
+  pthread_mutex_unlock(&itsQueueLock);
+  out << "clients " << itsNumClients << "/" << itsMaxClients
+      << " workers " << busy << "/" << itsPool.numworkers
+      << " queued " << queued
+      << " subscribers " << itsNumSubscribers
+      << " accepted " << itsAccepted
+      << " commands " << itsCommands
+      << " worker-commands " << itsWorkerCommands
+      << " bulk-workers " << bulkbusy << "/" << itsBulkPool.numworkers
+      << " bulk-queued " << bulkqueued
+      << " bulk-commands " << itsBulkCommands
+      << " held " << itsNumHeld
+      //The limits, 0 meaning there isn't one
+      << " bulk-span " << itsConfig->getBulkSpan() << "h"
+      << " client-kbytes " << itsConfig->getClientKBytes()
+      << " client-requests " << itsConfig->getClientRequests()
+      << " client-burst " << itsConfig->getClientBurst() << "s" << endl;
 }
@@ -0,0 +1,186 @@
+//
+// Copyright (C) David Brodrick
+// Copyright (C) CSIRO Australia Telescope National Facility
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.
+//
+// $Id: $
+
+#include <WireCodec.h>
+#include <zlib.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <iostream>
+
+const int WireCodec::theirHeaderSize = 12;
+const int WireCodec::theirMaxBlock = 1<<18;
+
+//Widest stride we will shuffle with
+#define MAXSTRIDE 16
+
+
+///////////////////////////////////////////////////////////////////////
+//Put the bytes of each 'stride' byte element together by position
+static void shuffle(const char *in, char *out, int len, int stride)
+{
+  int num = len/stride;
+  for (int j=0; j<stride; j++) {
+    const char *src = in+j;
+    char *dst = out+j*num;
+    for (int i=0; i<num; i++, src+=stride) dst[i] = *src;
+  }
+  //Any odd bytes at the end stay where they are
+  memcpy(out+num*stride, in+num*stride, len-num*stride);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Put shuffled bytes back in their original order
+static void unshuffle(const char *in, char *out, int len, int stride)
+{
+  int num = len/stride;
+  for (int j=0; j<stride; j++) {
+    const char *src = in+j*num;
+    char *dst = out+j;
+    for (int i=0; i<num; i++, dst+=stride) *dst = src[i];
+  }
+  memcpy(out+num*stride, in+num*stride, len-num*stride);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Constructor
+WireCodec::WireCodec(bool compress)
+:itsCompress(compress),
+itsFailed(false)
+{
+  itsStream = new z_stream;
+  memset(itsStream, 0, sizeof(z_stream));
+  int res;
+  if (compress) res = deflateInit(itsStream, Z_BEST_SPEED);
+  else res = inflateInit(itsStream);
+  if (res!=Z_OK) {
+    cerr << "WireCodec: Could not start zlib\n";
+    itsFailed = true;
+  }
+  itsShuffle = new char[theirMaxBlock];
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Destructor
+WireCodec::~WireCodec()
+{
+  if (itsCompress) deflateEnd(itsStream);
+  else inflateEnd(itsStream);
+  delete itsStream;
+  delete[] itsShuffle;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Compress the data as one or more blocks
+bool WireCodec::encode(const char *data, long long len, int stride,
+		       string &out)
+{
+  if (itsFailed || !itsCompress) return false;
+  if (stride<1 || stride>MAXSTRIDE) stride = 1;
+
+  while (len>0) {
+    int blocklen = (len>theirMaxBlock) ? theirMaxBlock : len;
+    const char *in = data;
+    if (stride>1) {
+      shuffle(data, itsShuffle, blocklen, stride);
+      in = itsShuffle;
+    }
+
+    //Leave room for the header, which needs the compressed length
+    string::size_type start = out.size();
+    out.resize(start+theirHeaderSize+deflateBound(itsStream, blocklen)+16);
+    itsStream->next_in = (Bytef*)in;
+    itsStream->avail_in = blocklen;
+    string::size_type done = start+theirHeaderSize;
+    while (true) {
+      itsStream->next_out = (Bytef*)&out[done];
+      itsStream->avail_out = out.size()-done;
+      int res = deflate(itsStream, Z_SYNC_FLUSH);
+      done = out.size()-itsStream->avail_out;
+      if (res!=Z_OK && res!=Z_BUF_ERROR) {
+	itsFailed = true;
+	return false;
+      }
+      //Everything is out once there is room to spare
+      if (itsStream->avail_in==0 && itsStream->avail_out>0) break;
+      out.resize(out.size()+blocklen/4+64);
+    }
+    out.resize(done);
+
+    unsigned int header[3];
+    header[0] = htonl(done-start-theirHeaderSize);
+    header[1] = htonl(blocklen);
+    header[2] = htonl(stride);
+    memcpy(&out[start], header, theirHeaderSize);
+    data += blocklen;
+    len -= blocklen;
+  }
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Read a block header
+bool WireCodec::readHeader(const char *header, int &packedlen, int &len,
+			   int &stride)
+{
+  unsigned int fields[3];
+  memcpy(fields, header, theirHeaderSize);
+  unsigned int plen = ntohl(fields[0]);
+  unsigned int ulen = ntohl(fields[1]);
+  unsigned int ustride = ntohl(fields[2]);
+  //Even data which doesn't compress at all only grows a little
+  if (ulen>(unsigned int)theirMaxBlock || plen>2u*theirMaxBlock ||
+      ustride<1 || ustride>MAXSTRIDE) {
+    return false;
+  }
+  packedlen = plen;
+  len = ulen;
+  stride = ustride;
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//Decompress the next block
+bool WireCodec::decode(const char *packed, int packedlen, char *out, int len,
+		       int stride)
+{
+  if (itsFailed || itsCompress) return false;
+  if (len>theirMaxBlock || stride<1 || stride>MAXSTRIDE) return false;
+
+  char *dest = (stride>1) ? itsShuffle : out;
+  itsStream->next_in = (Bytef*)packed;
+  itsStream->avail_in = packedlen;
+  itsStream->next_out = (Bytef*)dest;
+  itsStream->avail_out = len;
+  int res = inflate(itsStream, Z_SYNC_FLUSH);
+  //The flush at the end produces nothing, but may not have been taken
+  //if the block filled the output exactly
+  while (res==Z_OK && itsStream->avail_in>0 && itsStream->avail_out==0) {
+    char spare;
+    unsigned int before = itsStream->avail_in;
+    itsStream->next_out = (Bytef*)&spare;
+    itsStream->avail_out = 1;
+    res = inflate(itsStream, Z_SYNC_FLUSH);
+    if (itsStream->avail_out==0 || itsStream->avail_in==before) res = Z_DATA_ERROR;
+    else itsStream->avail_out = 0;
+  }
+  if ((res!=Z_OK && res!=Z_BUF_ERROR) ||
+      itsStream->avail_in!=0 || itsStream->avail_out!=0) {
+    itsFailed = true;
+    return false;
+  }
+  if (stride>1) unshuffle(itsShuffle, out, len, stride);
+  return true;
+}
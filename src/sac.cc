@@ -27,6 +27,9 @@
 #include <AudioSource.h>
 #include <Processor.h>
 #include <StoreMaster.h>
+#include <RawRing.h>
+#include <LiveFeed.h>
+#include <StoreCompactor.h>
 #include <WebMaster.h>
 #include <ConfigFile.h>
 #include <iostream>
@@ -34,12 +37,13 @@
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <sys/stat.h>
 
 //Configure sound card and start the audio thread
 void initAudio(ConfigFile &config, Buf<IntegPeriod*> *sink);
 //Configure and start the data processing thread
 void initProcessor(ConfigFile &config, Buf<IntegPeriod*> *source,
-		   StoreMaster *sink, StoreMaster *rawsink);
+		   StoreMaster *sink, RawRing *rawsink, LiveFeed *livesink);
 
 
 /////////////////////////////////////////////////////////////////////////////
@@ -68,18 +72,43 @@ int main(int argc, char *argv[])
 
   //Create component to manage the saving/retrieval of selected data
   StoreMaster *store = new StoreMaster(theconfig.getStoreDir());
+  store->setKeepRollups(theconfig.getKeepRollups());
+  store->setCompressSegments(theconfig.getCompressStore());
+  if (theconfig.getCompactStore()) {
+    //Start the thread which packs each closed day into a segment
+    StoreCompactor *compactor = new StoreCompactor(store);
+    compactor->start();
+  }
 
-  //Declare StoreMaster which manages saving/retrieval of all raw data
-  //This StoreMaster is optional and will only be created if the realtime
+  //Declare RawRing which manages saving/retrieval of all raw data
+  //This RawRing is optional and will only be created if the realtime
   //component is going to run.
-  StoreMaster *rawstore = NULL;
+  RawRing *rawstore = NULL;
+
+  //Ring of the most recent periods for clients which subscribe to the
+  //live data. This holds about two minutes worth.
+  int integtime = theconfig.getIntegTime();
+  LiveFeed *livefeed = new LiveFeed(120000/(integtime>0 ? integtime : 1000) + 1);
 
   //If requested, start the realtime processing component
   if (theconfig.getDoRealTime()) {
     if (theconfig.getStoreRaw()) {
       //We need to create a rolling store for raw audio data
-      rawstore = new StoreMaster(theconfig.getRawStoreDir(),
-				 theconfig.getMaxRawAge());
+      string rawdir = theconfig.getRawStoreDir();
+      mkdir(rawdir.c_str(), 0755);
+      if (rawdir.length()==0 || rawdir[rawdir.length()-1]!='/') rawdir += "/";
+      rawstore = new RawRing(rawdir + "raw.ring",
+			     theconfig.getMaxRawAge(),
+			     theconfig.getSampRate(),
+			     theconfig.getIntegTime(),
+			     theconfig.getNumBins());
+      if (!rawstore->isOpen()) {
+	cerr << "Could not open the raw data store, raw data will not be kept\n";
+	delete rawstore;
+	rawstore = NULL;
+      } else {
+	rawstore->setCompressAudio(theconfig.getCompressRaw());
+      }
     }
 
     //Create buffer between audio and data processing threads
@@ -88,11 +117,11 @@ int main(int argc, char *argv[])
     initAudio(theconfig, audiobuf);
     //initAudio(0, _samprate, _integperiod, audiobuf); //Null input source
     //Start the data processing (correlator) thread
-    initProcessor(theconfig, audiobuf, store, rawstore);
+    initProcessor(theconfig, audiobuf, store, rawstore, livefeed);
   }
 
   //Start the data network server component
-  WebMaster *ws = new WebMaster(store, rawstore, &theconfig);
+  WebMaster *ws = new WebMaster(store, rawstore, &theconfig, livefeed);
   ws->start();
 
   while (1) sleep(5000); //Hmmm, probably something better to do
@@ -131,7 +160,8 @@ void initAudio(ConfigFile &config, Buf<IntegPeriod*> *sink)
 void initProcessor(ConfigFile &config,
 		   Buf<IntegPeriod*> *source,
 		   StoreMaster *sink,
-		   StoreMaster *rawsink)
+		   RawRing *rawsink,
+		   LiveFeed *livesink)
 {
   //Get the gains to apply to each channel
   float gain1=config.getGain1();
@@ -141,6 +171,8 @@ void initProcessor(ConfigFile &config,
   //Determines if raw audio will be saved to disk - space consuming!
   ///Now disabled in preference to the raw data sink
   proc->setKeepAudio(false);
+  //Let any subscribed network clients see the data as it is produced
+  proc->setLiveFeed(livesink);
   //Print another reassuring message
   cerr << "Processor configured: raw audio buffer "
       << ((rawsink==NULL)?"disabled\n":"enabled\n");
@@ -14,6 +14,7 @@
 #include <PlotArea.h>
 #include <RFI.h>
 #include <IntegPeriod.h>
+#include <PeriodSeries.h>
 #include <TimeCoord.h>
 #include <iostream>
 #include <stdlib.h>
@@ -356,6 +357,7 @@ int main (int argc, char *argv[])
       markOutliers(temp+first, count, sigma, 21);
       //Discard the flagged data
       IntegPeriod::purgeFlagged(_data, _datalen, temp, templen);
+      delete[] temp;
 
     } else if (instruction=="u" || instruction=="undo") {
       //A very important one..
@@ -455,44 +457,35 @@ void help()
 //Draw a graph of the data between the specified times
 void drawGraph(timegen_t start, timegen_t end)
 {
-  //Count how many periods match
+  //Find the periods which match, the data is time sorted
+  int first = 0;
+  while (first<_datalen && _data[first].timeStamp<start) first++;
   int count = 0;
-  for (int i=0; i<_datalen; i++) {
-    if (_data[i].timeStamp>=start && _data[i].timeStamp<=end) count++;
-  }
+  while (first+count<_datalen && _data[first+count].timeStamp<=end) count++;
+  if (count==0) return;
 
-  float p1[count];
-  float p2[count];
-  float pX[count];
-  float t[count];
+  PeriodSeries series(_data+first, count);
+  float *t = series.hours();
   float pmax = 0.0;
-
-  count = 0;
-  for (int i=0; i<_datalen; i++) {
-    if (_data[i].timeStamp>=start && _data[i].timeStamp<=end) {
-      p1[count] = _data[i].power1;
-      if (p1[count]>pmax) pmax = p1[count];
-      p2[count] = _data[i].power2;
-      if (p2[count]>pmax) pmax = p2[count];
-      pX[count] = _data[i].powerX;
-      t[count]  = _data[i].timeStamp/3600000000.0;
-      count++;
-    }
+  for (int i=0; i<count; i++) {
+    if (series.power1[i]>pmax) pmax = series.power1[i];
+    if (series.power2[i]>pmax) pmax = series.power2[i];
   }
 
   PlotArea *x = PlotArea::getPlotArea(0);
   x->setTitle("(A) Radiometer Outputs");
   x->setAxisY("Power", pmax + pmax/20.0, 0.0, false);
   x->setAxisX("Time (Hours)", t[count-1], t[0], false);
-  x->plotLine(count, t, p1, 4);
-  x->plotLine(count, t, p2, 5);
+  x->plotLine(count, t, series.power1, 4);
+  x->plotLine(count, t, series.power2, 5);
 
   x = PlotArea::getPlotArea(1);
   x->setTitle("(B) Interferometer Output");
   x->setAxisY("Power", 0.0, 0.0, true);
   x->setAxisX("Time (Hours)", t[count-1], t[0], false);
-  x->plotLine(count, t, pX, 6);
+  x->plotLine(count, t, series.powerX, 6);
 
+  delete[] t;
 }
 
 
@@ -545,10 +538,7 @@ void writeData(const char *fname) {
     }
   }
 
-  ofstream datfile(fname, ios::out|ios::binary);
-  for (int i=0; i<_datalen; i++) {
-    datfile << _data[i];
-  }
+  IntegPeriod::write(_data, _datalen, fname);
 
   //And then change them back again
   if (_timeoffset!=0) {
@@ -13,7 +13,9 @@
 
 #include <PlotArea.h>
 #include <IntegPeriod.h>
+#include <PeriodSeries.h>
 #include <TimeCoord.h>
+#include <TimeAlign.h>
 #include <iostream>
 #include <sstream>
 #include <math.h>
@@ -69,9 +71,6 @@ timegen_t parseTime(istringstream &indate);
 void writeData(IntegPeriod *data, int datlen, char *fname);
 //Write the given data to a file in ASCII text format
 void writeASCII(IntegPeriod *data, int datlen, char *fname);
-//Find bidirectional closest match or return -1
-int match(int i, IntegPeriod *a, int alen,
-          IntegPeriod *b, int blen);
 //Print a usage message and exit
 void usage();
 
@@ -125,49 +124,41 @@ int main (int argc, char *argv[])
   PlotArea::setPopulation(3);
   cpgsch(1.2);
 
-  float temp[datalen];
-  float timedata[datalen];
+  //Plot straight from the columns
+  PeriodSeries series(data, datalen);
+  float *timedata = series.hours();
   float maxpow = 0.0;
   for (int i=0; i<datalen;i++) {
-      temp[i] = data[i].amplitude;
-      if (temp[i]>maxpow) maxpow = temp[i];
-      timedata[i] = data[i].timeStamp/float(3600000000.0);
+      if (series.amplitude[i]>maxpow) maxpow = series.amplitude[i];
   }
   PlotArea *x = PlotArea::getPlotArea(1);
   x->setTitle("Amplitude");
   x->setAxisY("Amplitude", maxpow, 0.0, false);
   x->setAxisX("Local Sidereal Time (Hours)", timedata[datalen-1], timedata[0], false);
-  x->plotLine(datalen, timedata, temp, 4);
+  x->plotLine(datalen, timedata, series.amplitude, 4);
 
 
-  for (int i=0; i<datalen;i++) {
-      temp[i] = data[i].phase;
-  }
   x = PlotArea::getPlotArea(2);//3
   x->setTitle("Phase");
   x->setAxisY("Phase", PI, -PI, false);
   x->setAxisX("Local Sidereal Time (Hours)", timedata[datalen-1], timedata[0], false);
-  x->plotPoints(datalen, timedata, temp, 10);
+  x->plotPoints(datalen, timedata, series.phase, 10);
 
   float minpow = 0.0;
   maxpow = 0.0;
-  float temp2[datalen];
   for (int i=0; i<datalen;i++) {
-    temp[i] = data[i].power1;
-    temp2[i] = data[i].power2;
-    if (temp[i]>maxpow) maxpow = temp[i];
-    if (temp[i]<minpow) minpow = temp[i];
-    if (temp2[i]>maxpow) maxpow = temp2[i];
-    if (temp2[i]<minpow) minpow = temp2[i];
-    timedata[i] = data[i].timeStamp/float(3600000000.0);
+    if (series.power1[i]>maxpow) maxpow = series.power1[i];
+    if (series.power1[i]<minpow) minpow = series.power1[i];
+    if (series.power2[i]>maxpow) maxpow = series.power2[i];
+    if (series.power2[i]<minpow) minpow = series.power2[i];
   }
   x = PlotArea::getPlotArea(0);//2
   //x->setTitle("Corrected Data");
   x->setTitle("Observed Fringe Patterns");
   x->setAxisY("Power", maxpow, minpow, false);
   x->setAxisX("Local Sidereal Time (Hours)", timedata[datalen-1], timedata[0], false);
-  x->plotPoints(datalen, timedata, temp, 2);
-  x->plotPoints(datalen, timedata, temp2, 6);
+  x->plotPoints(datalen, timedata, series.power1, 2);
+  x->plotPoints(datalen, timedata, series.power2, 6);
 
 
 /*  float tempI[_Ilen];
@@ -195,6 +186,7 @@ int main (int argc, char *argv[])
   x->plotPoints(_Ilen, timeI, tempI, 8);
   x->plotPoints(_Qlen, timeQ, tempQ, 6);
   */
+  delete[] timedata;
   //Close the pgplot device
   cpgclos();
 
@@ -345,8 +337,10 @@ void scale(IntegPeriod *ref, int reflen,
   int count=0;
   double gainavg1=0.0, gainavg2=0.0;
 
+  int *mapping = TimeAlign::mutual(ref, reflen, data, datalen,
+				   TimeAlign::last_tie, TimeAlign::first_tie);
   for (int r1=0; r1<reflen; r1++) {
-    int d1 = match(r1, ref, reflen, data, datalen);
+    int d1 = mapping[r1];
     if (d1==-1) continue; //No nearest match
 
     cerr << "matched " << r1 << " to " << d1 << endl;
@@ -355,6 +349,7 @@ void scale(IntegPeriod *ref, int reflen,
     if (data[d1].power2!=0.0) gainavg2 += ref[r1].power1/data[d1].power2;
     count++;
   }
+  delete[] mapping;
 
   gainavg1/=(float)count;
   gainavg2/=(float)count;
@@ -371,52 +366,6 @@ void scale(IntegPeriod *ref, int reflen,
 }
 
 
-/////////////////////////////////////////////////////////////////
-//Find bidirectional closest match or return -1
-//This is a shit house implementation
-int match(int i, IntegPeriod *a, int alen,
-	  IntegPeriod *b, int blen)
-{
-  if (a==NULL || alen==0 || b==NULL || blen==0) return -1;
-
-  //Need to match up appropriate samples
-  int b2=-1, a1=0;
-
-  long long bestdiff = a[i].timeStamp - b[0].timeStamp;
-  if (bestdiff<0) bestdiff = -bestdiff; //Get absolute
-  for (int b1=0; b1<blen; b1++) {
-    long long thisdiff = a[i].timeStamp - b[b1].timeStamp;
-    if (thisdiff<0) thisdiff = -thisdiff; //Get absolute
-    //Compare this with best
-    if (thisdiff<=bestdiff) {
-      bestdiff = thisdiff;
-      b2 = b1;
-    }
-  }
-  if (b2==-1) return -1;
-
-  //Then also check if this ref epoch is closest to the data
-  long long backdiff = a[0].timeStamp - b[b2].timeStamp;
-  if (backdiff<0) backdiff = -backdiff; //Get absolute
-  for (int a2=0; a2<alen; a2++) {
-    long long thisdiff = a[a2].timeStamp - b[b2].timeStamp;
-    if (thisdiff<0) thisdiff = -thisdiff; //Get absolute
-    //Compare this with best
-    if (thisdiff<backdiff) {
-      backdiff = thisdiff;
-      a1 = a2;
-    }
-  }
-
-  if (i!=a1) {
-    //Not the closest match in both directions
-    //cerr << "failed " << a[a1].timeStamp << "\t" << b[b1].timeStamp << endl;
-    return -1;
-  }
-  return b2;
-}
-
-
 /////////////////////////////////////////////////////////////////
 //Generate new "quadrature dataset" from I and Q data
 void getquadrature(IntegPeriod *&res, int &reslen,
@@ -438,8 +387,10 @@ void getquadrature(IntegPeriod *&res, int &reslen,
   res = new IntegPeriod[ilen>qlen?ilen:qlen];
   int resi = 0;
 
+  int *mapping = TimeAlign::mutual(i, ilen, q, qlen, TimeAlign::last_tie,
+				   TimeAlign::first_tie);
   for (int i1=0; i1<ilen; i1++) {
-    int q1 = match(i1, i, ilen, q, qlen);
+    int q1 = mapping[i1];
     if (q1==-1) continue;
 
     res[resi].timeStamp = (i[i1].timeStamp+q[q1].timeStamp)/2ll;
@@ -459,6 +410,7 @@ void getquadrature(IntegPeriod *&res, int &reslen,
     resi++;
     reslen++;
   }
+  if (mapping!=NULL) delete[] mapping;
   cout << "Of " << ilen << " and " << qlen << " arguments " << reslen
        << " were time-matched\n";
 }
@@ -467,8 +419,7 @@ void getquadrature(IntegPeriod *&res, int &reslen,
 ////////////////////////////////////////////////////////////////////////
 //Write the given data to a file in native binary format
 void writeData(IntegPeriod *data, int datlen, char *fname) {
-  ofstream datfile(fname, ios::out|ios::binary);
-  for (int i=0; i<datlen; i++) datfile << data[i];
+  IntegPeriod::write(data, datlen, fname);
 }
 
 
@@ -122,7 +122,9 @@ void calibrateData()
 //Integrate the data
 void averageData()
 {
-  IntegPeriod::integrate(_resdata, _reslen, _resdata, _reslen, _inttime);
+  IntegPeriod *olddata = _resdata;
+  IntegPeriod::integrate(_resdata, _reslen, olddata, _reslen, _inttime);
+  delete[] olddata;
 }
 
 
@@ -133,7 +135,9 @@ void processData()
   cout << "RFI processing data..";
   powerClean(_resdata, _reslen, 1.4, 10);
   markOutliers(_resdata, _reslen, _sigma, 20, false);
-  int d = IntegPeriod::purgeFlagged(_resdata, _reslen, _resdata, _reslen);
+  IntegPeriod *olddata = _resdata;
+  int d = IntegPeriod::purgeFlagged(_resdata, _reslen, olddata, _reslen);
+  delete[] olddata;
   cout << "\tdiscarded " << d << endl;
 }
 
@@ -142,19 +146,17 @@ void processData()
 //Merge the different data sets into one data set
 void mergeData()
 {
-  //Count how many data periods there are in all
+  //Sort each set, which is quick if it is in order already, and then
+  //merge them all together in one pass
+  cout << "Time-sorting data\n";
+  for (int i=0; i<_numdata; i++) IntegPeriod::sort(_data[i], _datalen[i]);
   cout << "Merging data sets\n";
-  for (int i=0; i<_numdata; i++) _reslen+=_datalen[i];
-  _resdata = new IntegPeriod[_reslen];
-  int resi = 0;
+  IntegPeriod::merge(_resdata, _reslen, _data, _datalen, _numdata);
   for (int i=0; i<_numdata; i++) {
-    for (int j=0; j<_datalen[i]; j++) {
-      _resdata[resi] = _data[i][j];
-      resi++;
-    }
+    delete[] _data[i];
+    _data[i] = NULL;
+    _datalen[i] = 0;
   }
-  cout << "Time-sorting data\n";
-  IntegPeriod::sort(_resdata, _reslen);
 }
 
 
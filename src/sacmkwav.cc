@@ -95,6 +95,10 @@ void loadData(istringstream &command, IntegPeriod *&data, int &count)
   data = NULL;
   IntegPeriod *tempdata;
   int tempcount;
+  //Each data set as it is loaded
+  int numsets = 0, setsize = 8;
+  IntegPeriod **sets = new IntegPeriod*[setsize];
+  int *setlens = new int[setsize];
   timegen_t start=0, end=0;
   string str;
 
@@ -153,16 +157,39 @@ void loadData(istringstream &command, IntegPeriod *&data, int &count)
       usage();
     }
 
-    if (tempcount!=0 && count!=0) {
-      cerr << "Merging\t";
-      IntegPeriod::merge(data, count, data, count, tempdata, tempcount);
-      cerr << "DONE\n";
-    } else if (tempcount!=0) {
-      //First data, no point 'merging'
-      data = tempdata;
-      count = tempcount;
+    if (tempcount!=0) {
+      //Keep the new data to be merged with the rest at the end
+      if (numsets==setsize) {
+	setsize *= 2;
+	IntegPeriod **newsets = new IntegPeriod*[setsize];
+	int *newlens = new int[setsize];
+	for (int i=0; i<numsets; i++) {
+	  newsets[i] = sets[i];
+	  newlens[i] = setlens[i];
+	}
+	delete[] sets;
+	delete[] setlens;
+	sets = newsets;
+	setlens = newlens;
+      }
+      sets[numsets] = tempdata;
+      setlens[numsets] = tempcount;
+      numsets++;
     }
   }
+
+  if (numsets==1) {
+    //Only one set, no point 'merging'
+    data = sets[0];
+    count = setlens[0];
+  } else if (numsets>1) {
+    cerr << "Merging\t";
+    IntegPeriod::merge(data, count, sets, setlens, numsets);
+    for (int i=0; i<numsets; i++) delete[] sets[i];
+    cerr << "DONE\n";
+  }
+  delete[] sets;
+  delete[] setlens;
   cerr << "END DATA SET\n";
 }
 
@@ -170,14 +197,7 @@ void loadData(istringstream &command, IntegPeriod *&data, int &count)
 ////////////////////////////////////////////////////////////////////////
 //Write the given data to a single file
 void writeData(IntegPeriod *data, int datlen, char *fname) {
-  ofstream datfile(fname, ios::out|ios::binary);
-  for (int i=0; i<datlen; i++) {
-    //cout << ts << " " <<
-    //    data[i].power1 << " " <<
-    //    data[i].power2 << " " <<
-    //    data[i].powerX << "\n";
-    datfile << data[i];
-  }
+  IntegPeriod::write(data, datlen, fname);
 }
 
 
@@ -14,6 +14,7 @@
 #include <TCPstream.h>
 #include <Site.h>
 #include <IntegPeriod.h>
+#include <PeriodSeries.h>
 #include <TimeCoord.h>
 #include <iostream>
 #include <stdlib.h>
@@ -161,13 +162,10 @@ int main (int argc, char *argv[])
   x->setAxisX("Time (Hours)", 24, 0, false);
 
   for (int sys=0; sys<_numfiles; sys++) {
-    float temp[_numdata[sys]];
-    float timedata[_numdata[sys]];
-    for (int i=0; i<_numdata[sys]; i++) {
-      temp[i] = _data[sys][i].amplitude;
-      timedata[i] = _data[sys][i].timeStamp/float(3600000000.0);
-    }
-    x->plotPoints(_numdata[sys], timedata, temp, 3+sys);
+    PeriodSeries series(_data[sys], _numdata[sys]);
+    float *timedata = series.hours();
+    x->plotPoints(_numdata[sys], timedata, series.amplitude, 3+sys);
+    delete[] timedata;
   }
 
   x = PlotArea::getPlotArea(1);
@@ -176,13 +174,10 @@ int main (int argc, char *argv[])
   x->setAxisX("Time (Hours)", 24, 0, false);
 
   for (int sys=0; sys<_numfiles; sys++) {
-    float temp[_numdata[sys]];
-    float timedata[_numdata[sys]];
-    for (int i=0; i<_numdata[sys]; i++) {
-      temp[i] = _data[sys][i].phase;
-      timedata[i] = _data[sys][i].timeStamp/float(3600000000.0);
-    }
-    x->plotPoints(_numdata[sys], timedata, temp, 3+sys);
+    PeriodSeries series(_data[sys], _numdata[sys]);
+    float *timedata = series.hours();
+    x->plotPoints(_numdata[sys], timedata, series.phase, 3+sys);
+    delete[] timedata;
   }
 
   _numsources = 15;
@@ -410,13 +405,10 @@ ExtendedSource *replaceSource(int srcnum,
 	x->setAxisX("Time (Hours)", 24, 0, false);
 
 	for (int sys=0; sys<_numfiles; sys++) {
-	  float temp[_numdata[sys]];
-	  float timedata[_numdata[sys]];
-	  for (int i=0; i<_numdata[sys]; i++) {
-	    temp[i] = tempdata[sys][i].amplitude;
-	    timedata[i] = tempdata[sys][i].timeStamp/float(3600000000.0);
-	  }
-	  x->plotPoints(_numdata[sys], timedata, temp, 3+sys);
+	  PeriodSeries series(tempdata[sys], _numdata[sys]);
+	  float *timedata = series.hours();
+	  x->plotPoints(_numdata[sys], timedata, series.amplitude, 3+sys);
+	  delete[] timedata;
 	}
 
 	x = PlotArea::getPlotArea(3);
@@ -425,13 +417,10 @@ ExtendedSource *replaceSource(int srcnum,
 	x->setAxisX("Time (Hours)", 24, 0, false);
 
 	for (int sys=0; sys<_numfiles; sys++) {
-	  float temp[_numdata[sys]];
-	  float timedata[_numdata[sys]];
-	  for (int i=0; i<_numdata[sys]; i++) {
-	    temp[i] = tempdata[sys][i].phase;
-	    timedata[i] = tempdata[sys][i].timeStamp/float(3600000000.0);
-	  }
-	  x->plotPoints(_numdata[sys], timedata, temp, 3+sys);
+	  PeriodSeries series(tempdata[sys], _numdata[sys]);
+	  float *timedata = series.hours();
+	  x->plotPoints(_numdata[sys], timedata, series.phase, 3+sys);
+	  delete[] timedata;
 	}
       }
     }
@@ -16,7 +16,11 @@
 #include <RFI.h>
 #include <TCPstream.h>
 #include <IntegPeriod.h>
+#include <PeriodSeries.h>
+#include <Rollup.h>
+#include <ServerPool.h>
 #include <TimeCoord.h>
+#include <TimeAlign.h>
 #include <iostream>
 #include <stdlib.h>
 #include <sstream>
@@ -56,9 +60,12 @@ char *_savefile = NULL; //File to write any output graphs to (if not screen)
 float _minbeam = 2.0; //"min beam size" to use in model. Probably leave alone.
 bool _rfi   = true; //Should we perform RFI processing
 timegen_t _inttime= 30000000; //Default integration time if RFI processing
+timegen_t _quicklook = 0; //Resolution of server rollups to plot, 0 for raw
+int _maxpoints = 0; //Most server summaries to plot across the range, 0 for raw
 timegen_t _earliest = 0; //The earliest timestamp on the graphs
 float _sigma = 1.2; //How many std dev from mean is to be considered RFI
 float _noiselimit = 0; //How large can std dev be to mean else flag as RFI
+float _median = 0; //If set, flag this many robust std dev above local median
 int _numdatarequests = 0; //The number of data requests specified by user
 string *_datarequests; //Holds all data request command strings
 string _server = string("localhost");
@@ -85,10 +92,10 @@ void usage();
 //Manages loading of a data request, RFI processing and display
 void doRequest(istringstream &command, int set);
 //Initialise the graphs
-void graphInit(IntegPeriod *procdata, int count,
+void graphInit(const PeriodSeries &procdata,
 	       float tmin, float tmax, int set);
 //Draw the graphs
-void drawGraphs(IntegPeriod *procdata, int count, bool withlines,
+void drawGraphs(const PeriodSeries &procdata, bool withlines,
 		bool rfi, int set);
 //Load all data specified in the command
 void loadData(istringstream &command, IntegPeriod *&data, int &count);
@@ -97,14 +104,10 @@ void writeData(IntegPeriod *data, int datlen, char *fname);
 //Write the given data to a file in ASCII text format
 void writeASCII(IntegPeriod *data, int datlen, char *fname);
 //Do all RFI processing with user specified settings
-void cleanData2(IntegPeriod *&res, int &rescount,
-	       IntegPeriod *data, int count);
+void cleanData2(PeriodSeries &res, PeriodSeries &data);
 //Scale values of 'data' to approximate those in 'ref'
 void scale(IntegPeriod *ref, int reflen,
 	   IntegPeriod *data, int datalen);
-//Find bidirectional closest match or return -1
-int match(int i, IntegPeriod *a, int alen,
-          IntegPeriod *b, int blen);
 
 
 /////////////////////////////////////////////////////////////////
@@ -154,70 +157,77 @@ void doRequest(istringstream &command, int set)
   loadData(command, data, count);
   if (count==0) return;
 
+  //The processing and plotting only need the powers, as columns
+  PeriodSeries series(data, count);
+
   //If requested, do some RFI filtering
-  IntegPeriod *cleandata = data;
-  int cleancount=count;
+  PeriodSeries cleanseries;
+  PeriodSeries *cleandata = &series;
   if (_rfi) {
-    cleanData2(cleandata, cleancount, data, count);
+    cleanData2(cleanseries, series);
+    cleandata = &cleanseries;
   }
 
   //Work out the max and min time labels to use on the graph
   float tmin = 0.0;
   float tmax = 0.0;
-  if (!_LST && data[0].timeStamp>86400000000ll) {
+  if (!_LST && series.timeStamp[0]>86400000000ll) {
     tmin = 0.0;
-    tmax = (data[count-1].timeStamp-data[0].timeStamp)/float(3600000000ll);;
+    tmax = (series.timeStamp[count-1]-series.timeStamp[0])/float(3600000000ll);;
   } else {
-    tmin = data[0].timeStamp/float(3600000000ll);
-    tmax = data[count-1].timeStamp/float(3600000000ll);
+    tmin = series.timeStamp[0]/float(3600000000ll);
+    tmax = series.timeStamp[count-1]/float(3600000000ll);
   }
 
   //draw the graphs
-  graphInit(cleandata, cleancount, tmin, tmax, set);
+  graphInit(*cleandata, tmin, tmax, set);
   if (!_withlines && !_withdots) {
-    drawGraphs(data, count, false, true, set);
+    drawGraphs(series, false, true, set);
   }
   if (_withdots) {
-    drawGraphs(cleandata, cleancount, false, false, set);
+    drawGraphs(*cleandata, false, false, set);
   } else {
-    drawGraphs(cleandata, cleancount, true, false, set);
+    drawGraphs(*cleandata, true, false, set);
   }
 
-  //Write data to file
-  writeData(cleandata, cleancount, "data.out");
-  if (_writeASCII) writeASCII(cleandata, cleancount, "data.txt");
+  //Write data to file, keeping any spectra if it wasn't processed
+  IntegPeriod *outdata = data;
+  if (_rfi) outdata = cleandata->toPeriods();
+  writeData(outdata, cleandata->size(), "data.out");
+  if (_writeASCII) writeASCII(outdata, cleandata->size(), "data.txt");
 
-  if (cleandata!=data) delete[] cleandata;
+  if (outdata!=NULL && outdata!=data) delete[] outdata;
   delete[] data;
 }
 
 
 /////////////////////////////////////////////////////////////////
 //Clean the data according to any user defined arguments
-void cleanData2(IntegPeriod *&res, int &rescount,
-	       IntegPeriod *data, int count)
+void cleanData2(PeriodSeries &res, PeriodSeries &data)
 {
-  if (data==NULL || count==0) return;
+  res.resize(0);
+  if (data.size()==0) return;
+
+  PeriodSeries tempdata, tempdata2;
 
-  res = NULL;
-  rescount = 0;
-  IntegPeriod *tempdata = NULL, *tempdata2 = NULL;
-  int tempcount = 0, tempcount2 = 0;
+  if (_median) {
+    medianClean(res, data, _median, _inttime);
+    cerr << "Finished cleaning data\n";
+    return;
+  }
 
-  markOutliers(data, count, 2.0, 20);
-  IntegPeriod::purgeFlagged(tempdata, tempcount, data, count);
-  if (tempdata==NULL || tempcount==0) return;
+  markOutliers(data, 2.0, 20);
+  data.purgeFlagged(tempdata);
+  if (tempdata.size()==0) return;
 
 
-  powerClean(tempdata, tempcount, 1.2, 20);
-  IntegPeriod::purgeFlagged(tempdata2, tempcount2, tempdata, tempcount);
-  delete[] tempdata;
-  if (tempdata2==NULL || tempcount2==0) return;
+  powerClean(tempdata, 1.2, 20);
+  tempdata.purgeFlagged(tempdata2);
+  if (tempdata2.size()==0) return;
 
   //Perform second pass
-  markOutliers(tempdata2, tempcount2, _sigma, 20, _noiselimit?true:false);
-  IntegPeriod::integrate(res, rescount, tempdata2, tempcount2, _inttime);
-  delete[] tempdata2;
+  markOutliers(tempdata2, _sigma, 20, _noiselimit?true:false);
+  tempdata2.integrate(res, _inttime);
 
   cerr << "Finished cleaning data\n";
 }
@@ -229,44 +239,19 @@ bool getServerLoc(int port, const char *server, pair_t &loc)
 {
   loc.c1 = LONGNOTINIT;
   loc.c2 = LONGNOTINIT;
-  SocketAddr server_addr = SocketAddr(IPaddress(server), port);
-
-  int listening_socket = socket(AF_INET,SOCK_STREAM,0);
-  if( listening_socket < 0 )
-    CurrentNetCallback::on_error("Socket creation error");
-
-  int value = 1;
-  if( setsockopt(listening_socket, SOL_SOCKET, SO_REUSEADDR,
-		 (char*)&value, sizeof(value)) < 0 )
-    CurrentNetCallback::on_error("setsockopt SO_REUSEADDR error");
-
-  TCPstream dsrc;
-  if (dsrc.rdbuf()->connect(server_addr)!=NULL) {
-      dsrc.rdbuf()->set_blocking_io(true);
-
-      if (dsrc.good() && dsrc.rdbuf()->is_open() && !dsrc.eof()) {
-	//Finally, ask it's location
-	dsrc << "LOCATION\n";
-	dsrc >> loc.c1 >> loc.c2;
-	if (dsrc.fail() || dsrc.eof()) {
-	  cerr << "Error reading location from server\n";
-	  dsrc.close();
-	  return false;
-	}
-	if (loc.c1>180.0 || loc.c1<-180.0 || loc.c2>90.0 || loc.c2<-90.0) {
-	  cerr << "Returned location was invalid: " << loc.c1 << " " << loc.c2 << endl;
-	  dsrc.close();
-	  return false;
-	}
-	dsrc.close();
-	cout << "Telescope location is: " << loc.c1 << " " << loc.c2 << endl;
-	loc.c1 = PI*loc.c1/180.0;
-        loc.c2 = PI*loc.c2/180.0;
-	return true;
-      }
+  double lon, lat;
+  if (!ServerPool::global().getLocation(lon, lat, server, port)) {
+    cerr << "Error reading location from server\n";
+    return false;
   }
-  dsrc.close();
-  return false;
+  if (lon>180.0 || lon<-180.0 || lat>90.0 || lat<-90.0) {
+    cerr << "Returned location was invalid: " << lon << " " << lat << endl;
+    return false;
+  }
+  cout << "Telescope location is: " << lon << " " << lat << endl;
+  loc.c1 = PI*lon/180.0;
+  loc.c2 = PI*lat/180.0;
+  return true;
 }
 
 
@@ -278,6 +263,10 @@ void loadData(istringstream &command, IntegPeriod *&data, int &count)
   data = NULL;
   IntegPeriod *tempdata;
   int tempcount;
+  //Each data set as it is loaded
+  int numsets = 0, setsize = 8;
+  IntegPeriod **sets = new IntegPeriod*[setsize];
+  int *setlens = new int[setsize];
   timegen_t start=0, end=0;
   timegen_t realstart=-1; //earliest time out of any dataset
   string str;
@@ -313,14 +302,35 @@ void loadData(istringstream &command, IntegPeriod *&data, int &count)
       }
       cerr << "Loading from network:\n";
 
-      //Work out if we should request server-side pre-processing
-      bool procserver = true;
-      if (_server=="localhost" || !_rfi) procserver = false;
-      //And then ask the server for the data
-      if (!IntegPeriod::load(tempdata, tempcount, start, end,
-			     _server.c_str(), 31234, procserver)) {
-	cerr << "Could not obtain requested data, quitting\n";
-	exit(1);
+      if (_quicklook>0 || _maxpoints>0) {
+        //Only request the summaries from the server, which is much faster
+        Rollup *rolls = NULL;
+        int numrolls = 0;
+        bool ok;
+        if (_maxpoints>0) {
+          //Let the server pick the resolution to suit the number of points
+          ok = Rollup::loadBuckets(rolls, numrolls, start, end, _maxpoints,
+                                   _server.c_str(), 31234);
+        } else {
+          ok = Rollup::load(rolls, numrolls, start, end, _quicklook,
+                            _server.c_str(), 31234);
+        }
+        if (!ok) {
+	  cerr << "Could not obtain requested data, quitting\n";
+	  exit(1);
+        }
+        Rollup::toIntegPeriods(tempdata, tempcount, rolls, numrolls);
+        if (rolls!=NULL) delete[] rolls;
+      } else {
+        //Work out if we should request server-side pre-processing
+        int procserver = _median ? clean_median : clean_sigma;
+        if (_server=="localhost" || !_rfi) procserver = clean_none;
+        //And then ask the server for the data
+        if (!IntegPeriod::load(tempdata, tempcount, start, end,
+			       _server.c_str(), 31234, procserver)) {
+	  cerr << "Could not obtain requested data, quitting\n";
+	  exit(1);
+        }
       }
       if (_LST) {
 	//We can ask the server exactly what its location is
@@ -414,17 +424,40 @@ void loadData(istringstream &command, IntegPeriod *&data, int &count)
     }
 
 
-    if (tempcount!=0 && count!=0) {
-      //Merge the new data
-      cerr << "Merging\t";
-      IntegPeriod::merge(data, count, data, count, tempdata, tempcount);
-      cerr << "DONE\n";
-    } else if (tempcount!=0) {
-      data = tempdata;
-      count = tempcount;
+    if (tempcount!=0) {
+      //Keep the new data to be merged with the rest at the end
+      if (numsets==setsize) {
+	setsize *= 2;
+	IntegPeriod **newsets = new IntegPeriod*[setsize];
+	int *newlens = new int[setsize];
+	for (int i=0; i<numsets; i++) {
+	  newsets[i] = sets[i];
+	  newlens[i] = setlens[i];
+	}
+	delete[] sets;
+	delete[] setlens;
+	sets = newsets;
+	setlens = newlens;
+      }
+      sets[numsets] = tempdata;
+      setlens[numsets] = tempcount;
+      numsets++;
     }
   }
 
+  if (numsets==1) {
+    //Only one set, no point 'merging'
+    data = sets[0];
+    count = setlens[0];
+  } else if (numsets>1) {
+    cerr << "Merging\t";
+    IntegPeriod::merge(data, count, sets, setlens, numsets);
+    for (int i=0; i<numsets; i++) delete[] sets[i];
+    cerr << "DONE\n";
+  }
+  delete[] sets;
+  delete[] setlens;
+
   if (!_LST) {
     //If sidereal time mode wasn't selected on the command line
     //then display times as an offset from the start
@@ -442,7 +475,7 @@ void loadData(istringstream &command, IntegPeriod *&data, int &count)
 
 /////////////////////////////////////////////////////////////////
 //Initialise the graphs for normal drawing mode - not modelling mode
-void graphInit(IntegPeriod *procdata, int count,
+void graphInit(const PeriodSeries &procdata,
 	       float tmin, float tmax, int stgraph)
 {
   static bool first = true;
@@ -502,17 +535,18 @@ void graphInit(IntegPeriod *procdata, int count,
 
   ymin=999999999, ymax=0;
   xmin=999999999, xmax=-999999999;
+  int count = procdata.size();
   for (int i=0; i<count; i++) {
     if (!_complex) {
-      if ((procdata[i].power1<ymin)&&!_only2) ymin = procdata[i].power1;
-      if ((procdata[i].power2<ymin)&&!_only1) ymin = procdata[i].power2;
-      if ((procdata[i].power1>ymax)&&!_only2) ymax = procdata[i].power1;
-      if ((procdata[i].power2>ymax)&&!_only1) ymax = procdata[i].power2;
-      if ((procdata[i].powerX<xmin)) xmin = procdata[i].powerX;
-      if ((procdata[i].powerX>xmax)) xmax = procdata[i].powerX;
+      if ((procdata.power1[i]<ymin)&&!_only2) ymin = procdata.power1[i];
+      if ((procdata.power2[i]<ymin)&&!_only1) ymin = procdata.power2[i];
+      if ((procdata.power1[i]>ymax)&&!_only2) ymax = procdata.power1[i];
+      if ((procdata.power2[i]>ymax)&&!_only1) ymax = procdata.power2[i];
+      if ((procdata.powerX[i]<xmin)) xmin = procdata.powerX[i];
+      if ((procdata.powerX[i]>xmax)) xmax = procdata.powerX[i];
     } else {
-      if (procdata[i].amplitude < ymin) ymin = procdata[i].amplitude;
-      if (procdata[i].amplitude > ymax) ymax = procdata[i].amplitude;
+      if (procdata.amplitude[i] < ymin) ymin = procdata.amplitude[i];
+      if (procdata.amplitude[i] > ymax) ymax = procdata.amplitude[i];
     }
   }
   ymax+=ymax/10.0;
@@ -554,34 +588,21 @@ void graphInit(IntegPeriod *procdata, int count,
 
 
 /////////////////////////////////////////////////////////////////
-void drawGraphs(IntegPeriod *procdata, int count, bool lines, bool rfi, int set) {
-  int realcount=0;
+void drawGraphs(const PeriodSeries &procdata, bool lines, bool rfi, int set) {
+  int realcount = procdata.size();
 
-  float temp[count];
-  float timedata[count];
+  //The columns can be plotted directly
+  float *temp = procdata.power1;
+  float *timedata = procdata.hours();
   PlotArea *x = NULL;
 
-  for (int i=0; i<count;i++) {
-    temp[i] = procdata[i].power1;
-    if (_LST) {
-      timedata[i] = procdata[i].timeStamp/float(3600000000.0);
-    } else {
-      timedata[i] = procdata[i].timeStamp/float(3600000000.0);
-    }
-    realcount++;
-  }
-
-
   if (!_onlyX) {
     if (_ref!=NULL && _LST && _rfi) {
-      float reftemp[_reflen];
-      float reftime[_reflen];
-      for (int i=0; i<_reflen;i++) {
-	reftemp[i] = _ref[i].power1;
-	reftime[i] = _ref[i].timeStamp/float(3600000000.0);
-      }
+      PeriodSeries ref(_ref, _reflen);
+      float *reftime = ref.hours();
       x = PlotArea::getPlotArea(0);
-      x->plotPoints(_reflen, reftime, reftemp, 2);
+      x->plotPoints(_reflen, reftime, ref.power1, 2);
+      delete[] reftime;
     }
 
     if (!_complex) {
@@ -596,7 +617,7 @@ void drawGraphs(IntegPeriod *procdata, int count, bool lines, bool rfi, int set)
 	  }
 	}
 	if (!_only1) {
-	  for (int i=0; i<count;i++) temp[i] = procdata[i].power2;
+	  temp = procdata.power2;
 	  if (lines) {
 	    x->plotLine(realcount, timedata, temp, 5);
 	  } else {
@@ -613,7 +634,7 @@ void drawGraphs(IntegPeriod *procdata, int count, bool lines, bool rfi, int set)
 
     if (_complex) {
       //Display "complex" visibilities
-      for (int i=0; i<count;i++) temp[i] = procdata[i].phase;
+      temp = procdata.phase;
       x->setAxisY("Phase", PI, -PI, false);
       if (lines)
 	x->plotPoints(realcount, timedata, temp, 7);
@@ -622,7 +643,7 @@ void drawGraphs(IntegPeriod *procdata, int count, bool lines, bool rfi, int set)
 
       //Plot the amplitude on the same graph as the input powers
       x = PlotArea::getPlotArea(set);
-      for (int i=0; i<count;i++) temp[i] = procdata[i].amplitude;
+      temp = procdata.amplitude;
 
       if (lines) {
 	x->plotLine(realcount, timedata, temp, 3);
@@ -633,7 +654,7 @@ void drawGraphs(IntegPeriod *procdata, int count, bool lines, bool rfi, int set)
     } else {
       //Display standard cross power data
       //for (int i=0; i<count;i++) temp[i] = procdata[i].amplitude*cos(procdata[i].phase);
-      for (int i=0; i<count;i++) temp[i] = procdata[i].powerX;
+      temp = procdata.powerX;
 
       if (lines) {
 	x->plotLine(realcount, timedata, temp, 7);
@@ -648,16 +669,14 @@ void drawGraphs(IntegPeriod *procdata, int count, bool lines, bool rfi, int set)
        x->plotPoints(realcount, timedata, temp, 5);*/
     }
   }
+  delete[] timedata;
 }
 
 
 ////////////////////////////////////////////////////////////////////////
 //Write the given data to a file in native binary format
 void writeData(IntegPeriod *data, int datlen, char *fname) {
-  ofstream datfile(fname, ios::out|ios::binary);
-  for (int i=0; i<datlen; i++) {
-    datfile << data[i];
-  }
+  IntegPeriod::write(data, datlen, fname);
 }
 
 
@@ -706,6 +725,29 @@ void parseArgs(int argc, char *argv[])
       _inttime *= 1000000;
       cerr << "Using " << _inttime/1000000 << " second integration periods\n";
       i+=1;
+    } else if (tempstr == "-Q") {
+      if (argc<i+2) {
+        cerr << "Insufficient arguments after -Q option\n";
+        usage();
+      }
+      istringstream tmp(argv[i+1]);
+      tmp >> _quicklook;
+      if (tmp.fail() || _quicklook<=0) {usage();}
+      _quicklook *= 1000000;
+      cerr << "Quick look using " << _quicklook/1000000
+	   << " second summaries from the server\n";
+      i+=1;
+    } else if (tempstr == "-P") {
+      if (argc<i+2) {
+        cerr << "Insufficient arguments after -P option\n";
+        usage();
+      }
+      istringstream tmp(argv[i+1]);
+      tmp >> _maxpoints;
+      if (tmp.fail() || _maxpoints<=0) {usage();}
+      cerr << "Asking the server for at most " << _maxpoints
+	   << " summaries across each range\n";
+      i+=1;
     } else if (tempstr == "-S") {
       if (argc<i+2) {
         cerr << "Insufficient arguments after -S option\n";
@@ -727,6 +769,16 @@ void parseArgs(int argc, char *argv[])
       if (tmp.fail()) {usage();}
       cerr << "Will discard blocks noisier than " << _noiselimit << endl;
       i+=1;
+    } else if (tempstr == "-M") {
+      if (argc<i+2) {
+        cerr << "Insufficient arguments after -M option\n";
+        usage();
+      }
+      istringstream tmp(argv[i+1]);
+      tmp >> _median;
+      if (tmp.fail() || _median<=0) {usage();}
+      cerr << "Will discard points more than " << _median << " robust std dev above median\n";
+      i+=1;
     } else if (tempstr == "-x") {
       istringstream tmp(argv[i+1]);
       tmp >> _server;
@@ -960,8 +1012,9 @@ void scale(IntegPeriod *ref, int reflen,
   int count=0;
   double gainavg1=0.0, gainavg2=0.0;
 
+  int *mapping = TimeAlign::mutual(ref, reflen, data, datalen);
   for (int r1=0; r1<reflen; r1++) {
-    int d1 = match(r1, ref, reflen, data, datalen);
+    int d1 = mapping[r1];
     if (d1==-1) continue; //No nearest match
 
     //Both gains are calculated WRT channel 1 of reference
@@ -969,6 +1022,7 @@ void scale(IntegPeriod *ref, int reflen,
     if (data[d1].power2!=0.0) gainavg2 += ref[r1].power1/data[d1].power2;
     count++;
   }
+  delete[] mapping;
 
   gainavg1/=(float)count;
   gainavg2/=(float)count;
@@ -985,46 +1039,3 @@ void scale(IntegPeriod *ref, int reflen,
 }
 
 
-/////////////////////////////////////////////////////////////////
-//Find bidirectional closest match or return -1
-int match(int i, IntegPeriod *a, int alen,
-	  IntegPeriod *b, int blen)
-{
-  if (a==NULL || alen==0 || b==NULL || blen==0) return -1;
-
-  //Need to match up appropriate samples
-  //Dodgy slow implementation too
-  int b2=-1, a1=-1;
-
-  long long bestdiff = a[i].timeStamp - b[0].timeStamp;
-  for (int b1=0; b1<blen; b1++) {
-    long long thisdiff = a[i].timeStamp - b[b1].timeStamp;
-    if (thisdiff<0) thisdiff = -thisdiff; //Get absolute
-    //Compare this with best
-    if (thisdiff<=bestdiff) {
-      bestdiff = thisdiff;
-      b2 = b1;
-    }
-  }
-  if (b2==-1) return -1;
-
-  //Then also check if this ref epoch is closest to the data
-  long long backdiff = a[0].timeStamp - b[b2].timeStamp;
-  if (backdiff<0) backdiff = -backdiff; //Get absolute
-  for (int a2=0; a2<alen; a2++) {
-    long long thisdiff = a[a2].timeStamp - b[b2].timeStamp;
-      if (thisdiff<0) thisdiff = -thisdiff; //Get absolute
-      //Compare this with best
-      if (thisdiff<=backdiff) {
-	backdiff = thisdiff;
-	a1 = a2;
-      }
-  }
-
-  if (i!=a1) {
-    //Not the closest match in both directions
-    //cerr << "failed " << a[a1].timeStamp << "\t" << b[b1].timeStamp << endl;
-    return -1;
-  }
-  return b2;
-}
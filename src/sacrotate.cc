@@ -197,8 +197,7 @@ void usage()
 ////////////////////////////////////////////////////////////////////////
 //Write the given data to a file in native binary format
 void writeData(IntegPeriod *data, int datlen, char *fname) {
-  ofstream datfile(fname, ios::out|ios::binary);
-  for (int i=0; i<datlen; i++) datfile << data[i];
+  IntegPeriod::write(data, datlen, fname);
 }
 
 
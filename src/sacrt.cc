@@ -15,6 +15,9 @@
 #include <RFI.h>
 #include <TCPstream.h>
 #include <IntegPeriod.h>
+#include <PeriodSeries.h>
+#include <AsyncLoader.h>
+#include <ServerPool.h>
 #include <TimeCoord.h>
 #include <iostream>
 #include <stdlib.h>
@@ -26,6 +29,7 @@
 #include <assert.h>
 #include <unistd.h>
 #include <cstring>
+#include <utility>
 
 extern "C" {
 #include <cpgplot.h>
@@ -37,6 +41,7 @@ using namespace::std;
 bool _RFI = true;  //Whether or not to perform basic RFI processing
 bool _LST = false; //Whether to display time as system LST
 bool _offsetGraphs = false; //Whether to rescale data and offset lines
+bool _medianClean = false; //Whether to use median based RFI cleaning
 timegen_t _lastOffset = 0; //Time we last calculated the graph offsets
 int _updatePeriod = 5; //Time between server polls, in seconds
 timegen_t _graphSpan = 3600000000ll; //Time span of the graph
@@ -80,6 +85,8 @@ void processData();
 void calculateOffsets();
 //Draw graphs of the current data
 void drawGraphs();
+//Return a new array of the time axis values for a server's data
+float *timeAxis(const PeriodSeries &series, int server, timegen_t now);
 //Applies very crude cleaning for the raw data
 void cleanDataCrude(IntegPeriod *&res, int &rescount,
 		    IntegPeriod *data, int count);
@@ -99,6 +106,7 @@ void usage()
   cerr << "-u <seconds>\tUpdate interval in seconds, eg, \"10\"\n";
   cerr << "-r <seconds>\tRescale the graphs every this many seconds, eg \"60\"\n";
   cerr << "-o\t\tScale the power levels to a common value and then offset them\n";
+  cerr << "-m\t\tFind RFI using the local median rather than the local mean\n";
   cerr << "-LST\t\tShow the time axis in server Local Sidereal Time\n";
   cerr << endl;
   exit(1);
@@ -237,6 +245,9 @@ int main (int argc, char *argv[])
     } else if (arg == "-o") {
       //Rescale and offset the receiver data
       _offsetGraphs = true;
+    } else if (arg == "-m") {
+      //Use the robust median based RFI cleaning
+      _medianClean = true;
     } else if (arg == "-a") {
       //Specify the server to get the audio from
       if (i+2>argc) {
@@ -270,13 +281,21 @@ int main (int argc, char *argv[])
       usage();
     }
   }
-  //Next need to work out graph start time and download bulk of data.
+  //Next need to work out graph start time and download bulk of data,
+  //from all of the servers at once
+  AsyncLoader **loaders = new AsyncLoader*[_numservers];
   for (int i=0; i<_numservers; i++) {
     timegen_t now = getAbs();
     timegen_t start = now - _graphSpan;
     cout << "Initialising data from " << _serverNames[i] << endl;
-    IntegPeriod::load(_data[i], _numData[i], now, start, *_servers[i], false);
+    loaders[i] = new AsyncLoader(*_servers[i]);
+    loaders[i]->start(start, now, false);
   }
+  for (int i=0; i<_numservers; i++) {
+    loaders[i]->take(_data[i], _numData[i]);
+    delete loaders[i];
+  }
+  delete[] loaders;
 
   if (cpgbeg(0, "/XS", 2, 1) != 1)
 //  if (cpgbeg(0, "/tmp/graph.ps/CPS", 2, 2) != 1)
@@ -306,7 +325,10 @@ int main (int argc, char *argv[])
 //Get the latest data for each system
 void updateData()
 {
+  //Ask all of the servers first so they send their data at once
+  AsyncLoader **loaders = new AsyncLoader*[_numservers];
   for (int i=0; i<_numservers; i++) {
+    loaders[i] = NULL;
     if (!checkServer(i)) {
       cerr << "No connection to " << _serverNames[i] << endl;
       continue;
@@ -318,11 +340,17 @@ void updateData()
       lastdata = getAbs() - _graphSpan;
     }
 
+    cout << "Polling " << _serverNames[i] << endl;
+    loaders[i] = new AsyncLoader(*_servers[i]);
+    loaders[i]->start(lastdata, 0, false);
+  }
+
+  for (int i=0; i<_numservers; i++) {
+    if (loaders[i]==NULL) continue;
     IntegPeriod *newdata = NULL;
     int newlen = 0;
-
-    cout << "Polling " << _serverNames[i] << endl;
-    IntegPeriod::load(newdata, newlen, lastdata, 0, *_servers[i], false);
+    loaders[i]->take(newdata, newlen);
+    delete loaders[i];
 
     if (newdata==NULL||newlen==0) {
       cerr << "Got no data from " << _serverNames[i] << endl;
@@ -331,10 +359,10 @@ void updateData()
 	int biglen = _numData[i] + newlen;
 	IntegPeriod *bigdata = new IntegPeriod[biglen];
 	for (int j=0; j<_numData[i]; j++) {
-	  bigdata[j] = _data[i][j];
+	  bigdata[j] = std::move(_data[i][j]);
 	}
 	for (int j=0; j<newlen; j++) {
-	  bigdata[_numData[i]+j] = newdata[j];
+	  bigdata[_numData[i]+j] = std::move(newdata[j]);
 	}
 	delete[] _data[i];
 	delete[] newdata;
@@ -346,6 +374,7 @@ void updateData()
       }
     }
   }
+  delete[] loaders;
 }
 
 
@@ -366,7 +395,7 @@ void purgeOldData()
     } else if (j!=0) {
       IntegPeriod *newdata = new IntegPeriod[newlen];
       for (int k=j; k<_numData[i]; k++) {
-        newdata[k-j] = _data[i][k];
+        newdata[k-j] = std::move(_data[i][k]);
       }
       delete[] _data[i];
       _data[i] = newdata;
@@ -379,6 +408,19 @@ void purgeOldData()
 }
 
 
+/////////////////////////////////////////////////////////////////
+//Return a new array of the time axis values for a server's data
+float *timeAxis(const PeriodSeries &series, int server, timegen_t now)
+{
+  if (!_LST) return series.hours(now);
+  float *res = new float[series.size()>0 ? series.size() : 1];
+  for (int j=0; j<series.size(); j++) {
+    res[j] = Abs2LST(series.timeStamp[j], _serverLong[server])/3600000000.0;
+  }
+  return res;
+}
+
+
 /////////////////////////////////////////////////////////////////
 //Draw graphs of the current data
 void drawGraphs()
@@ -417,20 +459,11 @@ void drawGraphs()
 
   for (int i=0; i<_numservers; i++) {
     if (_procDataC[i]==NULL || _numProcDataC[i]<=0) continue;
-    float tdata[_numProcDataC[i]];
-    float p1data[_numProcDataC[i]];
-    float p2data[_numProcDataC[i]];
-    for (int j=0; j<_numProcDataC[i]; j++) {
-      p1data[j] = _procDataC[i][j].power1;
-      p2data[j] = _procDataC[i][j].power2;
-      if (_LST) {
-	tdata[j] = Abs2LST(_procDataC[i][j].timeStamp, _serverLong[i])/3600000000.0;
-      } else {
-        tdata[j] = (_procDataC[i][j].timeStamp-now)/3600000000.0;
-      }
-    }
-    p->plotPoints(_numProcDataC[i], tdata, p1data, 2*i+2);
-    p->plotPoints(_numProcDataC[i], tdata, p2data, 2*i+1+2);
+    PeriodSeries series(_procDataC[i], _numProcDataC[i]);
+    float *tdata = timeAxis(series, i, now);
+    p->plotPoints(_numProcDataC[i], tdata, series.power1, 2*i+2);
+    p->plotPoints(_numProcDataC[i], tdata, series.power2, 2*i+1+2);
+    delete[] tdata;
   }
 
   if (_lastScale==0 || getAbs()-_lastScale>_rescalePeriod) {
@@ -459,32 +492,18 @@ void drawGraphs()
   //Plot the raw fringe data as dots
   for (int i=0; i<_numservers; i++) {
       if (_procDataC[i]==NULL || _numProcDataC[i]==0) continue;
-    float tdata[_numProcDataC[i]];
-    float xdata[_numProcDataC[i]];
-    for (int j=0; j<_numProcDataC[i]; j++) {
-      xdata[j] = _procDataC[i][j].powerX;
-      if (_LST) {
-	tdata[j] = Abs2LST(_procDataC[i][j].timeStamp, _serverLong[i])/3600000000.0;
-      } else {
-        tdata[j] = (_procDataC[i][j].timeStamp-now)/3600000000.0;
-      }
-    }
-    p->plotPoints(_numProcDataC[i], tdata, xdata, 2*i+2);
+    PeriodSeries series(_procDataC[i], _numProcDataC[i]);
+    float *tdata = timeAxis(series, i, now);
+    p->plotPoints(_numProcDataC[i], tdata, series.powerX, 2*i+2);
+    delete[] tdata;
   }
   //Plot the fully processed fringe data as lines
   for (int i=0; i<_numservers; i++) {
     if (_procDataF[i]==NULL || _numProcDataF[i]==0) continue;
-    float tdata[_numProcDataF[i]];
-    float xdata[_numProcDataF[i]];
-    for (int j=0; j<_numProcDataF[i]; j++) {
-      xdata[j] = _procDataF[i][j].powerX;
-      if (_LST) {
-	tdata[j] = Abs2LST(_procDataF[i][j].timeStamp, _serverLong[i])/3600000000.0;
-      } else {
-	tdata[j] = (_procDataF[i][j].timeStamp-now)/3600000000.0;
-      }
-    }
-    p->plotLine(_numProcDataF[i], tdata, xdata, 2*i+1+2);
+    PeriodSeries series(_procDataF[i], _numProcDataF[i]);
+    float *tdata = timeAxis(series, i, now);
+    p->plotLine(_numProcDataF[i], tdata, series.powerX, 2*i+1+2);
+    delete[] tdata;
   }
 }
 
@@ -531,11 +550,15 @@ bool reconnectServer(int num)
       _servers[num]->clear();
 
       if (_servers[num]->good() && _servers[num]->rdbuf()->is_open()
-	  && !_servers[num]->eof()) {
+	  && !_servers[num]->eof() &&
+	  IntegPeriod::negotiate(*_servers[num], server_addr,
+				 ServerPool::global().getCompress())) {
 	//Ask the server for it's location
         pair_t loc;
 	*_servers[num] << "LOCATION\n";
 	*_servers[num] >> loc.c1 >> loc.c2;
+	//Don't leave the end of the line for the next reply
+	_servers[num]->ignore(1000, '\n');
 	if (_servers[num]->fail() || _servers[num]->eof()) {
 	  cerr << "Error reading location from server\n";
 	  _servers[num]->close();
@@ -655,8 +678,12 @@ void calculateOffsets()
 void cleanDataCrude(IntegPeriod *&res, int &rescount,
 		    IntegPeriod *data, int count)
 {
-  powerClean(data, count, 1.2, 15);
-  IntegPeriod::purgeFlagged(res, rescount, data, count);
+  PeriodSeries series(data, count);
+  powerClean(series, 1.2, 15);
+  series.copyFlags(data);
+  series.purgeFlagged(series);
+  res = series.toPeriods();
+  rescount = series.size();
 }
 
 
@@ -669,23 +696,30 @@ void cleanDataFine(IntegPeriod *&res, int &rescount,
 
   res = NULL;
   rescount = 0;
-  IntegPeriod *tempdata = NULL, *tempdata2 = NULL;
-  int tempcount = 0, tempcount2 = 0;
-
-  markOutliers(data, count, 1.0, 20);
-  IntegPeriod::purgeFlagged(tempdata, tempcount, data, count);
-  if (tempdata==NULL || tempcount==0) return;
+  PeriodSeries series(data, count);
+
+  if (_medianClean) {
+    PeriodSeries clean;
+    medianClean(clean, series, 3.0, 20000000);
+    series.copyFlags(data);
+    res = clean.toPeriods();
+    rescount = clean.size();
+    return;
+  }
 
+  markOutliers(series, 1.0, 20);
+  series.copyFlags(data);
+  series.purgeFlagged(series);
+  if (series.size()==0) return;
 
-  powerClean(tempdata, tempcount, 1.15, 20);
-  IntegPeriod::purgeFlagged(tempdata2, tempcount2, tempdata, tempcount);
-  delete[] tempdata;
-  if (tempdata2==NULL || tempcount2==0) return;
+  powerClean(series, 1.15, 20);
+  series.purgeFlagged(series);
+  if (series.size()==0) return;
 
   //Perform second pass
-  markOutliers(tempdata2, tempcount2, 5.0, 30, true);
-  //IntegPeriod::purgeFlagged(res, rescount, tempdata2, tempcount2);
-  IntegPeriod::integrate(res, rescount, tempdata2, tempcount2, 20000000);
-  delete[] tempdata2;
+  markOutliers(series, 5.0, 30, true);
+  series.integrate(series, 20000000);
+  res = series.toPeriods();
+  rescount = series.size();
 }
 
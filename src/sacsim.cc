@@ -122,8 +122,7 @@ int main (int argc, char *argv[])
   }
 
   ///WRITE THE OUTPUT FILE
-  ofstream datfile("sim.out", ios::out|ios::binary);
-  for (int i=0; i<numperiods; i++) datfile << data[i];
+  IntegPeriod::write(data, numperiods, "sim.out");
   
   //_savefile="/tmp/foo.png";
   //_display=png;